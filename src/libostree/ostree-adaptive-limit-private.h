@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A limit on the number of outstanding operations (e.g. HTTP requests or
+ * object writes during a pull) that adjusts itself from the completion
+ * latency of those operations and, optionally, the throughput achieved,
+ * in the style of TCP congestion control:
+ *
+ *  - We start in "slow start", doubling the limit after each window
+ *    (i.e. once as many operations as the limit have completed) as long as
+ *    latency isn't inflated and throughput keeps going up.
+ *  - After that, the limit grows by one per window while latency stays
+ *    close to the lowest seen, and is cut by a quarter when latency is
+ *    inflated (operations are queueing somewhere) without a matching
+ *    throughput gain.
+ *  - Transient errors (timeouts, 5xx) halve it, like packet loss in TCP.
+ *
+ * A fixed limit ignores all of the above.
+ */
+typedef struct {
+  guint value;
+  guint min;
+  guint max;
+  gboolean fixed;
+  gboolean slow_start;
+
+  guint64 base_latency; /* Lowest average latency of a window, in µs */
+  gdouble last_throughput; /* Bytes per second in the last window, or 0 */
+
+  /* The current window */
+  guint64 window_start;
+  guint64 window_start_bytes;
+  guint64 window_latency;
+  guint window_n;
+} OstreeAdaptiveLimit;
+
+void _ostree_adaptive_limit_init (OstreeAdaptiveLimit *limit,
+                                  guint                initial,
+                                  guint                min,
+                                  guint                max);
+
+void _ostree_adaptive_limit_set_fixed (OstreeAdaptiveLimit *limit,
+                                       guint                value);
+
+void _ostree_adaptive_limit_sample (OstreeAdaptiveLimit *limit,
+                                    guint64              now,
+                                    guint64              latency,
+                                    guint64              total_bytes);
+
+void _ostree_adaptive_limit_backoff (OstreeAdaptiveLimit *limit);
+
+static inline guint
+_ostree_adaptive_limit_get (OstreeAdaptiveLimit *limit)
+{
+  return limit->value;
+}
+
+G_END_DECLS
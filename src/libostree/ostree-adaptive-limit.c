@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-adaptive-limit-private.h"
+
+/* See ostree-adaptive-limit-private.h for an overview. */
+
+void
+_ostree_adaptive_limit_init (OstreeAdaptiveLimit *limit,
+                             guint                initial,
+                             guint                min,
+                             guint                max)
+{
+  g_assert (min > 0);
+  g_assert (min <= max);
+
+  memset (limit, 0, sizeof (*limit));
+  limit->min = min;
+  limit->max = max;
+  limit->value = CLAMP (initial, min, max);
+  limit->slow_start = TRUE;
+}
+
+void
+_ostree_adaptive_limit_set_fixed (OstreeAdaptiveLimit *limit,
+                                  guint                value)
+{
+  value = MAX (value, 1);
+  limit->value = limit->min = limit->max = value;
+  limit->fixed = TRUE;
+}
+
+static void
+reset_window (OstreeAdaptiveLimit *limit)
+{
+  limit->window_n = 0;
+  limit->window_latency = 0;
+}
+
+/*
+ * _ostree_adaptive_limit_sample:
+ * @now: Monotonic time (in µs) at which the operation completed
+ * @latency: How long (in µs) the operation took
+ * @total_bytes: Running total of bytes transferred, if throughput is
+ *   meaningful for this limit; otherwise 0
+ *
+ * Record a successful operation, and adjust the limit at the end of each
+ * window.
+ */
+void
+_ostree_adaptive_limit_sample (OstreeAdaptiveLimit *limit,
+                               guint64              now,
+                               guint64              latency,
+                               guint64              total_bytes)
+{
+  if (limit->fixed)
+    return;
+
+  if (limit->window_n == 0)
+    {
+      limit->window_start = now;
+      limit->window_start_bytes = total_bytes;
+    }
+  limit->window_latency += latency;
+  limit->window_n++;
+  if (limit->window_n < limit->value)
+    return;
+
+  const guint64 avg_latency = MAX (limit->window_latency / limit->window_n, 1);
+  const guint64 elapsed = now - limit->window_start;
+  gdouble throughput = 0;
+  if (total_bytes > limit->window_start_bytes && elapsed > 0)
+    throughput = (gdouble)(total_bytes - limit->window_start_bytes) * G_USEC_PER_SEC / elapsed;
+
+  if (limit->base_latency == 0 || avg_latency < limit->base_latency)
+    limit->base_latency = avg_latency;
+
+  const gboolean queueing = avg_latency > limit->base_latency * 2;
+  const gboolean have_throughput = throughput > 0 && limit->last_throughput > 0;
+  const gboolean gain = have_throughput && throughput > limit->last_throughput * 1.05;
+
+  if (queueing && !gain)
+    {
+      limit->value = MAX (limit->value * 3 / 4, limit->min);
+      limit->slow_start = FALSE;
+    }
+  else if (limit->slow_start)
+    {
+      /* Doubling didn't buy us anything; the link is probably full */
+      if (have_throughput && !gain)
+        limit->slow_start = FALSE;
+      else
+        limit->value = MIN (limit->value * 2, limit->max);
+    }
+  else if (!queueing)
+    limit->value = MIN (limit->value + 1, limit->max);
+
+  limit->last_throughput = throughput;
+  reset_window (limit);
+}
+
+/* Called on transient errors, like timeouts */
+void
+_ostree_adaptive_limit_backoff (OstreeAdaptiveLimit *limit)
+{
+  if (limit->fixed)
+    return;
+
+  limit->value = MAX (limit->value / 2, limit->min);
+  limit->slow_start = FALSE;
+  reset_window (limit);
+}
@@ -20,6 +20,7 @@
 #include "config.h"
 
 #include "ostree-sysroot-private.h"
+#include "ostree-repo-private.h"
 #include "ostree-bootloader-grub2.h"
 #include "otutil.h"
 #include <gio/gfiledescriptorbased.h>
@@ -52,6 +53,22 @@
 #define GRUB2_EFI_SUFFIX "efi"
 #endif
 
+/* So... yeah.  Just going to hardcode these. */
+static const char hardcoded_video[] = "load_video\n"
+  "set gfxpayload=keep\n";
+static const char hardcoded_insmods[] = "insmod gzio\n";
+
+/* With sysroot.grub2-native, the parts of the grub2-mkconfig output other
+ * than our own menu entries are captured once into this file, next to
+ * grub.cfg, and the configuration is generated in-process from then on.
+ * It records a fingerprint of the generator's inputs (see
+ * grub2_generator_fingerprint()), and is captured again when they change.
+ */
+#define GRUB2_TEMPLATE_NAME "grub.cfg.ostree-template"
+#define GRUB2_TEMPLATE_GROUP "grub2"
+#define GRUB2_OSTREE_SECTION_BEGIN "### BEGIN /etc/grub.d/15_ostree ###\n"
+#define GRUB2_OSTREE_SECTION_END "### END /etc/grub.d/15_ostree ###\n"
+
 struct _OstreeBootloaderGrub2
 {
   GObject       parent_instance;
@@ -148,42 +165,15 @@ _ostree_bootloader_grub2_get_name (OstreeBootloader *bootloader)
   return "grub2";
 }
 
-/* This implementation is quite complex; see this issue for
- * a starting point:
- * https://github.com/ostreedev/ostree/issues/717
- */
-gboolean
-_ostree_bootloader_grub2_generate_config (OstreeSysroot                 *sysroot,
-                                          int                            bootversion,
-                                          int                            target_fd,
-                                          GCancellable                  *cancellable,
-                                          GError                       **error)
+/* Render a menuentry for each of @loader_configs into @output */
+static gboolean
+grub2_append_entries (GPtrArray     *loader_configs,
+                      const char    *grub2_boot_device_id,
+                      const char    *grub2_prepare_root_cache,
+                      gboolean       is_efi,
+                      GString       *output,
+                      GError       **error)
 {
-  /* So... yeah.  Just going to hardcode these. */
-  static const char hardcoded_video[] = "load_video\n"
-    "set gfxpayload=keep\n";
-  static const char hardcoded_insmods[] = "insmod gzio\n";
-  const char *grub2_boot_device_id =
-    g_getenv ("GRUB2_BOOT_DEVICE_ID");
-  const char *grub2_prepare_root_cache =
-    g_getenv ("GRUB2_PREPARE_ROOT_CACHE");
-
-  /* We must have been called via the wrapper script */
-  g_assert (grub2_boot_device_id != NULL);
-  g_assert (grub2_prepare_root_cache != NULL);
-
-  /* Passed from the parent */
-  gboolean is_efi = g_getenv ("_OSTREE_GRUB2_IS_EFI") != NULL;
-
-  g_autoptr(GOutputStream) out_stream = g_unix_output_stream_new (target_fd, FALSE);
-
-  g_autoptr(GPtrArray) loader_configs = NULL;
-  if (!_ostree_sysroot_read_boot_loader_configs (sysroot, bootversion,
-                                                 &loader_configs,
-                                                 cancellable, error))
-    return FALSE;
-
-  g_autoptr(GString) output = g_string_new ("");
   for (guint i = 0; i < loader_configs->len; i++)
     {
       OstreeBootconfigParser *config = loader_configs->pdata[i];
@@ -259,6 +249,45 @@ _ostree_bootloader_grub2_generate_config (OstreeSysroot                 *sysroot
       g_string_append (output, "}\n");
     }
 
+  return TRUE;
+}
+
+/* This implementation is quite complex; see this issue for
+ * a starting point:
+ * https://github.com/ostreedev/ostree/issues/717
+ */
+gboolean
+_ostree_bootloader_grub2_generate_config (OstreeSysroot                 *sysroot,
+                                          int                            bootversion,
+                                          int                            target_fd,
+                                          GCancellable                  *cancellable,
+                                          GError                       **error)
+{
+  const char *grub2_boot_device_id =
+    g_getenv ("GRUB2_BOOT_DEVICE_ID");
+  const char *grub2_prepare_root_cache =
+    g_getenv ("GRUB2_PREPARE_ROOT_CACHE");
+
+  /* We must have been called via the wrapper script */
+  g_assert (grub2_boot_device_id != NULL);
+  g_assert (grub2_prepare_root_cache != NULL);
+
+  /* Passed from the parent */
+  gboolean is_efi = g_getenv ("_OSTREE_GRUB2_IS_EFI") != NULL;
+
+  g_autoptr(GOutputStream) out_stream = g_unix_output_stream_new (target_fd, FALSE);
+
+  g_autoptr(GPtrArray) loader_configs = NULL;
+  if (!_ostree_sysroot_read_boot_loader_configs (sysroot, bootversion,
+                                                 &loader_configs,
+                                                 cancellable, error))
+    return FALSE;
+
+  g_autoptr(GString) output = g_string_new ("");
+  if (!grub2_append_entries (loader_configs, grub2_boot_device_id, grub2_prepare_root_cache,
+                             is_efi, output, error))
+    return FALSE;
+
   gsize bytes_written;
   if (!g_output_stream_write_all (out_stream, output->str, output->len,
                                   &bytes_written, cancellable, error))
@@ -267,6 +296,205 @@ _ostree_bootloader_grub2_generate_config (OstreeSysroot                 *sysroot
   return TRUE;
 }
 
+/* Split @config, as written by grub2-mkconfig with our 15_ostree script, into
+ * a template: the text before and after our section, and the values
+ * 15_ostree passed to _ostree_bootloader_grub2_generate_config().  Returns
+ * %NULL if @config doesn't look like that.
+ */
+static GKeyFile *
+grub2_template_from_config (const char *config)
+{
+  const char *begin = strstr (config, GRUB2_OSTREE_SECTION_BEGIN);
+  if (!begin)
+    return NULL;
+  const char *body = begin + strlen (GRUB2_OSTREE_SECTION_BEGIN);
+  const char *end = strstr (body, GRUB2_OSTREE_SECTION_END);
+  if (!end)
+    return NULL;
+
+  /* Parse the first entry, as written by grub2_append_entries() */
+  if (!g_str_has_prefix (body, "menuentry "))
+    return NULL;
+  const char *eol = strchr (body, '\n');
+  if (!eol || eol > end)
+    return NULL;
+  static const char uuid_prefix[] = " 'ostree-0-";
+  const char *device_id = g_strstr_len (body, eol - body, uuid_prefix);
+  if (!device_id)
+    return NULL;
+  device_id += strlen (uuid_prefix);
+  const char *device_id_end = strchr (device_id, '\'');
+  if (!device_id_end || device_id_end > eol)
+    return NULL;
+
+  const char *prepare_root = eol + 1;
+  if (!g_str_has_prefix (prepare_root, hardcoded_video))
+    return NULL;
+  prepare_root += strlen (hardcoded_video);
+  if (!g_str_has_prefix (prepare_root, hardcoded_insmods))
+    return NULL;
+  prepare_root += strlen (hardcoded_insmods);
+  const char *prepare_root_end = strstr (prepare_root, "\nlinux");
+  if (!prepare_root_end || prepare_root_end > end)
+    return NULL;
+
+  g_autoptr(GKeyFile) template = g_key_file_new ();
+  g_autofree char *header = g_strndup (config, body - config);
+  g_key_file_set_string (template, GRUB2_TEMPLATE_GROUP, "header", header);
+  g_key_file_set_string (template, GRUB2_TEMPLATE_GROUP, "footer", end);
+  g_autofree char *device_id_str = g_strndup (device_id, device_id_end - device_id);
+  g_key_file_set_string (template, GRUB2_TEMPLATE_GROUP, "boot-device-id", device_id_str);
+  g_autofree char *prepare_root_str = g_strndup (prepare_root, prepare_root_end - prepare_root);
+  g_key_file_set_string (template, GRUB2_TEMPLATE_GROUP, "prepare-root-cache", prepare_root_str);
+  return g_steal_pointer (&template);
+}
+
+/* Add @path, relative to @dfd, to the fingerprint in @hasher: its name,
+ * whether it's executable and its contents, or that it's missing. */
+static gboolean
+grub2_fingerprint_file (OtChecksum    *hasher,
+                        int            dfd,
+                        const char    *path,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  ot_checksum_update (hasher, (guint8*)path, strlen (path) + 1);
+
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (dfd, path, &fd, error))
+    return FALSE;
+  if (fd == -1)
+    {
+      ot_checksum_update (hasher, (guint8*)"-", 1);
+      return TRUE;
+    }
+
+  struct stat stbuf;
+  if (!glnx_fstat (fd, &stbuf, error))
+    return FALSE;
+  g_autoptr(GBytes) contents = glnx_fd_readall_bytes (fd, cancellable, error);
+  if (!contents)
+    return FALSE;
+
+  g_autofree char *header =
+    g_strdup_printf ("%c%" G_GSIZE_FORMAT, (stbuf.st_mode & S_IXUSR) ? 'x' : 'r',
+                     g_bytes_get_size (contents));
+  ot_checksum_update (hasher, (guint8*)header, strlen (header) + 1);
+  ot_checksum_update_bytes (hasher, contents);
+  return TRUE;
+}
+
+static int
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return strcmp (*(const char *const *) a, *(const char *const *) b);
+}
+
+/* A checksum of what the output of @grub_exec depends on, other than the
+ * deployments: /etc/default/grub, the scripts in /etc/grub.d, and
+ * @grub_exec itself, all under @root (or /) where it runs.  A captured
+ * template is only used while this stays the same.
+ */
+static char *
+grub2_generator_fingerprint (const char    *root,
+                             const char    *grub_exec,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  glnx_autofd int root_dfd = -1;
+  if (!glnx_opendirat (AT_FDCWD, root ?: "/", TRUE, &root_dfd, error))
+    return NULL;
+
+  g_auto(OtChecksum) hasher = { 0, };
+  ot_checksum_init (&hasher);
+
+  if (!grub2_fingerprint_file (&hasher, root_dfd, "etc/default/grub", cancellable, error))
+    return NULL;
+
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  gboolean exists;
+  if (!ot_dfd_iter_init_allow_noent (root_dfd, "etc/grub.d", &dfd_iter, &exists, error))
+    return NULL;
+  g_autoptr(GPtrArray) scripts = g_ptr_array_new_with_free_func (g_free);
+  while (exists)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return NULL;
+      if (dent == NULL)
+        break;
+      if (dent->d_type == DT_REG)
+        g_ptr_array_add (scripts, g_strconcat ("etc/grub.d/", dent->d_name, NULL));
+    }
+  g_ptr_array_sort (scripts, compare_strings);
+  for (guint i = 0; i < scripts->len; i++)
+    {
+      if (!grub2_fingerprint_file (&hasher, root_dfd, scripts->pdata[i], cancellable, error))
+        return NULL;
+    }
+
+  /* The generator is looked up in $PATH if it isn't absolute */
+  g_autofree char *grub_exec_path = NULL;
+  if (g_path_is_absolute (grub_exec))
+    grub_exec_path = g_strdup (grub_exec + strspn (grub_exec, "/"));
+  else if (root == NULL)
+    grub_exec_path = g_find_program_in_path (grub_exec);
+  if (!grub2_fingerprint_file (&hasher, root_dfd, grub_exec_path ?: grub_exec,
+                               cancellable, error))
+    return NULL;
+
+  char hexdigest[OSTREE_SHA256_STRING_LEN + 1];
+  ot_checksum_get_hexdigest (&hasher, hexdigest, sizeof (hexdigest));
+  return g_strdup (hexdigest);
+}
+
+/* Generate the configuration for @bootversion from @template in-process, and
+ * atomically write it to @path.
+ */
+static gboolean
+grub2_write_native_config (OstreeBootloaderGrub2  *self,
+                           GKeyFile               *template,
+                           int                     bootversion,
+                           const char             *path,
+                           GCancellable           *cancellable,
+                           GError                **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Generating grub2 config", error);
+  g_autofree char *header = g_key_file_get_string (template, GRUB2_TEMPLATE_GROUP, "header", error);
+  if (!header)
+    return FALSE;
+  g_autofree char *footer = g_key_file_get_string (template, GRUB2_TEMPLATE_GROUP, "footer", error);
+  if (!footer)
+    return FALSE;
+  g_autofree char *boot_device_id =
+    g_key_file_get_string (template, GRUB2_TEMPLATE_GROUP, "boot-device-id", error);
+  if (!boot_device_id)
+    return FALSE;
+  g_autofree char *prepare_root_cache =
+    g_key_file_get_string (template, GRUB2_TEMPLATE_GROUP, "prepare-root-cache", error);
+  if (!prepare_root_cache)
+    return FALSE;
+
+  g_autoptr(GPtrArray) loader_configs = NULL;
+  if (!_ostree_sysroot_read_boot_loader_configs (self->sysroot, bootversion,
+                                                 &loader_configs,
+                                                 cancellable, error))
+    return FALSE;
+
+  g_autoptr(GString) output = g_string_new (header);
+  if (!grub2_append_entries (loader_configs, boot_device_id, prepare_root_cache,
+                             self->is_efi, output, error))
+    return FALSE;
+  g_string_append (output, footer);
+
+  if (!glnx_file_replace_contents_at (AT_FDCWD, path, (guint8*)output->str, output->len,
+                                      0, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
 typedef struct {
   const char *root;
   const char *bootversion_str;
@@ -395,35 +623,124 @@ _ostree_bootloader_grub2_write_config (OstreeBootloader      *bootloader,
                                                       bootversion);
     }
 
-  const char *grub_argv[4] = { NULL, "-o", NULL, NULL};
-  Grub2ChildSetupData cdata = { NULL, };
-  grub_argv[0] = grub_exec;
-  grub_argv[2] = gs_file_get_path_cached (new_config_path);
-
-  GSpawnFlags grub_spawnflags = G_SPAWN_SEARCH_PATH;
-  if (!g_getenv ("OSTREE_DEBUG_GRUB2"))
-    grub_spawnflags |= G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL;
-  cdata.root = grub2_mkconfig_chroot;
-  g_autofree char *bootversion_str = g_strdup_printf ("%u", (guint)bootversion);
-  cdata.bootversion_str = bootversion_str;
-  cdata.is_efi = self->is_efi;
-  /* Note in older versions of the grub2 package, this script doesn't even try
-     to be atomic; it just does:
-
-     cat ${grub_cfg}.new > ${grub_cfg}
-     rm -f ${grub_cfg}.new
-
-     Upstream is fixed though.
-  */
-  int grub2_estatus;
-  if (!g_spawn_sync (NULL, (char**)grub_argv, NULL, grub_spawnflags,
-                     grub2_child_setup, &cdata, NULL, NULL,
-                     &grub2_estatus, error))
-    return FALSE;
-  if (!g_spawn_check_exit_status (grub2_estatus, error))
+  /* With sysroot.grub2-native, use the template captured from a previous run
+   * of the generator if there is one, and its inputs haven't changed since.
+   */
+  gboolean native = ostree_sysroot_repo (self->sysroot)->grub2_native;
+  g_autofree char *fingerprint = NULL;
+  g_autoptr(GFile) template_path = NULL;
+  g_autoptr(GKeyFile) template = NULL;
+  if (native)
     {
-      g_prefix_error (error, "%s: ", grub_argv[0]);
-      return FALSE;
+      g_autoptr(GError) local_error = NULL;
+      fingerprint = grub2_generator_fingerprint (grub2_mkconfig_chroot, grub_exec,
+                                                 cancellable, &local_error);
+      if (!fingerprint)
+        {
+          g_debug ("Not using a grub2 template: %s", local_error->message);
+          native = FALSE;
+        }
+    }
+  if (native)
+    {
+      g_autoptr(GFile) config_dir = NULL;
+      if (self->is_efi)
+        config_dir = g_file_get_parent (self->config_path_efi);
+      else if (g_file_query_exists (self->config_path_bios_1, NULL))
+        config_dir = g_file_get_parent (self->config_path_bios_1);
+      else
+        config_dir = g_file_get_parent (self->config_path_bios_2);
+      template_path = g_file_get_child (config_dir, GRUB2_TEMPLATE_NAME);
+
+      g_autoptr(GError) local_error = NULL;
+      template = g_key_file_new ();
+      if (!g_key_file_load_from_file (template, gs_file_get_path_cached (template_path),
+                                      G_KEY_FILE_NONE, &local_error))
+        {
+          if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return glnx_prefix_error (error, "Loading %s",
+                                        gs_file_get_path_cached (template_path));
+            }
+          g_clear_pointer (&template, g_key_file_unref);
+        }
+      else
+        {
+          g_autofree char *template_fingerprint =
+            g_key_file_get_string (template, GRUB2_TEMPLATE_GROUP, "fingerprint", NULL);
+          if (g_strcmp0 (template_fingerprint, fingerprint) != 0)
+            {
+              g_debug ("%s is out of date; running %s",
+                       gs_file_get_path_cached (template_path), grub_exec);
+              g_clear_pointer (&template, g_key_file_unref);
+            }
+        }
+    }
+
+  if (template)
+    {
+      if (!grub2_write_native_config (self, template, bootversion,
+                                      gs_file_get_path_cached (new_config_path),
+                                      cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      const char *grub_argv[4] = { NULL, "-o", NULL, NULL};
+      Grub2ChildSetupData cdata = { NULL, };
+      grub_argv[0] = grub_exec;
+      grub_argv[2] = gs_file_get_path_cached (new_config_path);
+
+      GSpawnFlags grub_spawnflags = G_SPAWN_SEARCH_PATH;
+      if (!g_getenv ("OSTREE_DEBUG_GRUB2"))
+        grub_spawnflags |= G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL;
+      cdata.root = grub2_mkconfig_chroot;
+      g_autofree char *bootversion_str = g_strdup_printf ("%u", (guint)bootversion);
+      cdata.bootversion_str = bootversion_str;
+      cdata.is_efi = self->is_efi;
+      /* Note in older versions of the grub2 package, this script doesn't even try
+         to be atomic; it just does:
+
+         cat ${grub_cfg}.new > ${grub_cfg}
+         rm -f ${grub_cfg}.new
+
+         Upstream is fixed though.
+      */
+      int grub2_estatus;
+      if (!g_spawn_sync (NULL, (char**)grub_argv, NULL, grub_spawnflags,
+                         grub2_child_setup, &cdata, NULL, NULL,
+                         &grub2_estatus, error))
+        return FALSE;
+      if (!g_spawn_check_exit_status (grub2_estatus, error))
+        {
+          g_prefix_error (error, "%s: ", grub_argv[0]);
+          return FALSE;
+        }
+
+      /* Capture the template for next time; it's only an optimization, so
+       * failing to doesn't fail the deployment. */
+      if (native)
+        {
+          g_autoptr(GError) local_error = NULL;
+          g_autofree char *config =
+            glnx_file_get_contents_utf8_at (AT_FDCWD, gs_file_get_path_cached (new_config_path),
+                                            NULL, cancellable, &local_error);
+          g_autoptr(GKeyFile) new_template = config ? grub2_template_from_config (config) : NULL;
+          if (!config)
+            g_debug ("Not capturing a grub2 template: %s", local_error->message);
+          else if (!new_template)
+            g_debug ("No ostree section found in %s output; not capturing a template",
+                     grub_argv[0]);
+          else
+            {
+              g_key_file_set_string (new_template, GRUB2_TEMPLATE_GROUP, "fingerprint",
+                                     fingerprint);
+              if (!g_key_file_save_to_file (new_template, gs_file_get_path_cached (template_path),
+                                            &local_error))
+                g_debug ("Failed to save grub2 template: %s", local_error->message);
+            }
+        }
     }
 
   /* Now let's fdatasync() for the new file */
@@ -29,6 +29,17 @@ G_BEGIN_DECLS
 
 /* It's what gzip does, 9 is too slow */
 #define OSTREE_ARCHIVE_DEFAULT_COMPRESSION_LEVEL (6)
+/* zstd's own default; decompression speed hardly depends on it */
+#define OSTREE_ARCHIVE_DEFAULT_ZSTD_COMPRESSION_LEVEL (3)
+
+/* How the content of regular files is compressed in archive repositories.
+ * zstd repositories have mode "archive-zstd" in their config, which older
+ * versions reject.
+ */
+typedef enum {
+  OSTREE_ARCHIVE_COMPRESSION_ZLIB,
+  OSTREE_ARCHIVE_COMPRESSION_ZSTD,
+} OstreeArchiveCompression;
 
 /* This file contains private implementation data format definitions
  * read by multiple implementation .c files.
@@ -76,6 +87,24 @@ GBytes *_ostree_file_header_new (GFileInfo         *file_info,
 GBytes *_ostree_zlib_file_header_new (GFileInfo         *file_info,
                                       GVariant          *xattrs);
 
+GConverter *_ostree_archive_compressor_new (OstreeArchiveCompression  compression,
+                                            int                       level,
+                                            GError                  **error);
+
+GConverter *_ostree_archive_decompressor_new (OstreeArchiveCompression  compression,
+                                              GError                  **error);
+
+gboolean
+_ostree_archive_stream_parse (OstreeArchiveCompression  compression,
+                              GInputStream             *input,
+                              guint64                   input_length,
+                              gboolean                  trusted,
+                              GInputStream            **out_input,
+                              GFileInfo               **out_file_info,
+                              GVariant                **out_xattrs,
+                              GCancellable             *cancellable,
+                              GError                  **error);
+
 gboolean
 _ostree_make_temporary_symlink_at (int             tmp_dirfd,
                                    const char     *target,
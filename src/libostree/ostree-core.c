@@ -33,6 +33,10 @@
 #include "ostree-core-private.h"
 #include "ostree-chain-input-stream.h"
 #include "otutil.h"
+#ifdef HAVE_ZSTD
+#include "ostree-zstd-compressor.h"
+#include "ostree-zstd-decompressor.h"
+#endif
 
 /* Generic ABI checks */
 G_STATIC_ASSERT(OSTREE_REPO_MODE_BARE == 0);
@@ -576,31 +580,61 @@ ostree_raw_file_to_content_stream (GInputStream       *input,
   return TRUE;
 }
 
-/**
- * ostree_content_stream_parse:
- * @compressed: Whether or not the stream is zlib-compressed
- * @input: Object content stream
- * @input_length: Length of stream
- * @trusted: If %TRUE, assume the content has been validated
- * @out_input: (out): The raw file content stream
- * @out_file_info: (out): Normal metadata
- * @out_xattrs: (out): Extended attributes
- * @cancellable: Cancellable
- * @error: Error
- *
- * The reverse of ostree_raw_file_to_content_stream(); this function
- * converts an object content stream back into components.
+/* Returns a converter compressing the content of regular files in an archive
+ * repository using @compression.
  */
-gboolean
-ostree_content_stream_parse (gboolean                compressed,
-                             GInputStream           *input,
-                             guint64                 input_length,
-                             gboolean                trusted,
-                             GInputStream          **out_input,
-                             GFileInfo             **out_file_info,
-                             GVariant              **out_xattrs,
-                             GCancellable           *cancellable,
-                             GError                **error)
+GConverter *
+_ostree_archive_compressor_new (OstreeArchiveCompression  compression,
+                                int                       level,
+                                GError                  **error)
+{
+  switch (compression)
+    {
+    case OSTREE_ARCHIVE_COMPRESSION_ZLIB:
+      return (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, level);
+    case OSTREE_ARCHIVE_COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+      return (GConverter*)_ostree_zstd_compressor_new (level, NULL);
+#else
+      return glnx_null_throw (error, "This version of ostree was built without zstd support");
+#endif
+    }
+  g_assert_not_reached ();
+}
+
+/* The reverse of _ostree_archive_compressor_new() */
+GConverter *
+_ostree_archive_decompressor_new (OstreeArchiveCompression  compression,
+                                  GError                  **error)
+{
+  switch (compression)
+    {
+    case OSTREE_ARCHIVE_COMPRESSION_ZLIB:
+      return (GConverter*)g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
+    case OSTREE_ARCHIVE_COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+      return (GConverter*)_ostree_zstd_decompressor_new (NULL);
+#else
+      return glnx_null_throw (error, "Object is zstd compressed, but this version of ostree was built without zstd support");
+#endif
+    }
+  g_assert_not_reached ();
+}
+
+/* Backend of ostree_content_stream_parse(); @compression only matters if
+ * @compressed is set.
+ */
+static gboolean
+content_stream_parse (gboolean                  compressed,
+                      OstreeArchiveCompression  compression,
+                      GInputStream             *input,
+                      guint64                   input_length,
+                      gboolean                  trusted,
+                      GInputStream            **out_input,
+                      GFileInfo               **out_file_info,
+                      GVariant                **out_xattrs,
+                      GCancellable             *cancellable,
+                      GError                  **error)
 {
   guint32 archive_header_size;
   guchar dummy[4];
@@ -662,8 +696,10 @@ ostree_content_stream_parse (gboolean                compressed,
        **/
       if (compressed)
         {
-          g_autoptr(GConverter) zlib_decomp = (GConverter*)g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
-          ret_input = g_converter_input_stream_new (input, zlib_decomp);
+          g_autoptr(GConverter) decomp = _ostree_archive_decompressor_new (compression, error);
+          if (!decomp)
+            return FALSE;
+          ret_input = g_converter_input_stream_new (input, decomp);
         }
       else
         ret_input = g_object_ref (input);
@@ -675,6 +711,57 @@ ostree_content_stream_parse (gboolean                compressed,
   return TRUE;
 }
 
+/* Like ostree_content_stream_parse() with @compressed set, for an archive
+ * repository object compressed with @compression.
+ */
+gboolean
+_ostree_archive_stream_parse (OstreeArchiveCompression  compression,
+                              GInputStream             *input,
+                              guint64                   input_length,
+                              gboolean                  trusted,
+                              GInputStream            **out_input,
+                              GFileInfo               **out_file_info,
+                              GVariant                **out_xattrs,
+                              GCancellable             *cancellable,
+                              GError                  **error)
+{
+  return content_stream_parse (TRUE, compression, input, input_length, trusted,
+                               out_input, out_file_info, out_xattrs,
+                               cancellable, error);
+}
+
+/**
+ * ostree_content_stream_parse:
+ * @compressed: Whether or not the stream is zlib-compressed
+ * @input: Object content stream
+ * @input_length: Length of stream
+ * @trusted: If %TRUE, assume the content has been validated
+ * @out_input: (out): The raw file content stream
+ * @out_file_info: (out): Normal metadata
+ * @out_xattrs: (out): Extended attributes
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * The reverse of ostree_raw_file_to_content_stream(); this function
+ * converts an object content stream back into components.
+ */
+gboolean
+ostree_content_stream_parse (gboolean                compressed,
+                             GInputStream           *input,
+                             guint64                 input_length,
+                             gboolean                trusted,
+                             GInputStream          **out_input,
+                             GFileInfo             **out_file_info,
+                             GVariant              **out_xattrs,
+                             GCancellable           *cancellable,
+                             GError                **error)
+{
+  return content_stream_parse (compressed, OSTREE_ARCHIVE_COMPRESSION_ZLIB,
+                               input, input_length, trusted,
+                               out_input, out_file_info, out_xattrs,
+                               cancellable, error);
+}
+
 /**
  * ostree_content_file_parse_at:
  * @compressed: Whether or not the stream is zlib-compressed
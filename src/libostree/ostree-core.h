@@ -162,6 +162,8 @@ typedef enum {
  *     Unix epoch in UTC, big-endian) after which the summary is considered
  *     stale and should be re-downloaded if possible (similar to the HTTP
  *     `Expires` header)
+ *   - key: "ostree.packs", value: a{sv}, checksum of each pack file under
+ *     `objects/pack/` -> 32 bytes of checksum of its index (Since: 2019.3)
  *
  * The currently defined keys for the `a{sv}` of additional metadata for each commit are:
  *  - key: `ostree.commit.timestamp`, value: `t`, timestamp (seconds since the
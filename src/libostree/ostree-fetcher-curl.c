@@ -98,6 +98,7 @@ struct FetcherRequest {
   char *filename;
   guint64 current_size;
   guint64 max_size;
+  char *range; /* (nullable) HTTP byte range, e.g. "8-4095" */
   OstreeFetcherRequestFlags flags;
   gboolean is_membuf;
   GError *caught_write_error;
@@ -230,8 +231,12 @@ _ostree_fetcher_init (OstreeFetcher *self)
   curl_multi_setopt (self->multi, CURLMOPT_TIMERFUNCTION, update_timeout_cb);
   curl_multi_setopt (self->multi, CURLMOPT_TIMERDATA, self);
 #if CURL_AT_LEAST_VERSION(7, 30, 0)
-  /* Let's do something reasonable here. */
-  curl_multi_setopt (self->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, 8);
+  /* The pull code adapts its concurrency up to this limit, and without
+   * HTTP/2 each outstanding request needs its own connection; as in the
+   * libsoup backend, don't let the connection pool cap it first.
+   */
+  curl_multi_setopt (self->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                     (long) _OSTREE_MAX_OUTSTANDING_FETCHER_REQUESTS);
 #endif
   /* This version mirrors the version at which we're enabling HTTP2 support.
    * See also https://github.com/curl/curl/blob/curl-7_53_0/docs/examples/http2-download.c
@@ -283,6 +288,29 @@ ensure_tmpfile (FetcherRequest *req, GError **error)
   return TRUE;
 }
 
+/* Range requests must get 206 Partial Content; see
+ * _ostree_fetcher_request_range_to_membuf().  file:// URIs have no response
+ * code, so they never pass.
+ */
+static gboolean
+check_range_response (FetcherRequest *req,
+                      GError        **error)
+{
+  if (!req->range)
+    return TRUE;
+
+  long response = 0;
+  curl_easy_getinfo (req->easy, CURLINFO_RESPONSE_CODE, &response);
+  if (response != 206)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Range request for %s not honored (response %ld)",
+                   req->filename, response);
+      return FALSE;
+    }
+  return TRUE;
+}
+
 /* Check for completed transfers, and remove their easy handles */
 static void
 check_multi_info (OstreeFetcher *fetcher)
@@ -357,6 +385,8 @@ check_multi_info (OstreeFetcher *fetcher)
                   continued_request = TRUE;
                 }
             }
+          else if (!check_range_response (req, &req->caught_write_error))
+            g_task_return_error (task, g_steal_pointer (&req->caught_write_error));
           else if (req->is_membuf)
             {
               GBytes *ret;
@@ -542,6 +572,10 @@ write_cb (void *ptr, size_t size, size_t nmemb, void *data)
   if (req->caught_write_error)
     return -1;
 
+  /* Don't bother receiving a whole file we didn't ask for */
+  if (req->current_size == 0 && !check_range_response (req, &req->caught_write_error))
+    return -1;
+
   if (req->max_size > 0)
     {
       if (realsize > req->max_size ||
@@ -597,6 +631,7 @@ request_unref (FetcherRequest *req)
 
   g_ptr_array_unref (req->mirrorlist);
   g_free (req->filename);
+  g_free (req->range);
   g_clear_error (&req->caught_write_error);
   glnx_tmpfile_clear (&req->tmpf);
   if (req->output_buf)
@@ -771,6 +806,9 @@ initiate_next_curl_request (FetcherRequest *req,
   if ((self->config_flags & OSTREE_FETCHER_FLAGS_TRANSFER_GZIP) > 0)
     curl_easy_setopt (req->easy, CURLOPT_ACCEPT_ENCODING, "");
 
+  if (req->range)
+    curl_easy_setopt (req->easy, CURLOPT_RANGE, req->range);
+
   /* We should only speak HTTP; TODO: only enable file if specified */
   curl_easy_setopt (req->easy, CURLOPT_PROTOCOLS, (long)(CURLPROTO_HTTP | CURLPROTO_HTTPS | CURLPROTO_FILE));
   /* Picked the current version in F25 as of 20170127, since
@@ -821,6 +859,8 @@ _ostree_fetcher_request_async (OstreeFetcher         *self,
                                const char            *filename,
                                OstreeFetcherRequestFlags flags,
                                gboolean               is_membuf,
+                               guint64                range_offset,
+                               guint64                range_length,
                                guint64                max_size,
                                int                    priority,
                                GCancellable          *cancellable,
@@ -852,6 +892,9 @@ _ostree_fetcher_request_async (OstreeFetcher         *self,
   req->mirrorlist = g_ptr_array_ref (mirrorlist);
   req->filename = g_strdup (filename);
   req->max_size = max_size;
+  if (range_length > 0)
+    req->range = g_strdup_printf ("%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+                                  range_offset, range_offset + range_length - 1);
   req->flags = flags;
   req->is_membuf = is_membuf;
   /* We'll allocate the tmpfile on demand, so we handle
@@ -883,7 +926,7 @@ _ostree_fetcher_request_to_tmpfile (OstreeFetcher         *self,
                                     gpointer               user_data)
 {
   _ostree_fetcher_request_async (self, mirrorlist, filename, flags, FALSE,
-                                 max_size, priority, cancellable,
+                                 0, 0, max_size, priority, cancellable,
                                  callback, user_data);
 }
 
@@ -921,7 +964,25 @@ _ostree_fetcher_request_to_membuf (OstreeFetcher         *self,
                                    gpointer               user_data)
 {
   _ostree_fetcher_request_async (self, mirrorlist, filename, flags, TRUE,
-                                 max_size, priority, cancellable,
+                                 0, 0, max_size, priority, cancellable,
+                                 callback, user_data);
+}
+
+void
+_ostree_fetcher_request_range_to_membuf (OstreeFetcher         *self,
+                                         GPtrArray             *mirrorlist,
+                                         const char            *filename,
+                                         OstreeFetcherRequestFlags flags,
+                                         guint64                offset,
+                                         guint64                length,
+                                         guint64                max_size,
+                                         int                    priority,
+                                         GCancellable          *cancellable,
+                                         GAsyncReadyCallback    callback,
+                                         gpointer               user_data)
+{
+  _ostree_fetcher_request_async (self, mirrorlist, filename, flags, TRUE,
+                                 offset, length, max_size, priority, cancellable,
                                  callback, user_data);
 }
 
@@ -97,6 +97,10 @@ typedef struct {
   guint64 max_size;
   guint64 current_size;
   guint64 content_length;
+
+  /* Byte range to request; range_length == 0 means the whole file */
+  guint64 range_offset;
+  guint64 range_length;
 } OstreeFetcherPendingURI;
 
 /* Used by session_thread_idle_add() */
@@ -431,6 +435,16 @@ create_pending_soup_request (OstreeFetcherPendingURI  *pending,
 
   pending->request = soup_session_request_uri (pending->thread_closure->session,
                                                (SoupURI*)(uri ? uri : next_mirror), error);
+
+  /* Non-HTTP requests (i.e. file://) can't do ranges; on_request_sent()
+   * fails them. */
+  if (pending->request && pending->range_length > 0 &&
+      SOUP_IS_REQUEST_HTTP (pending->request))
+    {
+      glnx_unref_object SoupMessage *msg = soup_request_http_get_message ((SoupRequestHTTP*) pending->request);
+      soup_message_headers_set_range (msg->request_headers, pending->range_offset,
+                                      pending->range_offset + pending->range_length - 1);
+    }
 }
 
 static void
@@ -524,6 +538,14 @@ ostree_fetcher_session_thread (gpointer data)
       g_object_set (closure->session,
                     "max-conns-per-host",
                     max_conns, NULL);
+      /* The pull code adapts its concurrency up to this limit; make sure
+       * the session-wide limit (10 by default) doesn't cap it first.
+       */
+      g_object_get (closure->session, "max-conns", &max_conns, NULL);
+      if (max_conns < _OSTREE_MAX_OUTSTANDING_FETCHER_REQUESTS)
+        g_object_set (closure->session,
+                      "max-conns",
+                      _OSTREE_MAX_OUTSTANDING_FETCHER_REQUESTS, NULL);
     }
 
   /* This model ensures we don't hit a race using g_main_loop_quit();
@@ -1126,6 +1148,16 @@ on_request_sent (GObject        *object,
         }
     }
 
+  /* See _ostree_fetcher_request_range_to_membuf() */
+  if (pending->range_length > 0 &&
+      (msg == NULL || msg->status_code != SOUP_STATUS_PARTIAL_CONTENT))
+    {
+      local_error = g_error_new (G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                                 "Range request for %s not honored (status %u)",
+                                 pending->filename, msg ? msg->status_code : 0);
+      goto out;
+    }
+
   pending->state = OSTREE_FETCHER_STATE_DOWNLOADING;
   
   pending->content_length = soup_request_get_content_length (pending->request);
@@ -1155,6 +1187,8 @@ _ostree_fetcher_request_async (OstreeFetcher         *self,
                                const char            *filename,
                                OstreeFetcherRequestFlags flags,
                                gboolean               is_membuf,
+                               guint64                range_offset,
+                               guint64                range_length,
                                guint64                max_size,
                                int                    priority,
                                GCancellable          *cancellable,
@@ -1177,6 +1211,8 @@ _ostree_fetcher_request_async (OstreeFetcher         *self,
   pending->flags = flags;
   pending->max_size = max_size;
   pending->is_membuf = is_membuf;
+  pending->range_offset = range_offset;
+  pending->range_length = range_length;
 
   task = g_task_new (self, cancellable, callback, user_data);
   g_task_set_source_tag (task, _ostree_fetcher_request_async);
@@ -1203,7 +1239,7 @@ _ostree_fetcher_request_to_tmpfile (OstreeFetcher         *self,
                                     gpointer               user_data)
 {
   _ostree_fetcher_request_async (self, mirrorlist, filename, flags, FALSE,
-                                 max_size, priority, cancellable,
+                                 0, 0, max_size, priority, cancellable,
                                  callback, user_data);
 }
 
@@ -1246,7 +1282,25 @@ _ostree_fetcher_request_to_membuf (OstreeFetcher         *self,
                                    gpointer               user_data)
 {
   _ostree_fetcher_request_async (self, mirrorlist, filename, flags, TRUE,
-                                 max_size, priority, cancellable,
+                                 0, 0, max_size, priority, cancellable,
+                                 callback, user_data);
+}
+
+void
+_ostree_fetcher_request_range_to_membuf (OstreeFetcher         *self,
+                                         GPtrArray             *mirrorlist,
+                                         const char            *filename,
+                                         OstreeFetcherRequestFlags flags,
+                                         guint64                offset,
+                                         guint64                length,
+                                         guint64                max_size,
+                                         int                    priority,
+                                         GCancellable          *cancellable,
+                                         GAsyncReadyCallback    callback,
+                                         gpointer               user_data)
+{
+  _ostree_fetcher_request_async (self, mirrorlist, filename, flags, TRUE,
+                                 offset, length, max_size, priority, cancellable,
                                  callback, user_data);
 }
 
@@ -149,6 +149,24 @@ gboolean _ostree_fetcher_request_to_membuf_finish (OstreeFetcher *self,
                                                    GBytes       **out_buf,
                                                    GError       **error);
 
+/* Like _ostree_fetcher_request_to_membuf(), but asks for @length bytes
+ * starting at @offset.  Any reply other than 206 Partial Content (which
+ * includes all file:// URIs) fails with %G_IO_ERROR_NOT_SUPPORTED, so that
+ * callers can fall back to something else.  Complete with
+ * _ostree_fetcher_request_to_membuf_finish().
+ */
+void _ostree_fetcher_request_range_to_membuf (OstreeFetcher         *self,
+                                              GPtrArray             *mirrorlist,
+                                              const char            *filename,
+                                              OstreeFetcherRequestFlags flags,
+                                              guint64                offset,
+                                              guint64                length,
+                                              guint64                max_size,
+                                              int                    priority,
+                                              GCancellable          *cancellable,
+                                              GAsyncReadyCallback    callback,
+                                              gpointer               user_data);
+
 
 G_END_DECLS
 
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/* A thread-safe cache of reference counted values, keyed by string, which
+ * keeps the total size of its values (as given by the caller) within a
+ * budget by evicting the least recently used entries.
+ */
+typedef struct _OstreeLruCache OstreeLruCache;
+
+OstreeLruCache *_ostree_lru_cache_new (gsize           max_size,
+                                       GBoxedCopyFunc  value_ref,
+                                       GDestroyNotify  value_unref);
+
+void _ostree_lru_cache_free (OstreeLruCache *cache);
+
+gpointer _ostree_lru_cache_lookup (OstreeLruCache *cache,
+                                   const char     *key);
+
+void _ostree_lru_cache_insert (OstreeLruCache *cache,
+                               const char     *key,
+                               gpointer        value,
+                               gsize           size);
+
+void _ostree_lru_cache_remove (OstreeLruCache *cache,
+                               const char     *key);
+
+gsize _ostree_lru_cache_get_size (OstreeLruCache *cache);
+
+void _ostree_lru_cache_get_stats (OstreeLruCache *cache,
+                                  guint64        *out_hits,
+                                  guint64        *out_misses);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (OstreeLruCache, _ostree_lru_cache_free)
+
+G_END_DECLS
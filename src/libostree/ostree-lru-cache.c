@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ostree-lru-cache-private.h"
+
+typedef struct {
+  GList link;  /* In OstreeLruCache.lru; data points back to the entry */
+  char *key;
+  gpointer value;
+  gsize size;
+} OstreeLruCacheEntry;
+
+struct _OstreeLruCache
+{
+  GMutex lock;
+  GHashTable *entries;  /* key (owned by the entry) → OstreeLruCacheEntry */
+  GQueue lru;           /* Most recently used first */
+  gsize size;
+  gsize max_size;
+  guint64 hits;
+  guint64 misses;
+  GBoxedCopyFunc value_ref;
+  GDestroyNotify value_unref;
+};
+
+static void
+entry_free (OstreeLruCache      *cache,
+            OstreeLruCacheEntry *entry)
+{
+  cache->value_unref (entry->value);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+/* Called with the lock held */
+static void
+remove_entry (OstreeLruCache      *cache,
+              OstreeLruCacheEntry *entry)
+{
+  g_queue_unlink (&cache->lru, &entry->link);
+  g_hash_table_remove (cache->entries, entry->key);
+  cache->size -= entry->size;
+  entry_free (cache, entry);
+}
+
+OstreeLruCache *
+_ostree_lru_cache_new (gsize           max_size,
+                       GBoxedCopyFunc  value_ref,
+                       GDestroyNotify  value_unref)
+{
+  OstreeLruCache *cache = g_new0 (OstreeLruCache, 1);
+  g_mutex_init (&cache->lock);
+  cache->entries = g_hash_table_new (g_str_hash, g_str_equal);
+  g_queue_init (&cache->lru);
+  cache->max_size = max_size;
+  cache->value_ref = value_ref;
+  cache->value_unref = value_unref;
+  return cache;
+}
+
+void
+_ostree_lru_cache_free (OstreeLruCache *cache)
+{
+  GList *l = cache->lru.head;
+  while (l != NULL)
+    {
+      GList *next = l->next;
+      entry_free (cache, l->data);
+      l = next;
+    }
+  g_hash_table_unref (cache->entries);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+/* Returns a new reference to the value for @key, or %NULL */
+gpointer
+_ostree_lru_cache_lookup (OstreeLruCache *cache,
+                          const char     *key)
+{
+  gpointer ret = NULL;
+
+  g_mutex_lock (&cache->lock);
+  OstreeLruCacheEntry *entry = g_hash_table_lookup (cache->entries, key);
+  if (entry != NULL)
+    {
+      g_queue_unlink (&cache->lru, &entry->link);
+      g_queue_push_head_link (&cache->lru, &entry->link);
+      ret = cache->value_ref (entry->value);
+      cache->hits++;
+    }
+  else
+    cache->misses++;
+  g_mutex_unlock (&cache->lock);
+
+  return ret;
+}
+
+/* Add a reference to @value, of @size bytes, replacing any previous value
+ * for @key; a value larger than the whole budget isn't cached. */
+void
+_ostree_lru_cache_insert (OstreeLruCache *cache,
+                          const char     *key,
+                          gpointer        value,
+                          gsize           size)
+{
+  if (size > cache->max_size)
+    return;
+
+  OstreeLruCacheEntry *entry = g_new0 (OstreeLruCacheEntry, 1);
+  entry->link.data = entry;
+  entry->key = g_strdup (key);
+  entry->value = cache->value_ref (value);
+  entry->size = size;
+
+  g_mutex_lock (&cache->lock);
+  OstreeLruCacheEntry *old = g_hash_table_lookup (cache->entries, key);
+  if (old != NULL)
+    remove_entry (cache, old);
+
+  g_hash_table_insert (cache->entries, entry->key, entry);
+  g_queue_push_head_link (&cache->lru, &entry->link);
+  cache->size += size;
+
+  while (cache->size > cache->max_size)
+    remove_entry (cache, cache->lru.tail->data);
+  g_mutex_unlock (&cache->lock);
+}
+
+void
+_ostree_lru_cache_remove (OstreeLruCache *cache,
+                          const char     *key)
+{
+  g_mutex_lock (&cache->lock);
+  OstreeLruCacheEntry *entry = g_hash_table_lookup (cache->entries, key);
+  if (entry != NULL)
+    remove_entry (cache, entry);
+  g_mutex_unlock (&cache->lock);
+}
+
+/* The total size of the values in @cache */
+gsize
+_ostree_lru_cache_get_size (OstreeLruCache *cache)
+{
+  g_mutex_lock (&cache->lock);
+  gsize size = cache->size;
+  g_mutex_unlock (&cache->lock);
+  return size;
+}
+
+/* The number of lookups which found, and didn't find, a value */
+void
+_ostree_lru_cache_get_stats (OstreeLruCache *cache,
+                             guint64        *out_hits,
+                             guint64        *out_misses)
+{
+  g_mutex_lock (&cache->lock);
+  *out_hits = cache->hits;
+  *out_misses = cache->misses;
+  g_mutex_unlock (&cache->lock);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+
+#include "libglnx.h"
+#include "ostree-core.h"
+
+G_BEGIN_DECLS
+
+/**
+ * OstreeObjectSet:
+ *
+ * A set of object names, stored as binary checksums in a single open
+ * addressing hash table.  This takes 33 bytes per slot, rather than the
+ * several hundred bytes per element of a #GHashTable of serialized object
+ * names, and is used for the large sets built when traversing a repository.
+ *
+ * Elements can't be removed.
+ */
+typedef struct _OstreeObjectSet OstreeObjectSet;
+
+#define OSTREE_TYPE_OBJECT_SET (ostree_object_set_get_type ())
+
+G_GNUC_INTERNAL
+GType ostree_object_set_get_type (void);
+
+G_GNUC_INTERNAL
+OstreeObjectSet *ostree_object_set_new (gsize n_elements_hint);
+
+G_GNUC_INTERNAL
+OstreeObjectSet *ostree_object_set_ref (OstreeObjectSet *set);
+G_GNUC_INTERNAL
+void ostree_object_set_unref (OstreeObjectSet *set);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (OstreeObjectSet, ostree_object_set_unref)
+
+G_GNUC_INTERNAL
+gboolean ostree_object_set_add (OstreeObjectSet  *set,
+                                const guint8     *csum,
+                                OstreeObjectType  objtype);
+G_GNUC_INTERNAL
+gboolean ostree_object_set_add_checksum (OstreeObjectSet  *set,
+                                         const char       *checksum,
+                                         OstreeObjectType  objtype);
+
+G_GNUC_INTERNAL
+gboolean ostree_object_set_contains (OstreeObjectSet  *set,
+                                     const guint8     *csum,
+                                     OstreeObjectType  objtype);
+G_GNUC_INTERNAL
+gboolean ostree_object_set_contains_checksum (OstreeObjectSet  *set,
+                                              const char       *checksum,
+                                              OstreeObjectType  objtype);
+
+G_GNUC_INTERNAL
+gsize ostree_object_set_get_size (OstreeObjectSet *set);
+
+G_GNUC_INTERNAL
+gboolean ostree_object_set_iter_next (OstreeObjectSet   *set,
+                                      gsize             *iter,
+                                      const guint8     **out_csum,
+                                      OstreeObjectType  *out_objtype);
+
+G_END_DECLS
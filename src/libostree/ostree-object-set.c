@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-object-set-private.h"
+
+/* Slots are stored inline, with an object type of 0 marking an empty slot
+ * (object types start at 1).  Since checksums are uniformly distributed,
+ * their leading bytes make a good enough hash, and linear probing keeps
+ * lookups within a cache line or two at the load factor we allow.
+ */
+typedef struct {
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  guint8 objtype;
+} OstreeObjectSetSlot;
+
+G_STATIC_ASSERT (sizeof (OstreeObjectSetSlot) == OSTREE_SHA256_DIGEST_LEN + 1);
+G_STATIC_ASSERT (OSTREE_OBJECT_TYPE_FILE > 0);
+
+#define MIN_SLOTS 64
+
+struct _OstreeObjectSet
+{
+  guint ref_count;
+  gsize n_elements;
+  gsize n_slots;  /* a power of 2 */
+  OstreeObjectSetSlot *slots;
+};
+
+G_DEFINE_BOXED_TYPE (OstreeObjectSet, ostree_object_set, ostree_object_set_ref, ostree_object_set_unref)
+
+/* Keep the load factor at or below 3/4 */
+static gsize
+slots_for_elements (gsize n_elements)
+{
+  gsize n_slots = MIN_SLOTS;
+  while (n_slots - n_slots / 4 < n_elements)
+    n_slots *= 2;
+  return n_slots;
+}
+
+static inline gsize
+slot_hash (const guint8    *csum,
+           OstreeObjectType objtype)
+{
+  guint64 v;
+  memcpy (&v, csum, sizeof (v));
+  return (gsize) (v ^ objtype);
+}
+
+static OstreeObjectSetSlot *
+find_slot (OstreeObjectSetSlot *slots,
+           gsize                n_slots,
+           const guint8        *csum,
+           OstreeObjectType     objtype)
+{
+  gsize mask = n_slots - 1;
+  gsize i = slot_hash (csum, objtype) & mask;
+
+  while (TRUE)
+    {
+      OstreeObjectSetSlot *slot = &slots[i];
+      if (slot->objtype == 0 ||
+          (slot->objtype == objtype &&
+           memcmp (slot->csum, csum, OSTREE_SHA256_DIGEST_LEN) == 0))
+        return slot;
+      i = (i + 1) & mask;
+    }
+}
+
+static void
+resize (OstreeObjectSet *set,
+        gsize            n_slots)
+{
+  OstreeObjectSetSlot *slots = g_new0 (OstreeObjectSetSlot, n_slots);
+
+  for (gsize i = 0; i < set->n_slots; i++)
+    {
+      const OstreeObjectSetSlot *old = &set->slots[i];
+      if (old->objtype == 0)
+        continue;
+      *find_slot (slots, n_slots, old->csum, old->objtype) = *old;
+    }
+
+  g_free (set->slots);
+  set->slots = slots;
+  set->n_slots = n_slots;
+}
+
+/**
+ * ostree_object_set_new:
+ * @n_elements_hint: number of elements expected, or 0 if unknown
+ *
+ * Create a new empty #OstreeObjectSet, sized to hold @n_elements_hint
+ * elements without growing.
+ *
+ * Returns: (transfer full): a new object set
+ */
+OstreeObjectSet *
+ostree_object_set_new (gsize n_elements_hint)
+{
+  OstreeObjectSet *set = g_new0 (OstreeObjectSet, 1);
+  set->ref_count = 1;
+  set->n_slots = slots_for_elements (n_elements_hint);
+  set->slots = g_new0 (OstreeObjectSetSlot, set->n_slots);
+  return set;
+}
+
+/**
+ * ostree_object_set_ref:
+ * @set: an #OstreeObjectSet
+ *
+ * Increase the reference count of @set.
+ *
+ * Returns: (transfer full): @set
+ */
+OstreeObjectSet *
+ostree_object_set_ref (OstreeObjectSet *set)
+{
+  g_return_val_if_fail (set != NULL, NULL);
+  g_return_val_if_fail (set->ref_count >= 1, NULL);
+
+  set->ref_count++;
+  return set;
+}
+
+/**
+ * ostree_object_set_unref:
+ * @set: (transfer full): an #OstreeObjectSet
+ *
+ * Decrement the reference count of @set. If it reaches zero, the set is freed.
+ */
+void
+ostree_object_set_unref (OstreeObjectSet *set)
+{
+  g_return_if_fail (set != NULL);
+  g_return_if_fail (set->ref_count >= 1);
+
+  if (--set->ref_count > 0)
+    return;
+
+  g_free (set->slots);
+  g_free (set);
+}
+
+/**
+ * ostree_object_set_add:
+ * @set: an #OstreeObjectSet
+ * @csum: binary SHA256 checksum of the object
+ * @objtype: type of the object
+ *
+ * Add the object named by @csum and @objtype to @set.
+ *
+ * Returns: %TRUE if the object was not already in @set
+ */
+gboolean
+ostree_object_set_add (OstreeObjectSet  *set,
+                       const guint8     *csum,
+                       OstreeObjectType  objtype)
+{
+  g_return_val_if_fail (set != NULL, FALSE);
+  g_return_val_if_fail (csum != NULL, FALSE);
+  g_return_val_if_fail (objtype >= OSTREE_OBJECT_TYPE_FILE &&
+                        objtype <= OSTREE_OBJECT_TYPE_LAST, FALSE);
+
+  OstreeObjectSetSlot *slot = find_slot (set->slots, set->n_slots, csum, objtype);
+  if (slot->objtype != 0)
+    return FALSE;
+
+  if (set->n_slots - set->n_slots / 4 <= set->n_elements)
+    {
+      resize (set, set->n_slots * 2);
+      slot = find_slot (set->slots, set->n_slots, csum, objtype);
+    }
+
+  memcpy (slot->csum, csum, OSTREE_SHA256_DIGEST_LEN);
+  slot->objtype = objtype;
+  set->n_elements++;
+  return TRUE;
+}
+
+/**
+ * ostree_object_set_add_checksum:
+ * @set: an #OstreeObjectSet
+ * @checksum: ASCII SHA256 checksum of the object
+ * @objtype: type of the object
+ *
+ * Like ostree_object_set_add(), for an ASCII checksum.
+ *
+ * Returns: %TRUE if the object was not already in @set
+ */
+gboolean
+ostree_object_set_add_checksum (OstreeObjectSet  *set,
+                                const char       *checksum,
+                                OstreeObjectType  objtype)
+{
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  return ostree_object_set_add (set, csum, objtype);
+}
+
+/**
+ * ostree_object_set_contains:
+ * @set: an #OstreeObjectSet
+ * @csum: binary SHA256 checksum of the object
+ * @objtype: type of the object
+ *
+ * Returns: %TRUE if the object named by @csum and @objtype is in @set
+ */
+gboolean
+ostree_object_set_contains (OstreeObjectSet  *set,
+                            const guint8     *csum,
+                            OstreeObjectType  objtype)
+{
+  g_return_val_if_fail (set != NULL, FALSE);
+  g_return_val_if_fail (csum != NULL, FALSE);
+
+  return find_slot (set->slots, set->n_slots, csum, objtype)->objtype != 0;
+}
+
+/**
+ * ostree_object_set_contains_checksum:
+ * @set: an #OstreeObjectSet
+ * @checksum: ASCII SHA256 checksum of the object
+ * @objtype: type of the object
+ *
+ * Like ostree_object_set_contains(), for an ASCII checksum.
+ *
+ * Returns: %TRUE if the object is in @set
+ */
+gboolean
+ostree_object_set_contains_checksum (OstreeObjectSet  *set,
+                                     const char       *checksum,
+                                     OstreeObjectType  objtype)
+{
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  return ostree_object_set_contains (set, csum, objtype);
+}
+
+/**
+ * ostree_object_set_get_size:
+ * @set: an #OstreeObjectSet
+ *
+ * Returns: the number of objects in @set
+ */
+gsize
+ostree_object_set_get_size (OstreeObjectSet *set)
+{
+  g_return_val_if_fail (set != NULL, 0);
+
+  return set->n_elements;
+}
+
+/**
+ * ostree_object_set_iter_next:
+ * @set: an #OstreeObjectSet
+ * @iter: (inout): iteration state, initialised to 0
+ * @out_csum: (out) (transfer none): binary checksum of the next object
+ * @out_objtype: (out): type of the next object
+ *
+ * Step through the objects in @set, in no particular order.  @set must not
+ * be modified during the iteration.  @out_csum points into @set.
+ *
+ * Returns: %TRUE if an object was returned, %FALSE at the end of the set
+ */
+gboolean
+ostree_object_set_iter_next (OstreeObjectSet   *set,
+                             gsize             *iter,
+                             const guint8     **out_csum,
+                             OstreeObjectType  *out_objtype)
+{
+  g_return_val_if_fail (set != NULL, FALSE);
+  g_return_val_if_fail (iter != NULL, FALSE);
+
+  for (gsize i = *iter; i < set->n_slots; i++)
+    {
+      const OstreeObjectSetSlot *slot = &set->slots[i];
+      if (slot->objtype == 0)
+        continue;
+
+      *iter = i + 1;
+      *out_csum = slot->csum;
+      *out_objtype = slot->objtype;
+      return TRUE;
+    }
+
+  *iter = set->n_slots;
+  return FALSE;
+}
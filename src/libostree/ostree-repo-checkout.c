@@ -24,8 +24,10 @@
 #include "config.h"
 
 #include <glib-unix.h>
+#include <sys/ioctl.h>
 #include <sys/xattr.h>
 #include <gio/gfiledescriptorbased.h>
+#include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
 #include "otutil.h"
 
@@ -34,6 +36,11 @@
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
 
+/* The standardized version of BTRFS_IOC_CLONE */
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 #define WHITEOUT_PREFIX ".wh."
 #define OPAQUE_WHITEOUT_NAME ".wh..wh..opq"
 
@@ -42,6 +49,7 @@ typedef struct {
   GString *path_buf; /* buffer for real path if filtering enabled */
   GString *selabel_path_buf; /* buffer for selinux path if labeling enabled; this may be
                                 the same buffer as path_buf */
+  GMutex *devino_lock; /* held while updating devino_to_csum_cache in parallel mode */
 } CheckoutState;
 
 static void
@@ -90,16 +98,21 @@ checkout_object_for_uncompressed_cache (OstreeRepo      *self,
   if (!glnx_fchmod (tmpf.fd, file_mode, error))
     return FALSE;
 
+  /* Parallel checkouts may race to create the cache */
+  g_mutex_lock (&self->cache_lock);
+  gboolean cache_dir_ok = TRUE;
   if (self->uncompressed_objects_dir_fd == -1)
     {
-      if (!glnx_shutil_mkdir_p_at (self->repo_dir_fd, "uncompressed-objects-cache", 0755,
-                                   cancellable, error))
-        return FALSE;
-      if (!glnx_opendirat (self->repo_dir_fd, "uncompressed-objects-cache", TRUE,
-                           &self->uncompressed_objects_dir_fd,
-                           error))
-        return FALSE;
+      cache_dir_ok =
+        glnx_shutil_mkdir_p_at (self->repo_dir_fd, "uncompressed-objects-cache", 0755,
+                                cancellable, error) &&
+        glnx_opendirat (self->repo_dir_fd, "uncompressed-objects-cache", TRUE,
+                        &self->uncompressed_objects_dir_fd,
+                        error);
     }
+  g_mutex_unlock (&self->cache_lock);
+  if (!cache_dir_ok)
+    return FALSE;
 
   if (!_ostree_repo_ensure_loose_objdir_at (self->uncompressed_objects_dir_fd,
                                             loose_path,
@@ -139,7 +152,14 @@ write_regular_file_content (OstreeRepo            *self,
       int infd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*) input);
       guint64 len = g_file_info_get_size (file_info);
 
-      if (glnx_regfile_copy_bytes (infd, outfd, (off_t)len) < 0)
+      /* Share the data blocks if we can; if the filesystem doesn't support
+       * it, or the checkout is on another one, this fails with e.g.
+       * EOPNOTSUPP or EXDEV and we copy instead, which uses
+       * copy_file_range() where available.
+       */
+      if (options->reflink && ioctl (outfd, FICLONE, infd) == 0)
+        ;
+      else if (glnx_regfile_copy_bytes (infd, outfd, (off_t)len) < 0)
         return glnx_throw_errno_prefix (error, "regfile copy");
     }
   else
@@ -709,7 +729,11 @@ checkout_one_file_at (OstreeRepo                        *repo,
                   key->ino = stbuf.st_ino;
                   memcpy (key->checksum, checksum, OSTREE_SHA256_STRING_LEN+1);
 
+                  if (state->devino_lock)
+                    g_mutex_lock (state->devino_lock);
                   g_hash_table_add ((GHashTable*)options->devino_to_csum_cache, key);
+                  if (state->devino_lock)
+                    g_mutex_unlock (state->devino_lock);
                 }
 
               if (hardlink_res != HARDLINK_RESULT_NOT_SUPPORTED)
@@ -728,7 +752,8 @@ checkout_one_file_at (OstreeRepo                        *repo,
   g_autoptr(GVariant) xattrs = NULL;
 
   /* Ok, if we're archive and we didn't find an object, uncompress
-   * it now, stick it in the cache, and then hardlink to that.
+   * it now, stick it in the cache, and then hardlink to that (or
+   * clone it, for reflink checkouts).
    */
   if (can_cache
       && !is_whiteout
@@ -736,56 +761,94 @@ checkout_one_file_at (OstreeRepo                        *repo,
       && !is_reg_zerosized
       && need_copy
       && repo->mode == OSTREE_REPO_MODE_ARCHIVE
-      && options->mode == OSTREE_REPO_CHECKOUT_MODE_USER)
+      && (options->mode == OSTREE_REPO_CHECKOUT_MODE_USER || options->reflink))
     {
-      HardlinkResult hardlink_res = HARDLINK_RESULT_NOT_SUPPORTED;
-
-      if (!ostree_repo_load_file (repo, checksum, &input, NULL, NULL,
-                                  cancellable, error))
-        return FALSE;
+      glnx_autofd int cached_fd = -1;
 
       /* Overwrite any parent repo from earlier */
       _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, OSTREE_REPO_MODE_BARE);
 
-      if (!checkout_object_for_uncompressed_cache (repo, loose_path_buf,
-                                                   source_info, input,
-                                                   cancellable, error))
-        return glnx_prefix_error (error, "Unpacking loose object %s", checksum);
-
-      g_clear_object (&input);
-
-      /* Store the 2-byte objdir prefix (e.g. e3) in a set.  The basic
-       * idea here is that if we had to unpack an object, it's very
-       * likely we're replacing some other object, so we may need a GC.
-       *
-       * This model ensures that we do work roughly proportional to
-       * the size of the changes.  For example, we don't scan any
-       * directories if we didn't modify anything, meaning you can
-       * checkout the same tree multiple times very quickly.
-       *
-       * This is also scale independent; we don't hardcode e.g. looking
-       * at 1000 objects.
-       *
-       * The downside is that if we're unlucky, we may not free
-       * an object for quite some time.
-       */
-      g_mutex_lock (&repo->cache_lock);
-      {
-        gpointer key = GUINT_TO_POINTER ((g_ascii_xdigit_value (checksum[0]) << 4) +
-                                         g_ascii_xdigit_value (checksum[1]));
-        if (repo->updated_uncompressed_dirs == NULL)
-          repo->updated_uncompressed_dirs = g_hash_table_new (NULL, NULL);
-        g_hash_table_add (repo->updated_uncompressed_dirs, key);
-      }
-      g_mutex_unlock (&repo->cache_lock);
+      /* Reflink checkouts didn't look in the cache above */
+      if (options->reflink && repo->uncompressed_objects_dir_fd != -1)
+        {
+          if (!ot_openat_ignore_enoent (repo->uncompressed_objects_dir_fd, loose_path_buf,
+                                        &cached_fd, error))
+            return FALSE;
+        }
 
-      if (!checkout_file_hardlink (repo, checksum, options, loose_path_buf,
-                                   destination_dfd, destination_name,
-                                   FALSE, &hardlink_res,
-                                   cancellable, error))
-        return glnx_prefix_error (error, "Using new cached uncompressed hardlink of %s to %s", checksum, destination_name);
+      gboolean cached = TRUE;
+      if (cached_fd == -1)
+        {
+          if (!ostree_repo_load_file (repo, checksum, &input, NULL, NULL,
+                                      cancellable, error))
+            return FALSE;
 
-      need_copy = (hardlink_res == HARDLINK_RESULT_NOT_SUPPORTED);
+          g_autoptr(GError) local_error = NULL;
+          cached = checkout_object_for_uncompressed_cache (repo, loose_path_buf,
+                                                           source_info, input,
+                                                           cancellable, &local_error);
+          g_clear_object (&input);
+          if (!cached && !options->reflink)
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return glnx_prefix_error (error, "Unpacking loose object %s", checksum);
+            }
+          else if (!cached)
+            {
+              /* Cloning is only an optimization over copying, and e.g. the
+               * repository may be read-only; copy from the object below. */
+              g_debug ("Not caching %s for reflink checkout: %s", checksum, local_error->message);
+            }
+
+          /* Store the 2-byte objdir prefix (e.g. e3) in a set.  The basic
+           * idea here is that if we had to unpack an object, it's very
+           * likely we're replacing some other object, so we may need a GC.
+           *
+           * This model ensures that we do work roughly proportional to
+           * the size of the changes.  For example, we don't scan any
+           * directories if we didn't modify anything, meaning you can
+           * checkout the same tree multiple times very quickly.
+           *
+           * This is also scale independent; we don't hardcode e.g. looking
+           * at 1000 objects.
+           *
+           * The downside is that if we're unlucky, we may not free
+           * an object for quite some time.
+           */
+          g_mutex_lock (&repo->cache_lock);
+          {
+            gpointer key = GUINT_TO_POINTER ((g_ascii_xdigit_value (checksum[0]) << 4) +
+                                             g_ascii_xdigit_value (checksum[1]));
+            if (repo->updated_uncompressed_dirs == NULL)
+              repo->updated_uncompressed_dirs = g_hash_table_new (NULL, NULL);
+            g_hash_table_add (repo->updated_uncompressed_dirs, key);
+          }
+          g_mutex_unlock (&repo->cache_lock);
+        }
+
+      if (options->reflink && cached)
+        {
+          /* Copy from the cached object below, which write_regular_file_content()
+           * can clone.
+           */
+          if (cached_fd == -1
+              && !glnx_openat_rdonly (repo->uncompressed_objects_dir_fd, loose_path_buf, FALSE,
+                                   &cached_fd, error))
+            return FALSE;
+          input = g_unix_input_stream_new (glnx_steal_fd (&cached_fd), TRUE);
+        }
+      else if (!options->reflink)
+        {
+          HardlinkResult hardlink_res = HARDLINK_RESULT_NOT_SUPPORTED;
+
+          if (!checkout_file_hardlink (repo, checksum, options, loose_path_buf,
+                                       destination_dfd, destination_name,
+                                       FALSE, &hardlink_res,
+                                       cancellable, error))
+            return glnx_prefix_error (error, "Using new cached uncompressed hardlink of %s to %s", checksum, destination_name);
+
+          need_copy = (hardlink_res == HARDLINK_RESULT_NOT_SUPPORTED);
+        }
     }
 
   /* Fall back to copy if we couldn't hardlink */
@@ -798,7 +861,7 @@ checkout_one_file_at (OstreeRepo                        *repo,
        */
       if (options->no_copy_fallback)
         g_assert (is_bare_user_symlink || is_reg_zerosized);
-      if (!ostree_repo_load_file (repo, checksum, &input, NULL, &xattrs,
+      if (!ostree_repo_load_file (repo, checksum, input ? NULL : &input, NULL, &xattrs,
                                   cancellable, error))
         return FALSE;
 
@@ -852,43 +915,54 @@ pop_path_element (OstreeRepoCheckoutAtOptions *options,
     g_string_truncate (state->selabel_path_buf, state->selabel_path_buf->len - n);
 }
 
-/*
- * checkout_tree_at:
- * @self: Repo
- * @mode: Options controlling all files
- * @state: Any state we're carrying through
- * @overwrite_mode: Whether or not to overwrite files
- * @destination_parent_fd: Place tree here
- * @destination_name: Use this name for tree
- * @source: Source tree
- * @source_info: Source info
- * @cancellable: Cancellable
- * @error: Error
- *
- * Like ostree_repo_checkout_tree(), but check out @source into the
- * relative @destination_name, located by @destination_parent_fd.
+/* Metadata for a directory we're checking out, filled in by
+ * checkout_dir_prepare() and consumed by checkout_dir_finalize().
+ */
+typedef struct {
+  gboolean skip; /* Set if the filter excluded this directory */
+  gboolean did_exist;
+  guint32 uid;
+  guint32 gid;
+  guint32 mode;
+  GVariant *dirtree;
+  int dfd;
+} CheckoutDir;
+
+static void
+checkout_dir_clear (CheckoutDir *dir)
+{
+  g_clear_pointer (&dir->dirtree, (GDestroyNotify) g_variant_unref);
+  glnx_close_fd (&dir->dfd);
+}
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(CheckoutDir, checkout_dir_clear)
+
+/* Load the dirtree/dirmeta pair, run the filter, and create (or, when
+ * unioning, reuse) the destination directory with a restrictive mode.
+ * The final mode, ownership and mtime are applied later by
+ * checkout_dir_finalize(), once all children have been written.
  */
 static gboolean
-checkout_tree_at_recurse (OstreeRepo                        *self,
-                          OstreeRepoCheckoutAtOptions       *options,
-                          CheckoutState                     *state,
-                          int                                destination_parent_fd,
-                          const char                        *destination_name,
-                          const char                        *dirtree_checksum,
-                          const char                        *dirmeta_checksum,
-                          GCancellable                      *cancellable,
-                          GError                           **error)
+checkout_dir_prepare (OstreeRepo                        *self,
+                      OstreeRepoCheckoutAtOptions       *options,
+                      CheckoutState                     *state,
+                      int                                destination_parent_fd,
+                      const char                        *destination_name,
+                      const char                        *dirtree_checksum,
+                      const char                        *dirmeta_checksum,
+                      CheckoutDir                       *out_dir,
+                      GCancellable                      *cancellable,
+                      GError                           **error)
 {
-  gboolean did_exist = FALSE;
   gboolean is_opaque_whiteout = FALSE;
   const gboolean sepolicy_enabled = options->sepolicy && !self->disable_xattrs;
-  g_autoptr(GVariant) dirtree = NULL;
   g_autoptr(GVariant) dirmeta = NULL;
   g_autoptr(GVariant) xattrs = NULL;
   g_autoptr(GVariant) modified_xattrs = NULL;
 
+  out_dir->dfd = -1;
+
   if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_TREE,
-                                 dirtree_checksum, &dirtree, error))
+                                 dirtree_checksum, &out_dir->dirtree, error))
     return FALSE;
   if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_META,
                                  dirmeta_checksum, &dirmeta, error))
@@ -899,9 +973,9 @@ checkout_tree_at_recurse (OstreeRepo                        *self,
   g_variant_get (dirmeta, "(uuu@a(ayay))",
                  &uid, &gid, &mode,
                  options->mode != OSTREE_REPO_CHECKOUT_MODE_USER ? &xattrs : NULL);
-  uid = GUINT32_FROM_BE (uid);
-  gid = GUINT32_FROM_BE (gid);
-  mode = GUINT32_FROM_BE (mode);
+  out_dir->uid = uid = GUINT32_FROM_BE (uid);
+  out_dir->gid = gid = GUINT32_FROM_BE (gid);
+  out_dir->mode = mode = GUINT32_FROM_BE (mode);
 
   if (options->filter)
     {
@@ -911,12 +985,15 @@ checkout_tree_at_recurse (OstreeRepo                        *self,
       stbuf.st_gid = gid;
       if (options->filter (self, state->path_buf->str, &stbuf, options->filter_user_data)
           == OSTREE_REPO_CHECKOUT_FILTER_SKIP)
-        return TRUE; /* Note early return */
+        {
+          out_dir->skip = TRUE;
+          return TRUE; /* Note early return */
+        }
     }
 
   if (options->process_whiteouts)
     {
-      g_autoptr(GVariant) dir_file_contents = g_variant_get_child_value (dirtree, 0);
+      g_autoptr(GVariant) dir_file_contents = g_variant_get_child_value (out_dir->dirtree, 0);
       GVariantIter viter;
       const char *fname;
       g_autoptr(GVariant) contents_csum_v = NULL;
@@ -973,22 +1050,21 @@ checkout_tree_at_recurse (OstreeRepo                        *self,
           case OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES:
           case OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES:
           case OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_IDENTICAL:
-            did_exist = TRUE;
+            out_dir->did_exist = TRUE;
             break;
           }
       }
   }
 
-  glnx_autofd int destination_dfd = -1;
   if (!glnx_opendirat (destination_parent_fd, destination_name, TRUE,
-                       &destination_dfd, error))
+                       &out_dir->dfd, error))
     return FALSE;
 
   struct stat repo_dfd_stat;
   if (fstat (self->repo_dir_fd, &repo_dfd_stat) < 0)
     return glnx_throw_errno (error);
   struct stat destination_stat;
-  if (fstat (destination_dfd, &destination_stat) < 0)
+  if (fstat (out_dir->dfd, &destination_stat) < 0)
     return glnx_throw_errno (error);
 
   if (options->no_copy_fallback && repo_dfd_stat.st_dev != destination_stat.st_dev)
@@ -996,38 +1072,146 @@ checkout_tree_at_recurse (OstreeRepo                        *self,
                        (guint64)repo_dfd_stat.st_dev, (guint64)destination_stat.st_dev);
 
   /* Set the xattrs if we created the dir */
-  if (!did_exist && xattrs)
+  if (!out_dir->did_exist && xattrs)
     {
-      if (!glnx_fd_set_all_xattrs (destination_dfd, xattrs, cancellable, error))
+      if (!glnx_fd_set_all_xattrs (out_dir->dfd, xattrs, cancellable, error))
         return FALSE;
     }
 
-  /* Process files in this subdir */
-  { g_autoptr(GVariant) dir_file_contents = g_variant_get_child_value (dirtree, 0);
-    GVariantIter viter;
-    g_variant_iter_init (&viter, dir_file_contents);
-    const char *fname;
-    g_autoptr(GVariant) contents_csum_v = NULL;
-    while (g_variant_iter_loop (&viter, "(&s@ay)", &fname, &contents_csum_v))
-      {
-        push_path_element (options, state, fname, FALSE);
+  return TRUE;
+}
 
-        char tmp_checksum[OSTREE_SHA256_STRING_LEN+1];
-        _ostree_checksum_inplace_from_bytes_v (contents_csum_v, tmp_checksum);
+/* Check out the regular files and symlinks directly in @dir */
+static gboolean
+checkout_dir_files (OstreeRepo                        *self,
+                    OstreeRepoCheckoutAtOptions       *options,
+                    CheckoutState                     *state,
+                    CheckoutDir                       *dir,
+                    GCancellable                      *cancellable,
+                    GError                           **error)
+{
+  g_autoptr(GVariant) dir_file_contents = g_variant_get_child_value (dir->dirtree, 0);
+  GVariantIter viter;
+  g_variant_iter_init (&viter, dir_file_contents);
+  const char *fname;
+  g_autoptr(GVariant) contents_csum_v = NULL;
+  while (g_variant_iter_loop (&viter, "(&s@ay)", &fname, &contents_csum_v))
+    {
+      push_path_element (options, state, fname, FALSE);
 
-        if (!checkout_one_file_at (self, options, state,
-                                   tmp_checksum,
-                                   destination_dfd, fname,
-                                   cancellable, error))
-          return FALSE;
+      char tmp_checksum[OSTREE_SHA256_STRING_LEN+1];
+      _ostree_checksum_inplace_from_bytes_v (contents_csum_v, tmp_checksum);
 
-        pop_path_element (options, state, fname, FALSE);
-      }
-    contents_csum_v = NULL; /* iter_loop freed it */
-  }
+      if (!checkout_one_file_at (self, options, state,
+                                 tmp_checksum,
+                                 dir->dfd, fname,
+                                 cancellable, error))
+        return FALSE;
+
+      pop_path_element (options, state, fname, FALSE);
+    }
+  contents_csum_v = NULL; /* iter_loop freed it */
+
+  return TRUE;
+}
+
+/* We do fchmod/fchown last so that no one else could access the
+ * partially created directory and change content we're laying out.
+ */
+static gboolean
+checkout_dir_finalize (OstreeRepo                        *self,
+                       OstreeRepoCheckoutAtOptions       *options,
+                       int                                dfd,
+                       gboolean                           did_exist,
+                       guint32                            uid,
+                       guint32                            gid,
+                       guint32                            mode,
+                       GError                           **error)
+{
+  if (!did_exist)
+    {
+      guint32 canonical_mode;
+      /* Silently ignore world-writable directories (plus sticky, suid bits,
+       * etc.) when doing a checkout for bare-user-only repos, or if requested explicitly.
+       * This is related to the logic in ostree-repo-commit.c for files.
+       * See also: https://github.com/ostreedev/ostree/pull/909 i.e. 0c4b3a2b6da950fd78e63f9afec602f6188f1ab0
+       */
+      if (self->mode == OSTREE_REPO_MODE_BARE_USER_ONLY || options->bareuseronly_dirs)
+        canonical_mode = (mode & 0775) | S_IFDIR;
+      else
+        canonical_mode = mode;
+      if (TEMP_FAILURE_RETRY (fchmod (dfd, canonical_mode)) < 0)
+        return glnx_throw_errno_prefix (error, "fchmod");
+    }
+
+  if (!did_exist && options->mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+    {
+      if (TEMP_FAILURE_RETRY (fchown (dfd, uid, gid)) < 0)
+        return glnx_throw_errno (error);
+    }
+
+  /* Set directory mtime to OSTREE_TIMESTAMP, so that it is constant for all checkouts.
+   * Must be done after setting permissions and creating all children.  Note we skip doing
+   * this for directories that already exist (under the theory we possibly don't own them),
+   * and we also skip it if doing copying checkouts, which is mostly for /etc.
+   */
+  if (!did_exist && !options->force_copy)
+    {
+      const struct timespec times[2] = { { OSTREE_TIMESTAMP, UTIME_OMIT }, { OSTREE_TIMESTAMP, 0} };
+      if (TEMP_FAILURE_RETRY (futimens (dfd, times)) < 0)
+        return glnx_throw_errno (error);
+    }
+
+  if (fsync_is_enabled (self, options))
+    {
+      if (fsync (dfd) == -1)
+        return glnx_throw_errno (error);
+    }
+
+  return TRUE;
+}
+
+/*
+ * checkout_tree_at:
+ * @self: Repo
+ * @mode: Options controlling all files
+ * @state: Any state we're carrying through
+ * @overwrite_mode: Whether or not to overwrite files
+ * @destination_parent_fd: Place tree here
+ * @destination_name: Use this name for tree
+ * @source: Source tree
+ * @source_info: Source info
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_checkout_tree(), but check out @source into the
+ * relative @destination_name, located by @destination_parent_fd.
+ */
+static gboolean
+checkout_tree_at_recurse (OstreeRepo                        *self,
+                          OstreeRepoCheckoutAtOptions       *options,
+                          CheckoutState                     *state,
+                          int                                destination_parent_fd,
+                          const char                        *destination_name,
+                          const char                        *dirtree_checksum,
+                          const char                        *dirmeta_checksum,
+                          GCancellable                      *cancellable,
+                          GError                           **error)
+{
+  g_auto(CheckoutDir) dir = { .dfd = -1, };
+  if (!checkout_dir_prepare (self, options, state, destination_parent_fd, destination_name,
+                             dirtree_checksum, dirmeta_checksum, &dir,
+                             cancellable, error))
+    return FALSE;
+  if (dir.skip)
+    return TRUE; /* Note early return */
+
+  /* Process files in this subdir */
+  if (!checkout_dir_files (self, options, state, &dir, cancellable, error))
+    return FALSE;
 
   /* Process subdirectories */
-  { g_autoptr(GVariant) dir_subdirs = g_variant_get_child_value (dirtree, 1);
+  { g_autoptr(GVariant) dir_subdirs = g_variant_get_child_value (dir.dirtree, 1);
     const char *dname;
     g_autoptr(GVariant) subdirtree_csum_v = NULL;
     g_autoptr(GVariant) subdirmeta_csum_v = NULL;
@@ -1052,7 +1236,7 @@ checkout_tree_at_recurse (OstreeRepo                        *self,
         char subdirmeta_checksum[OSTREE_SHA256_STRING_LEN+1];
         _ostree_checksum_inplace_from_bytes_v (subdirmeta_csum_v, subdirmeta_checksum);
         if (!checkout_tree_at_recurse (self, options, state,
-                                       destination_dfd, dname,
+                                       dir.dfd, dname,
                                        subdirtree_checksum, subdirmeta_checksum,
                                        cancellable, error))
           return FALSE;
@@ -1061,48 +1245,303 @@ checkout_tree_at_recurse (OstreeRepo                        *self,
       }
   }
 
-  /* We do fchmod/fchown last so that no one else could access the
-   * partially created directory and change content we're laying out.
-   */
-  if (!did_exist)
+  return checkout_dir_finalize (self, options, dir.dfd, dir.did_exist,
+                                dir.uid, dir.gid, dir.mode, error);
+}
+
+/* Parallel checkout.  Every directory becomes a task on a GThreadPool; a
+ * task creates its directory, checks out the files directly inside it, and
+ * then queues one task per subdirectory.  Since directories must only get
+ * their final mode/ownership/mtime after all of their children exist, each
+ * task counts itself plus its outstanding subdirectories, and whichever
+ * thread drops that count to zero finalizes the directory and then
+ * releases its reference on the parent.
+ *
+ * Tasks address their directories relative to the root of the checkout
+ * rather than holding a directory fd open, so that very wide trees don't
+ * exhaust the fd limit.  Within a single directory, files are still
+ * processed before subdirectories and in dirtree order, which is what
+ * whiteout handling relies on.
+ */
+typedef struct _CheckoutDirTask CheckoutDirTask;
+
+typedef struct {
+  OstreeRepo *repo;
+  OstreeRepoCheckoutAtOptions *options;
+  GCancellable *cancellable;
+  int root_dfd;
+  GThreadPool *pool;
+
+  GMutex devino_lock;
+
+  GMutex lock;
+  GCond cond;
+  gboolean done;
+  GError *error;
+} CheckoutParallel;
+
+struct _CheckoutDirTask {
+  CheckoutDirTask *parent;
+  guint depth;
+  char *relpath; /* Relative to root_dfd; NULL for the root itself */
+  char *path;    /* Contents of CheckoutState.path_buf, if filtering */
+  char dirtree_checksum[OSTREE_SHA256_STRING_LEN+1];
+  char dirmeta_checksum[OSTREE_SHA256_STRING_LEN+1];
+
+  /* Filled in by checkout_dir_prepare() */
+  gboolean skip;
+  gboolean did_exist;
+  guint32 uid;
+  guint32 gid;
+  guint32 mode;
+
+  /* This task plus queued/running subdirectory tasks */
+  volatile gint n_pending;
+};
+
+static void
+checkout_dir_task_free (CheckoutDirTask *task)
+{
+  g_free (task->relpath);
+  g_free (task->path);
+  g_free (task);
+}
+
+static void
+checkout_parallel_take_error (CheckoutParallel *ctx,
+                              GError           *local_error)
+{
+  g_mutex_lock (&ctx->lock);
+  if (ctx->error == NULL)
+    ctx->error = g_steal_pointer (&local_error);
+  g_mutex_unlock (&ctx->lock);
+  g_clear_error (&local_error);
+}
+
+static gboolean
+checkout_parallel_should_stop (CheckoutParallel *ctx)
+{
+  gboolean ret;
+  g_mutex_lock (&ctx->lock);
+  ret = ctx->error != NULL;
+  g_mutex_unlock (&ctx->lock);
+  return ret || g_cancellable_is_cancelled (ctx->cancellable);
+}
+
+/* Drop one reference on @task; the last one finalizes the directory and
+ * propagates up to the parent.
+ */
+static void
+checkout_dir_task_complete (CheckoutParallel *ctx,
+                            CheckoutDirTask  *task)
+{
+  while (task && g_atomic_int_dec_and_test (&task->n_pending))
     {
-      guint32 canonical_mode;
-      /* Silently ignore world-writable directories (plus sticky, suid bits,
-       * etc.) when doing a checkout for bare-user-only repos, or if requested explicitly.
-       * This is related to the logic in ostree-repo-commit.c for files.
-       * See also: https://github.com/ostreedev/ostree/pull/909 i.e. 0c4b3a2b6da950fd78e63f9afec602f6188f1ab0
-       */
-      if (self->mode == OSTREE_REPO_MODE_BARE_USER_ONLY || options->bareuseronly_dirs)
-        canonical_mode = (mode & 0775) | S_IFDIR;
-      else
-        canonical_mode = mode;
-      if (TEMP_FAILURE_RETRY (fchmod (destination_dfd, canonical_mode)) < 0)
-        return glnx_throw_errno_prefix (error, "fchmod");
+      CheckoutDirTask *parent = task->parent;
+
+      if (!task->skip && !checkout_parallel_should_stop (ctx))
+        {
+          g_autoptr(GError) local_error = NULL;
+          glnx_autofd int owned_dfd = -1;
+          int dfd = ctx->root_dfd;
+
+          if (task->relpath)
+            {
+              if (!glnx_opendirat (ctx->root_dfd, task->relpath, TRUE, &owned_dfd, &local_error))
+                checkout_parallel_take_error (ctx, g_steal_pointer (&local_error));
+              dfd = owned_dfd;
+            }
+          if (dfd != -1 &&
+              !checkout_dir_finalize (ctx->repo, ctx->options, dfd, task->did_exist,
+                                      task->uid, task->gid, task->mode, &local_error))
+            checkout_parallel_take_error (ctx, g_steal_pointer (&local_error));
+        }
+
+      if (parent == NULL)
+        {
+          g_mutex_lock (&ctx->lock);
+          ctx->done = TRUE;
+          g_cond_signal (&ctx->cond);
+          g_mutex_unlock (&ctx->lock);
+        }
+
+      checkout_dir_task_free (task);
+      task = parent;
     }
+}
 
-  if (!did_exist && options->mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+/* Check out the files in an already created directory, then queue its
+ * subdirectories.
+ */
+static gboolean
+checkout_dir_task_process (CheckoutParallel *ctx,
+                           CheckoutDirTask  *task,
+                           CheckoutState    *state,
+                           CheckoutDir      *dir,
+                           GError          **error)
+{
+  task->did_exist = dir->did_exist;
+  task->uid = dir->uid;
+  task->gid = dir->gid;
+  task->mode = dir->mode;
+
+  if (!checkout_dir_files (ctx->repo, ctx->options, state, dir, ctx->cancellable, error))
+    return FALSE;
+
+  g_autoptr(GVariant) dir_subdirs = g_variant_get_child_value (dir->dirtree, 1);
+  const char *dname;
+  g_autoptr(GVariant) subdirtree_csum_v = NULL;
+  g_autoptr(GVariant) subdirmeta_csum_v = NULL;
+  GVariantIter viter;
+  g_variant_iter_init (&viter, dir_subdirs);
+  while (g_variant_iter_loop (&viter, "(&s@ay@ay)", &dname,
+                              &subdirtree_csum_v, &subdirmeta_csum_v))
     {
-      if (TEMP_FAILURE_RETRY (fchown (destination_dfd, uid, gid)) < 0)
-        return glnx_throw_errno (error);
+      /* See checkout_tree_at_recurse() */
+      if (!ot_util_filename_validate (dname, error))
+        return FALSE;
+
+      CheckoutDirTask *subtask = g_new0 (CheckoutDirTask, 1);
+      subtask->parent = task;
+      subtask->depth = task->depth + 1;
+      subtask->relpath = task->relpath ? g_build_filename (task->relpath, dname, NULL) : g_strdup (dname);
+      if (task->path)
+        subtask->path = g_strconcat (task->path, dname, "/", NULL);
+      _ostree_checksum_inplace_from_bytes_v (subdirtree_csum_v, subtask->dirtree_checksum);
+      _ostree_checksum_inplace_from_bytes_v (subdirmeta_csum_v, subtask->dirmeta_checksum);
+      subtask->n_pending = 1;
+
+      g_atomic_int_inc (&task->n_pending);
+      if (!g_thread_pool_push (ctx->pool, subtask, error))
+        {
+          subtask->skip = TRUE;
+          checkout_dir_task_complete (ctx, subtask);
+          return FALSE;
+        }
     }
 
-  /* Set directory mtime to OSTREE_TIMESTAMP, so that it is constant for all checkouts.
-   * Must be done after setting permissions and creating all children.  Note we skip doing
-   * this for directories that already exist (under the theory we possibly don't own them),
-   * and we also skip it if doing copying checkouts, which is mostly for /etc.
-   */
-  if (!did_exist && !options->force_copy)
+  return TRUE;
+}
+
+static void
+checkout_dir_task_run (gpointer data,
+                       gpointer user_data)
+{
+  CheckoutDirTask *task = data;
+  CheckoutParallel *ctx = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!checkout_parallel_should_stop (ctx))
     {
-      const struct timespec times[2] = { { OSTREE_TIMESTAMP, UTIME_OMIT }, { OSTREE_TIMESTAMP, 0} };
-      if (TEMP_FAILURE_RETRY (futimens (destination_dfd, times)) < 0)
-        return glnx_throw_errno (error);
+      g_auto(CheckoutState) state = { 0, };
+      g_auto(CheckoutDir) dir = { .dfd = -1, };
+      if (task->path)
+        state.path_buf = g_string_new (task->path);
+      state.devino_lock = &ctx->devino_lock;
+
+      if (!checkout_dir_prepare (ctx->repo, ctx->options, &state,
+                                 ctx->root_dfd, task->relpath,
+                                 task->dirtree_checksum, task->dirmeta_checksum,
+                                 &dir, ctx->cancellable, &local_error))
+        checkout_parallel_take_error (ctx, g_steal_pointer (&local_error));
+      else if (dir.skip)
+        task->skip = TRUE;
+      else if (!checkout_dir_task_process (ctx, task, &state, &dir, &local_error))
+        checkout_parallel_take_error (ctx, g_steal_pointer (&local_error));
     }
 
-  if (fsync_is_enabled (self, options))
+  checkout_dir_task_complete (ctx, task);
+}
+
+/* Deeper directories first; this keeps the number of queued tasks (and
+ * hence memory) proportional to the width of the tree rather than its
+ * total size.
+ */
+static gint
+checkout_dir_task_compare (gconstpointer a,
+                           gconstpointer b,
+                           gpointer      user_data)
+{
+  const CheckoutDirTask *task_a = a;
+  const CheckoutDirTask *task_b = b;
+  if (task_a->depth == task_b->depth)
+    return 0;
+  return task_a->depth > task_b->depth ? -1 : 1;
+}
+
+#define CHECKOUT_MAX_THREADS_PER_CPU 4
+
+static gboolean
+checkout_tree_at_parallel (OstreeRepo                        *self,
+                           OstreeRepoCheckoutAtOptions       *options,
+                           CheckoutState                     *state,
+                           int                                destination_parent_fd,
+                           const char                        *destination_name,
+                           const char                        *dirtree_checksum,
+                           const char                        *dirmeta_checksum,
+                           GCancellable                      *cancellable,
+                           GError                           **error)
+{
+  g_auto(CheckoutDir) dir = { .dfd = -1, };
+  if (!checkout_dir_prepare (self, options, state, destination_parent_fd, destination_name,
+                             dirtree_checksum, dirmeta_checksum, &dir,
+                             cancellable, error))
+    return FALSE;
+  if (dir.skip)
+    return TRUE; /* Note early return */
+
+  CheckoutParallel ctx = { 0, };
+  ctx.repo = self;
+  ctx.options = options;
+  ctx.cancellable = cancellable;
+  ctx.root_dfd = dir.dfd;
+  g_mutex_init (&ctx.devino_lock);
+  g_mutex_init (&ctx.lock);
+  g_cond_init (&ctx.cond);
+
+  /* The work is mostly system calls, so a few threads per CPU can help to
+   * keep the disk busy; beyond that they just add contention. */
+  const guint max_threads = CHECKOUT_MAX_THREADS_PER_CPU * MAX (g_get_num_processors (), 1);
+  ctx.pool = g_thread_pool_new (checkout_dir_task_run, &ctx,
+                                MIN ((guint)options->n_threads, max_threads), TRUE, error);
+  if (!ctx.pool)
     {
-      if (fsync (destination_dfd) == -1)
-        return glnx_throw_errno (error);
+      g_mutex_clear (&ctx.devino_lock);
+      g_mutex_clear (&ctx.lock);
+      g_cond_clear (&ctx.cond);
+      return FALSE;
+    }
+  g_thread_pool_set_sort_function (ctx.pool, checkout_dir_task_compare, NULL);
+
+  CheckoutDirTask *root = g_new0 (CheckoutDirTask, 1);
+  if (state->path_buf)
+    root->path = g_strdup (state->path_buf->str);
+  root->n_pending = 1;
+  state->devino_lock = &ctx.devino_lock;
+
+  g_autoptr(GError) local_error = NULL;
+  if (!checkout_dir_task_process (&ctx, root, state, &dir, &local_error))
+    checkout_parallel_take_error (&ctx, g_steal_pointer (&local_error));
+  checkout_dir_task_complete (&ctx, root);
+
+  g_mutex_lock (&ctx.lock);
+  while (!ctx.done)
+    g_cond_wait (&ctx.cond, &ctx.lock);
+  g_mutex_unlock (&ctx.lock);
+
+  g_thread_pool_free (ctx.pool, FALSE, TRUE);
+  state->devino_lock = NULL;
+  g_mutex_clear (&ctx.devino_lock);
+  g_mutex_clear (&ctx.lock);
+  g_cond_clear (&ctx.cond);
+
+  if (ctx.error)
+    {
+      g_propagate_error (error, ctx.error);
+      return FALSE;
     }
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
 
   return TRUE;
 }
@@ -1199,6 +1638,14 @@ checkout_tree_at (OstreeRepo                        *self,
   g_assert_cmpint (g_file_info_get_file_type (source_info), ==, G_FILE_TYPE_DIRECTORY);
   const char *dirtree_checksum = ostree_repo_file_tree_get_contents_checksum (source);
   const char *dirmeta_checksum = ostree_repo_file_tree_get_metadata_checksum (source);
+  /* libselinux label handles aren't safe to share across threads, so
+   * labeling checkouts are always done serially.
+   */
+  if (options->n_threads > 1 && !options->sepolicy)
+    return checkout_tree_at_parallel (self, options, &state, destination_parent_fd,
+                                      destination_name,
+                                      dirtree_checksum, dirmeta_checksum,
+                                      cancellable, error);
   return checkout_tree_at_recurse (self, options, &state, destination_parent_fd,
                                    destination_name,
                                    dirtree_checksum, dirmeta_checksum,
@@ -1216,6 +1663,10 @@ canonicalize_options (OstreeRepo                  *self,
   /* Force USER mode for BARE_USER_ONLY always - nothing else makes sense */
   if (ostree_repo_get_mode (self) == OSTREE_REPO_MODE_BARE_USER_ONLY)
     options->mode = OSTREE_REPO_CHECKOUT_MODE_USER;
+
+  /* Reflinking is a way of copying */
+  if (options->reflink)
+    options->force_copy = TRUE;
 }
 
 /**
@@ -37,6 +37,7 @@
 #include "ostree.h"
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
+#include "ostree-repo-object-index-private.h"
 #include "ostree-sepolicy-private.h"
 #include "ostree-repo-file-enumerator.h"
 #include "ostree-checksum-input-stream.h"
@@ -351,6 +352,8 @@ repo_store_size_entry (OstreeRepo       *self,
                        goffset           unpacked,
                        goffset           archived)
 {
+  /* Content objects may be written from multiple threads */
+  g_mutex_lock (&self->txn_lock);
   if (G_UNLIKELY (self->object_sizes == NULL))
     self->object_sizes = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                 g_free, content_size_cache_entry_free);
@@ -358,6 +361,7 @@ repo_store_size_entry (OstreeRepo       *self,
   g_hash_table_replace (self->object_sizes,
                         g_strdup (checksum),
                         content_size_cache_entry_new (unpacked, archived));
+  g_mutex_unlock (&self->txn_lock);
 }
 
 static int
@@ -973,7 +977,7 @@ write_content_object (OstreeRepo         *self,
     }
   else
     {
-      g_autoptr(GConverter) zlib_compressor = NULL;
+      g_autoptr(GConverter) compressor = NULL;
       g_autoptr(GOutputStream) compressed_out_stream = NULL;
       g_autoptr(GOutputStream) temp_out = NULL;
 
@@ -999,8 +1003,13 @@ write_content_object (OstreeRepo         *self,
 
       if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
         {
-          zlib_compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, self->zlib_compression_level);
-          compressed_out_stream = g_converter_output_stream_new (temp_out, zlib_compressor);
+          const int level =
+            self->archive_compression == OSTREE_ARCHIVE_COMPRESSION_ZSTD ? self->zstd_compression_level
+                                                                         : self->zlib_compression_level;
+          compressor = _ostree_archive_compressor_new (self->archive_compression, level, error);
+          if (!compressor)
+            return FALSE;
+          compressed_out_stream = g_converter_output_stream_new (temp_out, compressor);
           /* Don't close the base; we'll do that later */
           g_filter_output_stream_set_close_base_stream ((GFilterOutputStream*)compressed_out_stream, FALSE);
 
@@ -1604,6 +1613,7 @@ ostree_repo_prepare_transaction (OstreeRepo     *self,
 
   self->in_transaction = TRUE;
   self->cleanup_stagedir = FALSE;
+  self->object_index_checked = FALSE;
 
   struct statvfs stvfsbuf;
   if (TEMP_FAILURE_RETRY (fstatvfs (self->repo_dir_fd, &stvfsbuf)) < 0)
@@ -1661,9 +1671,13 @@ ostree_repo_prepare_transaction (OstreeRepo     *self,
  * syncfs() has potentially been invoked to ensure that all objects have been
  * written to disk.  In the future we may enhance this; see
  * https://github.com/ostreedev/ostree/issues/1184
+ *
+ * If @out_renamed is non-%NULL, an OstreeObjectIndexEntry is appended to
+ * it for each object.
  */
 static gboolean
 rename_pending_loose_objects (OstreeRepo        *self,
+                              GArray            *out_renamed,
                               GCancellable      *cancellable,
                               GError           **error)
 {
@@ -1721,6 +1735,17 @@ rename_pending_loose_objects (OstreeRepo        *self,
                               self->objects_dir_fd, loose_objpath, error))
             return FALSE;
 
+          char checksum[OSTREE_SHA256_STRING_LEN+1];
+          OstreeObjectType objtype;
+          if (out_renamed &&
+              _ostree_repo_parse_loose_object_name (self, dent->d_name, child_dent->d_name,
+                                                    checksum, &objtype))
+            {
+              OstreeObjectIndexEntry entry;
+              _ostree_object_index_entry_init (&entry, checksum, objtype);
+              g_array_append_val (out_renamed, entry);
+            }
+
           renamed_some_object = TRUE;
         }
 
@@ -2155,9 +2180,20 @@ ostree_repo_commit_transaction (OstreeRepo                  *self,
         return glnx_throw_errno_prefix (error, "syncfs");
     }
 
-  if (!rename_pending_loose_objects (self, cancellable, error))
+  g_autoptr(GArray) renamed_objects = NULL;
+  if (self->object_index_enabled)
+    renamed_objects = g_array_new (FALSE, FALSE, sizeof (OstreeObjectIndexEntry));
+  if (!rename_pending_loose_objects (self, renamed_objects, cancellable, error))
     return FALSE;
 
+  /* The objects are committed at this point; the index is just a cache */
+  if (renamed_objects)
+    {
+      g_autoptr(GError) local_error = NULL;
+      if (!_ostree_repo_object_index_add (self, renamed_objects, cancellable, &local_error))
+        g_debug ("Failed to update object index: %s", local_error->message);
+    }
+
   g_debug ("txn commit %s", glnx_basename (self->commit_stagedir.path));
   if (!glnx_tmpdir_delete (&self->commit_stagedir, cancellable, error))
     return FALSE;
@@ -3170,6 +3206,188 @@ get_final_xattrs (OstreeRepo                       *self,
   return TRUE;
 }
 
+/* Pipelined commit; see ostree_repo_commit_modifier_set_n_threads().
+ *
+ * The calling thread still walks the tree, calls the filter/xattr callbacks
+ * and handles all of the fast paths (devino hits, adoption, symlinks).  What
+ * it hands off are the regular files that need to be read, checksummed and
+ * (for archive repos) compressed via write_content_object().  Jobs are kept
+ * in a FIFO in enumeration order; the calling thread retires them from the
+ * head, inserting each result into its #OstreeMutableTree, so the resulting
+ * tree is built in the same order as a serial commit.
+ *
+ * Every queued job holds an open fd, so the number of jobs in flight is
+ * bounded.
+ */
+typedef struct {
+  OstreeRepo *repo;
+  GCancellable *cancellable;
+  GThreadPool *pool;
+  guint max_pending;
+  GQueue pending; /* CommitContentJob, in enumeration order */
+
+  GMutex lock;
+  GCond cond;
+  gboolean aborted;
+} CommitPipeline;
+
+typedef struct {
+  CommitPipeline *pipeline;
+  OstreeMutableTree *mtree;
+  char *name;
+  int fd;
+  GFileInfo *file_info;
+  GVariant *xattrs;
+
+  /* Protected by pipeline->lock */
+  gboolean done;
+  guchar *csum;
+  GError *error;
+} CommitContentJob;
+
+static void
+commit_content_job_free (CommitContentJob *job)
+{
+  g_clear_object (&job->mtree);
+  g_free (job->name);
+  glnx_close_fd (&job->fd);
+  g_clear_object (&job->file_info);
+  g_clear_pointer (&job->xattrs, (GDestroyNotify) g_variant_unref);
+  g_free (job->csum);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+static void
+commit_content_job_run (gpointer data,
+                        gpointer user_data)
+{
+  CommitContentJob *job = data;
+  CommitPipeline *pipeline = user_data;
+  g_autofree guchar *csum = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  g_mutex_lock (&pipeline->lock);
+  const gboolean aborted = pipeline->aborted;
+  g_mutex_unlock (&pipeline->lock);
+
+  if (!aborted)
+    {
+      g_autoptr(GInputStream) file_input = g_unix_input_stream_new (job->fd, TRUE);
+      job->fd = -1; /* Transfer ownership */
+      (void) write_content_object (pipeline->repo, NULL, file_input, job->file_info,
+                                   job->xattrs, &csum, pipeline->cancellable,
+                                   &local_error);
+    }
+
+  g_mutex_lock (&pipeline->lock);
+  job->csum = g_steal_pointer (&csum);
+  job->error = g_steal_pointer (&local_error);
+  job->done = TRUE;
+  g_cond_broadcast (&pipeline->cond);
+  g_mutex_unlock (&pipeline->lock);
+}
+
+static CommitPipeline *
+commit_pipeline_new (OstreeRepo   *repo,
+                     guint         n_threads,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  g_autofree CommitPipeline *pipeline = g_new0 (CommitPipeline, 1);
+  pipeline->pool = g_thread_pool_new (commit_content_job_run, pipeline,
+                                      n_threads, TRUE, error);
+  if (!pipeline->pool)
+    return NULL;
+  pipeline->repo = repo;
+  pipeline->cancellable = cancellable;
+  pipeline->max_pending = n_threads * 4;
+  g_queue_init (&pipeline->pending);
+  g_mutex_init (&pipeline->lock);
+  g_cond_init (&pipeline->cond);
+  return g_steal_pointer (&pipeline);
+}
+
+/* Wait for, and insert into their mtrees, the oldest jobs until at most
+ * @max_remaining are left in flight.
+ */
+static gboolean
+commit_pipeline_retire (CommitPipeline *pipeline,
+                        guint           max_remaining,
+                        GError        **error)
+{
+  while (pipeline->pending.length > max_remaining)
+    {
+      CommitContentJob *job = g_queue_pop_head (&pipeline->pending);
+
+      g_mutex_lock (&pipeline->lock);
+      while (!job->done)
+        g_cond_wait (&pipeline->cond, &pipeline->lock);
+      g_mutex_unlock (&pipeline->lock);
+
+      gboolean ok;
+      if (job->error)
+        {
+          g_propagate_error (error, g_steal_pointer (&job->error));
+          ok = FALSE;
+        }
+      else
+        {
+          char tmp_checksum[OSTREE_SHA256_STRING_LEN+1];
+          ostree_checksum_inplace_from_bytes (job->csum, tmp_checksum);
+          ok = ostree_mutable_tree_replace_file (job->mtree, job->name, tmp_checksum,
+                                                 error);
+        }
+      commit_content_job_free (job);
+      if (!ok)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+commit_pipeline_push (CommitPipeline    *pipeline,
+                      OstreeMutableTree *mtree,
+                      const char        *name,
+                      int               *fdp,
+                      GFileInfo         *file_info,
+                      GVariant          *xattrs,
+                      GError           **error)
+{
+  if (!commit_pipeline_retire (pipeline, pipeline->max_pending - 1, error))
+    return FALSE;
+
+  CommitContentJob *job = g_new0 (CommitContentJob, 1);
+  job->pipeline = pipeline;
+  job->mtree = g_object_ref (mtree);
+  job->name = g_strdup (name);
+  job->fd = glnx_steal_fd (fdp);
+  job->file_info = g_object_ref (file_info);
+  job->xattrs = xattrs ? g_variant_ref (xattrs) : NULL;
+  g_queue_push_tail (&pipeline->pending, job);
+
+  return g_thread_pool_push (pipeline->pool, job, error);
+}
+
+static void
+commit_pipeline_free (CommitPipeline *pipeline)
+{
+  /* If we're here with jobs still queued, we're unwinding from an error;
+   * let the workers skip whatever they haven't started yet.
+   */
+  g_mutex_lock (&pipeline->lock);
+  pipeline->aborted = TRUE;
+  g_mutex_unlock (&pipeline->lock);
+  g_thread_pool_free (pipeline->pool, FALSE, TRUE);
+  g_queue_foreach (&pipeline->pending, (GFunc) commit_content_job_free, NULL);
+  g_queue_clear (&pipeline->pending);
+  g_mutex_clear (&pipeline->lock);
+  g_cond_clear (&pipeline->cond);
+  g_free (pipeline);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(CommitPipeline, commit_pipeline_free)
+
 static gboolean
 write_directory_to_mtree_internal (OstreeRepo                  *self,
                                    GFile                       *dir,
@@ -3183,6 +3401,7 @@ write_dfd_iter_to_mtree_internal (OstreeRepo                  *self,
                                   GLnxDirFdIterator           *src_dfd_iter,
                                   OstreeMutableTree           *mtree,
                                   OstreeRepoCommitModifier    *modifier,
+                                  CommitPipeline              *pipeline,
                                   GPtrArray                   *path,
                                   GCancellable                *cancellable,
                                   GError                     **error);
@@ -3206,6 +3425,7 @@ write_dir_entry_to_mtree_internal (OstreeRepo                  *self,
                                    GFileInfo                   *child_info,
                                    OstreeMutableTree           *mtree,
                                    OstreeRepoCommitModifier    *modifier,
+                                   CommitPipeline              *pipeline,
                                    GPtrArray                   *path,
                                    GCancellable                *cancellable,
                                    GError                     **error)
@@ -3278,7 +3498,7 @@ write_dir_entry_to_mtree_internal (OstreeRepo                  *self,
         return FALSE;
 
       if (!write_dfd_iter_to_mtree_internal (self, &child_dfd_iter, child_mtree,
-                                             modifier, path,
+                                             modifier, pipeline, path,
                                              cancellable, error))
         return FALSE;
 
@@ -3306,6 +3526,7 @@ write_content_to_mtree_internal (OstreeRepo                  *self,
                                            GFileInfo                   *child_info,
                                            OstreeMutableTree           *mtree,
                                            OstreeRepoCommitModifier    *modifier,
+                                           CommitPipeline              *pipeline,
                                            GPtrArray                   *path,
                                            GCancellable                *cancellable,
                                            GError                     **error)
@@ -3499,6 +3720,16 @@ write_content_to_mtree_internal (OstreeRepo                  *self,
         return FALSE;
       did_adopt = TRUE;
     }
+  /* Hand off reading and checksumming to the pipeline if we have one;
+   * the consume case is excluded when setting it up.
+   */
+  else if (pipeline && file_input_fd != -1)
+    {
+      g_assert (!delete_after_commit);
+      if (!commit_pipeline_push (pipeline, mtree, name, &file_input_fd,
+                                 modified_info, xattrs, error))
+        return FALSE;
+    }
   else
     {
       g_autoptr(GInputStream) file_input = NULL;
@@ -3644,7 +3875,7 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
               if (!write_dir_entry_to_mtree_internal (self, repo_dir, dir_enum, NULL,
                                                       WRITE_DIR_CONTENT_FLAGS_NONE,
                                                       child_info,
-                                                      mtree, modifier, path,
+                                                      mtree, modifier, NULL, path,
                                                       cancellable, error))
                 return FALSE;
             }
@@ -3653,7 +3884,7 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
               if (!write_content_to_mtree_internal (self, repo_dir, dir_enum, NULL,
                                                     WRITE_DIR_CONTENT_FLAGS_NONE,
                                                     child_info,
-                                                    mtree, modifier, path,
+                                                    mtree, modifier, NULL, path,
                                                     cancellable, error))
                 return FALSE;
             }
@@ -3670,6 +3901,7 @@ write_dfd_iter_to_mtree_internal (OstreeRepo                  *self,
                                   GLnxDirFdIterator           *src_dfd_iter,
                                   OstreeMutableTree           *mtree,
                                   OstreeRepoCommitModifier    *modifier,
+                                  CommitPipeline              *pipeline,
                                   GPtrArray                   *path,
                                   GCancellable                *cancellable,
                                   GError                     **error)
@@ -3745,7 +3977,7 @@ write_dfd_iter_to_mtree_internal (OstreeRepo                  *self,
         {
           if (!write_dir_entry_to_mtree_internal (self, NULL, NULL, src_dfd_iter,
                                                   flags, child_info,
-                                                  mtree, modifier, path,
+                                                  mtree, modifier, pipeline, path,
                                                   cancellable, error))
             return FALSE;
 
@@ -3770,7 +4002,7 @@ write_dfd_iter_to_mtree_internal (OstreeRepo                  *self,
       /* Write a content object, we handled directories above */
       if (!write_content_to_mtree_internal (self, NULL, NULL, src_dfd_iter,
                                             flags, child_info,
-                                            mtree, modifier, path,
+                                            mtree, modifier, pipeline, path,
                                             cancellable, error))
         return FALSE;
     }
@@ -3850,9 +4082,26 @@ ostree_repo_write_dfd_to_mtree (OstreeRepo                *self,
   if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
     return FALSE;
 
+  const gboolean delete_after_commit = modifier &&
+    (modifier->flags & OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME);
+
+  /* In consume mode files are unlinked as soon as they're committed, and
+   * directories right after their contents; keep that serial.
+   */
+  g_autoptr(CommitPipeline) pipeline = NULL;
+  if (modifier && modifier->n_threads > 1 && !delete_after_commit)
+    {
+      pipeline = commit_pipeline_new (self, modifier->n_threads, cancellable, error);
+      if (!pipeline)
+        return FALSE;
+    }
+
   g_autoptr(GPtrArray) pathbuilder = g_ptr_array_new ();
-  if (!write_dfd_iter_to_mtree_internal (self, &dfd_iter, mtree, modifier, pathbuilder,
-                                         cancellable, error))
+  if (!write_dfd_iter_to_mtree_internal (self, &dfd_iter, mtree, modifier, pipeline,
+                                         pathbuilder, cancellable, error))
+    return FALSE;
+
+  if (pipeline && !commit_pipeline_retire (pipeline, 0, error))
     return FALSE;
 
   /* And now finally remove the toplevel; see also the handling for this flag in
@@ -3860,8 +4109,6 @@ ostree_repo_write_dfd_to_mtree (OstreeRepo                *self,
    * try to remove `.` (since we'd get EINVAL); that's what's used in
    * rpm-ostree.
    */
-  const gboolean delete_after_commit = modifier &&
-    (modifier->flags & OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME);
   if (delete_after_commit && !g_str_equal (path, "."))
     {
       if (!glnx_unlinkat (dfd, path, AT_REMOVEDIR, error))
@@ -4077,6 +4324,30 @@ ostree_repo_commit_modifier_set_devino_cache (OstreeRepoCommitModifier
   modifier->devino_cache = g_hash_table_ref ((GHashTable*)cache);
 }
 
+/**
+ * ostree_repo_commit_modifier_set_n_threads:
+ * @modifier: Modifier
+ * @n_threads: Number of worker threads
+ *
+ * If @n_threads is greater than 1, ostree_repo_write_dfd_to_mtree() (and
+ * ostree_repo_write_directory_to_mtree() for local paths) will read,
+ * checksum and, for archive repositories, compress regular files on a pool
+ * of @n_threads worker threads while the calling thread continues scanning
+ * the tree.  The filter and xattr callbacks are still only invoked from the
+ * calling thread, and the resulting tree is identical to a serial commit.
+ *
+ * This has no effect in combination with
+ * %OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME.
+ *
+ * Since: 2019.3
+ */
+void
+ostree_repo_commit_modifier_set_n_threads (OstreeRepoCommitModifier *modifier,
+                                           guint                     n_threads)
+{
+  modifier->n_threads = n_threads;
+}
+
 OstreeRepoDevInoCache *
 ostree_repo_devino_cache_ref (OstreeRepoDevInoCache *cache)
 {
@@ -4124,12 +4395,14 @@ import_via_reflink_is_possible (OstreeRepo *src_repo,
   /* Untrusted pulls require matching ownership */
   if (!trusted && (src_repo->owner_uid != dest_repo->owner_uid))
     return FALSE;
-  /* Equal modes are always compatible, and metadata
-   * is identical between all modes.
+  /* Metadata is identical between all modes, and equal modes are
+   * compatible as long as archive content is compressed the same way.
    */
-  if (src_repo->mode == dest_repo->mode ||
-      OSTREE_OBJECT_TYPE_IS_META (objtype))
+  if (OSTREE_OBJECT_TYPE_IS_META (objtype))
     return TRUE;
+  if (src_repo->mode == dest_repo->mode)
+    return src_repo->mode != OSTREE_REPO_MODE_ARCHIVE ||
+      src_repo->archive_compression == dest_repo->archive_compression;
   /* And now a special case between bare-user and bare-user-only,
    * mostly for https://github.com/flatpak/flatpak/issues/845
    */
@@ -4199,6 +4472,18 @@ import_one_object_direct (OstreeRepo    *dest_repo,
   if (!_ostree_repo_ensure_loose_objdir_at (dest_dfd, loose_path_buf, cancellable, error))
     return FALSE;
 
+  /* The source object may only exist in a pack file, in which case we need
+   * to go through the stream copy path.
+   */
+  if (!glnx_fstatat_allow_noent (src_repo->objects_dir_fd, loose_path_buf, NULL,
+                                 AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  if (errno == ENOENT)
+    {
+      *out_was_supported = FALSE;
+      return TRUE;
+    }
+
   gboolean did_hardlink = FALSE;
   if (can_hardlink)
     {
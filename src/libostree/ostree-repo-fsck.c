@@ -0,0 +1,391 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "ostree-autocleanups.h"
+#include "otutil.h"
+
+/* Parallel fsck.  Objects are checked in the order of their inode numbers,
+ * which on most filesystems approximates their order on disk; that keeps
+ * reads mostly sequential on rotating media, and lets the kernel's
+ * readahead work across objects.  Inode numbers are taken from the
+ * objects/ directory entries, so collecting them needs no extra I/O
+ * beyond reading the directories.
+ *
+ * The sorted objects are queued in fixed size batches on a FIFO
+ * GThreadPool, so the workers move through the list together; each
+ * object is verified with ostree_repo_fsck_object().  The calling thread
+ * iterates its main context until the workers are done, updating the
+ * progress once a second.
+ */
+
+#define FSCK_BATCH_SIZE 64
+#define FSCK_PROGRESS_INTERVAL_SECONDS 1
+
+typedef struct {
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  OstreeObjectType objtype;
+  guint64 ino;  /* G_MAXUINT64 if not loose in this repo */
+} FsckObject;
+
+typedef struct {
+  OstreeRepo *repo;
+  OstreeRepoFsckObjectsFlags flags;
+  GCancellable *cancellable;
+  GMainContext *context;
+  OstreeAsyncProgress *progress;
+  guint64 start_time;
+
+  FsckObject *objects;
+  guint n_objects;
+
+  volatile gint n_pending;  /* batches */
+  volatile gint done;
+  volatile gint stop;
+  volatile gint n_checked;
+  GMutex bytes_lock;
+  guint64 bytes_checked;
+
+  GMutex failures_lock;
+  GHashTable *failures;
+} FsckParallel;
+
+typedef struct {
+  guint start;
+  guint end;
+} FsckBatch;
+
+static int
+fsck_object_compare_name (gconstpointer a,
+                          gconstpointer b)
+{
+  const FsckObject *obj_a = a;
+  const FsckObject *obj_b = b;
+  int r = memcmp (obj_a->csum, obj_b->csum, sizeof (obj_a->csum));
+  if (r != 0)
+    return r;
+  return (int)obj_a->objtype - (int)obj_b->objtype;
+}
+
+static int
+fsck_object_compare_ino (gconstpointer a,
+                         gconstpointer b)
+{
+  const FsckObject *obj_a = a;
+  const FsckObject *obj_b = b;
+  if (obj_a->ino != obj_b->ino)
+    return obj_a->ino < obj_b->ino ? -1 : 1;
+  return fsck_object_compare_name (a, b);
+}
+
+/* Fill in the inode numbers of the loose objects in @objects, which must be
+ * sorted by name.
+ */
+static gboolean
+fsck_find_inodes (OstreeRepo     *self,
+                  GArray         *objects,
+                  GCancellable   *cancellable,
+                  GError        **error)
+{
+  static const gchar hexchars[] = "0123456789abcdef";
+
+  for (guint c = 0; c < 256; c++)
+    {
+      char prefix[3] = { hexchars[c >> 4], hexchars[c & 0xF], '\0' };
+
+      g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+      gboolean exists;
+      if (!ot_dfd_iter_init_allow_noent (self->objects_dir_fd, prefix, &dfd_iter, &exists, error))
+        return FALSE;
+      if (!exists)
+        continue;
+
+      while (TRUE)
+        {
+          struct dirent *dent;
+          if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+            return FALSE;
+          if (dent == NULL)
+            break;
+
+          char checksum[OSTREE_SHA256_STRING_LEN+1];
+          FsckObject key = { { 0, }, };
+          if (!_ostree_repo_parse_loose_object_name (self, prefix, dent->d_name, checksum, &key.objtype))
+            continue;
+          ostree_checksum_inplace_to_bytes (checksum, key.csum);
+
+          FsckObject *obj = bsearch (&key, objects->data, objects->len, sizeof (FsckObject),
+                                     fsck_object_compare_name);
+          if (obj)
+            obj->ino = dent->d_ino;
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+fsck_parallel_update_progress (FsckParallel *ctx)
+{
+  const guint n_checked = g_atomic_int_get (&ctx->n_checked);
+  g_mutex_lock (&ctx->bytes_lock);
+  const guint64 bytes_checked = ctx->bytes_checked;
+  g_mutex_unlock (&ctx->bytes_lock);
+
+  const guint64 elapsed = MAX (g_get_monotonic_time () - ctx->start_time, 1);
+  const guint64 bytes_per_second = bytes_checked * G_USEC_PER_SEC / elapsed;
+  guint64 seconds_remaining = 0;
+  if (n_checked > 0)
+    seconds_remaining = (elapsed * (ctx->n_objects - n_checked) / n_checked) / G_USEC_PER_SEC;
+
+  ostree_async_progress_set (ctx->progress,
+                             "objects-checked", "u", n_checked,
+                             "bytes-checked", "t", bytes_checked,
+                             "bytes-per-second", "t", bytes_per_second,
+                             "seconds-remaining", "t", seconds_remaining,
+                             NULL);
+}
+
+static gboolean
+fsck_parallel_progress_timeout (gpointer user_data)
+{
+  fsck_parallel_update_progress (user_data);
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+fsck_parallel_check_one (FsckParallel     *ctx,
+                         const FsckObject *obj)
+{
+  char checksum[OSTREE_SHA256_STRING_LEN+1];
+  ostree_checksum_inplace_from_bytes (obj->csum, checksum);
+
+  g_autoptr(GError) local_error = NULL;
+  if (!ostree_repo_fsck_object (ctx->repo, obj->objtype, checksum,
+                                ctx->cancellable, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      if ((ctx->flags & OSTREE_REPO_FSCK_OBJECTS_FLAGS_STOP_ON_CORRUPTION) &&
+          !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_atomic_int_set (&ctx->stop, TRUE);
+
+      g_mutex_lock (&ctx->failures_lock);
+      g_hash_table_replace (ctx->failures,
+                            g_variant_ref_sink (ostree_object_name_serialize (checksum, obj->objtype)),
+                            g_steal_pointer (&local_error));
+      g_mutex_unlock (&ctx->failures_lock);
+    }
+  else if (ctx->progress)
+    {
+      guint64 size = 0;
+      if (ostree_repo_query_object_storage_size (ctx->repo, obj->objtype, checksum,
+                                                 &size, NULL, NULL))
+        {
+          g_mutex_lock (&ctx->bytes_lock);
+          ctx->bytes_checked += size;
+          g_mutex_unlock (&ctx->bytes_lock);
+        }
+    }
+
+  g_atomic_int_inc (&ctx->n_checked);
+}
+
+static void
+fsck_parallel_batch_run (gpointer data,
+                         gpointer user_data)
+{
+  FsckBatch *batch = data;
+  FsckParallel *ctx = user_data;
+
+  for (guint i = batch->start; i < batch->end; i++)
+    {
+      if (g_atomic_int_get (&ctx->stop) || g_cancellable_is_cancelled (ctx->cancellable))
+        break;
+      fsck_parallel_check_one (ctx, &ctx->objects[i]);
+    }
+
+  g_free (batch);
+  if (g_atomic_int_dec_and_test (&ctx->n_pending))
+    {
+      g_atomic_int_set (&ctx->done, TRUE);
+      g_main_context_wakeup (ctx->context);
+    }
+}
+
+/**
+ * ostree_repo_fsck_objects:
+ * @self: Repo
+ * @objects: (element-type GVariant GVariant): Set of serialized object names to verify
+ * @flags: Options controlling the verification
+ * @n_threads: Number of objects to verify at once, or 0 for one per CPU
+ * @progress: (allow-none): Progress
+ * @out_failures: (out) (transfer container) (element-type GVariant GError): Map from
+ *   the serialized names of the objects which failed to verify to the errors
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Verify each of @objects as ostree_repo_fsck_object() does, using up to
+ * @n_threads threads.  Loose objects are read in the order of their inode
+ * numbers, which keeps reads mostly sequential on most filesystems.
+ *
+ * Objects which fail to verify, including because they are missing (with
+ * %G_IO_ERROR_NOT_FOUND), don't make this function fail; they are returned
+ * in @out_failures instead.  With
+ * %OSTREE_REPO_FSCK_OBJECTS_FLAGS_STOP_ON_CORRUPTION, checking stops soon
+ * after the first object which is present but corrupted, and
+ * @out_failures will not cover all of @objects.
+ *
+ * If @progress is given, it is updated about once a second from the
+ * thread-default main context of the caller, which is iterated while
+ * waiting.  The keys are "objects-total" (u), "objects-checked" (u),
+ * "bytes-checked" (t), "bytes-per-second" (t), "seconds-remaining" (t)
+ * which is an estimate from the rate so far, and "start-time" (t) in
+ * monotonic microseconds.
+ *
+ * Locking: shared
+ *
+ * Since: 2019.3
+ */
+gboolean
+ostree_repo_fsck_objects (OstreeRepo                  *self,
+                          GHashTable                  *objects,
+                          OstreeRepoFsckObjectsFlags   flags,
+                          guint                        n_threads,
+                          OstreeAsyncProgress         *progress,
+                          GHashTable                 **out_failures,
+                          GCancellable                *cancellable,
+                          GError                     **error)
+{
+  g_return_val_if_fail (objects != NULL, FALSE);
+  g_return_val_if_fail (out_failures != NULL, FALSE);
+
+  g_autoptr(OstreeRepoAutoLock) lock =
+    _ostree_repo_auto_lock_push (self, OSTREE_REPO_LOCK_SHARED, cancellable, error);
+  if (!lock)
+    return FALSE;
+
+  if (n_threads == 0)
+    n_threads = MAX (g_get_num_processors (), 1);
+
+  g_autoptr(GArray) sorted = g_array_sized_new (FALSE, FALSE, sizeof (FsckObject),
+                                                g_hash_table_size (objects));
+  GLNX_HASH_TABLE_FOREACH (objects, GVariant*, key)
+    {
+      const char *checksum;
+      FsckObject obj = { { 0, }, };
+      ostree_object_name_deserialize (key, &checksum, &obj.objtype);
+      ostree_checksum_inplace_to_bytes (checksum, obj.csum);
+      obj.ino = G_MAXUINT64;
+      g_array_append_val (sorted, obj);
+    }
+
+  g_array_sort (sorted, fsck_object_compare_name);
+  if (!fsck_find_inodes (self, sorted, cancellable, error))
+    return FALSE;
+  g_array_sort (sorted, fsck_object_compare_ino);
+
+  g_autoptr(GHashTable) failures =
+    g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
+                           (GDestroyNotify) g_variant_unref, (GDestroyNotify) g_error_free);
+
+  FsckParallel ctx = { 0, };
+  ctx.repo = self;
+  ctx.flags = flags;
+  ctx.cancellable = cancellable;
+  ctx.context = g_main_context_ref_thread_default ();
+  ctx.progress = progress;
+  ctx.start_time = g_get_monotonic_time ();
+  ctx.objects = (FsckObject *) sorted->data;
+  ctx.n_objects = sorted->len;
+  ctx.failures = failures;
+  g_mutex_init (&ctx.bytes_lock);
+  g_mutex_init (&ctx.failures_lock);
+
+  if (progress)
+    ostree_async_progress_set (progress,
+                               "objects-total", "u", ctx.n_objects,
+                               "objects-checked", "u", 0,
+                               "bytes-checked", "t", (guint64) 0,
+                               "bytes-per-second", "t", (guint64) 0,
+                               "seconds-remaining", "t", (guint64) 0,
+                               "start-time", "t", ctx.start_time,
+                               NULL);
+
+  gboolean ret = FALSE;
+  GSource *timeout = NULL;
+  GThreadPool *pool = g_thread_pool_new (fsck_parallel_batch_run, &ctx,
+                                         n_threads, TRUE, error);
+  if (!pool)
+    goto out;
+
+  /* Hold a reference of our own while queueing, as for the traversal */
+  ctx.n_pending = 1;
+  for (guint i = 0; i < ctx.n_objects; i += FSCK_BATCH_SIZE)
+    {
+      FsckBatch *batch = g_new0 (FsckBatch, 1);
+      batch->start = i;
+      batch->end = MIN (i + FSCK_BATCH_SIZE, ctx.n_objects);
+
+      g_atomic_int_inc (&ctx.n_pending);
+      /* Exclusive pools start their threads up front, so this can't fail */
+      g_thread_pool_push (pool, batch, NULL);
+    }
+
+  if (progress)
+    {
+      timeout = g_timeout_source_new_seconds (FSCK_PROGRESS_INTERVAL_SECONDS);
+      g_source_set_callback (timeout, fsck_parallel_progress_timeout, &ctx, NULL);
+      g_source_attach (timeout, ctx.context);
+    }
+
+  if (g_atomic_int_dec_and_test (&ctx.n_pending))
+    g_atomic_int_set (&ctx.done, TRUE);
+  while (!g_atomic_int_get (&ctx.done))
+    g_main_context_iteration (ctx.context, TRUE);
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (timeout)
+    {
+      g_source_destroy (timeout);
+      g_source_unref (timeout);
+    }
+  if (progress)
+    fsck_parallel_update_progress (&ctx);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  *out_failures = g_steal_pointer (&failures);
+ out:
+  g_main_context_unref (ctx.context);
+  g_mutex_clear (&ctx.bytes_lock);
+  g_mutex_clear (&ctx.failures_lock);
+  return ret;
+}
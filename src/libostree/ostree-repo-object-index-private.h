@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include "ostree-core-private.h"
+
+G_BEGIN_DECLS
+
+/* The object index is an optional cache (enabled with core.object-index)
+ * listing objects known to be stored in the repository, so that
+ * ostree_repo_has_object() can answer from a mapping rather than with an
+ * fstatat() per object.  It lives in the repository's own tmp/cache dir:
+ *
+ *   OstreeObjectIndexHeader, followed by n_entries OstreeObjectIndexEntry
+ *   sorted by (checksum, objtype).  All integers are big endian.
+ *
+ * Changes since the index was written are appended to a journal next to it,
+ * a sequence of OstreeObjectIndexEntry records whose first reserved byte
+ * holds _OSTREE_OBJECT_INDEX_RECORD_* flags; the last record for an object
+ * wins.  Once the journal grows large relative to the index, the two are
+ * merged into a new index and the journal is removed.
+ *
+ * The index is positive only: a miss falls back to the normal lookup, so it
+ * may lag behind the repository, but it must never list an object which has
+ * been deleted.  ostree_repo_delete_object() therefore journals the removal
+ * before removing any object.  Additions are journaled when a transaction
+ * commits, and ostree_repo_regenerate_object_index() rebuilds it from
+ * scratch.
+ */
+#define _OSTREE_OBJECT_INDEX_PATH _OSTREE_CACHE_DIR "/object-index"
+#define _OSTREE_OBJECT_INDEX_JOURNAL_PATH _OSTREE_CACHE_DIR "/object-index.journal"
+#define _OSTREE_OBJECT_INDEX_MAGIC "OSTOIDX1"
+#define _OSTREE_OBJECT_INDEX_MAGIC_LEN 8
+
+typedef struct {
+  char magic[_OSTREE_OBJECT_INDEX_MAGIC_LEN];
+  guint64 n_entries;
+} OstreeObjectIndexHeader;
+
+typedef struct {
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  guint8 objtype;
+  guint8 reserved[7];
+} OstreeObjectIndexEntry;
+
+G_STATIC_ASSERT (sizeof (OstreeObjectIndexHeader) == 16);
+G_STATIC_ASSERT (sizeof (OstreeObjectIndexEntry) == 40);
+
+#define _OSTREE_OBJECT_INDEX_RECORD_REMOVED (1 << 0)
+
+typedef struct OstreeObjectIndex OstreeObjectIndex;
+void _ostree_object_index_free (OstreeObjectIndex *index);
+
+void
+_ostree_object_index_entry_init (OstreeObjectIndexEntry *entry,
+                                 const char             *checksum,
+                                 OstreeObjectType        objtype);
+
+gboolean
+_ostree_repo_object_index_lookup (OstreeRepo        *self,
+                                  const char        *checksum,
+                                  OstreeObjectType   objtype,
+                                  gboolean          *out_found,
+                                  GError           **error);
+
+gboolean
+_ostree_repo_object_index_add (OstreeRepo    *self,
+                               GArray        *entries,
+                               GCancellable  *cancellable,
+                               GError       **error);
+
+gboolean
+_ostree_repo_object_index_remove (OstreeRepo        *self,
+                                  const char        *checksum,
+                                  OstreeObjectType   objtype,
+                                  GError           **error);
+
+gboolean
+_ostree_repo_object_index_maybe_compact (OstreeRepo    *self,
+                                         GCancellable  *cancellable,
+                                         GError       **error);
+
+G_END_DECLS
@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "ostree-repo-object-index-private.h"
+#include "ostree-autocleanups.h"
+#include "otutil.h"
+
+/* Values in OstreeObjectIndex.journal */
+#define JOURNAL_ADDED GUINT_TO_POINTER (1)
+#define JOURNAL_REMOVED GUINT_TO_POINTER (2)
+
+struct OstreeObjectIndex {
+  /* The sorted base index */
+  GMappedFile *mfile;
+  const OstreeObjectIndexEntry *entries;
+  guint64 n_entries;
+  ino_t ino;
+  struct timespec mtime;
+
+  /* Journal records read so far, later ones replacing earlier ones:
+   * OstreeObjectIndexEntry → JOURNAL_ADDED or JOURNAL_REMOVED */
+  GHashTable *journal;
+  ino_t journal_ino;
+  guint64 journal_offset;
+};
+
+void
+_ostree_object_index_free (OstreeObjectIndex *index)
+{
+  if (!index)
+    return;
+  g_clear_pointer (&index->mfile, g_mapped_file_unref);
+  g_clear_pointer (&index->journal, g_hash_table_unref);
+  g_free (index);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (OstreeObjectIndex, _ostree_object_index_free)
+
+void
+_ostree_object_index_entry_init (OstreeObjectIndexEntry *entry,
+                                 const char             *checksum,
+                                 OstreeObjectType        objtype)
+{
+  memset (entry, 0, sizeof (*entry));
+  ostree_checksum_inplace_to_bytes (checksum, entry->csum);
+  entry->objtype = objtype;
+}
+
+static int
+object_index_entry_compare (gconstpointer a,
+                            gconstpointer b)
+{
+  const OstreeObjectIndexEntry *entry_a = a;
+  const OstreeObjectIndexEntry *entry_b = b;
+  int r = memcmp (entry_a->csum, entry_b->csum, OSTREE_SHA256_DIGEST_LEN);
+  if (r != 0)
+    return r;
+  return (int)entry_a->objtype - (int)entry_b->objtype;
+}
+
+static guint
+object_index_entry_hash (gconstpointer v)
+{
+  const OstreeObjectIndexEntry *entry = v;
+  guint32 h;
+  memcpy (&h, entry->csum, sizeof (h));
+  return h ^ entry->objtype;
+}
+
+static gboolean
+object_index_entry_equal (gconstpointer a,
+                          gconstpointer b)
+{
+  return object_index_entry_compare (a, b) == 0;
+}
+
+static gboolean
+object_index_contains (const OstreeObjectIndexEntry *entries,
+                       guint64                       n_entries,
+                       const OstreeObjectIndexEntry *key)
+{
+  guint64 lo = 0;
+  guint64 hi = n_entries;
+
+  while (lo < hi)
+    {
+      guint64 mid = lo + (hi - lo) / 2;
+      int r = object_index_entry_compare (key, &entries[mid]);
+      if (r == 0)
+        return TRUE;
+      else if (r < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+object_index_has (OstreeObjectIndex            *index,
+                  const OstreeObjectIndexEntry *key)
+{
+  gpointer state = g_hash_table_lookup (index->journal, key);
+  if (state)
+    return state == JOURNAL_ADDED;
+  return object_index_contains (index->entries, index->n_entries, key);
+}
+
+static OstreeObjectIndex *
+object_index_open (OstreeRepo         *self,
+                   const struct stat  *stbuf,
+                   GError            **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Loading object index", error);
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (self->tmp_dir_fd, _OSTREE_OBJECT_INDEX_PATH, TRUE, &fd, error))
+    return NULL;
+  g_autoptr(GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    return NULL;
+
+  const char *contents = g_mapped_file_get_contents (mfile);
+  const gsize len = g_mapped_file_get_length (mfile);
+  if (len < sizeof (OstreeObjectIndexHeader))
+    return glnx_null_throw (error, "Truncated index");
+  const OstreeObjectIndexHeader *header = (const OstreeObjectIndexHeader*)contents;
+  if (memcmp (header->magic, _OSTREE_OBJECT_INDEX_MAGIC, _OSTREE_OBJECT_INDEX_MAGIC_LEN) != 0)
+    return glnx_null_throw (error, "Invalid header");
+  const guint64 n_entries = GUINT64_FROM_BE (header->n_entries);
+  if ((len - sizeof (OstreeObjectIndexHeader)) % sizeof (OstreeObjectIndexEntry) != 0 ||
+      n_entries != (len - sizeof (OstreeObjectIndexHeader)) / sizeof (OstreeObjectIndexEntry))
+    return glnx_null_throw (error, "Invalid size");
+
+  g_autoptr(OstreeObjectIndex) index = g_new0 (OstreeObjectIndex, 1);
+  index->entries = (const OstreeObjectIndexEntry*)(contents + sizeof (OstreeObjectIndexHeader));
+  index->n_entries = n_entries;
+  index->mfile = g_steal_pointer (&mfile);
+  index->ino = stbuf->st_ino;
+  index->mtime = stbuf->st_mtim;
+  index->journal = g_hash_table_new_full (object_index_entry_hash, object_index_entry_equal,
+                                          g_free, NULL);
+  return g_steal_pointer (&index);
+}
+
+/* Apply journal records to @index, in order */
+static gboolean
+object_index_apply_journal (OstreeObjectIndex            *index,
+                            const OstreeObjectIndexEntry *records,
+                            gsize                         n_records,
+                            GError                      **error)
+{
+  for (gsize i = 0; i < n_records; i++)
+    {
+      const OstreeObjectIndexEntry *record = &records[i];
+      const guint8 flags = record->reserved[0];
+      if (!ostree_validate_structureof_objtype (record->objtype, NULL) ||
+          (flags & ~_OSTREE_OBJECT_INDEX_RECORD_REMOVED) != 0)
+        return glnx_throw (error, "Invalid journal record");
+
+      OstreeObjectIndexEntry *key = g_new0 (OstreeObjectIndexEntry, 1);
+      memcpy (key->csum, record->csum, sizeof (key->csum));
+      key->objtype = record->objtype;
+      g_hash_table_replace (index->journal, key,
+                            (flags & _OSTREE_OBJECT_INDEX_RECORD_REMOVED) ? JOURNAL_REMOVED : JOURNAL_ADDED);
+    }
+  return TRUE;
+}
+
+/* Read any journal records appended since we last looked */
+static gboolean
+object_index_read_journal (OstreeRepo         *self,
+                           OstreeObjectIndex  *index,
+                           GError            **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Reading object index journal", error);
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (self->tmp_dir_fd, _OSTREE_OBJECT_INDEX_JOURNAL_PATH, &stbuf, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    {
+      g_hash_table_remove_all (index->journal);
+      index->journal_ino = 0;
+      index->journal_offset = 0;
+      return TRUE;
+    }
+
+  /* Records are only ever appended whole, so anything else is corruption */
+  if (stbuf.st_size % sizeof (OstreeObjectIndexEntry) != 0)
+    return glnx_throw (error, "Invalid size");
+
+  if (stbuf.st_ino != index->journal_ino || (guint64)stbuf.st_size < index->journal_offset)
+    {
+      g_hash_table_remove_all (index->journal);
+      index->journal_ino = stbuf.st_ino;
+      index->journal_offset = 0;
+    }
+  if ((guint64)stbuf.st_size == index->journal_offset)
+    return TRUE;
+
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (self->tmp_dir_fd, _OSTREE_OBJECT_INDEX_JOURNAL_PATH, TRUE, &fd, error))
+    return FALSE;
+  const gsize len = stbuf.st_size - index->journal_offset;
+  g_autofree OstreeObjectIndexEntry *records = g_malloc (len);
+  ssize_t n = TEMP_FAILURE_RETRY (pread (fd, records, len, index->journal_offset));
+  if (n < 0)
+    return glnx_throw_errno_prefix (error, "pread");
+  n -= n % sizeof (OstreeObjectIndexEntry);
+  if (!object_index_apply_journal (index, records, n / sizeof (OstreeObjectIndexEntry), error))
+    return FALSE;
+  index->journal_offset += n;
+  return TRUE;
+}
+
+/* (Re)map the index if it was replaced since we last looked, or drop our
+ * mapping if it was removed, and pick up new journal records.  Another
+ * process can only delete objects with an exclusive lock, which it can't
+ * take during our transaction; so unless @force is set, this only looks at
+ * the disk once per transaction.  Called with cache_lock held.
+ */
+static gboolean
+ensure_object_index_locked (OstreeRepo  *self,
+                            gboolean     force,
+                            GError     **error)
+{
+  if (!force && self->in_transaction && self->object_index_checked)
+    return TRUE;
+
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (self->tmp_dir_fd, _OSTREE_OBJECT_INDEX_PATH, &stbuf, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    {
+      g_clear_pointer (&self->object_index, _ostree_object_index_free);
+      self->object_index_checked = self->in_transaction;
+      return TRUE;
+    }
+
+  if (!(self->object_index &&
+        stbuf.st_ino == self->object_index->ino &&
+        stbuf.st_mtim.tv_sec == self->object_index->mtime.tv_sec &&
+        stbuf.st_mtim.tv_nsec == self->object_index->mtime.tv_nsec))
+    {
+      g_clear_pointer (&self->object_index, _ostree_object_index_free);
+      /* The index is only a cache; treat a corrupt one as missing */
+      g_autoptr(GError) local_error = NULL;
+      self->object_index = object_index_open (self, &stbuf, &local_error);
+      if (!self->object_index)
+        g_debug ("%s", local_error->message);
+    }
+
+  if (self->object_index)
+    {
+      g_autoptr(GError) local_error = NULL;
+      if (!object_index_read_journal (self, self->object_index, &local_error))
+        {
+          g_debug ("%s", local_error->message);
+          g_clear_pointer (&self->object_index, _ostree_object_index_free);
+        }
+    }
+
+  self->object_index_checked = self->in_transaction;
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_object_index_lookup:
+ *
+ * If the object index is enabled and lists @checksum/@objtype, set
+ * @out_found to %TRUE.  A %FALSE result means the caller must look the
+ * object up the usual way.
+ */
+gboolean
+_ostree_repo_object_index_lookup (OstreeRepo        *self,
+                                  const char        *checksum,
+                                  OstreeObjectType   objtype,
+                                  gboolean          *out_found,
+                                  GError           **error)
+{
+  *out_found = FALSE;
+  if (!self->object_index_enabled)
+    return TRUE;
+
+  OstreeObjectIndexEntry key;
+  _ostree_object_index_entry_init (&key, checksum, objtype);
+
+  g_mutex_lock (&self->cache_lock);
+  gboolean ret = ensure_object_index_locked (self, FALSE, error);
+  if (ret && self->object_index)
+    *out_found = object_index_has (self->object_index, &key);
+  g_mutex_unlock (&self->cache_lock);
+  return ret;
+}
+
+/* Write out @entries, which must be sorted and unique, as the new base index,
+ * and drop the journal it supersedes.
+ */
+static gboolean
+write_object_index (OstreeRepo    *self,
+                    GArray        *entries,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Writing object index", error);
+
+  if (!glnx_shutil_mkdir_p_at (self->tmp_dir_fd, _OSTREE_CACHE_DIR, 0775, cancellable, error))
+    return FALSE;
+
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  if (!glnx_open_tmpfile_linkable_at (self->tmp_dir_fd, _OSTREE_CACHE_DIR, O_WRONLY | O_CLOEXEC,
+                                      &tmpf, error))
+    return FALSE;
+
+  OstreeObjectIndexHeader header = { { 0, }, };
+  memcpy (header.magic, _OSTREE_OBJECT_INDEX_MAGIC, _OSTREE_OBJECT_INDEX_MAGIC_LEN);
+  header.n_entries = GUINT64_TO_BE (entries->len);
+  if (glnx_loop_write (tmpf.fd, &header, sizeof (header)) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+  if (glnx_loop_write (tmpf.fd, entries->data, entries->len * sizeof (OstreeObjectIndexEntry)) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+  if (!glnx_fchmod (tmpf.fd, 0644, error))
+    return FALSE;
+
+  /* No fsync(); after a crash this is at worst a missing or stale (but
+   * positive-only, hence still correct) cache. */
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE,
+                             self->tmp_dir_fd, _OSTREE_OBJECT_INDEX_PATH, error))
+    return FALSE;
+
+  /* Records appended by others since we read the journal are lost, but
+   * those can only be additions, since deletions need an exclusive lock. */
+  if (!ot_ensure_unlinked_at (self->tmp_dir_fd, _OSTREE_OBJECT_INDEX_JOURNAL_PATH, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Sort @entries and drop duplicates */
+static void
+sort_object_index_entries (GArray *entries)
+{
+  g_array_sort (entries, object_index_entry_compare);
+  guint n_unique = 0;
+  for (guint i = 0; i < entries->len; i++)
+    {
+      OstreeObjectIndexEntry *entry = &g_array_index (entries, OstreeObjectIndexEntry, i);
+      if (n_unique > 0 &&
+          object_index_entry_compare (entry, &g_array_index (entries, OstreeObjectIndexEntry, n_unique - 1)) == 0)
+        continue;
+      if (i != n_unique)
+        g_array_index (entries, OstreeObjectIndexEntry, n_unique) = *entry;
+      n_unique++;
+    }
+  g_array_set_size (entries, n_unique);
+}
+
+/* Append @n_records to the journal in a single write, so that concurrent
+ * writers can't interleave partial records.
+ */
+static gboolean
+append_object_index_journal (OstreeRepo                   *self,
+                             const OstreeObjectIndexEntry *records,
+                             gsize                         n_records,
+                             GError                      **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Appending to object index journal", error);
+  glnx_autofd int fd =
+    openat (self->tmp_dir_fd, _OSTREE_OBJECT_INDEX_JOURNAL_PATH,
+            O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOCTTY, 0644);
+  if (fd < 0)
+    return glnx_throw_errno_prefix (error, "openat");
+  if (glnx_loop_write (fd, records, n_records * sizeof (OstreeObjectIndexEntry)) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+  return TRUE;
+}
+
+/* Fold the journal into a new base index once it has grown to a fraction of
+ * the base; this keeps the cost of rewriting the base proportional to the
+ * number of objects added or removed since.
+ */
+#define JOURNAL_MIN_COMPACT_RECORDS 4096
+#define JOURNAL_COMPACT_DIVISOR 8
+
+/*
+ * _ostree_repo_object_index_maybe_compact:
+ *
+ * Rewrite the base index with the journal merged in, if the journal is large
+ * enough to be worth it.  The caller must hold at least a shared repository
+ * lock.
+ */
+gboolean
+_ostree_repo_object_index_maybe_compact (OstreeRepo    *self,
+                                         GCancellable  *cancellable,
+                                         GError       **error)
+{
+  if (!self->object_index_enabled)
+    return TRUE;
+
+  /* Take our own reference to the current mapping and a sorted copy of
+   * the journal, so we can merge without holding the cache lock. */
+  g_autoptr(GMappedFile) old_mfile = NULL;
+  const OstreeObjectIndexEntry *old_entries = NULL;
+  guint64 n_old_entries = 0;
+  g_autoptr(GArray) added = g_array_new (FALSE, FALSE, sizeof (OstreeObjectIndexEntry));
+  g_autoptr(GHashTable) removed =
+    g_hash_table_new_full (object_index_entry_hash, object_index_entry_equal, g_free, NULL);
+  g_mutex_lock (&self->cache_lock);
+  gboolean ret = ensure_object_index_locked (self, TRUE, error);
+  if (ret && self->object_index)
+    {
+      OstreeObjectIndex *index = self->object_index;
+      const guint64 n_records = index->journal_offset / sizeof (OstreeObjectIndexEntry);
+      if (n_records >= MAX (JOURNAL_MIN_COMPACT_RECORDS, index->n_entries / JOURNAL_COMPACT_DIVISOR))
+        {
+          old_mfile = g_mapped_file_ref (index->mfile);
+          old_entries = index->entries;
+          n_old_entries = index->n_entries;
+          GLNX_HASH_TABLE_FOREACH_KV (index->journal, const OstreeObjectIndexEntry*, entry, gpointer, state)
+            {
+              if (state == JOURNAL_ADDED)
+                g_array_append_val (added, *entry);
+              else
+                g_hash_table_add (removed, g_memdup (entry, sizeof (*entry)));
+            }
+        }
+    }
+  g_mutex_unlock (&self->cache_lock);
+  if (!ret)
+    return FALSE;
+  if (!old_mfile)
+    return TRUE;
+
+  g_debug ("Compacting object index: %" G_GUINT64_FORMAT " entries, %u added, %u removed",
+           n_old_entries, added->len, g_hash_table_size (removed));
+  sort_object_index_entries (added);
+
+  g_autoptr(GArray) merged =
+    g_array_sized_new (FALSE, FALSE, sizeof (OstreeObjectIndexEntry), n_old_entries + added->len);
+  guint64 i = 0;
+  guint j = 0;
+  while (i < n_old_entries || j < added->len)
+    {
+      const OstreeObjectIndexEntry *new_entry =
+        j < added->len ? &g_array_index (added, OstreeObjectIndexEntry, j) : NULL;
+      int r;
+      if (i == n_old_entries)
+        r = 1;
+      else if (new_entry == NULL)
+        r = -1;
+      else
+        r = object_index_entry_compare (&old_entries[i], new_entry);
+
+      if (r <= 0)
+        {
+          if (!g_hash_table_contains (removed, &old_entries[i]))
+            g_array_append_val (merged, old_entries[i]);
+          i++;
+          if (r == 0)
+            j++;
+        }
+      else
+        {
+          g_array_append_val (merged, *new_entry);
+          j++;
+        }
+    }
+
+  return write_object_index (self, merged, cancellable, error);
+}
+
+/*
+ * _ostree_repo_object_index_add:
+ *
+ * Record @entries (objects which have just been committed to the repository)
+ * in the index journal.  If there is no index yet, build it from scratch.
+ * The caller must hold at least a shared repository lock, so objects
+ * can't be deleted concurrently.
+ */
+gboolean
+_ostree_repo_object_index_add (OstreeRepo    *self,
+                               GArray        *entries,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  if (!self->object_index_enabled || entries->len == 0)
+    return TRUE;
+
+  /* Only journal what the index doesn't already list */
+  g_autoptr(GArray) new_entries = g_array_new (FALSE, FALSE, sizeof (OstreeObjectIndexEntry));
+  gboolean have_index = FALSE;
+  g_mutex_lock (&self->cache_lock);
+  gboolean ret = ensure_object_index_locked (self, TRUE, error);
+  if (ret && self->object_index)
+    {
+      have_index = TRUE;
+      for (guint i = 0; i < entries->len; i++)
+        {
+          const OstreeObjectIndexEntry *entry = &g_array_index (entries, OstreeObjectIndexEntry, i);
+          if (!object_index_has (self->object_index, entry))
+            g_array_append_val (new_entries, *entry);
+        }
+    }
+  g_mutex_unlock (&self->cache_lock);
+  if (!ret)
+    return FALSE;
+
+  if (!have_index)
+    return ostree_repo_regenerate_object_index (self, cancellable, error);
+
+  if (new_entries->len > 0 &&
+      !append_object_index_journal (self, (OstreeObjectIndexEntry*)new_entries->data,
+                                    new_entries->len, error))
+    return FALSE;
+
+  return _ostree_repo_object_index_maybe_compact (self, cancellable, error);
+}
+
+/*
+ * _ostree_repo_object_index_remove:
+ *
+ * Record that @checksum/@objtype is about to be deleted; this must succeed
+ * before the object is removed.  The caller must hold an exclusive
+ * repository lock, so that a concurrent transaction can't re-add it.
+ */
+gboolean
+_ostree_repo_object_index_remove (OstreeRepo        *self,
+                                  const char        *checksum,
+                                  OstreeObjectType   objtype,
+                                  GError           **error)
+{
+  OstreeObjectIndexEntry record;
+  _ostree_object_index_entry_init (&record, checksum, objtype);
+  record.reserved[0] = _OSTREE_OBJECT_INDEX_RECORD_REMOVED;
+
+  g_mutex_lock (&self->cache_lock);
+  gboolean ret = ensure_object_index_locked (self, TRUE, error);
+  /* Without a base index, there is nothing listing it; a new base is
+   * generated from the objects on disk. */
+  if (ret && self->object_index && object_index_has (self->object_index, &record))
+    {
+      ret = append_object_index_journal (self, &record, 1, error);
+      if (ret)
+        ret = object_index_apply_journal (self->object_index, &record, 1, error);
+    }
+  g_mutex_unlock (&self->cache_lock);
+  return ret;
+}
+
+/**
+ * ostree_repo_regenerate_object_index:
+ * @self: Repo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Rebuild the repository's object index from the objects currently stored
+ * in it.  The index is a cache which, when the `core.object-index` option
+ * is enabled, lets ostree_repo_has_object() avoid a filesystem lookup for
+ * objects known to be present.  It is kept up to date as transactions
+ * commit and objects are deleted, so this is only needed to recover a
+ * damaged index, or after objects were deleted while `core.object-index`
+ * was disabled.
+ *
+ * This function may be used whether or not `core.object-index` is enabled,
+ * but the index is only consulted when it is.
+ *
+ * Locking: shared
+ * Since: 2019.3
+ */
+gboolean
+ostree_repo_regenerate_object_index (OstreeRepo    *self,
+                                     GCancellable  *cancellable,
+                                     GError       **error)
+{
+  g_return_val_if_fail (OSTREE_IS_REPO (self), FALSE);
+
+  g_autoptr(OstreeRepoAutoLock) lock =
+    _ostree_repo_auto_lock_push (self, OSTREE_REPO_LOCK_SHARED, cancellable, error);
+  if (!lock)
+    return FALSE;
+
+  g_autoptr(GHashTable) objects = NULL;
+  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_ALL | OSTREE_REPO_LIST_OBJECTS_NO_PARENTS,
+                                 &objects, cancellable, error))
+    return FALSE;
+
+  g_autoptr(GArray) entries =
+    g_array_sized_new (FALSE, FALSE, sizeof (OstreeObjectIndexEntry), g_hash_table_size (objects));
+  GLNX_HASH_TABLE_FOREACH (objects, GVariant*, serialized_key)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      OstreeObjectIndexEntry entry;
+
+      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+      _ostree_object_index_entry_init (&entry, checksum, objtype);
+      g_array_append_val (entries, entry);
+    }
+  sort_object_index_entries (entries);
+
+  return write_object_index (self, entries, cancellable, error);
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include "ostree-core-private.h"
+#include "ostree-object-set-private.h"
+
+G_BEGIN_DECLS
+
+/* Pack files live in objects/pack/, as a pair of files named after the
+ * SHA256 of the data file:
+ *
+ *   pack-<checksum>.pack: _OSTREE_PACK_DATA_MAGIC, followed by the verbatim
+ *     contents of the loose (archive mode) objects, each starting at an offset
+ *     aligned to _OSTREE_PACK_ALIGNMENT so metadata can be used directly from
+ *     a mapping.
+ *   pack-<checksum>.idx: an OstreePackIndexHeader followed by n_entries
+ *     OstreePackIndexEntry, sorted by (checksum, objtype) so it can be
+ *     mmap()ed and binary searched.
+ *
+ * Packs are immutable once written.  The data file is always written
+ * before its index, and readers only look for the index, so a pack is
+ * never seen half-written.  All integers are big endian.
+ */
+#define _OSTREE_PACK_DIR "pack"
+#define _OSTREE_PACK_PREFIX "pack-"
+#define _OSTREE_PACK_DATA_SUFFIX ".pack"
+#define _OSTREE_PACK_INDEX_SUFFIX ".idx"
+
+/* Under the repo's cache dir: copies of remote pack indexes, per remote */
+#define _OSTREE_PACK_INDEX_CACHE_DIR "pack-indexes"
+
+/* Summary key listing the repository's packs, as a map of pack checksum to
+ * the 32 byte SHA256 digest of its index (type "a{sv}", values "ay"); see
+ * ostree_repo_regenerate_summary(). */
+#define OSTREE_SUMMARY_PACKS "ostree.packs"
+
+/* Default for the "max-pack-index-size" pull option.  An index entry is 56
+ * bytes, so this allows for over a million objects per pack. */
+#define _OSTREE_MAX_PACK_INDEX_SIZE (64 * 1024 * 1024)
+
+#define _OSTREE_PACK_DATA_MAGIC "OSTPACK1"
+#define _OSTREE_PACK_INDEX_MAGIC "OSTPIDX1"
+#define _OSTREE_PACK_MAGIC_LEN 8
+#define _OSTREE_PACK_ALIGNMENT 8
+
+typedef struct {
+  char magic[_OSTREE_PACK_MAGIC_LEN];
+  guint64 n_entries;
+} OstreePackIndexHeader;
+
+typedef struct {
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  guint8 objtype;
+  guint8 reserved[7];
+  guint64 offset;
+  guint64 size;
+} OstreePackIndexEntry;
+
+G_STATIC_ASSERT (sizeof (OstreePackIndexHeader) == 16);
+G_STATIC_ASSERT (sizeof (OstreePackIndexEntry) == 56);
+
+typedef struct OstreeRepoPack OstreeRepoPack;
+void _ostree_repo_pack_free (OstreeRepoPack *pack);
+
+const OstreePackIndexEntry *
+_ostree_pack_index_lookup (const OstreePackIndexEntry *entries,
+                           guint64                     n_entries,
+                           const guint8               *csum,
+                           OstreeObjectType            objtype);
+
+gboolean
+_ostree_pack_index_parse (const char                  *contents,
+                          gsize                        len,
+                          const OstreePackIndexEntry **out_entries,
+                          guint64                     *out_n_entries,
+                          GError                     **error);
+
+gboolean
+_ostree_repo_list_packs (OstreeRepo    *self,
+                         GPtrArray    **out_packs,
+                         GError       **error);
+
+gboolean
+_ostree_repo_load_packed_object (OstreeRepo        *self,
+                                 const char        *checksum,
+                                 OstreeObjectType   objtype,
+                                 GBytes           **out_bytes,
+                                 GError           **error);
+
+gboolean
+_ostree_repo_has_packed_object (OstreeRepo        *self,
+                                const char        *checksum,
+                                OstreeObjectType   objtype,
+                                gboolean          *out_is_stored,
+                                guint64           *out_size,
+                                GError           **error);
+
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo    *self,
+                                  GHashTable    *inout_objects,
+                                  GCancellable  *cancellable,
+                                  GError       **error);
+
+gboolean
+_ostree_repo_list_packed_objects_set (OstreeRepo       *self,
+                                      OstreeObjectSet  *inout_objects,
+                                      GCancellable     *cancellable,
+                                      GError          **error);
+
+G_END_DECLS
@@ -0,0 +1,800 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "ostree-repo-pack-private.h"
+#include "ostree-autocleanups.h"
+#include "otutil.h"
+
+#define _OSTREE_PACK_COPY_BUFSIZE (128 * 1024)
+
+struct OstreeRepoPack {
+  char *checksum;
+  GMappedFile *index;
+  const OstreePackIndexEntry *entries;
+  guint64 n_entries;
+  GBytes *data;
+};
+
+void
+_ostree_repo_pack_free (OstreeRepoPack *pack)
+{
+  if (!pack)
+    return;
+  g_free (pack->checksum);
+  g_clear_pointer (&pack->index, g_mapped_file_unref);
+  g_clear_pointer (&pack->data, g_bytes_unref);
+  g_free (pack);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (OstreeRepoPack, _ostree_repo_pack_free)
+
+static int
+pack_index_entry_compare (const guint8               *csum,
+                          OstreeObjectType            objtype,
+                          const OstreePackIndexEntry *entry)
+{
+  int r = memcmp (csum, entry->csum, OSTREE_SHA256_DIGEST_LEN);
+  if (r != 0)
+    return r;
+  return (int)objtype - (int)entry->objtype;
+}
+
+/* Binary search in a sorted index; see ostree-repo-pack-private.h */
+const OstreePackIndexEntry *
+_ostree_pack_index_lookup (const OstreePackIndexEntry *entries,
+                           guint64                     n_entries,
+                           const guint8               *csum,
+                           OstreeObjectType            objtype)
+{
+  guint64 lo = 0;
+  guint64 hi = n_entries;
+
+  while (lo < hi)
+    {
+      guint64 mid = lo + (hi - lo) / 2;
+      int r = pack_index_entry_compare (csum, objtype, &entries[mid]);
+      if (r == 0)
+        return &entries[mid];
+      else if (r < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return NULL;
+}
+
+/* Validate a pack index held in memory (mapped from disk, or fetched from a
+ * remote); on success @out_entries points into @contents.
+ */
+gboolean
+_ostree_pack_index_parse (const char                  *contents,
+                          gsize                        len,
+                          const OstreePackIndexEntry **out_entries,
+                          guint64                     *out_n_entries,
+                          GError                     **error)
+{
+  if (len < sizeof (OstreePackIndexHeader))
+    return glnx_throw (error, "Truncated pack index");
+  const OstreePackIndexHeader *header = (const OstreePackIndexHeader*)contents;
+  if (memcmp (header->magic, _OSTREE_PACK_INDEX_MAGIC, _OSTREE_PACK_MAGIC_LEN) != 0)
+    return glnx_throw (error, "Invalid pack index header");
+  const guint64 n_entries = GUINT64_FROM_BE (header->n_entries);
+  if (n_entries != (len - sizeof (OstreePackIndexHeader)) / sizeof (OstreePackIndexEntry) ||
+      (len - sizeof (OstreePackIndexHeader)) % sizeof (OstreePackIndexEntry) != 0)
+    return glnx_throw (error, "Invalid pack index size");
+
+  *out_entries = (const OstreePackIndexEntry*)(contents + sizeof (OstreePackIndexHeader));
+  *out_n_entries = n_entries;
+  return TRUE;
+}
+
+static GMappedFile *
+map_pack_file (int          pack_dfd,
+               const char  *name,
+               const char  *magic,
+               GError     **error)
+{
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (pack_dfd, name, TRUE, &fd, error))
+    return NULL;
+  g_autoptr(GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    return NULL;
+  if (g_mapped_file_get_length (mfile) < _OSTREE_PACK_MAGIC_LEN ||
+      memcmp (g_mapped_file_get_contents (mfile), magic, _OSTREE_PACK_MAGIC_LEN) != 0)
+    return glnx_null_throw (error, "Invalid header in %s", name);
+  return g_steal_pointer (&mfile);
+}
+
+static OstreeRepoPack *
+pack_open (int          pack_dfd,
+           const char  *checksum,
+           GError     **error)
+{
+  g_autofree char *index_name =
+    g_strconcat (_OSTREE_PACK_PREFIX, checksum, _OSTREE_PACK_INDEX_SUFFIX, NULL);
+  g_autofree char *data_name =
+    g_strconcat (_OSTREE_PACK_PREFIX, checksum, _OSTREE_PACK_DATA_SUFFIX, NULL);
+  GLNX_AUTO_PREFIX_ERROR ("Loading pack", error);
+
+  g_autoptr(GMappedFile) index = map_pack_file (pack_dfd, index_name,
+                                                _OSTREE_PACK_INDEX_MAGIC, error);
+  if (!index)
+    return NULL;
+
+  const OstreePackIndexEntry *entries;
+  guint64 n_entries;
+  if (!_ostree_pack_index_parse (g_mapped_file_get_contents (index),
+                                 g_mapped_file_get_length (index),
+                                 &entries, &n_entries, error))
+    {
+      glnx_prefix_error (error, "%s", index_name);
+      return NULL;
+    }
+
+  g_autoptr(GMappedFile) data = map_pack_file (pack_dfd, data_name,
+                                               _OSTREE_PACK_DATA_MAGIC, error);
+  if (!data)
+    return NULL;
+
+  g_autoptr(OstreeRepoPack) pack = g_new0 (OstreeRepoPack, 1);
+  pack->checksum = g_strdup (checksum);
+  pack->entries = entries;
+  pack->n_entries = n_entries;
+  pack->index = g_steal_pointer (&index);
+  pack->data = g_mapped_file_get_bytes (data);
+  return g_steal_pointer (&pack);
+}
+
+/* Load (or reload, if objects/pack has changed since we last looked) the set
+ * of packs.  Called with cache_lock held.
+ */
+static gboolean
+ensure_packs_locked (OstreeRepo  *self,
+                     gboolean     check_for_changes,
+                     GError     **error)
+{
+  if (self->packs && !check_for_changes)
+    return TRUE;
+
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (self->objects_dir_fd, _OSTREE_PACK_DIR, &stbuf, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    {
+      g_clear_pointer (&self->packs, (GDestroyNotify) g_ptr_array_unref);
+      self->packs = g_ptr_array_new_with_free_func ((GDestroyNotify) _ostree_repo_pack_free);
+      return TRUE;
+    }
+
+  if (self->packs &&
+      stbuf.st_mtim.tv_sec == self->packs_mtime.tv_sec &&
+      stbuf.st_mtim.tv_nsec == self->packs_mtime.tv_nsec)
+    return TRUE;
+
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (self->objects_dir_fd, _OSTREE_PACK_DIR, FALSE,
+                                    &dfd_iter, error))
+    return FALSE;
+
+  g_autoptr(GPtrArray) old_packs = g_steal_pointer (&self->packs);
+  g_autoptr(GPtrArray) new_packs =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) _ostree_repo_pack_free);
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      const char *name = dent->d_name;
+      if (!g_str_has_prefix (name, _OSTREE_PACK_PREFIX) ||
+          !g_str_has_suffix (name, _OSTREE_PACK_INDEX_SUFFIX))
+        continue;
+      const char *checksum = name + strlen (_OSTREE_PACK_PREFIX);
+      if (strlen (checksum) != OSTREE_SHA256_STRING_LEN + strlen (_OSTREE_PACK_INDEX_SUFFIX))
+        continue;
+      char checksum_buf[OSTREE_SHA256_STRING_LEN+1];
+      memcpy (checksum_buf, checksum, OSTREE_SHA256_STRING_LEN);
+      checksum_buf[OSTREE_SHA256_STRING_LEN] = '\0';
+
+      /* Packs are immutable, so reuse any we already have mapped */
+      OstreeRepoPack *pack = NULL;
+      for (guint i = 0; old_packs && i < old_packs->len; i++)
+        {
+          OstreeRepoPack *old_pack = old_packs->pdata[i];
+          if (old_pack && strcmp (old_pack->checksum, checksum_buf) == 0)
+            {
+              pack = old_pack;
+              old_packs->pdata[i] = NULL;
+              break;
+            }
+        }
+      if (!pack)
+        {
+          pack = pack_open (dfd_iter.fd, checksum_buf, error);
+          if (!pack)
+            return FALSE;
+        }
+      g_ptr_array_add (new_packs, pack);
+    }
+
+  self->packs = g_steal_pointer (&new_packs);
+  self->packs_mtime = stbuf.st_mtim;
+  return TRUE;
+}
+
+/* Find @csum/@objtype in our packs.  Callers have already missed the loose
+ * object, and a repack in another process may just have moved it into a new
+ * pack, so on a miss objects/pack is checked again; that's one fstatat(),
+ * and the directory is only rescanned if it changed.  Called with
+ * cache_lock held.
+ */
+static gboolean
+lookup_packed_object_locked (OstreeRepo                  *self,
+                             const guint8                *csum,
+                             OstreeObjectType             objtype,
+                             OstreeRepoPack             **out_pack,
+                             const OstreePackIndexEntry **out_entry,
+                             GError                     **error)
+{
+  *out_pack = NULL;
+  *out_entry = NULL;
+
+  /* Packs are only supported for archive repositories */
+  if (self->mode != OSTREE_REPO_MODE_ARCHIVE)
+    return TRUE;
+
+  for (int attempt = 0; attempt < 2; attempt++)
+    {
+      if (!ensure_packs_locked (self, attempt > 0, error))
+        return FALSE;
+
+      for (guint i = 0; i < self->packs->len; i++)
+        {
+          OstreeRepoPack *pack = self->packs->pdata[i];
+          const OstreePackIndexEntry *entry =
+            _ostree_pack_index_lookup (pack->entries, pack->n_entries, csum, objtype);
+          if (entry)
+            {
+              *out_pack = pack;
+              *out_entry = entry;
+              return TRUE;
+            }
+        }
+    }
+
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_load_packed_object:
+ *
+ * Look up an object in the repository's pack files; if found, @out_bytes is
+ * set to its contents, in the same format as a loose archive object.  The
+ * returned bytes point directly into the mapped pack.  If not found,
+ * @out_bytes is set to %NULL.
+ */
+gboolean
+_ostree_repo_load_packed_object (OstreeRepo        *self,
+                                 const char        *checksum,
+                                 OstreeObjectType   objtype,
+                                 GBytes           **out_bytes,
+                                 GError           **error)
+{
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+
+  g_autoptr(GBytes) ret_bytes = NULL;
+  OstreeRepoPack *pack;
+  const OstreePackIndexEntry *entry;
+  gboolean ret = FALSE;
+
+  g_mutex_lock (&self->cache_lock);
+  if (!lookup_packed_object_locked (self, csum, objtype, &pack, &entry, error))
+    goto out;
+  if (entry)
+    {
+      const guint64 offset = GUINT64_FROM_BE (entry->offset);
+      const guint64 size = GUINT64_FROM_BE (entry->size);
+      const gsize data_len = g_bytes_get_size (pack->data);
+      if (offset < _OSTREE_PACK_MAGIC_LEN || offset > data_len || size > data_len - offset)
+        {
+          glnx_throw (error, "Invalid offset for %s.%s in pack %s", checksum,
+                      ostree_object_type_to_string (objtype), pack->checksum);
+          goto out;
+        }
+      ret_bytes = g_bytes_new_from_bytes (pack->data, offset, size);
+    }
+  ret = TRUE;
+ out:
+  g_mutex_unlock (&self->cache_lock);
+  if (ret)
+    *out_bytes = g_steal_pointer (&ret_bytes);
+  return ret;
+}
+
+gboolean
+_ostree_repo_has_packed_object (OstreeRepo        *self,
+                                const char        *checksum,
+                                OstreeObjectType   objtype,
+                                gboolean          *out_is_stored,
+                                guint64           *out_size,
+                                GError           **error)
+{
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+
+  OstreeRepoPack *pack;
+  const OstreePackIndexEntry *entry;
+
+  g_mutex_lock (&self->cache_lock);
+  gboolean ret = lookup_packed_object_locked (self, csum, objtype, &pack, &entry, error);
+  if (ret)
+    {
+      *out_is_stored = (entry != NULL);
+      if (entry && out_size)
+        *out_size = GUINT64_FROM_BE (entry->size);
+    }
+  g_mutex_unlock (&self->cache_lock);
+  return ret;
+}
+
+static int
+compare_pack_names (gconstpointer a_pp,
+                    gconstpointer b_pp)
+{
+  return strcmp (*((char**)a_pp), *((char**)b_pp));
+}
+
+/* Return the checksums of all packs in the repository, sorted. */
+gboolean
+_ostree_repo_list_packs (OstreeRepo    *self,
+                         GPtrArray    **out_packs,
+                         GError       **error)
+{
+  g_autoptr(GPtrArray) ret_packs = g_ptr_array_new_with_free_func (g_free);
+  if (self->mode != OSTREE_REPO_MODE_ARCHIVE)
+    {
+      *out_packs = g_steal_pointer (&ret_packs);
+      return TRUE;
+    }
+
+  g_mutex_lock (&self->cache_lock);
+  gboolean ret = ensure_packs_locked (self, TRUE, error);
+  for (guint i = 0; ret && i < self->packs->len; i++)
+    {
+      OstreeRepoPack *pack = self->packs->pdata[i];
+      g_ptr_array_add (ret_packs, g_strdup (pack->checksum));
+    }
+  g_mutex_unlock (&self->cache_lock);
+  if (!ret)
+    return FALSE;
+
+  g_ptr_array_sort (ret_packs, compare_pack_names);
+  *out_packs = g_steal_pointer (&ret_packs);
+  return TRUE;
+}
+
+/* Add every packed object to @inout_objects, in the format used by
+ * ostree_repo_list_objects(); objects which are also loose keep their
+ * is_loose flag.
+ */
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo    *self,
+                                  GHashTable    *inout_objects,
+                                  GCancellable  *cancellable,
+                                  GError       **error)
+{
+  if (self->mode != OSTREE_REPO_MODE_ARCHIVE)
+    return TRUE;
+
+  gboolean ret = FALSE;
+  g_mutex_lock (&self->cache_lock);
+  if (!ensure_packs_locked (self, TRUE, error))
+    goto out;
+
+  for (guint i = 0; i < self->packs->len; i++)
+    {
+      OstreeRepoPack *pack = self->packs->pdata[i];
+      for (guint64 j = 0; j < pack->n_entries; j++)
+        {
+          const OstreePackIndexEntry *entry = &pack->entries[j];
+          char checksum[OSTREE_SHA256_STRING_LEN+1];
+          ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+
+          g_autoptr(GVariant) key =
+            g_variant_ref_sink (ostree_object_name_serialize (checksum, entry->objtype));
+          gboolean is_loose = FALSE;
+          g_autoptr(GPtrArray) pack_names = g_ptr_array_new ();
+          g_autofree const char **prev_names = NULL;
+          GVariant *prev = g_hash_table_lookup (inout_objects, key);
+          if (prev)
+            {
+              g_variant_get (prev, "(b^a&s)", &is_loose, &prev_names);
+              for (const char **it = prev_names; it && *it; it++)
+                g_ptr_array_add (pack_names, (char*)*it);
+            }
+          g_ptr_array_add (pack_names, pack->checksum);
+
+          GVariant *value = g_variant_new ("(b@as)", is_loose,
+                                           g_variant_new_strv ((const char *const*)pack_names->pdata,
+                                                               pack_names->len));
+          g_hash_table_replace (inout_objects, g_steal_pointer (&key),
+                                g_variant_ref_sink (value));
+        }
+    }
+
+  ret = TRUE;
+ out:
+  g_mutex_unlock (&self->cache_lock);
+  return ret;
+}
+
+/* Add the name of every packed object to @inout_objects */
+gboolean
+_ostree_repo_list_packed_objects_set (OstreeRepo       *self,
+                                      OstreeObjectSet  *inout_objects,
+                                      GCancellable     *cancellable,
+                                      GError          **error)
+{
+  if (self->mode != OSTREE_REPO_MODE_ARCHIVE)
+    return TRUE;
+
+  gboolean ret = FALSE;
+  g_mutex_lock (&self->cache_lock);
+  if (!ensure_packs_locked (self, TRUE, error))
+    goto out;
+
+  for (guint i = 0; i < self->packs->len; i++)
+    {
+      OstreeRepoPack *pack = self->packs->pdata[i];
+      for (guint64 j = 0; j < pack->n_entries; j++)
+        ostree_object_set_add (inout_objects, pack->entries[j].csum, pack->entries[j].objtype);
+    }
+
+  ret = TRUE;
+ out:
+  g_mutex_unlock (&self->cache_lock);
+  return ret;
+}
+
+typedef struct {
+  char checksum[OSTREE_SHA256_STRING_LEN+1];
+  OstreeObjectType objtype;
+  guint64 offset;
+  guint64 size;
+} RepackObject;
+
+/* Order of objects in the pack data: metadata first, so a client walking a
+ * commit finds the trees close together, then content.
+ */
+static int
+repack_object_compare_layout (gconstpointer a,
+                              gconstpointer b)
+{
+  const RepackObject *obj_a = a;
+  const RepackObject *obj_b = b;
+  const gboolean a_is_meta = OSTREE_OBJECT_TYPE_IS_META (obj_a->objtype);
+  const gboolean b_is_meta = OSTREE_OBJECT_TYPE_IS_META (obj_b->objtype);
+
+  if (a_is_meta != b_is_meta)
+    return a_is_meta ? -1 : 1;
+  if (obj_a->objtype != obj_b->objtype)
+    return (int)obj_a->objtype - (int)obj_b->objtype;
+  return strcmp (obj_a->checksum, obj_b->checksum);
+}
+
+/* Order of the index; lowercase hex sorts the same as the binary digest */
+static int
+repack_object_compare_index (gconstpointer a,
+                             gconstpointer b)
+{
+  const RepackObject *obj_a = a;
+  const RepackObject *obj_b = b;
+  int r = strcmp (obj_a->checksum, obj_b->checksum);
+  if (r != 0)
+    return r;
+  return (int)obj_a->objtype - (int)obj_b->objtype;
+}
+
+static gboolean
+pack_write (int          fd,
+            OtChecksum  *hasher,
+            const void  *buf,
+            gsize        len,
+            guint64     *inout_offset,
+            GError     **error)
+{
+  if (glnx_loop_write (fd, buf, len) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+  if (hasher)
+    ot_checksum_update (hasher, buf, len);
+  *inout_offset += len;
+  return TRUE;
+}
+
+static gboolean
+repack_write_data (OstreeRepo    *self,
+                   int            pack_dfd,
+                   GArray        *objects,
+                   char          *out_checksum,
+                   guint64       *out_size,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  static const guint8 zeroes[_OSTREE_PACK_ALIGNMENT] = { 0, };
+  /* Objects are streamed through this, so large ones aren't read into memory */
+  g_autofree guint8 *buf = g_malloc (_OSTREE_PACK_COPY_BUFSIZE);
+
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  if (!glnx_open_tmpfile_linkable_at (pack_dfd, ".", O_WRONLY | O_CLOEXEC,
+                                      &tmpf, error))
+    return FALSE;
+
+  g_auto(OtChecksum) hasher = { 0, };
+  ot_checksum_init (&hasher);
+  guint64 offset = 0;
+  if (!pack_write (tmpf.fd, &hasher, _OSTREE_PACK_DATA_MAGIC, _OSTREE_PACK_MAGIC_LEN,
+                   &offset, error))
+    return FALSE;
+
+  for (guint i = 0; i < objects->len; i++)
+    {
+      RepackObject *obj = &g_array_index (objects, RepackObject, i);
+      char loose_path[_OSTREE_LOOSE_PATH_MAX];
+      _ostree_loose_path (loose_path, obj->checksum, obj->objtype, self->mode);
+
+      glnx_autofd int fd = -1;
+      if (!glnx_openat_rdonly (self->objects_dir_fd, loose_path, FALSE, &fd, error))
+        return FALSE;
+
+      const gsize padding = (_OSTREE_PACK_ALIGNMENT - (offset % _OSTREE_PACK_ALIGNMENT)) % _OSTREE_PACK_ALIGNMENT;
+      if (padding > 0 && !pack_write (tmpf.fd, &hasher, zeroes, padding, &offset, error))
+        return FALSE;
+
+      obj->offset = offset;
+      while (TRUE)
+        {
+          if (g_cancellable_set_error_if_cancelled (cancellable, error))
+            return FALSE;
+          ssize_t n = glnx_loop_read (fd, buf, _OSTREE_PACK_COPY_BUFSIZE);
+          if (n < 0)
+            return glnx_throw_errno_prefix (error, "read(%s)", loose_path);
+          if (n == 0)
+            break;
+          if (!pack_write (tmpf.fd, &hasher, buf, n, &offset, error))
+            return FALSE;
+        }
+      obj->size = offset - obj->offset;
+    }
+
+  if (!glnx_fchmod (tmpf.fd, 0644, error))
+    return FALSE;
+  if (!self->disable_fsync && fsync (tmpf.fd) < 0)
+    return glnx_throw_errno_prefix (error, "fsync");
+
+  ot_checksum_get_hexdigest (&hasher, out_checksum, OSTREE_SHA256_STRING_LEN+1);
+  g_autofree char *name =
+    g_strconcat (_OSTREE_PACK_PREFIX, out_checksum, _OSTREE_PACK_DATA_SUFFIX, NULL);
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE_IGNORE_EXIST,
+                             pack_dfd, name, error))
+    return FALSE;
+
+  *out_size = offset;
+  return TRUE;
+}
+
+static gboolean
+repack_write_index (OstreeRepo    *self,
+                    int            pack_dfd,
+                    GArray        *objects,
+                    const char    *pack_checksum,
+                    GError       **error)
+{
+  g_array_sort (objects, repack_object_compare_index);
+
+  const gsize index_len = sizeof (OstreePackIndexHeader) + objects->len * sizeof (OstreePackIndexEntry);
+  g_autofree guint8 *buf = g_malloc0 (index_len);
+  OstreePackIndexHeader *header = (OstreePackIndexHeader*)buf;
+  memcpy (header->magic, _OSTREE_PACK_INDEX_MAGIC, _OSTREE_PACK_MAGIC_LEN);
+  header->n_entries = GUINT64_TO_BE (objects->len);
+  OstreePackIndexEntry *entries = (OstreePackIndexEntry*)(buf + sizeof (OstreePackIndexHeader));
+  for (guint i = 0; i < objects->len; i++)
+    {
+      const RepackObject *obj = &g_array_index (objects, RepackObject, i);
+      ostree_checksum_inplace_to_bytes (obj->checksum, entries[i].csum);
+      entries[i].objtype = obj->objtype;
+      entries[i].offset = GUINT64_TO_BE (obj->offset);
+      entries[i].size = GUINT64_TO_BE (obj->size);
+    }
+
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  if (!glnx_open_tmpfile_linkable_at (pack_dfd, ".", O_WRONLY | O_CLOEXEC,
+                                      &tmpf, error))
+    return FALSE;
+  guint64 offset = 0;
+  if (!pack_write (tmpf.fd, NULL, buf, index_len, &offset, error))
+    return FALSE;
+  if (!glnx_fchmod (tmpf.fd, 0644, error))
+    return FALSE;
+  if (!self->disable_fsync && fsync (tmpf.fd) < 0)
+    return glnx_throw_errno_prefix (error, "fsync");
+
+  g_autofree char *name =
+    g_strconcat (_OSTREE_PACK_PREFIX, pack_checksum, _OSTREE_PACK_INDEX_SUFFIX, NULL);
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE_IGNORE_EXIST,
+                             pack_dfd, name, error))
+    return FALSE;
+
+  if (!self->disable_fsync && fsync (pack_dfd) < 0)
+    return glnx_throw_errno_prefix (error, "fsync");
+
+  return TRUE;
+}
+
+/**
+ * ostree_repo_repack:
+ * @self: Repo
+ * @options: (nullable): GVariant of type a{sv}
+ * @out_n_packed: (out) (optional): Number of objects moved into the new pack
+ * @out_pack_size: (out) (optional): Size in bytes of the new pack data file
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Move loose dirtree, dirmeta and content objects of an archive repository
+ * into a new pack file under `objects/pack/`, and delete the loose copies.
+ * Packed objects are found transparently by ostree_repo_has_object(),
+ * ostree_repo_load_variant(), ostree_repo_load_file() and
+ * ostree_repo_list_objects().  Commit objects and their detached metadata
+ * always stay loose.  Loose objects which are already in a pack are just
+ * deleted.
+ *
+ * Pack files are append-only; ostree_repo_prune() does not remove objects
+ * from them.
+ *
+ * The following @options are currently defined:
+ *
+ *   - max-object-size: t: Leave objects whose loose (compressed) size is
+ *     larger than this many bytes loose.  The default of 0 means no limit.
+ *
+ * Since: 2019.3
+ */
+gboolean
+ostree_repo_repack (OstreeRepo    *self,
+                    GVariant      *options,
+                    guint         *out_n_packed,
+                    guint64       *out_pack_size,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  g_return_val_if_fail (OSTREE_IS_REPO (self), FALSE);
+
+  if (self->mode != OSTREE_REPO_MODE_ARCHIVE)
+    return glnx_throw (error, "Pack files are only supported in archive repositories");
+
+  guint64 max_object_size = 0;
+  if (options)
+    (void) g_variant_lookup (options, "max-object-size", "t", &max_object_size);
+
+  g_autoptr(OstreeRepoAutoLock) lock =
+    _ostree_repo_auto_lock_push (self, OSTREE_REPO_LOCK_EXCLUSIVE, cancellable, error);
+  if (!lock)
+    return FALSE;
+
+  g_autoptr(GHashTable) objects = NULL;
+  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_ALL | OSTREE_REPO_LIST_OBJECTS_NO_PARENTS,
+                                 &objects, cancellable, error))
+    return FALSE;
+
+  g_autoptr(GArray) to_pack = g_array_new (FALSE, FALSE, sizeof (RepackObject));
+  g_autoptr(GArray) already_packed = g_array_new (FALSE, FALSE, sizeof (RepackObject));
+  GLNX_HASH_TABLE_FOREACH_KV (objects, GVariant*, serialized_key, GVariant*, objdata)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      gboolean is_loose;
+      g_autoptr(GVariant) pack_names = NULL;
+
+      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+      g_variant_get (objdata, "(b@as)", &is_loose, &pack_names);
+
+      if (!is_loose)
+        continue;
+      switch (objtype)
+        {
+        case OSTREE_OBJECT_TYPE_FILE:
+        case OSTREE_OBJECT_TYPE_DIR_TREE:
+        case OSTREE_OBJECT_TYPE_DIR_META:
+          break;
+        default:
+          continue;
+        }
+
+      RepackObject obj = { { 0, }, objtype, 0, 0 };
+      memcpy (obj.checksum, checksum, OSTREE_SHA256_STRING_LEN);
+
+      if (g_variant_n_children (pack_names) > 0)
+        {
+          g_array_append_val (already_packed, obj);
+          continue;
+        }
+
+      if (max_object_size > 0)
+        {
+          guint64 size;
+          if (!ostree_repo_query_object_storage_size (self, objtype, checksum, &size,
+                                                      cancellable, error))
+            return FALSE;
+          if (size > max_object_size)
+            continue;
+        }
+
+      g_array_append_val (to_pack, obj);
+    }
+
+  guint64 pack_size = 0;
+  if (to_pack->len > 0)
+    {
+      if (!glnx_shutil_mkdir_p_at (self->objects_dir_fd, _OSTREE_PACK_DIR, 0775,
+                                   cancellable, error))
+        return FALSE;
+      glnx_autofd int pack_dfd = -1;
+      if (!glnx_opendirat (self->objects_dir_fd, _OSTREE_PACK_DIR, TRUE, &pack_dfd, error))
+        return FALSE;
+
+      g_array_sort (to_pack, repack_object_compare_layout);
+
+      char pack_checksum[OSTREE_SHA256_STRING_LEN+1];
+      if (!repack_write_data (self, pack_dfd, to_pack, pack_checksum, &pack_size,
+                              cancellable, error))
+        return FALSE;
+      if (!repack_write_index (self, pack_dfd, to_pack, pack_checksum, error))
+        return FALSE;
+
+      g_debug ("Wrote pack %s with %u objects", pack_checksum, to_pack->len);
+    }
+
+  /* Now that the pack is safely on disk, drop the loose copies */
+  GArray *to_delete[] = { to_pack, already_packed };
+  for (guint i = 0; i < G_N_ELEMENTS (to_delete); i++)
+    {
+      for (guint j = 0; j < to_delete[i]->len; j++)
+        {
+          const RepackObject *obj = &g_array_index (to_delete[i], RepackObject, j);
+          char loose_path[_OSTREE_LOOSE_PATH_MAX];
+          _ostree_loose_path (loose_path, obj->checksum, obj->objtype, self->mode);
+          if (!ot_ensure_unlinked_at (self->objects_dir_fd, loose_path, error))
+            return FALSE;
+        }
+    }
+
+  if (out_n_packed)
+    *out_n_packed = to_pack->len;
+  if (out_pack_size)
+    *out_pack_size = pack_size;
+  return TRUE;
+}
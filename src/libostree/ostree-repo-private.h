@@ -23,9 +23,12 @@
 
 #include <sys/statvfs.h>
 #include "otutil.h"
+#include "ostree-core-private.h"
 #include "ostree-ref.h"
 #include "ostree-repo.h"
 #include "ostree-remote-private.h"
+#include "ostree-object-set-private.h"
+#include "ostree-lru-cache-private.h"
 
 G_BEGIN_DECLS
 
@@ -36,16 +39,42 @@ G_BEGIN_DECLS
 #define _OSTREE_SUMMARY_CACHE_DIR "summaries"
 #define _OSTREE_CACHE_DIR "cache"
 
-#define _OSTREE_MAX_OUTSTANDING_FETCHER_REQUESTS 8
-#define _OSTREE_MAX_OUTSTANDING_DELTAPART_REQUESTS 2
+/* Under the repo's cache dir: the static delta superblock digests last put in
+ * the summary, keyed by delta name, along with the (device, inode, size, mtime
+ * seconds, mtime nanoseconds) of the superblock they were computed from. */
+#define _OSTREE_SUMMARY_DELTAS_CACHE "summary-deltas"
+#define _OSTREE_SUMMARY_DELTAS_CACHE_GVARIANT_STRING "a{s(tttttay)}"
+
+/* The number of outstanding object fetches and writes during a pull adapts
+ * between the MIN and MAX values below, starting from INITIAL; see
+ * ostree-adaptive-limit.c.  Remotes can lower the maximums or disable the
+ * adaptation altogether in their configuration, and the maximums are further
+ * lowered if RLIMIT_NOFILE is small.
+ */
+#define _OSTREE_INITIAL_OUTSTANDING_FETCHER_REQUESTS 8
+#define _OSTREE_MIN_OUTSTANDING_FETCHER_REQUESTS 2
+#define _OSTREE_MAX_OUTSTANDING_FETCHER_REQUESTS 64
+
+/* Static delta parts are downloaded, decompressed and executed as a
+ * pipeline with one apply thread per CPU; at least this many parts are
+ * downloaded at once.  Parts being applied may use up to 1/FRACTION of
+ * physical memory (beyond the first).
+ */
+#define _OSTREE_MIN_OUTSTANDING_DELTAPART_REQUESTS 2
+#define _OSTREE_DELTAPART_MEMORY_FRACTION 4
+#define _OSTREE_DELTAPART_DEFAULT_MEMORY_BUDGET (256 * 1024 * 1024)
 
 /* In most cases, writing to disk should be much faster than
  * fetching from the network, so we shouldn't actually hit
  * this. But if using pipelining and e.g. pulling over LAN
  * (or writing to slow media), we can have a runaway
- * situation towards EMFILE.
+ * situation towards EMFILE.  The adaptive maximums below are only
+ * safe because the pull code also keeps them within RLIMIT_NOFILE; see
+ * get_fd_limited_concurrency() in ostree-repo-pull.c.
  * */
-#define _OSTREE_MAX_OUTSTANDING_WRITE_REQUESTS 16
+#define _OSTREE_INITIAL_OUTSTANDING_WRITE_REQUESTS 16
+#define _OSTREE_MIN_OUTSTANDING_WRITE_REQUESTS 4
+#define _OSTREE_MAX_OUTSTANDING_WRITE_REQUESTS 64
 
 /* Well-known keys for the additional metadata field in a summary file. */
 #define OSTREE_SUMMARY_LAST_MODIFIED "ostree.summary.last-modified"
@@ -79,6 +108,7 @@ struct OstreeRepoCommitModifier {
 
   OstreeSePolicy *sepolicy;
   GHashTable *devino_cache;
+  guint n_threads;
 };
 
 typedef enum {
@@ -132,6 +162,17 @@ struct OstreeRepo {
   guint dirmeta_cache_refcount;
   /* char * checksum → GVariant * for dirmeta objects, used in the checkout path */
   GHashTable *dirmeta_cache;
+  /* OstreeRepoPack, mapped lazily; see ostree-repo-pack.c */
+  GPtrArray *packs;
+  struct timespec packs_mtime;
+  /* Mapped lazily; see ostree-repo-object-index.c */
+  struct OstreeObjectIndex *object_index;
+  gboolean object_index_checked; /* Already looked at on disk this transaction */
+  /* With core.mmap-metadata: loose path → GBytes mapping of a metadata object */
+  OstreeLruCache *metadata_map_cache;
+  /* With core.metadata-cache-size: loose path → GVariant of a commit, dirtree
+   * or dirmeta object */
+  OstreeLruCache *metadata_cache;
 
   gboolean inited;
   gboolean writable;
@@ -141,6 +182,8 @@ struct OstreeRepo {
   gboolean disable_fsync;
   gboolean disable_xattrs;
   guint zlib_compression_level;
+  OstreeArchiveCompression archive_compression; /* Only for archive repos */
+  guint zstd_compression_level;
   GHashTable *loose_object_devino_hash;
   GHashTable *updated_uncompressed_dirs;
   GHashTable *object_sizes;
@@ -167,9 +210,14 @@ struct OstreeRepo {
   gboolean add_remotes_config_dir; /* Add new remotes in remotes.d dir */
   gint lock_timeout_seconds;
   guint64 payload_link_threshold;
+  gboolean object_index_enabled;
+  gboolean packed_refs_enabled;
   gint fs_support_reflink; /* The underlying filesystem has support for ioctl (FICLONE..) */
   gchar **repo_finders;
   gchar *bootloader; /* Configure which bootloader to use. */
+  gboolean targeted_sync; /* sysroot.sync-mode=targeted */
+  gboolean prefinalize_staged; /* sysroot.prefinalize-staged */
+  gboolean grub2_native; /* sysroot.grub2-native */
 
   OstreeRepo *parent_repo;
 };
@@ -250,6 +298,37 @@ GFile *
 _ostree_repo_get_commit_metadata_loose_path (OstreeRepo        *self,
                                              const char        *checksum);
 
+gboolean
+_ostree_repo_parse_loose_object_name (OstreeRepo        *self,
+                                      const char        *prefix,
+                                      const char        *name,
+                                      char              *out_checksum,
+                                      OstreeObjectType  *out_objtype);
+
+gboolean
+_ostree_repo_list_objects_set (OstreeRepo                  *self,
+                               OstreeRepoListObjectsFlags   flags,
+                               OstreeObjectSet             *inout_objects,
+                               GCancellable                *cancellable,
+                               GError                     **error);
+
+gboolean
+_ostree_repo_traverse_commit_union_set (OstreeRepo       *repo,
+                                        const char       *commit_checksum,
+                                        int               maxdepth,
+                                        OstreeObjectSet  *inout_reachable,
+                                        GCancellable     *cancellable,
+                                        GError          **error);
+
+gboolean
+_ostree_repo_traverse_commits_union_set_parallel (OstreeRepo          *repo,
+                                                  const char * const  *commit_checksums,
+                                                  int                  maxdepth,
+                                                  OstreeObjectSet     *inout_reachable,
+                                                  guint                n_threads,
+                                                  GCancellable        *cancellable,
+                                                  GError             **error);
+
 gboolean
 _ostree_repo_has_loose_object (OstreeRepo           *self,
                                const char           *checksum,
@@ -439,11 +518,22 @@ _ostree_repo_get_remote_inherited (OstreeRepo  *self,
                                    const char  *name,
                                    GError     **error);
 
+gboolean
+_ostree_repo_mode_from_string (const char                *mode,
+                               OstreeRepoMode            *out_mode,
+                               OstreeArchiveCompression  *out_compression,
+                               GError                   **error);
+
 gboolean
 _ostree_repo_maybe_regenerate_summary (OstreeRepo    *self,
                                        GCancellable  *cancellable,
                                        GError       **error);
 
+gboolean
+_ostree_repo_regenerate_summary_incremental (OstreeRepo    *self,
+                                             GCancellable  *cancellable,
+                                             GError       **error);
+
 /* Locking APIs are currently private.
  * See https://github.com/ostreedev/ostree/pull/1555
  */
@@ -25,12 +25,17 @@
 
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
+#include "ostree-repo-object-index-private.h"
+#include "ostree-repo-pack-private.h"
+#include "ostree-repo-summary-index-private.h"
 #include "ostree-autocleanups.h"
 #include "otutil.h"
 
 typedef struct {
   OstreeRepo *repo;
+  /* Exactly one of these is set */
   GHashTable *reachable;
+  OstreeObjectSet *reachable_set;
   guint n_reachable_meta;
   guint n_reachable_content;
   guint n_unreachable_meta;
@@ -38,6 +43,18 @@ typedef struct {
   guint64 freed_bytes;
 } OtPruneData;
 
+static gboolean
+prune_data_is_reachable (OtPruneData      *data,
+                         const char       *checksum,
+                         OstreeObjectType  objtype)
+{
+  if (data->reachable_set)
+    return ostree_object_set_contains_checksum (data->reachable_set, checksum, objtype);
+
+  g_autoptr(GVariant) key = g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype));
+  return g_hash_table_contains (data->reachable, key);
+}
+
 static gboolean
 maybe_prune_loose_object (OtPruneData        *data,
                           OstreeRepoPruneFlags    flags,
@@ -47,11 +64,8 @@ maybe_prune_loose_object (OtPruneData        *data,
                           GError            **error)
 {
   gboolean reachable = FALSE;
-  g_autoptr(GVariant) key = NULL;
 
-  key = ostree_object_name_serialize (checksum, objtype);
-
-  if (g_hash_table_lookup_extended (data->reachable, key, NULL, NULL))
+  if (prune_data_is_reachable (data, checksum, objtype))
     reachable = TRUE;
   else
     {
@@ -85,9 +99,7 @@ maybe_prune_loose_object (OtPruneData        *data,
 
               sprintf (target_checksum, "%.2s%.62s", target_buf + _OSTREE_PAYLOAD_LINK_PREFIX_LEN, target_buf + _OSTREE_PAYLOAD_LINK_PREFIX_LEN + 3);
 
-              g_autoptr(GVariant) target_key = ostree_object_name_serialize (target_checksum, OSTREE_OBJECT_TYPE_FILE);
-
-              if (g_hash_table_lookup_extended (data->reachable, target_key, NULL, NULL))
+              if (prune_data_is_reachable (data, target_checksum, OSTREE_OBJECT_TYPE_FILE))
                 {
                   guint64 target_storage_size = 0;
                   if (!ostree_repo_query_object_storage_size (data->repo, OSTREE_OBJECT_TYPE_FILE, target_checksum,
@@ -139,6 +151,29 @@ _ostree_repo_prune_tmp (OstreeRepo *self,
   if (self->cache_dir_fd == -1)
     return TRUE;
 
+  /* Cached pack indexes and summary shards are kept per remote */
+  const char *per_remote_cache_dirs[] = { _OSTREE_PACK_INDEX_CACHE_DIR,
+                                          _OSTREE_SUMMARY_SHARDS_CACHE_DIR };
+  for (guint i = 0; i < G_N_ELEMENTS (per_remote_cache_dirs); i++)
+    {
+      g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+      gboolean exists;
+      if (!ot_dfd_iter_init_allow_noent (self->cache_dir_fd, per_remote_cache_dirs[i],
+                                         &dfd_iter, &exists, error))
+        return FALSE;
+      while (exists)
+        {
+          struct dirent *dent;
+          if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+            return FALSE;
+          if (dent == NULL)
+            break;
+          if (!g_hash_table_contains (self->remotes, dent->d_name) &&
+              !glnx_shutil_rm_rf_at (dfd_iter.fd, dent->d_name, cancellable, error))
+            return FALSE;
+        }
+    }
+
   g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
   gboolean exists;
   if (!ot_dfd_iter_init_allow_noent (self->cache_dir_fd, _OSTREE_SUMMARY_CACHE_DIR,
@@ -257,6 +292,29 @@ ostree_repo_prune_static_deltas (OstreeRepo *self, const char *commit,
   return TRUE;
 }
 
+/* Cleanups shared by all the prune variants, once objects have been deleted */
+static gboolean
+prune_finish (OstreeRepo           *self,
+              OstreeRepoPruneFlags  flags,
+              GCancellable         *cancellable,
+              GError              **error)
+{
+  if (!ostree_repo_prune_static_deltas (self, NULL, cancellable, error))
+    return FALSE;
+
+  if (!_ostree_repo_prune_tmp (self, cancellable, error))
+    return FALSE;
+
+  /* Fold the removals journaled for each deleted object into the index */
+  if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+    {
+      if (!_ostree_repo_object_index_maybe_compact (self, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 repo_prune_internal (OstreeRepo        *self,
                      GHashTable        *objects,
@@ -291,10 +349,49 @@ repo_prune_internal (OstreeRepo        *self,
         return FALSE;
     }
 
-  if (!ostree_repo_prune_static_deltas (self, NULL, cancellable, error))
+  if (!prune_finish (self, options->flags, cancellable, error))
     return FALSE;
 
-  if (!_ostree_repo_prune_tmp (self, cancellable, error))
+  *out_objects_total = (data.n_reachable_meta + data.n_unreachable_meta +
+                        data.n_reachable_content + data.n_unreachable_content);
+  *out_objects_pruned = (data.n_unreachable_meta + data.n_unreachable_content);
+  *out_pruned_object_size_total = data.freed_bytes;
+  return TRUE;
+}
+
+/* Like repo_prune_internal(), for the loose objects in @objects and the
+ * reachable objects in @reachable.
+ */
+static gboolean
+repo_prune_set (OstreeRepo           *self,
+                OstreeObjectSet      *objects,
+                OstreeObjectSet      *reachable,
+                OstreeRepoPruneFlags  flags,
+                gint                 *out_objects_total,
+                gint                 *out_objects_pruned,
+                guint64              *out_pruned_object_size_total,
+                GCancellable         *cancellable,
+                GError              **error)
+{
+  OtPruneData data = { 0, };
+
+  data.repo = self;
+  data.reachable_set = reachable;
+
+  gsize iter = 0;
+  const guint8 *csum;
+  OstreeObjectType objtype;
+  while (ostree_object_set_iter_next (objects, &iter, &csum, &objtype))
+    {
+      char checksum[OSTREE_SHA256_STRING_LEN+1];
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+
+      if (!maybe_prune_loose_object (&data, flags, checksum, objtype,
+                                     cancellable, error))
+        return FALSE;
+    }
+
+  if (!prune_finish (self, flags, cancellable, error))
     return FALSE;
 
   *out_objects_total = (data.n_reachable_meta + data.n_unreachable_meta +
@@ -304,6 +401,586 @@ repo_prune_internal (OstreeRepo        *self,
   return TRUE;
 }
 
+/* Incremental prune
+ *
+ * Rather than computing the full reachable set on every run, we keep a
+ * reference count for each object reachable from the retained commits:
+ * each retained commit holds a reference to its commit object, a live
+ * commit to its root dirtree and dirmeta, and a live dirtree to each of
+ * its entries.  An object is only visited when its count goes from 0 to 1
+ * or back, so adding or dropping a commit which shares most of its tree
+ * with others only visits the directories which differ.
+ *
+ * The counts are saved in the repository's cache dir along with the set
+ * of retained commits as of the last run:
+ *
+ *   PruneRefcountsHeader, n_commits commit checksums (32 bytes each,
+ *   sorted), then n_entries PruneRefcountsEntry sorted by
+ *   (checksum, objtype).  All integers are big endian.
+ *
+ * If the file is missing or doesn't match the repository (e.g. a dropped
+ * commit has since been deleted by other means), we recompute the counts
+ * from scratch, and prune the same way as a regular refs-only prune.
+ */
+#define _OSTREE_PRUNE_REFCOUNTS_PATH _OSTREE_CACHE_DIR "/prune-refcounts"
+#define _OSTREE_PRUNE_REFCOUNTS_MAGIC "OSTPRRC1"
+
+typedef struct {
+  char magic[8];
+  guint64 n_commits;
+  guint64 n_entries;
+} PruneRefcountsHeader;
+
+typedef struct {
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  guint8 objtype;
+  guint8 reserved[3];
+  guint32 refcount;
+} PruneRefcountsEntry;
+
+G_STATIC_ASSERT (sizeof (PruneRefcountsHeader) == 24);
+G_STATIC_ASSERT (sizeof (PruneRefcountsEntry) == 40);
+
+typedef struct {
+  OstreeRepo *repo;
+  /* Private (copy-on-write) mapping of the saved state */
+  GMappedFile *mfile;
+  PruneRefcountsEntry *entries;
+  guint64 n_entries;
+  /* Commit checksums retained by the last prune */
+  GHashTable *roots;
+  /* PruneRefcountsEntry, for objects not in @entries */
+  GHashTable *new_entries;
+  /* PruneRefcountsEntry whose count dropped to zero */
+  GArray *dead;
+} PruneRefcounts;
+
+static void
+prune_refcounts_clear (PruneRefcounts *rc)
+{
+  g_clear_pointer (&rc->mfile, g_mapped_file_unref);
+  g_clear_pointer (&rc->roots, g_hash_table_unref);
+  g_clear_pointer (&rc->new_entries, g_hash_table_unref);
+  g_clear_pointer (&rc->dead, g_array_unref);
+}
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (PruneRefcounts, prune_refcounts_clear)
+
+static int
+prune_refcounts_entry_compare (gconstpointer a,
+                               gconstpointer b)
+{
+  const PruneRefcountsEntry *entry_a = a;
+  const PruneRefcountsEntry *entry_b = b;
+  int r = memcmp (entry_a->csum, entry_b->csum, OSTREE_SHA256_DIGEST_LEN);
+  if (r != 0)
+    return r;
+  return (int)entry_a->objtype - (int)entry_b->objtype;
+}
+
+static guint
+prune_refcounts_entry_hash (gconstpointer v)
+{
+  const PruneRefcountsEntry *entry = v;
+  guint h;
+  memcpy (&h, entry->csum, sizeof (h));
+  return h ^ entry->objtype;
+}
+
+static gboolean
+prune_refcounts_entry_equal (gconstpointer a,
+                             gconstpointer b)
+{
+  return prune_refcounts_entry_compare (a, b) == 0;
+}
+
+static int
+commit_csum_compare (gconstpointer a,
+                     gconstpointer b)
+{
+  return memcmp (a, b, OSTREE_SHA256_DIGEST_LEN);
+}
+
+static void
+prune_refcounts_init (PruneRefcounts *rc,
+                      OstreeRepo     *repo)
+{
+  rc->repo = repo;
+  rc->roots = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  rc->new_entries = g_hash_table_new_full (prune_refcounts_entry_hash, prune_refcounts_entry_equal,
+                                           g_free, NULL);
+  rc->dead = g_array_new (FALSE, FALSE, sizeof (PruneRefcountsEntry));
+}
+
+/* Load the saved state into @rc; sets @out_loaded to %FALSE if there isn't
+ * a valid one.
+ */
+static gboolean
+prune_refcounts_load (PruneRefcounts  *rc,
+                      gboolean        *out_loaded,
+                      GError         **error)
+{
+  *out_loaded = FALSE;
+
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (rc->repo->tmp_dir_fd, _OSTREE_PRUNE_REFCOUNTS_PATH, &fd, error))
+    return FALSE;
+  if (fd == -1)
+    return TRUE;
+
+  g_autoptr(GMappedFile) mfile = g_mapped_file_new_from_fd (fd, TRUE, error);
+  if (!mfile)
+    return FALSE;
+  char *contents = g_mapped_file_get_contents (mfile);
+  const gsize len = g_mapped_file_get_length (mfile);
+  if (len < sizeof (PruneRefcountsHeader))
+    return TRUE;
+  const PruneRefcountsHeader *header = (const PruneRefcountsHeader*)contents;
+  const guint64 n_commits = GUINT64_FROM_BE (header->n_commits);
+  const guint64 n_entries = GUINT64_FROM_BE (header->n_entries);
+  if (memcmp (header->magic, _OSTREE_PRUNE_REFCOUNTS_MAGIC, sizeof (header->magic)) != 0 ||
+      n_commits > len / OSTREE_SHA256_DIGEST_LEN ||
+      n_entries > len / sizeof (PruneRefcountsEntry) ||
+      len != sizeof (PruneRefcountsHeader) + n_commits * OSTREE_SHA256_DIGEST_LEN +
+             n_entries * sizeof (PruneRefcountsEntry))
+    {
+      g_debug ("Ignoring invalid %s", _OSTREE_PRUNE_REFCOUNTS_PATH);
+      return TRUE;
+    }
+
+  const guint8 *commits = (const guint8*)contents + sizeof (PruneRefcountsHeader);
+  for (guint64 i = 0; i < n_commits; i++)
+    g_hash_table_add (rc->roots, ostree_checksum_from_bytes (commits + i * OSTREE_SHA256_DIGEST_LEN));
+  rc->entries = (PruneRefcountsEntry*)(commits + n_commits * OSTREE_SHA256_DIGEST_LEN);
+  rc->n_entries = n_entries;
+  rc->mfile = g_steal_pointer (&mfile);
+  *out_loaded = TRUE;
+  return TRUE;
+}
+
+/* Find the entry for @key, adding one with a zero count if needed */
+static PruneRefcountsEntry *
+prune_refcounts_lookup (PruneRefcounts            *rc,
+                        const PruneRefcountsEntry *key)
+{
+  guint64 lo = 0;
+  guint64 hi = rc->n_entries;
+  while (lo < hi)
+    {
+      guint64 mid = lo + (hi - lo) / 2;
+      int r = prune_refcounts_entry_compare (key, &rc->entries[mid]);
+      if (r == 0)
+        return &rc->entries[mid];
+      else if (r < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  PruneRefcountsEntry *entry = g_hash_table_lookup (rc->new_entries, key);
+  if (!entry)
+    {
+      entry = g_memdup (key, sizeof (*key));
+      entry->refcount = 0;
+      g_hash_table_add (rc->new_entries, entry);
+    }
+  return entry;
+}
+
+/* The objects a live commit or dirtree holds a reference to */
+static gboolean
+get_object_children (OstreeRepo        *repo,
+                     const guint8      *csum,
+                     OstreeObjectType   objtype,
+                     GArray            *out_children,
+                     GError           **error)
+{
+  char checksum[OSTREE_SHA256_STRING_LEN+1];
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+
+  PruneRefcountsEntry child = { { 0, }, };
+  g_autoptr(GVariant) v = NULL;
+  if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+    {
+      if (!ostree_repo_load_variant (repo, objtype, checksum, &v, error))
+        return FALSE;
+      g_autoptr(GVariant) tree_csum = NULL;
+      g_autoptr(GVariant) meta_csum = NULL;
+      g_variant_get_child (v, 6, "@ay", &tree_csum);
+      g_variant_get_child (v, 7, "@ay", &meta_csum);
+      if (!ostree_validate_structureof_csum_v (tree_csum, error) ||
+          !ostree_validate_structureof_csum_v (meta_csum, error))
+        return FALSE;
+      memcpy (child.csum, ostree_checksum_bytes_peek (tree_csum), OSTREE_SHA256_DIGEST_LEN);
+      child.objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
+      g_array_append_val (out_children, child);
+      memcpy (child.csum, ostree_checksum_bytes_peek (meta_csum), OSTREE_SHA256_DIGEST_LEN);
+      child.objtype = OSTREE_OBJECT_TYPE_DIR_META;
+      g_array_append_val (out_children, child);
+    }
+  else if (objtype == OSTREE_OBJECT_TYPE_DIR_TREE)
+    {
+      if (!ostree_repo_load_variant (repo, objtype, checksum, &v, error))
+        return FALSE;
+      g_autoptr(GVariant) files = g_variant_get_child_value (v, 0);
+      g_autoptr(GVariant) dirs = g_variant_get_child_value (v, 1);
+      const gsize n_files = g_variant_n_children (files);
+      for (gsize i = 0; i < n_files; i++)
+        {
+          g_autoptr(GVariant) file_csum = NULL;
+          g_variant_get_child (files, i, "(&s@ay)", NULL, &file_csum);
+          if (!ostree_validate_structureof_csum_v (file_csum, error))
+            return FALSE;
+          memcpy (child.csum, ostree_checksum_bytes_peek (file_csum), OSTREE_SHA256_DIGEST_LEN);
+          child.objtype = OSTREE_OBJECT_TYPE_FILE;
+          g_array_append_val (out_children, child);
+        }
+      const gsize n_dirs = g_variant_n_children (dirs);
+      for (gsize i = 0; i < n_dirs; i++)
+        {
+          g_autoptr(GVariant) tree_csum = NULL;
+          g_autoptr(GVariant) meta_csum = NULL;
+          g_variant_get_child (dirs, i, "(&s@ay@ay)", NULL, &tree_csum, &meta_csum);
+          if (!ostree_validate_structureof_csum_v (tree_csum, error) ||
+              !ostree_validate_structureof_csum_v (meta_csum, error))
+            return FALSE;
+          memcpy (child.csum, ostree_checksum_bytes_peek (tree_csum), OSTREE_SHA256_DIGEST_LEN);
+          child.objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
+          g_array_append_val (out_children, child);
+          memcpy (child.csum, ostree_checksum_bytes_peek (meta_csum), OSTREE_SHA256_DIGEST_LEN);
+          child.objtype = OSTREE_OBJECT_TYPE_DIR_META;
+          g_array_append_val (out_children, child);
+        }
+    }
+
+  return TRUE;
+}
+
+/* Add (@delta = 1) or drop (@delta = -1) a reference to @commit, following
+ * references from objects which become live or dead in turn.
+ */
+static gboolean
+prune_refcounts_update (PruneRefcounts  *rc,
+                        const char      *commit,
+                        int              delta,
+                        GCancellable    *cancellable,
+                        GError         **error)
+{
+  g_autoptr(GArray) stack = g_array_new (FALSE, FALSE, sizeof (PruneRefcountsEntry));
+  PruneRefcountsEntry key = { { 0, }, };
+  ostree_checksum_inplace_to_bytes (commit, key.csum);
+  key.objtype = OSTREE_OBJECT_TYPE_COMMIT;
+  g_array_append_val (stack, key);
+
+  while (stack->len > 0)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      key = g_array_index (stack, PruneRefcountsEntry, stack->len - 1);
+      g_array_set_size (stack, stack->len - 1);
+
+      PruneRefcountsEntry *entry = prune_refcounts_lookup (rc, &key);
+      guint32 refcount = GUINT32_FROM_BE (entry->refcount);
+      if (delta > 0)
+        {
+          entry->refcount = GUINT32_TO_BE (refcount + 1);
+          if (refcount > 0)
+            continue;
+        }
+      else
+        {
+          if (refcount == 0)
+            {
+              char checksum[OSTREE_SHA256_STRING_LEN+1];
+              ostree_checksum_inplace_from_bytes (key.csum, checksum);
+              return glnx_throw (error, "Unbalanced reference count for %s.%s",
+                                 checksum, ostree_object_type_to_string (key.objtype));
+            }
+          entry->refcount = GUINT32_TO_BE (refcount - 1);
+          if (refcount > 1)
+            continue;
+          g_array_append_val (rc->dead, key);
+        }
+
+      if (!get_object_children (rc->repo, key.csum, key.objtype, stack, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+prune_refcounts_write (PruneRefcounts  *rc,
+                       GHashTable      *retained,
+                       GCancellable    *cancellable,
+                       GError         **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Writing prune reference counts", error);
+  OstreeRepo *self = rc->repo;
+
+  g_autoptr(GArray) commits = g_array_sized_new (FALSE, FALSE, OSTREE_SHA256_DIGEST_LEN,
+                                                 g_hash_table_size (retained));
+  GLNX_HASH_TABLE_FOREACH (retained, const char*, checksum)
+    {
+      guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+      ostree_checksum_inplace_to_bytes (checksum, csum);
+      g_array_append_vals (commits, csum, 1);
+    }
+  g_array_sort (commits, commit_csum_compare);
+
+  g_autoptr(GArray) entries = g_array_sized_new (FALSE, FALSE, sizeof (PruneRefcountsEntry),
+                                                 rc->n_entries + g_hash_table_size (rc->new_entries));
+  for (guint64 i = 0; i < rc->n_entries; i++)
+    {
+      if (rc->entries[i].refcount != 0)
+        g_array_append_val (entries, rc->entries[i]);
+    }
+  GLNX_HASH_TABLE_FOREACH (rc->new_entries, PruneRefcountsEntry*, entry)
+    {
+      if (entry->refcount != 0)
+        g_array_append_val (entries, *entry);
+    }
+  g_array_sort (entries, prune_refcounts_entry_compare);
+
+  if (!glnx_shutil_mkdir_p_at (self->tmp_dir_fd, _OSTREE_CACHE_DIR, 0775, cancellable, error))
+    return FALSE;
+
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  if (!glnx_open_tmpfile_linkable_at (self->tmp_dir_fd, _OSTREE_CACHE_DIR, O_WRONLY | O_CLOEXEC,
+                                      &tmpf, error))
+    return FALSE;
+
+  PruneRefcountsHeader header = { { 0, }, };
+  memcpy (header.magic, _OSTREE_PRUNE_REFCOUNTS_MAGIC, sizeof (header.magic));
+  header.n_commits = GUINT64_TO_BE (commits->len);
+  header.n_entries = GUINT64_TO_BE (entries->len);
+  if (glnx_loop_write (tmpf.fd, &header, sizeof (header)) < 0 ||
+      glnx_loop_write (tmpf.fd, commits->data, commits->len * OSTREE_SHA256_DIGEST_LEN) < 0 ||
+      glnx_loop_write (tmpf.fd, entries->data, entries->len * sizeof (PruneRefcountsEntry)) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+  if (!glnx_fchmod (tmpf.fd, 0644, error))
+    return FALSE;
+  if (!self->disable_fsync && fsync (tmpf.fd) < 0)
+    return glnx_throw_errno_prefix (error, "fsync");
+
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE,
+                             self->tmp_dir_fd, _OSTREE_PRUNE_REFCOUNTS_PATH, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Find the commits reachable from refs, following at most @depth parents,
+ * split into complete and partial ones.  Like
+ * ostree_repo_traverse_reachable_refs(), but without walking trees.
+ */
+static gboolean
+find_retained_commits (OstreeRepo    *self,
+                       int            depth,
+                       GHashTable    *out_complete,
+                       GHashTable    *out_partial,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  g_autoptr(GHashTable) all_refs = NULL;
+  if (!ostree_repo_list_refs (self, NULL, &all_refs, cancellable, error))
+    return FALSE;
+  g_autoptr(GHashTable) all_collection_refs = NULL;
+  if (!ostree_repo_list_collection_refs (self, NULL, &all_collection_refs,
+                                         OSTREE_REPO_LIST_REFS_EXT_EXCLUDE_REMOTES, cancellable, error))
+    return FALSE;
+
+  g_autoptr(GPtrArray) tips = g_ptr_array_new ();
+  GLNX_HASH_TABLE_FOREACH_V (all_refs, const char*, checksum)
+    g_ptr_array_add (tips, (char*)checksum);
+  GLNX_HASH_TABLE_FOREACH_V (all_collection_refs, const char*, checksum)
+    g_ptr_array_add (tips, (char*)checksum);
+
+  for (guint i = 0; i < tips->len; i++)
+    {
+      const char *checksum = tips->pdata[i];
+      g_autofree char *parent = NULL;
+      int remaining = depth;
+
+      while (TRUE)
+        {
+          if (g_hash_table_contains (out_complete, checksum) ||
+              g_hash_table_contains (out_partial, checksum))
+            break;
+
+          g_autoptr(GVariant) commit = NULL;
+          if (!ostree_repo_load_variant_if_exists (self, OSTREE_OBJECT_TYPE_COMMIT,
+                                                   checksum, &commit, error))
+            return FALSE;
+          /* As for traversal, missing parents are expected */
+          if (!commit)
+            break;
+
+          OstreeRepoCommitState commitstate;
+          if (!ostree_repo_load_commit (self, checksum, NULL, &commitstate, error))
+            return FALSE;
+          if (commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+            g_hash_table_add (out_partial, g_strdup (checksum));
+          else
+            g_hash_table_add (out_complete, g_strdup (checksum));
+
+          if (remaining == 0)
+            break;
+          if (remaining > 0)
+            remaining--;
+
+          g_autofree char *next = ostree_commit_get_parent (commit);
+          if (!next)
+            break;
+          g_free (parent);
+          parent = g_steal_pointer (&next);
+          checksum = parent;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Update the reference counts for the commits added to and dropped from
+ * @retained since the last run.
+ */
+static gboolean
+prune_refcounts_apply (PruneRefcounts  *rc,
+                       GHashTable      *retained,
+                       GCancellable    *cancellable,
+                       GError         **error)
+{
+  /* Add references first, so objects moving from a dropped commit to a
+   * new one never reach zero. */
+  GLNX_HASH_TABLE_FOREACH (retained, const char*, checksum)
+    {
+      if (!g_hash_table_contains (rc->roots, checksum) &&
+          !prune_refcounts_update (rc, checksum, 1, cancellable, error))
+        return FALSE;
+    }
+  GLNX_HASH_TABLE_FOREACH (rc->roots, const char*, checksum)
+    {
+      if (!g_hash_table_contains (retained, checksum) &&
+          !prune_refcounts_update (rc, checksum, -1, cancellable, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+repo_prune_incremental (OstreeRepo           *self,
+                        OstreeRepoPruneFlags  flags,
+                        gint                  depth,
+                        gint                 *out_objects_total,
+                        gint                 *out_objects_pruned,
+                        guint64              *out_pruned_object_size_total,
+                        GCancellable         *cancellable,
+                        GError              **error)
+{
+  g_autoptr(GHashTable) retained = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GHashTable) partial = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  if (!find_retained_commits (self, depth, retained, partial, cancellable, error))
+    return FALSE;
+
+  /* Partial commits aren't counted, since we may not be able to walk their
+   * trees; just keep whatever they reference this time around. */
+  g_autoptr(OstreeObjectSet) keep = ostree_object_set_new (0);
+  GLNX_HASH_TABLE_FOREACH (partial, const char*, checksum)
+    {
+      if (!_ostree_repo_traverse_commit_union_set (self, checksum, 0, keep, cancellable, error))
+        return FALSE;
+    }
+
+  g_auto(PruneRefcounts) rc = { NULL, };
+  prune_refcounts_init (&rc, self);
+  gboolean loaded;
+  if (!prune_refcounts_load (&rc, &loaded, error))
+    return FALSE;
+  if (loaded)
+    {
+      g_autoptr(GError) local_error = NULL;
+      if (!prune_refcounts_apply (&rc, retained, cancellable, &local_error))
+        {
+          if (g_cancellable_is_cancelled (cancellable))
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return FALSE;
+            }
+          /* Most likely a dropped commit was deleted by other means */
+          g_debug ("Recomputing prune reference counts: %s", local_error->message);
+          prune_refcounts_clear (&rc);
+          prune_refcounts_init (&rc, self);
+          loaded = FALSE;
+        }
+    }
+
+  if (!loaded)
+    {
+      /* Start from scratch, and fall back to a regular prune against the
+       * objects we found */
+      if (!prune_refcounts_apply (&rc, retained, cancellable, error))
+        return FALSE;
+
+      GLNX_HASH_TABLE_FOREACH (rc.new_entries, PruneRefcountsEntry*, entry)
+        ostree_object_set_add (keep, entry->csum, entry->objtype);
+
+      g_autoptr(OstreeObjectSet) objects = ostree_object_set_new (0);
+      if (!_ostree_repo_list_objects_set (self, OSTREE_REPO_LIST_OBJECTS_LOOSE | OSTREE_REPO_LIST_OBJECTS_NO_PARENTS,
+                                          objects, cancellable, error))
+        return FALSE;
+      if (!repo_prune_set (self, objects, keep, flags, out_objects_total, out_objects_pruned,
+                           out_pruned_object_size_total, cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      OtPruneData data = { 0, };
+      data.repo = self;
+      data.reachable_set = keep;
+
+      for (guint i = 0; i < rc.dead->len; i++)
+        {
+          const PruneRefcountsEntry *entry = &g_array_index (rc.dead, PruneRefcountsEntry, i);
+          char checksum[OSTREE_SHA256_STRING_LEN+1];
+          ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+
+          /* Objects may already be gone, or be in a pack */
+          gboolean is_loose;
+          if (!_ostree_repo_has_loose_object (self, checksum, entry->objtype, &is_loose,
+                                              cancellable, error))
+            return FALSE;
+          if (!is_loose)
+            continue;
+
+          if (!maybe_prune_loose_object (&data, flags, checksum, entry->objtype,
+                                         cancellable, error))
+            return FALSE;
+        }
+
+      if (!prune_finish (self, flags, cancellable, error))
+        return FALSE;
+
+      guint n_live = 0;
+      for (guint64 i = 0; i < rc.n_entries; i++)
+        n_live += (rc.entries[i].refcount != 0);
+      GLNX_HASH_TABLE_FOREACH (rc.new_entries, PruneRefcountsEntry*, entry)
+        n_live += (entry->refcount != 0);
+
+      *out_objects_total = n_live + data.n_reachable_meta + data.n_reachable_content +
+        data.n_unreachable_meta + data.n_unreachable_content;
+      *out_objects_pruned = data.n_unreachable_meta + data.n_unreachable_content;
+      *out_pruned_object_size_total = data.freed_bytes;
+    }
+
+  if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+    {
+      if (!prune_refcounts_write (&rc, retained, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 /**
  * ostree_repo_traverse_reachable_refs:
  * @self: Repo
@@ -383,10 +1060,24 @@ ostree_repo_traverse_reachable_refs (OstreeRepo *self,
  * when combined with @depth, this is a convenient way to delete
  * history from the repository.
  *
+ * With %OSTREE_REPO_PRUNE_FLAGS_INCREMENTAL (which requires
+ * %OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY), reference counts for the objects
+ * reachable from the retained commits are saved in the repository's cache,
+ * and later incremental prunes only walk the commits which were added or
+ * dropped since, and the directories in which they differ from the other
+ * retained ones.  This does not find objects which were never reachable
+ * from a retained commit (for example, left behind by an interrupted
+ * commit), nor unused payload links; run a regular prune occasionally for
+ * those.  The first incremental prune, or one after commits it retained
+ * were deleted by other means, costs the same as a regular one.
+ *
  * Use the %OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE to just determine
  * statistics on objects that would be deleted, without actually
  * deleting them.
  *
+ * Only loose objects are deleted; objects moved into pack files by
+ * ostree_repo_repack() are kept, even when unreachable.
+ *
  * Locking: exclusive
  */
 gboolean
@@ -404,50 +1095,81 @@ ostree_repo_prune (OstreeRepo        *self,
   if (!lock)
     return FALSE;
 
-  g_autoptr(GHashTable) objects = NULL;
-  gboolean refs_only = flags & OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY;
+  if (flags & OSTREE_REPO_PRUNE_FLAGS_INCREMENTAL)
+    {
+      if (!(flags & OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY))
+        return glnx_throw (error, "Incremental prune is only supported with refs-only");
+      return repo_prune_incremental (self, flags, depth, out_objects_total, out_objects_pruned,
+                                     out_pruned_object_size_total, cancellable, error);
+    }
 
-  g_autoptr(GHashTable) reachable = ostree_repo_traverse_new_reachable ();
+  gboolean refs_only = flags & OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY;
 
   /* This original prune API has fixed logic for traversing refs or all commits
    * combined with actually deleting content. The newer backend API just does
-   * the deletion.
+   * the deletion.  Since we don't need to hand the reachable set to anyone,
+   * use the compact representation; the object sets for a large repository
+   * would otherwise take gigabytes as hash tables of serialized names.
    */
+  g_autoptr(OstreeObjectSet) objects = ostree_object_set_new (0);
+  if (!_ostree_repo_list_objects_set (self, OSTREE_REPO_LIST_OBJECTS_LOOSE | OSTREE_REPO_LIST_OBJECTS_NO_PARENTS,
+                                      objects, cancellable, error))
+    return FALSE;
+
+  g_autoptr(OstreeObjectSet) reachable = ostree_object_set_new (0);
+  g_autoptr(GPtrArray) commits = g_ptr_array_new_with_free_func (g_free);
 
   if (refs_only)
     {
-      if (!ostree_repo_traverse_reachable_refs (self, depth, reachable, cancellable, error))
+      g_autoptr(GHashTable) retained = g_hash_table_new (g_str_hash, g_str_equal);
+      g_autoptr(GHashTable) all_refs = NULL;  /* (element-type utf8 utf8) */
+      if (!ostree_repo_list_refs (self, NULL, &all_refs, cancellable, error))
         return FALSE;
-    }
+      GLNX_HASH_TABLE_FOREACH_V (all_refs, const char*, checksum)
+        g_hash_table_add (retained, (char*)checksum);
 
-  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_ALL | OSTREE_REPO_LIST_OBJECTS_NO_PARENTS,
-                                 &objects, cancellable, error))
-    return FALSE;
+      g_autoptr(GHashTable) all_collection_refs = NULL;  /* (element-type OstreeChecksumRef utf8) */
+      if (!ostree_repo_list_collection_refs (self, NULL, &all_collection_refs,
+                                             OSTREE_REPO_LIST_REFS_EXT_EXCLUDE_REMOTES, cancellable, error))
+        return FALSE;
+      GLNX_HASH_TABLE_FOREACH_V (all_collection_refs, const char*, checksum)
+        g_hash_table_add (retained, (char*)checksum);
 
-  if (!refs_only)
+      GLNX_HASH_TABLE_FOREACH (retained, const char*, checksum)
+        g_ptr_array_add (commits, g_strdup (checksum));
+    }
+  else
     {
-      GLNX_HASH_TABLE_FOREACH (objects, GVariant*, serialized_key)
+      /* Commits may also be packed */
+      g_autoptr(OstreeObjectSet) packed = ostree_object_set_new (0);
+      if (!_ostree_repo_list_objects_set (self, OSTREE_REPO_LIST_OBJECTS_PACKED | OSTREE_REPO_LIST_OBJECTS_NO_PARENTS,
+                                          packed, cancellable, error))
+        return FALSE;
+
+      OstreeObjectSet *sets[] = { objects, packed };
+      for (guint i = 0; i < G_N_ELEMENTS (sets); i++)
         {
-          const char *checksum;
+          gsize iter = 0;
+          const guint8 *csum;
           OstreeObjectType objtype;
-
-          ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
-
-          if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
-            continue;
-
-          g_debug ("Finding objects to keep for commit %s", checksum);
-          if (!ostree_repo_traverse_commit_union (self, checksum, depth, reachable,
-                                                  cancellable, error))
-            return FALSE;
+          while (ostree_object_set_iter_next (sets[i], &iter, &csum, &objtype))
+            {
+              if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+                g_ptr_array_add (commits, ostree_checksum_from_bytes (csum));
+            }
         }
     }
+  g_ptr_array_add (commits, NULL);
+
+  g_debug ("Finding objects to keep for %u commits", commits->len - 1);
+  if (!_ostree_repo_traverse_commits_union_set_parallel (self, (const char * const *)commits->pdata,
+                                                         depth, reachable, 0,
+                                                         cancellable, error))
+    return FALSE;
 
-  { OstreeRepoPruneOptions opts = { flags, reachable };
-    return repo_prune_internal (self, objects, &opts,
-                                out_objects_total, out_objects_pruned,
-                                out_pruned_object_size_total, cancellable, error);
-  }
+  return repo_prune_set (self, objects, reachable, flags,
+                         out_objects_total, out_objects_pruned,
+                         out_pruned_object_size_total, cancellable, error);
 }
 
 /**
@@ -31,6 +31,9 @@
 #include "otutil.h"
 #include "ostree-repo-pull-private.h"
 #include "ostree-repo-private.h"
+#include "ostree-repo-pack-private.h"
+#include "ostree-repo-summary-index-private.h"
+#include "ostree-adaptive-limit-private.h"
 
 #ifdef HAVE_LIBCURL_OR_LIBSOUP
 
@@ -49,6 +52,7 @@
 #endif  /* HAVE_AVAHI */
 
 #include <gio/gunixinputstream.h>
+#include <sys/resource.h>
 #include <sys/statvfs.h>
 #ifdef HAVE_LIBSYSTEMD
 #include <systemd/sd-journal.h>
@@ -78,6 +82,7 @@ typedef struct {
   char          *remote_name;
   char          *remote_refspec_name;
   OstreeRepoMode remote_mode;
+  OstreeArchiveCompression remote_archive_compression;
   OstreeFetcher *fetcher;
   OstreeFetcherSecurityState fetcher_security_state;
 
@@ -128,12 +133,22 @@ typedef struct {
   GHashTable       *pending_fetch_content; /* Map<checksum,FetchObjectData> */
   GHashTable       *pending_fetch_delta_superblocks; /* Set<FetchDeltaSuperData> */
   GHashTable       *pending_fetch_deltaparts; /* Set<FetchStaticDeltaData> */
+  GPtrArray        *remote_packs; /* Array<RemotePack>, from the summary */
+  guint             n_queued_pack_objects; /* Objects waiting in remote_packs */
+  GSource          *pack_fetch_src;
   guint             n_outstanding_metadata_fetches;
   guint             n_outstanding_metadata_write_requests;
   guint             n_outstanding_content_fetches;
   guint             n_outstanding_content_write_requests;
   guint             n_outstanding_deltapart_fetches;
   guint             n_outstanding_deltapart_write_requests;
+  GQueue            deltaparts_to_apply; /* FetchStaticDeltaData, downloaded */
+  GThreadPool      *deltapart_pool; /* Decompresses and executes delta parts */
+  guint             max_deltapart_jobs;
+  guint64           deltapart_memory_budget;
+  guint64           deltapart_memory_in_use; /* usize of the parts being applied */
+  OstreeAdaptiveLimit fetch_limit; /* Bounds all outstanding fetches */
+  OstreeAdaptiveLimit write_limit; /* Bounds all outstanding writes */
   guint             n_total_deltaparts;
   guint             n_total_delta_fallbacks;
   guint64           fetched_deltapart_size; /* How much of the delta we have now */
@@ -152,6 +167,7 @@ typedef struct {
   gboolean          timestamp_check; /* Verify commit timestamps */
   int               maxdepth;
   guint64           max_metadata_size;
+  guint64           max_pack_index_size;
   guint64           start_time;
 
   gboolean          is_mirror;
@@ -173,6 +189,19 @@ typedef struct {
   GSource *idle_src;
 } OtPullData;
 
+/* A pack published by the remote (see ostree-repo-pack-private.h); wanted
+ * objects found in its index are queued here, and fetched in batches of
+ * byte ranges by start_fetch_pack_ranges().
+ */
+typedef struct {
+  char *checksum;
+  GBytes *index;
+  const OstreePackIndexEntry *entries;
+  guint64 n_entries;
+  GPtrArray *queued_metadata; /* Array<FetchObjectData> */
+  GPtrArray *queued_content; /* Array<FetchObjectData> */
+} RemotePack;
+
 typedef struct {
   OtPullData  *pull_data;
   GVariant    *object;
@@ -186,8 +215,27 @@ typedef struct {
 
   OstreeCollectionRef *requested_ref;  /* (nullable) */
   guint n_retries_remaining;
+
+  guint64 start_time; /* When the current fetch or write started */
+
+  /* Set if the object is to be fetched from a pack */
+  RemotePack *pack;
+  guint64 pack_offset;
+  guint64 pack_size;
+  gboolean skip_packs;
 } FetchObjectData;
 
+typedef struct {
+  OtPullData *pull_data;
+  RemotePack *pack;
+  gboolean is_meta;
+  guint64 offset;
+  guint64 length;
+  GPtrArray *objects; /* Array<FetchObjectData> */
+  guint n_retries_remaining;
+  guint64 start_time;
+} FetchPackRangeData;
+
 typedef struct {
   OtPullData  *pull_data;
   GVariant *objects;
@@ -196,7 +244,15 @@ typedef struct {
   char *to_revision;
   guint i;
   guint64 size;
+  guint64 usize;
   guint n_retries_remaining;
+
+  /* Set once the part is available locally */
+  GInputStream *part_in;
+  GBytes *inline_part_bytes;
+  GBytes *dictionary; /* zstd dictionary from the superblock, if any */
+  OstreeStaticDeltaOpenFlags open_flags;
+  GError *apply_error; /* Set by the thread applying the part */
 } FetchStaticDeltaData;
 
 typedef struct {
@@ -228,6 +284,8 @@ static void start_fetch_deltapart (OtPullData *pull_data,
 static void start_fetch_delta_superblock (OtPullData          *pull_data,
                                           FetchDeltaSuperData *fetch_data);
 static gboolean fetcher_queue_is_full (OtPullData *pull_data);
+static void fetch_static_delta_data_free (gpointer data);
+static gboolean on_static_delta_applied (gpointer user_data);
 static void queue_scan_one_metadata_object (OtPullData                *pull_data,
                                             const char                *csum,
                                             OstreeObjectType           objtype,
@@ -260,6 +318,10 @@ static gboolean scan_one_metadata_object (OtPullData                 *pull_data,
                                           GCancellable               *cancellable,
                                           GError                    **error);
 static void scan_object_queue_data_free (ScanObjectQueueData *scan_data);
+static void ensure_pack_fetch_queued (OtPullData *pull_data);
+static void clear_queued_pack_objects (OtPullData *pull_data);
+static gboolean validate_variant_is_csum (GVariant       *csum,
+                                          GError        **error);
 static gboolean
 gpg_verify_unwritten_commit (OtPullData                 *pull_data,
                              const char                 *checksum,
@@ -306,6 +368,11 @@ update_progress (gpointer user_data)
   ostree_async_progress_set (pull_data->progress,
                              "outstanding-fetches", "u", outstanding_fetches,
                              "outstanding-writes", "u", outstanding_writes,
+                             /* The current limits chosen by the adaptive scheduler */
+                             "max-outstanding-fetches", "u",
+                                  _ostree_adaptive_limit_get (&pull_data->fetch_limit),
+                             "max-outstanding-writes", "u",
+                                  _ostree_adaptive_limit_get (&pull_data->write_limit),
                              "fetched", "u", fetched,
                              "requested", "u", requested,
                              "scanning", "u", g_queue_is_empty (&pull_data->scan_object_queue) ? 0 : 1,
@@ -354,10 +421,12 @@ pull_termination_condition (OtPullData          *pull_data)
 {
   gboolean current_fetch_idle = (pull_data->n_outstanding_metadata_fetches == 0 &&
                                  pull_data->n_outstanding_content_fetches == 0 &&
-                                 pull_data->n_outstanding_deltapart_fetches == 0);
+                                 pull_data->n_outstanding_deltapart_fetches == 0 &&
+                                 pull_data->n_queued_pack_objects == 0);
   gboolean current_write_idle = (pull_data->n_outstanding_metadata_write_requests == 0 &&
                                  pull_data->n_outstanding_content_write_requests == 0 &&
-                                 pull_data->n_outstanding_deltapart_write_requests == 0 );
+                                 pull_data->n_outstanding_deltapart_write_requests == 0 &&
+                                 g_queue_is_empty (&pull_data->deltaparts_to_apply));
   gboolean current_scan_idle = g_queue_is_empty (&pull_data->scan_object_queue);
   gboolean current_idle = current_fetch_idle && current_write_idle && current_scan_idle;
 
@@ -407,7 +476,10 @@ check_outstanding_requests_handle_error (OtPullData          *pull_data,
       g_hash_table_remove_all (pull_data->pending_fetch_metadata);
       g_hash_table_remove_all (pull_data->pending_fetch_delta_superblocks);
       g_hash_table_remove_all (pull_data->pending_fetch_deltaparts);
+      g_queue_foreach (&pull_data->deltaparts_to_apply, (GFunc) fetch_static_delta_data_free, NULL);
+      g_queue_clear (&pull_data->deltaparts_to_apply);
       g_hash_table_remove_all (pull_data->pending_fetch_content);
+      clear_queued_pack_objects (pull_data);
     }
   else
     {
@@ -451,6 +523,7 @@ check_outstanding_requests_handle_error (OtPullData          *pull_data,
       /* Now, process deltapart requests */
       g_hash_table_iter_init (&hiter, pull_data->pending_fetch_deltaparts);
       while (!fetcher_queue_is_full (pull_data) &&
+             !deltapart_queue_is_full (pull_data) &&
              g_hash_table_iter_next (&hiter, &key, &value))
         {
           FetchStaticDeltaData *fetch = key;
@@ -476,13 +549,18 @@ check_outstanding_requests_handle_error (OtPullData          *pull_data,
           g_free (checksum);
         }
 
+      /* Objects queued for fetching from packs are batched up from an idle */
+      if (pull_data->n_queued_pack_objects > 0)
+        ensure_pack_fetch_queued (pull_data);
     }
 }
 
 /* We have a total-request limit, as well has a hardcoded max of 2 for delta
  * parts. The logic for the delta one is that processing them is expensive, and
  * doing multiple simultaneously could risk space/memory on smaller devices. We
- * also throttle on outstanding writes in case fetches are faster.
+ * also throttle on outstanding writes in case fetches are faster.  The request
+ * and write limits adapt to the observed network and disk performance; see
+ * init_concurrency_limits().
  */
 static gboolean
 fetcher_queue_is_full (OtPullData *pull_data)
@@ -490,17 +568,182 @@ fetcher_queue_is_full (OtPullData *pull_data)
   const gboolean fetch_full =
       ((pull_data->n_outstanding_metadata_fetches +
         pull_data->n_outstanding_content_fetches +
-        pull_data->n_outstanding_deltapart_fetches) ==
-         _OSTREE_MAX_OUTSTANDING_FETCHER_REQUESTS);
-  const gboolean deltas_full =
-      (pull_data->n_outstanding_deltapart_fetches ==
-        _OSTREE_MAX_OUTSTANDING_DELTAPART_REQUESTS);
+        pull_data->n_outstanding_deltapart_fetches) >=
+         _ostree_adaptive_limit_get (&pull_data->fetch_limit));
+  /* Delta parts being applied are bounded by deltapart_queue_is_full() */
   const gboolean writes_full =
       ((pull_data->n_outstanding_metadata_write_requests +
-        pull_data->n_outstanding_content_write_requests +
-        pull_data->n_outstanding_deltapart_write_requests) >=
-         _OSTREE_MAX_OUTSTANDING_WRITE_REQUESTS);
-  return fetch_full || deltas_full || writes_full;
+        pull_data->n_outstanding_content_write_requests) >=
+         _ostree_adaptive_limit_get (&pull_data->write_limit));
+  return fetch_full || writes_full;
+}
+
+/* Whether we should hold off on downloading more delta parts.  We stay at
+ * most one round of jobs ahead of the threads applying them.
+ */
+static gboolean
+deltapart_queue_is_full (OtPullData *pull_data)
+{
+  return (pull_data->n_outstanding_deltapart_fetches +
+          pull_data->deltaparts_to_apply.length) >=
+    MAX (pull_data->max_deltapart_jobs, _OSTREE_MIN_OUTSTANDING_DELTAPART_REQUESTS);
+}
+
+/* Feed the outcome of a fetch started at @start_time into the fetch limit */
+static void
+fetch_limit_update (OtPullData   *pull_data,
+                    guint64       start_time,
+                    const GError *error)
+{
+  if (error == NULL)
+    {
+      const guint64 now = g_get_monotonic_time ();
+      _ostree_adaptive_limit_sample (&pull_data->fetch_limit, now, now - start_time,
+                                     _ostree_fetcher_bytes_transferred (pull_data->fetcher));
+    }
+  /* Timeouts and server errors are our equivalent of packet loss */
+  else if (_ostree_fetcher_should_retry_request (error, 1))
+    _ostree_adaptive_limit_backoff (&pull_data->fetch_limit);
+}
+
+static void
+write_limit_update (OtPullData *pull_data,
+                    guint64     start_time)
+{
+  const guint64 now = g_get_monotonic_time ();
+  _ostree_adaptive_limit_sample (&pull_data->write_limit, now, now - start_time, 0);
+}
+
+/* Parse an optional positive integer @option_name of @remote_name; leaves
+ * @out_value untouched if it isn't set.
+ */
+static gboolean
+get_remote_uint_option (OstreeRepo  *self,
+                        const char  *remote_name,
+                        const char  *option_name,
+                        guint       *out_value,
+                        GError     **error)
+{
+  g_autofree char *value_str = NULL;
+  if (!ostree_repo_get_remote_option (self, remote_name, option_name, NULL,
+                                      &value_str, error))
+    return FALSE;
+  if (value_str == NULL)
+    return TRUE;
+
+  char *endp = NULL;
+  guint64 value = g_ascii_strtoull (value_str, &endp, 10);
+  if (endp == value_str || *endp != '\0' || value == 0 || value > G_MAXUINT)
+    return glnx_throw (error, "Invalid value '%s' for option %s of remote %s",
+                       value_str, option_name, remote_name);
+  *out_value = value;
+  return TRUE;
+}
+
+/* How much uncompressed delta data we allow to be applied at once */
+static guint64
+get_deltapart_memory_budget (void)
+{
+  const long n_pages = sysconf (_SC_PHYS_PAGES);
+  const long page_size = sysconf (_SC_PAGESIZE);
+  if (n_pages <= 0 || page_size <= 0)
+    return _OSTREE_DELTAPART_DEFAULT_MEMORY_BUDGET;
+  return ((guint64) n_pages * page_size) / _OSTREE_DELTAPART_MEMORY_FRACTION;
+}
+
+/* Each outstanding fetch holds up to two file descriptors (its connection
+ * and the temporary file it downloads to), and so does each outstanding write
+ * (the downloaded file and the object being written).  We don't raise
+ * RLIMIT_NOFILE behind the application's back; instead the fetch and write
+ * maximums are each kept to 1/16 of the soft limit, so that between them they
+ * use at most a quarter of it and leave the rest to the application and the
+ * HTTP library.  With the usual soft limit of 1024 that is the full 64 of
+ * each; a lower limit lowers the maximums rather than risking EMFILE.
+ */
+static guint
+get_fd_limited_concurrency (void)
+{
+  struct rlimit rl;
+  if (getrlimit (RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY)
+    return G_MAXUINT;
+  return (guint) MIN (MAX (rl.rlim_cur / 16, 1), G_MAXUINT);
+}
+
+/* Set up the fetch and write limits, taking into account the configuration
+ * of @remote_name (if any), and the limits for applying delta parts.
+ */
+static gboolean
+init_concurrency_limits (OtPullData  *pull_data,
+                         const char  *remote_name,
+                         GError     **error)
+{
+  gboolean adaptive = TRUE;
+  guint max_fetches = 0;
+  guint max_writes = 0;
+  guint max_deltaparts = 0;
+
+  if (remote_name != NULL)
+    {
+      if (!ostree_repo_get_remote_boolean_option (pull_data->repo, remote_name,
+                                                  "adaptive-concurrency", TRUE,
+                                                  &adaptive, error))
+        return FALSE;
+      if (!get_remote_uint_option (pull_data->repo, remote_name,
+                                   "max-concurrent-fetches", &max_fetches, error))
+        return FALSE;
+      if (!get_remote_uint_option (pull_data->repo, remote_name,
+                                   "max-concurrent-writes", &max_writes, error))
+        return FALSE;
+      if (!get_remote_uint_option (pull_data->repo, remote_name,
+                                   "max-concurrent-delta-parts", &max_deltaparts, error))
+        return FALSE;
+    }
+
+  /* Beyond this we'd only be fighting the HTTP session's own limits */
+  max_fetches = MIN (max_fetches, _OSTREE_MAX_OUTSTANDING_FETCHER_REQUESTS);
+
+  if (adaptive)
+    {
+      if (max_fetches == 0)
+        max_fetches = _OSTREE_MAX_OUTSTANDING_FETCHER_REQUESTS;
+      if (max_writes == 0)
+        max_writes = _OSTREE_MAX_OUTSTANDING_WRITE_REQUESTS;
+    }
+
+  /* Configured maximums are clamped too; a value of 0 (unset) stays 0 */
+  const guint fd_max = get_fd_limited_concurrency ();
+  max_fetches = MIN (max_fetches, fd_max);
+  max_writes = MIN (max_writes, fd_max);
+
+  if (adaptive)
+    {
+      _ostree_adaptive_limit_init (&pull_data->fetch_limit,
+                                   _OSTREE_INITIAL_OUTSTANDING_FETCHER_REQUESTS,
+                                   MIN (_OSTREE_MIN_OUTSTANDING_FETCHER_REQUESTS, max_fetches),
+                                   max_fetches);
+      _ostree_adaptive_limit_init (&pull_data->write_limit,
+                                   _OSTREE_INITIAL_OUTSTANDING_WRITE_REQUESTS,
+                                   MIN (_OSTREE_MIN_OUTSTANDING_WRITE_REQUESTS, max_writes),
+                                   max_writes);
+    }
+  else
+    {
+      /* Use the configured maximums as-is, or the historical fixed limits */
+      _ostree_adaptive_limit_set_fixed (&pull_data->fetch_limit,
+                                        max_fetches ?: _OSTREE_INITIAL_OUTSTANDING_FETCHER_REQUESTS);
+      _ostree_adaptive_limit_set_fixed (&pull_data->write_limit,
+                                        max_writes ?: _OSTREE_INITIAL_OUTSTANDING_WRITE_REQUESTS);
+    }
+
+  /* Applying delta parts is CPU-bound; see start_deltapart_applies() */
+  pull_data->max_deltapart_jobs = max_deltaparts ?: MAX (g_get_num_processors (), 1);
+  pull_data->deltapart_memory_budget = get_deltapart_memory_budget ();
+
+  g_debug ("Outstanding request limits: fetches %u-%u, writes %u-%u%s, delta parts %u",
+           pull_data->fetch_limit.min, pull_data->fetch_limit.max,
+           pull_data->write_limit.min, pull_data->write_limit.max,
+           adaptive ? "" : " (fixed)", pull_data->max_deltapart_jobs);
+  return TRUE;
 }
 
 static void
@@ -1054,12 +1297,63 @@ content_fetch_on_write_complete (GObject        *object,
   if (g_hash_table_remove (pull_data->requested_fallback_content, expected_checksum))
     pull_data->n_fetched_deltapart_fallbacks++;
  out:
+  write_limit_update (pull_data, fetch_data->start_time);
   pull_data->n_outstanding_content_write_requests--;
   /* No retries for local writes. */
   check_outstanding_requests_handle_error (pull_data, &local_error);
   fetch_object_data_free (fetch_data);
 }
 
+/* Parse @input, a fetched archive-format content object of @size bytes, and
+ * start writing it into the repo; the checksum is verified on completion.
+ * Takes ownership of @fetch_data on success.
+ */
+static gboolean
+write_fetched_content (OtPullData      *pull_data,
+                       FetchObjectData *fetch_data,
+                       GInputStream    *input,
+                       guint64          size,
+                       GCancellable    *cancellable,
+                       GError         **error)
+{
+  const char *checksum;
+  OstreeObjectType objtype;
+  guint64 length;
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GInputStream) file_in = NULL;
+  g_autoptr(GInputStream) object_input = NULL;
+
+  ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
+  g_assert (objtype == OSTREE_OBJECT_TYPE_FILE);
+
+  /* If it appears corrupted, we'll delete it below */
+  if (!_ostree_archive_stream_parse (pull_data->remote_archive_compression,
+                                     input, size, FALSE,
+                                     &file_in, &file_info, &xattrs,
+                                     cancellable, error))
+    return FALSE;
+
+  if ((pull_data->importflags & _OSTREE_REPO_IMPORT_FLAGS_VERIFY_BAREUSERONLY) > 0)
+    {
+      if (!_ostree_validate_bareuseronly_mode_finfo (file_info, checksum, error))
+        return FALSE;
+    }
+
+  if (!ostree_raw_file_to_content_stream (file_in, file_info, xattrs,
+                                          &object_input, &length,
+                                          cancellable, error))
+    return FALSE;
+
+  fetch_data->start_time = g_get_monotonic_time ();
+  pull_data->n_outstanding_content_write_requests++;
+  ostree_repo_write_content_async (pull_data->repo, checksum,
+                                   object_input, length,
+                                   cancellable,
+                                   content_fetch_on_write_complete, fetch_data);
+  return TRUE;
+}
+
 static void
 content_fetch_on_complete (GObject        *object,
                            GAsyncResult   *result,
@@ -1071,19 +1365,16 @@ content_fetch_on_complete (GObject        *object,
   g_autoptr(GError) local_error = NULL;
   GError **error = &local_error;
   GCancellable *cancellable = NULL;
-  guint64 length;
   g_auto(GLnxTmpfile) tmpf = { 0, };
   g_autoptr(GInputStream) tmpf_input = NULL;
-  g_autoptr(GFileInfo) file_info = NULL;
-  g_autoptr(GVariant) xattrs = NULL;
-  g_autoptr(GInputStream) file_in = NULL;
-  g_autoptr(GInputStream) object_input = NULL;
   const char *checksum;
   g_autofree char *checksum_obj = NULL;
   OstreeObjectType objtype;
   gboolean free_fetch_data = TRUE;
 
-  if (!_ostree_fetcher_request_to_tmpfile_finish (fetcher, result, &tmpf, error))
+  const gboolean fetched = _ostree_fetcher_request_to_tmpfile_finish (fetcher, result, &tmpf, error);
+  fetch_limit_update (pull_data, fetch_data->start_time, local_error);
+  if (!fetched)
     goto out;
 
   ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
@@ -1114,28 +1405,9 @@ content_fetch_on_complete (GObject        *object,
       /* Non-mirroring path */
       tmpf_input = g_unix_input_stream_new (glnx_steal_fd (&tmpf.fd), TRUE);
 
-      /* If it appears corrupted, we'll delete it below */
-      if (!ostree_content_stream_parse (TRUE, tmpf_input, stbuf.st_size, FALSE,
-                                        &file_in, &file_info, &xattrs,
-                                        cancellable, error))
-        goto out;
-
-      if (verifying_bareuseronly)
-        {
-          if (!_ostree_validate_bareuseronly_mode_finfo (file_info, checksum, error))
-            goto out;
-        }
-
-      if (!ostree_raw_file_to_content_stream (file_in, file_info, xattrs,
-                                              &object_input, &length,
-                                              cancellable, error))
+      if (!write_fetched_content (pull_data, fetch_data, tmpf_input, stbuf.st_size,
+                                  cancellable, error))
         goto out;
-
-      pull_data->n_outstanding_content_write_requests++;
-      ostree_repo_write_content_async (pull_data->repo, checksum,
-                                       object_input, length,
-                                       cancellable,
-                                       content_fetch_on_write_complete, fetch_data);
       free_fetch_data = FALSE;
     }
 
@@ -1190,6 +1462,7 @@ on_metadata_written (GObject           *object,
   queue_scan_one_metadata_object_c (pull_data, csum, objtype, fetch_data->path, 0, fetch_data->requested_ref);
 
  out:
+  write_limit_update (pull_data, fetch_data->start_time);
   g_assert (pull_data->n_outstanding_metadata_write_requests > 0);
   pull_data->n_outstanding_metadata_write_requests--;
   fetch_object_data_free (fetch_data);
@@ -1198,6 +1471,64 @@ on_metadata_written (GObject           *object,
   check_outstanding_requests_handle_error (pull_data, &local_error);
 }
 
+/* Verify a fetched metadata object and start writing it into the repo.
+ * Takes ownership of @fetch_data on success.
+ */
+static gboolean
+write_fetched_metadata (OtPullData      *pull_data,
+                        FetchObjectData *fetch_data,
+                        GVariant        *metadata,
+                        GError         **error)
+{
+  const char *checksum;
+  OstreeObjectType objtype;
+
+  ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
+
+  /* Compute checksum and verify structure now. Note this is a recent change
+   * (Jan 2018) - we used to verify the checksum only when writing down
+   * below. But we want to do "structure" verification early on as well
+   * before the object is written even to the staging directory.
+   */
+  if (!_ostree_verify_metadata_object (objtype, checksum, metadata, error))
+    return FALSE;
+
+  /* For commit objects, check the GPG signature before writing to the repo,
+   * and also write the .commitpartial to say that we're still processing
+   * this commit.
+   */
+  if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+    {
+      /* Do GPG verification. `detached_data` may be NULL if no detached
+       * metadata was found during pull; that's handled by
+       * gpg_verify_unwritten_commit(). If we ever change the pull code to
+       * not always fetch detached metadata, this bit will have to learn how
+       * to look up from the disk state as well, or insert the on-disk
+       * metadata into this hash.
+       */
+      GVariant *detached_data = g_hash_table_lookup (pull_data->fetched_detached_metadata, checksum);
+      if (!gpg_verify_unwritten_commit (pull_data, checksum, metadata, detached_data,
+                                        fetch_data->requested_ref, pull_data->cancellable, error))
+        return FALSE;
+
+      if (!ostree_repo_mark_commit_partial (pull_data->repo, checksum, TRUE, error))
+        return FALSE;
+    }
+
+  /* Note that we now (Jan 2018) pass NULL for checksum, which means "don't
+   * verify checksum", since we just did it above. Related to this...now
+   * that we're doing all the verification here, one thing we could do later
+   * just `glnx_link_tmpfile_at()` into the repository, like the content
+   * fetch path does for trusted commits.
+   */
+  fetch_data->start_time = g_get_monotonic_time ();
+  ostree_repo_write_metadata_async (pull_data->repo, objtype, NULL, metadata,
+                                    pull_data->cancellable,
+                                    on_metadata_written, fetch_data);
+  pull_data->n_outstanding_metadata_write_requests++;
+  return TRUE;
+}
+
 static void
 meta_fetch_on_complete (GObject           *object,
                         GAsyncResult      *result,
@@ -1220,7 +1551,9 @@ meta_fetch_on_complete (GObject           *object,
   g_debug ("fetch of %s%s complete", checksum_obj,
            fetch_data->is_detached_meta ? " (detached)" : "");
 
-  if (!_ostree_fetcher_request_to_tmpfile_finish (fetcher, result, &tmpf, error))
+  const gboolean fetched = _ostree_fetcher_request_to_tmpfile_finish (fetcher, result, &tmpf, error);
+  fetch_limit_update (pull_data, fetch_data->start_time, local_error);
+  if (!fetched)
     {
       if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
         {
@@ -1286,46 +1619,8 @@ meta_fetch_on_complete (GObject           *object,
                                FALSE, &metadata, error))
         goto out;
 
-      /* Compute checksum and verify structure now. Note this is a recent change
-       * (Jan 2018) - we used to verify the checksum only when writing down
-       * below. But we want to do "structure" verification early on as well
-       * before the object is written even to the staging directory.
-       */
-      if (!_ostree_verify_metadata_object (objtype, checksum, metadata, error))
+      if (!write_fetched_metadata (pull_data, fetch_data, metadata, error))
         goto out;
-
-      /* For commit objects, check the GPG signature before writing to the repo,
-       * and also write the .commitpartial to say that we're still processing
-       * this commit.
-       */
-      if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
-        {
-          /* Do GPG verification. `detached_data` may be NULL if no detached
-           * metadata was found during pull; that's handled by
-           * gpg_verify_unwritten_commit(). If we ever change the pull code to
-           * not always fetch detached metadata, this bit will have to learn how
-           * to look up from the disk state as well, or insert the on-disk
-           * metadata into this hash.
-           */
-          GVariant *detached_data = g_hash_table_lookup (pull_data->fetched_detached_metadata, checksum);
-          if (!gpg_verify_unwritten_commit (pull_data, checksum, metadata, detached_data,
-                                            fetch_data->requested_ref, pull_data->cancellable, error))
-            goto out;
-
-          if (!ostree_repo_mark_commit_partial (pull_data->repo, checksum, TRUE, error))
-            goto out;
-        }
-
-      /* Note that we now (Jan 2018) pass NULL for checksum, which means "don't
-       * verify checksum", since we just did it above. Related to this...now
-       * that we're doing all the verification here, one thing we could do later
-       * just `glnx_link_tmpfile_at()` into the repository, like the content
-       * fetch path does for trusted commits.
-       */
-      ostree_repo_write_metadata_async (pull_data->repo, objtype, NULL, metadata,
-                                        pull_data->cancellable,
-                                        on_metadata_written, fetch_data);
-      pull_data->n_outstanding_metadata_write_requests++;
       free_fetch_data = FALSE;
     }
 
@@ -1349,6 +1644,10 @@ static void
 fetch_static_delta_data_free (gpointer  data)
 {
   FetchStaticDeltaData *fetch_data = data;
+  g_clear_object (&fetch_data->part_in);
+  g_clear_pointer (&fetch_data->inline_part_bytes, (GDestroyNotify) g_bytes_unref);
+  g_clear_pointer (&fetch_data->dictionary, (GDestroyNotify) g_bytes_unref);
+  g_clear_error (&fetch_data->apply_error);
   g_free (fetch_data->expected_checksum);
   g_variant_unref (fetch_data->objects);
   g_free (fetch_data->from_revision);
@@ -1356,28 +1655,112 @@ fetch_static_delta_data_free (gpointer  data)
   g_free (fetch_data);
 }
 
+/* Static delta parts are applied as a pipeline: parts are downloaded (see
+ * deltapart_queue_is_full()), then queued in deltaparts_to_apply until a
+ * thread in deltapart_pool is free to decompress and execute them.  Each of
+ * those threads handles one part at a time, so with several parts in flight
+ * the download, decompression and execution of different parts overlap.
+ *
+ * The number of threads is the number of CPUs, and decompressed parts are
+ * held in memory (or at least, in the page cache) while they're executed,
+ * so we also bound the total uncompressed size of the parts being applied.
+ */
 static void
-on_static_delta_written (GObject           *object,
-                         GAsyncResult      *result,
-                         gpointer           user_data)
+deltapart_apply_thread (gpointer data,
+                        gpointer user_data)
+{
+  FetchStaticDeltaData *fetch_data = data;
+  OtPullData *pull_data = user_data;
+  g_autoptr(GVariant) part = NULL;
+
+  if (_ostree_static_delta_part_open (fetch_data->part_in, fetch_data->inline_part_bytes,
+                                      fetch_data->open_flags, fetch_data->dictionary,
+                                      fetch_data->expected_checksum,
+                                      &part, pull_data->cancellable, &fetch_data->apply_error))
+    (void) _ostree_static_delta_part_execute (pull_data->repo, fetch_data->objects, part,
+                                              FALSE, NULL, pull_data->cancellable,
+                                              &fetch_data->apply_error);
+
+  /* Free the part (and close the fd) in this thread, before handing back */
+  g_clear_pointer (&part, (GDestroyNotify) g_variant_unref);
+  g_clear_object (&fetch_data->part_in);
+  g_clear_pointer (&fetch_data->inline_part_bytes, (GDestroyNotify) g_bytes_unref);
+
+  g_main_context_invoke (pull_data->main_context, on_static_delta_applied, fetch_data);
+}
+
+/* Hand queued parts to the apply threads, as far as the limits allow */
+static gboolean
+start_deltapart_applies (OtPullData  *pull_data,
+                         GError     **error)
+{
+  while (!g_queue_is_empty (&pull_data->deltaparts_to_apply) &&
+         pull_data->n_outstanding_deltapart_write_requests < pull_data->max_deltapart_jobs)
+    {
+      FetchStaticDeltaData *fetch_data = g_queue_peek_head (&pull_data->deltaparts_to_apply);
+
+      /* Always let one part through, however large */
+      if (pull_data->deltapart_memory_in_use > 0 &&
+          pull_data->deltapart_memory_in_use + fetch_data->usize > pull_data->deltapart_memory_budget)
+        break;
+
+      if (!pull_data->deltapart_pool)
+        {
+          pull_data->deltapart_pool = g_thread_pool_new (deltapart_apply_thread, pull_data,
+                                                         pull_data->max_deltapart_jobs,
+                                                         FALSE, error);
+          if (!pull_data->deltapart_pool)
+            return FALSE;
+        }
+
+      g_queue_pop_head (&pull_data->deltaparts_to_apply);
+      g_debug ("applying static delta part %s", fetch_data->expected_checksum);
+      pull_data->deltapart_memory_in_use += fetch_data->usize;
+      pull_data->n_outstanding_deltapart_write_requests++;
+      if (!g_thread_pool_push (pull_data->deltapart_pool, fetch_data, error))
+        {
+          pull_data->deltapart_memory_in_use -= fetch_data->usize;
+          pull_data->n_outstanding_deltapart_write_requests--;
+          fetch_static_delta_data_free (fetch_data);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Takes ownership of @fetch_data, which must have part_in set */
+static void
+queue_deltapart_apply (OtPullData           *pull_data,
+                       FetchStaticDeltaData *fetch_data)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  g_queue_push_tail (&pull_data->deltaparts_to_apply, fetch_data);
+  (void) start_deltapart_applies (pull_data, &local_error);
+  check_outstanding_requests_handle_error (pull_data, &local_error);
+}
+
+static gboolean
+on_static_delta_applied (gpointer user_data)
 {
   FetchStaticDeltaData *fetch_data = user_data;
   OtPullData *pull_data = fetch_data->pull_data;
-  g_autoptr(GError) local_error = NULL;
-  GError **error = &local_error;
+  g_autoptr(GError) local_error = g_steal_pointer (&fetch_data->apply_error);
 
   g_debug ("execute static delta part %s complete", fetch_data->expected_checksum);
 
-  if (!_ostree_static_delta_part_execute_finish (pull_data->repo, result, error))
-    goto out;
-
- out:
   g_assert (pull_data->n_outstanding_deltapart_write_requests > 0);
   pull_data->n_outstanding_deltapart_write_requests--;
+  g_assert (pull_data->deltapart_memory_in_use >= fetch_data->usize);
+  pull_data->deltapart_memory_in_use -= fetch_data->usize;
+  fetch_static_delta_data_free (fetch_data);
+
+  if (local_error == NULL && !pull_data->caught_error)
+    (void) start_deltapart_applies (pull_data, &local_error);
   /* No need to retry on failure to write locally. */
   check_outstanding_requests_handle_error (pull_data, &local_error);
-  /* Always free state */
-  fetch_static_delta_data_free (fetch_data);
+  return G_SOURCE_REMOVE;
 }
 
 static void
@@ -1389,48 +1772,29 @@ static_deltapart_fetch_on_complete (GObject           *object,
   FetchStaticDeltaData *fetch_data = user_data;
   OtPullData *pull_data = fetch_data->pull_data;
   g_auto(GLnxTmpfile) tmpf = { 0, };
-  g_autoptr(GInputStream) in = NULL;
-  g_autoptr(GVariant) part = NULL;
   g_autoptr(GError) local_error = NULL;
   GError **error = &local_error;
-  gboolean free_fetch_data = TRUE;
 
   g_debug ("fetch static delta part %s complete", fetch_data->expected_checksum);
 
-  if (!_ostree_fetcher_request_to_tmpfile_finish (fetcher, result, &tmpf, error))
-    goto out;
-
-  /* Transfer ownership of the fd */
-  in = g_unix_input_stream_new (glnx_steal_fd (&tmpf.fd), TRUE);
-
-  /* TODO - make async */
-  if (!_ostree_static_delta_part_open (in, NULL, 0, fetch_data->expected_checksum,
-                                       &part, pull_data->cancellable, error))
-    goto out;
-
-  _ostree_static_delta_part_execute_async (pull_data->repo,
-                                           fetch_data->objects,
-                                           part,
-                                           pull_data->cancellable,
-                                           on_static_delta_written,
-                                           fetch_data);
-  pull_data->n_outstanding_deltapart_write_requests++;
-  free_fetch_data = FALSE;
-
- out:
   g_assert (pull_data->n_outstanding_deltapart_fetches > 0);
   pull_data->n_outstanding_deltapart_fetches--;
 
-  if (local_error == NULL)
-    pull_data->n_fetched_deltaparts++;
+  if (_ostree_fetcher_request_to_tmpfile_finish (fetcher, result, &tmpf, error))
+    {
+      pull_data->n_fetched_deltaparts++;
 
-  if (_ostree_fetcher_should_retry_request (local_error, fetch_data->n_retries_remaining--))
-    enqueue_one_static_delta_part_request_s (pull_data, g_steal_pointer (&fetch_data));
+      /* Transfer ownership of the fd */
+      fetch_data->part_in = g_unix_input_stream_new (glnx_steal_fd (&tmpf.fd), TRUE);
+      queue_deltapart_apply (pull_data, fetch_data);
+    }
+  else if (_ostree_fetcher_should_retry_request (local_error, fetch_data->n_retries_remaining--))
+    enqueue_one_static_delta_part_request_s (pull_data, fetch_data);
   else
-    check_outstanding_requests_handle_error (pull_data, &local_error);
-
-  if (free_fetch_data)
-    g_clear_pointer (&fetch_data, fetch_static_delta_data_free);
+    {
+      check_outstanding_requests_handle_error (pull_data, &local_error);
+      fetch_static_delta_data_free (fetch_data);
+    }
 }
 
 static gboolean
@@ -2031,76 +2395,438 @@ scan_one_metadata_object (OtPullData                 *pull_data,
       is_stored = TRUE;
       is_requested = TRUE;
     }
-  /* Do we have any localcache repos? */
-  else if (!is_stored && pull_data->localcache_repos)
+  /* Do we have any localcache repos? */
+  else if (!is_stored && pull_data->localcache_repos)
+    {
+      for (guint i = 0; i < pull_data->localcache_repos->len; i++)
+        {
+          OstreeRepo *refd_repo = pull_data->localcache_repos->pdata[i];
+          gboolean localcache_repo_has_obj;
+
+          if (!ostree_repo_has_object (refd_repo, objtype, checksum,
+                                       &localcache_repo_has_obj, cancellable, error))
+            return FALSE;
+          if (!localcache_repo_has_obj)
+            continue;
+          if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+            {
+              /* mark as partial to ensure we scan the commit below */
+              if (!ostree_repo_mark_commit_partial (pull_data->repo, checksum, TRUE, error))
+                return FALSE;
+            }
+          if (!_ostree_repo_import_object (pull_data->repo, refd_repo,
+                                           objtype, checksum, pull_data->importflags,
+                                           cancellable, error))
+            return FALSE;
+          /* See comment above */
+          if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+            g_hash_table_insert (pull_data->fetched_detached_metadata, g_strdup (checksum), NULL);
+          is_stored = TRUE;
+          is_requested = TRUE;
+          pull_data->n_imported_metadata++;
+          break;
+        }
+    }
+
+  if (!is_stored && !is_requested)
+    {
+      gboolean do_fetch_detached;
+
+      g_hash_table_add (pull_data->requested_metadata, g_variant_ref (object));
+
+      do_fetch_detached = (objtype == OSTREE_OBJECT_TYPE_COMMIT);
+      enqueue_one_object_request (pull_data, checksum, objtype, path, do_fetch_detached, FALSE, ref);
+    }
+  else if (is_stored && objtype == OSTREE_OBJECT_TYPE_COMMIT)
+    {
+      /* Even though we already have the commit, we always try to (re)fetch the
+       * detached metadata before scanning it, in case new signatures appear.
+       * https://github.com/projectatomic/rpm-ostree/issues/630 */
+      if (!g_hash_table_contains (pull_data->fetched_detached_metadata, checksum))
+        enqueue_one_object_request (pull_data, checksum, objtype, path, TRUE, TRUE, ref);
+      else
+        {
+          if (!scan_commit_object (pull_data, checksum, recursion_depth, ref,
+                                   pull_data->cancellable, error))
+            return FALSE;
+
+          g_hash_table_add (pull_data->scanned_metadata, g_variant_ref (object));
+          pull_data->n_scanned_metadata++;
+        }
+    }
+  else if (is_stored && objtype == OSTREE_OBJECT_TYPE_DIR_TREE)
+    {
+      if (!scan_dirtree_object (pull_data, checksum, path, recursion_depth,
+                                pull_data->cancellable, error))
+        return FALSE;
+
+      g_hash_table_add (pull_data->scanned_metadata, g_variant_ref (object));
+      pull_data->n_scanned_metadata++;
+    }
+
+  return TRUE;
+}
+
+/* Objects in the same pack are coalesced into one range request as long as
+ * the gap between them is small; and we bound the size of each range since
+ * it is fetched into memory.
+ */
+#define PACK_RANGE_MAX_GAP (64 * 1024)
+#define PACK_RANGE_MAX_SIZE (16 * 1024 * 1024)
+
+static void
+remote_pack_free (RemotePack *pack)
+{
+  g_free (pack->checksum);
+  g_clear_pointer (&pack->index, g_bytes_unref);
+  g_ptr_array_foreach (pack->queued_metadata, (GFunc) fetch_object_data_free, NULL);
+  g_ptr_array_unref (pack->queued_metadata);
+  g_ptr_array_foreach (pack->queued_content, (GFunc) fetch_object_data_free, NULL);
+  g_ptr_array_unref (pack->queued_content);
+  g_free (pack);
+}
+
+static void
+fetch_pack_range_data_free (FetchPackRangeData *range)
+{
+  for (guint i = 0; i < range->objects->len; i++)
+    {
+      FetchObjectData *fetch_data = range->objects->pdata[i];
+      if (fetch_data)
+        fetch_object_data_free (fetch_data);
+    }
+  g_ptr_array_unref (range->objects);
+  g_free (range);
+}
+
+static void
+clear_queued_pack_objects (OtPullData *pull_data)
+{
+  for (guint i = 0; pull_data->remote_packs && i < pull_data->remote_packs->len; i++)
+    {
+      RemotePack *pack = pull_data->remote_packs->pdata[i];
+      g_ptr_array_foreach (pack->queued_metadata, (GFunc) fetch_object_data_free, NULL);
+      g_ptr_array_set_size (pack->queued_metadata, 0);
+      g_ptr_array_foreach (pack->queued_content, (GFunc) fetch_object_data_free, NULL);
+      g_ptr_array_set_size (pack->queued_content, 0);
+    }
+  pull_data->n_queued_pack_objects = 0;
+}
+
+/* If @fetch_data names an object in one of the remote's packs, queue it for
+ * a range fetch and return %TRUE (taking ownership); otherwise return %FALSE.
+ */
+static gboolean
+enqueue_packed_object (OtPullData      *pull_data,
+                       FetchObjectData *fetch_data)
+{
+  const char *checksum;
+  OstreeObjectType objtype;
+
+  if (pull_data->remote_packs == NULL || fetch_data->is_detached_meta ||
+      fetch_data->skip_packs)
+    return FALSE;
+
+  ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+
+  for (guint i = 0; i < pull_data->remote_packs->len; i++)
+    {
+      RemotePack *pack = pull_data->remote_packs->pdata[i];
+      const OstreePackIndexEntry *entry =
+        _ostree_pack_index_lookup (pack->entries, pack->n_entries, csum, objtype);
+      if (!entry)
+        continue;
+
+      const guint64 offset = GUINT64_FROM_BE (entry->offset);
+      const guint64 size = GUINT64_FROM_BE (entry->size);
+      /* Ignore bogus entries; we'll just try the loose object instead */
+      if (offset < _OSTREE_PACK_MAGIC_LEN || size == 0 || offset + size < offset)
+        return FALSE;
+
+      g_debug ("queuing fetch of %s.%s from pack %s", checksum,
+               ostree_object_type_to_string (objtype), pack->checksum);
+
+      fetch_data->pack = pack;
+      fetch_data->pack_offset = offset;
+      fetch_data->pack_size = size;
+      g_ptr_array_add (OSTREE_OBJECT_TYPE_IS_META (objtype) ? pack->queued_metadata : pack->queued_content,
+                       fetch_data);
+      pull_data->n_queued_pack_objects++;
+      ensure_pack_fetch_queued (pull_data);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Write one object sliced out of a pack range, verifying its checksum just
+ * like for loose objects.  Always takes ownership of @fetch_data.
+ */
+static gboolean
+write_packed_object (OtPullData      *pull_data,
+                     FetchObjectData *fetch_data,
+                     GBytes          *bytes,
+                     GError         **error)
+{
+  const char *checksum;
+  OstreeObjectType objtype;
+  gboolean ret = FALSE;
+
+  ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
+  g_debug ("fetch of %s.%s from pack complete", checksum,
+           ostree_object_type_to_string (objtype));
+
+  if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+    {
+      g_autoptr(GVariant) metadata =
+        g_variant_ref_sink (g_variant_new_from_bytes (ostree_metadata_variant_type (objtype),
+                                                      bytes, FALSE));
+      if (!write_fetched_metadata (pull_data, fetch_data, metadata, error))
+        goto out;
+      fetch_data = NULL;
+      pull_data->n_fetched_metadata++;
+    }
+  else if (pull_data->trusted_http_direct)
+    {
+      /* Packs hold archive-format objects, so this is the same as the loose
+       * case in content_fetch_on_complete().
+       */
+      g_auto(GLnxTmpfile) tmpf = { 0, };
+      if (!_ostree_fetcher_tmpf_from_flags (OSTREE_FETCHER_REQUEST_LINKABLE,
+                                            pull_data->tmpdir_dfd, &tmpf, error))
+        goto out;
+      if (glnx_loop_write (tmpf.fd, g_bytes_get_data (bytes, NULL),
+                           g_bytes_get_size (bytes)) < 0)
+        {
+          glnx_throw_errno_prefix (error, "write");
+          goto out;
+        }
+      if (!_ostree_repo_commit_tmpf_final (pull_data->repo, checksum, objtype,
+                                           &tmpf, pull_data->cancellable, error))
+        goto out;
+      pull_data->n_fetched_content++;
+    }
+  else
+    {
+      g_autoptr(GInputStream) input = g_memory_input_stream_new_from_bytes (bytes);
+      if (!write_fetched_content (pull_data, fetch_data, input, g_bytes_get_size (bytes),
+                                  pull_data->cancellable, error))
+        goto out;
+      fetch_data = NULL;
+    }
+
+  ret = TRUE;
+ out:
+  g_clear_pointer (&fetch_data, fetch_object_data_free);
+  return ret;
+}
+
+static void
+pack_range_fetch_on_complete (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  OstreeFetcher *fetcher = (OstreeFetcher *)object;
+  FetchPackRangeData *range = user_data;
+  OtPullData *pull_data = range->pull_data;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) local_error = NULL;
+  GError **error = &local_error;
+  gboolean fetched = _ostree_fetcher_request_to_membuf_finish (fetcher, result, &bytes, error);
+
+  fetch_limit_update (pull_data, range->start_time, local_error);
+  if (!fetched)
+    goto out;
+
+  /* The fetcher already rejected anything but a 206 */
+  const gsize len = g_bytes_get_size (bytes);
+  if (len != range->length)
+    {
+      fetched = FALSE;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Got %" G_GSIZE_FORMAT " bytes instead of %" G_GUINT64_FORMAT " at offset %" G_GUINT64_FORMAT " in pack %s",
+                   len, range->length, range->offset, range->pack->checksum);
+      goto out;
+    }
+
+  for (guint i = 0; i < range->objects->len; i++)
+    {
+      FetchObjectData *fetch_data = g_steal_pointer (&range->objects->pdata[i]);
+      g_autoptr(GBytes) object_bytes =
+        g_bytes_new_from_bytes (bytes, fetch_data->pack_offset - range->offset, fetch_data->pack_size);
+      if (!write_packed_object (pull_data, fetch_data, object_bytes, error))
+        goto out;
+    }
+
+ out:
+  if (range->is_meta)
+    {
+      g_assert (pull_data->n_outstanding_metadata_fetches > 0);
+      pull_data->n_outstanding_metadata_fetches--;
+    }
+  else
+    {
+      g_assert (pull_data->n_outstanding_content_fetches > 0);
+      pull_data->n_outstanding_content_fetches--;
+    }
+
+  /* If the pack has gone away (e.g. the summary is stale), or the server
+   * can't do ranges properly, fall back to fetching the loose objects.
+   */
+  const gboolean fallback_loose = !fetched &&
+    (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) ||
+     g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED));
+  if (fallback_loose ||
+      (!fetched && _ostree_fetcher_should_retry_request (local_error, range->n_retries_remaining--)))
     {
-      for (guint i = 0; i < pull_data->localcache_repos->len; i++)
+      g_clear_error (&local_error);
+      for (guint i = 0; i < range->objects->len; i++)
         {
-          OstreeRepo *refd_repo = pull_data->localcache_repos->pdata[i];
-          gboolean localcache_repo_has_obj;
-
-          if (!ostree_repo_has_object (refd_repo, objtype, checksum,
-                                       &localcache_repo_has_obj, cancellable, error))
-            return FALSE;
-          if (!localcache_repo_has_obj)
+          FetchObjectData *fetch_data = g_steal_pointer (&range->objects->pdata[i]);
+          if (!fetch_data)
             continue;
-          if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
-            {
-              /* mark as partial to ensure we scan the commit below */
-              if (!ostree_repo_mark_commit_partial (pull_data->repo, checksum, TRUE, error))
-                return FALSE;
-            }
-          if (!_ostree_repo_import_object (pull_data->repo, refd_repo,
-                                           objtype, checksum, pull_data->importflags,
-                                           cancellable, error))
-            return FALSE;
-          /* See comment above */
-          if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
-            g_hash_table_insert (pull_data->fetched_detached_metadata, g_strdup (checksum), NULL);
-          is_stored = TRUE;
-          is_requested = TRUE;
-          pull_data->n_imported_metadata++;
-          break;
+          fetch_data->pack = NULL;
+          fetch_data->skip_packs = fallback_loose;
+          enqueue_one_object_request_s (pull_data, fetch_data);
         }
     }
 
-  if (!is_stored && !is_requested)
-    {
-      gboolean do_fetch_detached;
+  check_outstanding_requests_handle_error (pull_data, &local_error);
+  fetch_pack_range_data_free (range);
+}
 
-      g_hash_table_add (pull_data->requested_metadata, g_variant_ref (object));
+static void
+start_fetch_pack_range (OtPullData         *pull_data,
+                        FetchPackRangeData *range)
+{
+  g_debug ("starting fetch of %u objects from pack %s (%" G_GUINT64_FORMAT " bytes at %" G_GUINT64_FORMAT ")",
+           range->objects->len, range->pack->checksum, range->length, range->offset);
 
-      do_fetch_detached = (objtype == OSTREE_OBJECT_TYPE_COMMIT);
-      enqueue_one_object_request (pull_data, checksum, objtype, path, do_fetch_detached, FALSE, ref);
-    }
-  else if (is_stored && objtype == OSTREE_OBJECT_TYPE_COMMIT)
+  if (range->is_meta)
+    pull_data->n_outstanding_metadata_fetches++;
+  else
+    pull_data->n_outstanding_content_fetches++;
+  range->start_time = g_get_monotonic_time ();
+
+  g_autofree char *pack_subpath =
+    g_strconcat ("objects/" _OSTREE_PACK_DIR "/" _OSTREE_PACK_PREFIX, range->pack->checksum,
+                 _OSTREE_PACK_DATA_SUFFIX, NULL);
+  const guint64 max_size = range->is_meta ? MIN (range->length, pull_data->max_metadata_size)
+                                           : range->length;
+  _ostree_fetcher_request_range_to_membuf (pull_data->fetcher, pull_data->content_mirrorlist,
+                                           pack_subpath, 0, range->offset, range->length, max_size,
+                                           range->is_meta ? OSTREE_REPO_PULL_METADATA_PRIORITY
+                                           : OSTREE_REPO_PULL_CONTENT_PRIORITY,
+                                           pull_data->cancellable,
+                                           pack_range_fetch_on_complete, range);
+}
+
+static int
+compare_fetch_pack_offsets (gconstpointer a_pp,
+                            gconstpointer b_pp)
+{
+  const FetchObjectData *a = *((FetchObjectData**)a_pp);
+  const FetchObjectData *b = *((FetchObjectData**)b_pp);
+
+  if (a->pack_offset < b->pack_offset)
+    return -1;
+  else if (a->pack_offset > b->pack_offset)
+    return 1;
+  return 0;
+}
+
+/* Turn the objects queued in @queued into as few range requests as
+ * possible, as long as the fetcher queue has room.
+ */
+static void
+start_fetch_pack_ranges (OtPullData *pull_data,
+                         RemotePack *pack,
+                         GPtrArray  *queued,
+                         gboolean    is_meta)
+{
+  g_ptr_array_sort (queued, compare_fetch_pack_offsets);
+
+  /* Metadata ranges are fetched with the usual metadata size limit */
+  const guint64 max_range_size = is_meta ? MIN (PACK_RANGE_MAX_SIZE, pull_data->max_metadata_size)
+                                         : PACK_RANGE_MAX_SIZE;
+  guint i = 0;
+  while (i < queued->len && !fetcher_queue_is_full (pull_data))
     {
-      /* Even though we already have the commit, we always try to (re)fetch the
-       * detached metadata before scanning it, in case new signatures appear.
-       * https://github.com/projectatomic/rpm-ostree/issues/630 */
-      if (!g_hash_table_contains (pull_data->fetched_detached_metadata, checksum))
-        enqueue_one_object_request (pull_data, checksum, objtype, path, TRUE, TRUE, ref);
-      else
-        {
-          if (!scan_commit_object (pull_data, checksum, recursion_depth, ref,
-                                   pull_data->cancellable, error))
-            return FALSE;
+      FetchObjectData *first = queued->pdata[i];
+      const guint64 start = first->pack_offset;
+      guint64 end = start + first->pack_size;
+      guint j;
 
-          g_hash_table_add (pull_data->scanned_metadata, g_variant_ref (object));
-          pull_data->n_scanned_metadata++;
+      for (j = i + 1; j < queued->len; j++)
+        {
+          FetchObjectData *next = queued->pdata[j];
+          const guint64 next_end = next->pack_offset + next->pack_size;
+          if (next->pack_offset > end + PACK_RANGE_MAX_GAP ||
+              next_end - start > max_range_size)
+            break;
+          end = MAX (end, next_end);
         }
+
+      FetchPackRangeData *range = g_new0 (FetchPackRangeData, 1);
+      range->pull_data = pull_data;
+      range->pack = pack;
+      range->is_meta = is_meta;
+      range->offset = start;
+      range->length = end - start;
+      range->objects = g_ptr_array_new ();
+      range->n_retries_remaining = pull_data->n_network_retries;
+      for (; i < j; i++)
+        g_ptr_array_add (range->objects, queued->pdata[i]);
+      g_assert (pull_data->n_queued_pack_objects >= range->objects->len);
+      pull_data->n_queued_pack_objects -= range->objects->len;
+
+      start_fetch_pack_range (pull_data, range);
     }
-  else if (is_stored && objtype == OSTREE_OBJECT_TYPE_DIR_TREE)
-    {
-      if (!scan_dirtree_object (pull_data, checksum, path, recursion_depth,
-                                pull_data->cancellable, error))
-        return FALSE;
 
-      g_hash_table_add (pull_data->scanned_metadata, g_variant_ref (object));
-      pull_data->n_scanned_metadata++;
+  g_ptr_array_remove_range (queued, 0, i);
+}
+
+/* Runs at a lower priority than the scanning idle, so that we batch up as
+ * many objects as possible before issuing requests.
+ */
+static gboolean
+pack_fetch_idle (gpointer user_data)
+{
+  OtPullData *pull_data = user_data;
+
+  g_clear_pointer (&pull_data->pack_fetch_src, (GDestroyNotify) g_source_destroy);
+
+  /* Metadata first, for the same reasons as in check_outstanding_requests_handle_error() */
+  for (guint i = 0; i < pull_data->remote_packs->len; i++)
+    {
+      RemotePack *pack = pull_data->remote_packs->pdata[i];
+      start_fetch_pack_ranges (pull_data, pack, pack->queued_metadata, TRUE);
+    }
+  for (guint i = 0; i < pull_data->remote_packs->len; i++)
+    {
+      RemotePack *pack = pull_data->remote_packs->pdata[i];
+      start_fetch_pack_ranges (pull_data, pack, pack->queued_content, FALSE);
     }
 
-  return TRUE;
+  return G_SOURCE_REMOVE;
+}
+
+static void
+ensure_pack_fetch_queued (OtPullData *pull_data)
+{
+  GSource *idle_src;
+
+  if (pull_data->pack_fetch_src || pull_data->caught_error)
+    return;
+
+  idle_src = g_idle_source_new ();
+  g_source_set_priority (idle_src, G_PRIORITY_DEFAULT_IDLE + 10);
+  g_source_set_callback (idle_src, pack_fetch_idle, pull_data, NULL);
+  g_source_attach (idle_src, pull_data->main_context);
+  g_source_unref (idle_src);
+  pull_data->pack_fetch_src = idle_src;
 }
 
 static void
@@ -2113,6 +2839,10 @@ enqueue_one_object_request_s (OtPullData      *pull_data,
   ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
   gboolean is_meta = OSTREE_OBJECT_TYPE_IS_META (objtype);
 
+  /* Objects in a remote pack are batched rather than fetched individually */
+  if (enqueue_packed_object (pull_data, fetch_data))
+    return;
+
   /* Are too many requests are in flight? */
   if (fetcher_queue_is_full (pull_data))
     {
@@ -2187,6 +2917,7 @@ start_fetch (OtPullData *pull_data,
     pull_data->n_outstanding_metadata_fetches++;
   else
     pull_data->n_outstanding_content_fetches++;
+  fetch->start_time = g_get_monotonic_time ();
 
   OstreeFetcherRequestFlags flags = 0;
   /* Override the path if we're trying to fetch the .commitmeta file first */
@@ -2225,6 +2956,158 @@ start_fetch (OtPullData *pull_data,
                                       is_meta ? meta_fetch_on_complete : content_fetch_on_complete, fetch);
 }
 
+static gboolean
+pack_index_matches_digest (GBytes       *index_bytes,
+                           const guint8 *expected_digest)
+{
+  guint8 digest[OSTREE_SHA256_DIGEST_LEN];
+  g_auto(OtChecksum) hasher = { 0, };
+  ot_checksum_init (&hasher);
+  ot_checksum_update_bytes (&hasher, index_bytes);
+  ot_checksum_get_digest (&hasher, digest, sizeof (digest));
+  return memcmp (digest, expected_digest, sizeof (digest)) == 0;
+}
+
+/* Load the indexes of the packs listed in the remote's summary.  Packs are
+ * immutable, so we keep a copy of each index under
+ * cache/pack-indexes/$remote/ and only fetch those we haven't seen before.
+ * Every index, cached or fetched, is checked against the digest in the
+ * summary before we use it, so a (signed) summary vouches for the object
+ * offsets we later request.
+ */
+static gboolean
+load_remote_pack_indexes (OtPullData    *pull_data,
+                          GVariant      *packs,
+                          GCancellable  *cancellable,
+                          GError       **error)
+{
+  OstreeRepo *self = pull_data->repo;
+  glnx_autofd int cache_dfd = -1;
+  GLNX_AUTO_PREFIX_ERROR ("Loading pack indexes", error);
+
+  if (self->cache_dir_fd != -1 && pull_data->remote_name != NULL)
+    {
+      g_autofree char *cache_path =
+        g_build_filename (_OSTREE_PACK_INDEX_CACHE_DIR, pull_data->remote_name, NULL);
+      if (!glnx_shutil_mkdir_p_at (self->cache_dir_fd, cache_path, 0775, cancellable, error))
+        return FALSE;
+      if (!glnx_opendirat (self->cache_dir_fd, cache_path, TRUE, &cache_dfd, error))
+        return FALSE;
+    }
+
+  g_autoptr(GPtrArray) remote_packs =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) remote_pack_free);
+  g_autoptr(GHashTable) index_names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  const guint n_packs = g_variant_n_children (packs);
+  for (guint i = 0; i < n_packs; i++)
+    {
+      const char *checksum;
+      g_autoptr(GVariant) index_csum_v = NULL;
+      g_variant_get_child (packs, i, "{&sv}", &checksum, &index_csum_v);
+
+      if (!ostree_validate_checksum_string (checksum, error))
+        return FALSE;
+      if (!validate_variant_is_csum (index_csum_v, error))
+        return FALSE;
+      const guint8 *index_digest = ostree_checksum_bytes_peek (index_csum_v);
+
+      g_autofree char *index_name =
+        g_strconcat (_OSTREE_PACK_PREFIX, checksum, _OSTREE_PACK_INDEX_SUFFIX, NULL);
+      g_autoptr(GBytes) index_bytes = NULL;
+      const OstreePackIndexEntry *entries = NULL;
+      guint64 n_entries = 0;
+
+      if (cache_dfd != -1)
+        {
+          glnx_autofd int fd = -1;
+          if (!ot_openat_ignore_enoent (cache_dfd, index_name, &fd, error))
+            return FALSE;
+          if (fd != -1)
+            {
+              index_bytes = ot_fd_readall_or_mmap (fd, 0, error);
+              if (!index_bytes)
+                return FALSE;
+              /* Just refetch it if the cached copy is corrupt */
+              if (!pack_index_matches_digest (index_bytes, index_digest) ||
+                  !_ostree_pack_index_parse (g_bytes_get_data (index_bytes, NULL),
+                                             g_bytes_get_size (index_bytes),
+                                             &entries, &n_entries, NULL))
+                g_clear_pointer (&index_bytes, g_bytes_unref);
+            }
+        }
+
+      if (index_bytes == NULL)
+        {
+          g_autofree char *index_path =
+            g_build_filename ("objects", _OSTREE_PACK_DIR, index_name, NULL);
+          if (!_ostree_fetcher_mirrored_request_to_membuf (pull_data->fetcher,
+                                                           pull_data->content_mirrorlist,
+                                                           index_path,
+                                                           OSTREE_FETCHER_REQUEST_OPTIONAL_CONTENT,
+                                                           pull_data->n_network_retries,
+                                                           &index_bytes,
+                                                           pull_data->max_pack_index_size,
+                                                           cancellable, error))
+            return FALSE;
+          /* Not fatal; we'll just fetch the objects loose */
+          if (index_bytes == NULL)
+            {
+              g_debug ("Pack %s listed in summary but its index is missing", checksum);
+              continue;
+            }
+
+          if (!pack_index_matches_digest (index_bytes, index_digest))
+            return glnx_throw (error, "%s doesn't match the checksum in the summary", index_name);
+
+          if (!_ostree_pack_index_parse (g_bytes_get_data (index_bytes, NULL),
+                                         g_bytes_get_size (index_bytes),
+                                         &entries, &n_entries, error))
+            return glnx_prefix_error (error, "%s", index_name);
+
+          if (cache_dfd != -1 &&
+              !glnx_file_replace_contents_at (cache_dfd, index_name,
+                                              g_bytes_get_data (index_bytes, NULL),
+                                              g_bytes_get_size (index_bytes),
+                                              GLNX_FILE_REPLACE_NODATASYNC,
+                                              cancellable, error))
+            return FALSE;
+        }
+
+      RemotePack *pack = g_new0 (RemotePack, 1);
+      pack->checksum = g_strdup (checksum);
+      pack->index = g_steal_pointer (&index_bytes);
+      pack->entries = entries;
+      pack->n_entries = n_entries;
+      pack->queued_metadata = g_ptr_array_new ();
+      pack->queued_content = g_ptr_array_new ();
+      g_ptr_array_add (remote_packs, pack);
+      g_hash_table_add (index_names, g_steal_pointer (&index_name));
+    }
+
+  /* Drop cached indexes for packs the remote no longer has */
+  if (cache_dfd != -1)
+    {
+      g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+      if (!glnx_dirfd_iterator_init_at (cache_dfd, ".", FALSE, &dfd_iter, error))
+        return FALSE;
+      while (TRUE)
+        {
+          struct dirent *dent;
+          if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+            return FALSE;
+          if (dent == NULL)
+            break;
+          if (!g_hash_table_contains (index_names, dent->d_name) &&
+              !glnx_unlinkat (cache_dfd, dent->d_name, 0, error))
+            return FALSE;
+        }
+    }
+
+  if (remote_packs->len > 0)
+    pull_data->remote_packs = g_steal_pointer (&remote_packs);
+  return TRUE;
+}
+
 static gboolean
 load_remote_repo_config (OtPullData    *pull_data,
                          GKeyFile     **out_keyfile,
@@ -2318,7 +3201,7 @@ static void
 enqueue_one_static_delta_part_request_s (OtPullData           *pull_data,
                                          FetchStaticDeltaData *fetch_data)
 {
-  if (fetcher_queue_is_full (pull_data))
+  if (fetcher_queue_is_full (pull_data) || deltapart_queue_is_full (pull_data))
     {
       g_debug ("queuing fetch of static delta %s-%s part %u",
                fetch_data->from_revision ?: "empty",
@@ -2338,7 +3221,6 @@ start_fetch_deltapart (OtPullData *pull_data,
 {
   g_autofree char *deltapart_path = _ostree_get_relative_static_delta_part_path (fetch->from_revision, fetch->to_revision, fetch->i);
   pull_data->n_outstanding_deltapart_fetches++;
-  g_assert_cmpint (pull_data->n_outstanding_deltapart_fetches, <=, _OSTREE_MAX_OUTSTANDING_DELTAPART_REQUESTS);
   _ostree_fetcher_request_to_tmpfile (pull_data->fetcher,
                                       pull_data->content_mirrorlist,
                                       deltapart_path, 0, fetch->size,
@@ -2363,6 +3245,7 @@ process_one_static_delta (OtPullData                 *pull_data,
   g_autoptr(GVariant) metadata = g_variant_get_child_value (delta_superblock, 0);
   g_autoptr(GVariant) headers = g_variant_get_child_value (delta_superblock, 6);
   g_autoptr(GVariant) fallback_objects = g_variant_get_child_value (delta_superblock, 7);
+  g_autoptr(GBytes) dictionary = _ostree_delta_get_zstd_dictionary (metadata);
 
   /* Gather free space so we can do a check below */
   struct statvfs stvfsbuf;
@@ -2419,6 +3302,7 @@ process_one_static_delta (OtPullData                 *pull_data,
           fetch_data->object_is_stored = FALSE;
           fetch_data->requested_ref = (ref != NULL) ? ostree_collection_ref_dup (ref) : NULL;
           fetch_data->n_retries_remaining = pull_data->n_network_retries;
+          fetch_data->start_time = g_get_monotonic_time ();
 
           ostree_repo_write_metadata_async (pull_data->repo, OSTREE_OBJECT_TYPE_COMMIT, to_checksum,
                                             to_commit,
@@ -2491,31 +3375,19 @@ process_one_static_delta (OtPullData                 *pull_data,
       fetch_data->objects = g_variant_ref (objects);
       fetch_data->expected_checksum = ostree_checksum_from_bytes_v (csum_v);
       fetch_data->size = size;
+      fetch_data->usize = usize;
       fetch_data->i = i;
       fetch_data->n_retries_remaining = pull_data->n_network_retries;
+      if (dictionary)
+        fetch_data->dictionary = g_bytes_ref (dictionary);
 
       if (inline_part_bytes != NULL)
         {
-          g_autoptr(GInputStream) memin = g_memory_input_stream_new_from_bytes (inline_part_bytes);
-          g_autoptr(GVariant) inline_delta_part = NULL;
-
           /* For inline parts we are relying on per-commit GPG, so don't bother checksumming. */
-          if (!_ostree_static_delta_part_open (memin, inline_part_bytes,
-                                               OSTREE_STATIC_DELTA_OPEN_FLAGS_SKIP_CHECKSUM,
-                                               NULL, &inline_delta_part,
-                                               cancellable, error))
-            {
-              fetch_static_delta_data_free (fetch_data);
-              return FALSE;
-            }
-
-          _ostree_static_delta_part_execute_async (pull_data->repo,
-                                                   fetch_data->objects,
-                                                   inline_delta_part,
-                                                   pull_data->cancellable,
-                                                   on_static_delta_written,
-                                                   fetch_data);
-          pull_data->n_outstanding_deltapart_write_requests++;
+          fetch_data->part_in = g_memory_input_stream_new_from_bytes (inline_part_bytes);
+          fetch_data->inline_part_bytes = g_steal_pointer (&inline_part_bytes);
+          fetch_data->open_flags = OSTREE_STATIC_DELTA_OPEN_FLAGS_SKIP_CHECKSUM;
+          queue_deltapart_apply (pull_data, fetch_data);
         }
       else
         {
@@ -2935,6 +3807,200 @@ _ostree_repo_cache_summary (OstreeRepo        *self,
   return TRUE;
 }
 
+static void
+summary_shard_digest (GBytes *bytes,
+                      guint8 *digest)
+{
+  g_auto(OtChecksum) hasher = { 0, };
+  ot_checksum_init (&hasher);
+  ot_checksum_update_bytes (&hasher, bytes);
+  ot_checksum_get_digest (&hasher, digest, OSTREE_SHA256_DIGEST_LEN);
+}
+
+/* Fetch the summary through the remote's summary index, if it has one.
+ * Only the shards listing @ref_names (and all other deltas if @all_deltas
+ * is set) are fetched, or all of them if @ref_names is %NULL; the merged
+ * summary then only lists those refs.  Shards are immutable, so we keep
+ * them under cache/summary-shards/$remote/ while the index lists them.
+ * Sets @out_summary to %NULL if the remote has no index.
+ */
+static gboolean
+fetch_summary_from_index (OtPullData          *pull_data,
+                          const char * const  *ref_names,
+                          gboolean             all_deltas,
+                          GBytes             **out_summary,
+                          GCancellable        *cancellable,
+                          GError             **error)
+{
+  OstreeRepo *self = pull_data->repo;
+  g_autoptr(GBytes) index_bytes = NULL;
+
+  if (!_ostree_fetcher_mirrored_request_to_membuf (pull_data->fetcher,
+                                                   pull_data->meta_mirrorlist,
+                                                   _OSTREE_SUMMARY_INDEX,
+                                                   OSTREE_FETCHER_REQUEST_OPTIONAL_CONTENT,
+                                                   pull_data->n_network_retries,
+                                                   &index_bytes,
+                                                   OSTREE_MAX_METADATA_SIZE,
+                                                   cancellable, error))
+    return FALSE;
+  if (index_bytes == NULL)
+    {
+      g_debug ("Remote %s has no summary index", pull_data->remote_name);
+      *out_summary = NULL;
+      return TRUE;
+    }
+
+  if (pull_data->gpg_verify_summary)
+    {
+      g_autoptr(GBytes) index_sig = NULL;
+      if (!_ostree_fetcher_mirrored_request_to_membuf (pull_data->fetcher,
+                                                       pull_data->meta_mirrorlist,
+                                                       _OSTREE_SUMMARY_INDEX_SIG,
+                                                       OSTREE_FETCHER_REQUEST_OPTIONAL_CONTENT,
+                                                       pull_data->n_network_retries,
+                                                       &index_sig,
+                                                       OSTREE_MAX_METADATA_SIZE,
+                                                       cancellable, error))
+        return FALSE;
+      if (index_sig == NULL)
+        {
+          g_set_error (error, OSTREE_GPG_ERROR, OSTREE_GPG_ERROR_NO_SIGNATURE,
+                       "GPG verification enabled, but no %s found (use gpg-verify-summary=false in remote config to disable)",
+                       _OSTREE_SUMMARY_INDEX_SIG);
+          return FALSE;
+        }
+
+      g_autoptr(OstreeGpgVerifyResult) result =
+        ostree_repo_verify_summary (self, pull_data->remote_name,
+                                    index_bytes, index_sig,
+                                    cancellable, error);
+      if (!ostree_gpg_verify_result_require_valid_signature (result, error))
+        return FALSE;
+    }
+
+  g_autoptr(GVariant) index =
+    g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_INDEX_GVARIANT_FORMAT,
+                                                  index_bytes, FALSE));
+  if (!g_variant_is_normal_form (index))
+    return glnx_throw (error, "Summary index not in normal form");
+
+  g_autoptr(GHashTable) wanted = NULL;
+  if (ref_names != NULL)
+    {
+      wanted = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      for (const char * const *it = ref_names; *it != NULL; it++)
+        g_hash_table_add (wanted, _ostree_summary_index_ref_shard (index, *it));
+      if (all_deltas)
+        g_hash_table_add (wanted, g_strdup (_OSTREE_SUMMARY_DELTAS_SHARD));
+    }
+
+  glnx_autofd int cache_dfd = -1;
+  if (self->cache_dir_fd != -1)
+    {
+      g_autofree char *cache_path =
+        g_build_filename (_OSTREE_SUMMARY_SHARDS_CACHE_DIR, pull_data->remote_name, NULL);
+      if (!glnx_shutil_mkdir_p_at (self->cache_dir_fd, cache_path, 0775, cancellable, error))
+        return FALSE;
+      if (!glnx_opendirat (self->cache_dir_fd, cache_path, TRUE, &cache_dfd, error))
+        return FALSE;
+    }
+
+  g_autoptr(GPtrArray) shards = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  g_autoptr(GHashTable) listed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GVariant) index_shards = g_variant_get_child_value (index, 0);
+  GVariantIter iter;
+  const char *shard_name;
+  GVariant *digest_v;
+  g_variant_iter_init (&iter, index_shards);
+  while (g_variant_iter_next (&iter, "{&s@ay}", &shard_name, &digest_v))
+    {
+      g_autoptr(GVariant) digest = digest_v;
+      if (!ostree_validate_structureof_csum_v (digest, error))
+        return glnx_prefix_error (error, "Summary shard %s", shard_name);
+
+      const guint8 *expected = ostree_checksum_bytes_peek (digest);
+      g_autofree char *checksum = ostree_checksum_from_bytes_v (digest);
+      g_hash_table_add (listed, g_strdup (checksum));
+
+      if (wanted != NULL && !g_hash_table_contains (wanted, shard_name))
+        continue;
+
+      g_autoptr(GBytes) shard_bytes = NULL;
+      guint8 actual[OSTREE_SHA256_DIGEST_LEN];
+      if (cache_dfd != -1)
+        {
+          glnx_autofd int fd = -1;
+          if (!ot_openat_ignore_enoent (cache_dfd, checksum, &fd, error))
+            return FALSE;
+          if (fd != -1)
+            {
+              shard_bytes = ot_fd_readall_or_mmap (fd, 0, error);
+              if (!shard_bytes)
+                return FALSE;
+              /* Just refetch it if the cached copy is corrupt */
+              summary_shard_digest (shard_bytes, actual);
+              if (memcmp (actual, expected, sizeof (actual)) != 0)
+                g_clear_pointer (&shard_bytes, g_bytes_unref);
+            }
+        }
+
+      if (shard_bytes == NULL)
+        {
+          g_autofree char *shard_path = g_build_filename (_OSTREE_SUMMARY_SHARDS_DIR, checksum, NULL);
+          if (!_ostree_fetcher_mirrored_request_to_membuf (pull_data->fetcher,
+                                                           pull_data->meta_mirrorlist,
+                                                           shard_path, 0,
+                                                           pull_data->n_network_retries,
+                                                           &shard_bytes,
+                                                           OSTREE_MAX_METADATA_SIZE,
+                                                           cancellable, error))
+            return FALSE;
+
+          summary_shard_digest (shard_bytes, actual);
+          if (memcmp (actual, expected, sizeof (actual)) != 0)
+            return glnx_throw (error, "Corrupted summary shard %s", checksum);
+
+          if (cache_dfd != -1 &&
+              !glnx_file_replace_contents_at (cache_dfd, checksum,
+                                              g_bytes_get_data (shard_bytes, NULL),
+                                              g_bytes_get_size (shard_bytes),
+                                              GLNX_FILE_REPLACE_NODATASYNC,
+                                              cancellable, error))
+            return FALSE;
+        }
+
+      g_ptr_array_add (shards,
+                       g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                                     shard_bytes, FALSE)));
+    }
+
+  /* Drop cached shards the index no longer lists */
+  if (cache_dfd != -1)
+    {
+      g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+      if (!glnx_dirfd_iterator_init_at (cache_dfd, ".", FALSE, &dfd_iter, error))
+        return FALSE;
+      while (TRUE)
+        {
+          struct dirent *dent;
+          if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+            return FALSE;
+          if (dent == NULL)
+            break;
+          if (!g_hash_table_contains (listed, dent->d_name) &&
+              !glnx_unlinkat (cache_dfd, dent->d_name, 0, error))
+            return FALSE;
+        }
+    }
+
+  g_autoptr(GVariant) summary = _ostree_summary_index_merge (index, shards);
+  g_debug ("Loaded summary for %s from %u of %" G_GSIZE_FORMAT " shards",
+           pull_data->remote_name, shards->len, g_variant_n_children (index_shards));
+  *out_summary = g_variant_get_data_as_bytes (summary);
+  return TRUE;
+}
+
 static OstreeFetcher *
 _ostree_repo_remote_new_fetcher (OstreeRepo  *self,
                                  const char  *remote_name,
@@ -3530,6 +4596,8 @@ initiate_request (OtPullData                 *pull_data,
  *     not being pulled will be ignored and any ref without a keyring remote
  *     will be verified with the keyring of the remote being pulled from.
  *     Since: 2019.2
+ *   * max-pack-index-size (t): Refuse to fetch pack indexes larger than this
+ *     many bytes; 0 to disable.  Default is 64 MiB.  Since: 2019.3
  */
 gboolean
 ostree_repo_pull_with_options (OstreeRepo             *self,
@@ -3565,6 +4633,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   gboolean opt_collection_refs_set = FALSE;
   gboolean opt_n_network_retries_set = FALSE;
   gboolean opt_ref_keyring_map_set = FALSE;
+  gboolean summary_from_index = FALSE;
   const char *main_collection_id = NULL;
   const char *url_override = NULL;
   gboolean inherit_transaction = FALSE;
@@ -3579,6 +4648,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
 
   /* Default */
   pull_data->max_metadata_size = OSTREE_MAX_METADATA_SIZE;
+  pull_data->max_pack_index_size = _OSTREE_MAX_PACK_INDEX_SIZE;
 
   if (options)
     {
@@ -3608,6 +4678,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
       (void) g_variant_lookup (options, "localcache-repos", "^a&s", &opt_localcache_repos);
       (void) g_variant_lookup (options, "timestamp-check", "b", &pull_data->timestamp_check);
       (void) g_variant_lookup (options, "max-metadata-size", "t", &pull_data->max_metadata_size);
+      (void) g_variant_lookup (options, "max-pack-index-size", "t", &pull_data->max_pack_index_size);
       (void) g_variant_lookup (options, "append-user-agent", "s", &pull_data->append_user_agent);
       opt_n_network_retries_set =
         g_variant_lookup (options, "n-network-retries", "u", &pull_data->n_network_retries);
@@ -3722,6 +4793,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
     }
 
   g_queue_init (&pull_data->scan_object_queue);
+  g_queue_init (&pull_data->deltaparts_to_apply);
 
   pull_data->start_time = g_get_monotonic_time ();
 
@@ -3774,6 +4846,12 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
         }
     }
 
+  if (!init_concurrency_limits (pull_data,
+                                _ostree_repo_remote_name_is_file (remote_name_or_baseurl) ?
+                                  NULL : remote_name_or_baseurl,
+                                error))
+    goto out;
+
   pull_data->phase = OSTREE_PULL_PHASE_FETCHING_REFS;
 
   if (!reinitialize_fetcher (pull_data, remote_name_or_baseurl, error))
@@ -3931,7 +5009,8 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
                                               &remote_mode_str, error))
         goto out;
 
-      if (!ostree_repo_mode_from_string (remote_mode_str, &pull_data->remote_mode, error))
+      if (!_ostree_repo_mode_from_string (remote_mode_str, &pull_data->remote_mode,
+                                          &pull_data->remote_archive_compression, error))
         goto out;
 
       if (!ot_keyfile_get_boolean_with_default (remote_config, "core", "tombstone-commits", FALSE,
@@ -3982,12 +5061,14 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
 
       const gboolean verifying_bareuseronly =
         (pull_data->importflags & _OSTREE_REPO_IMPORT_FLAGS_VERIFY_BAREUSERONLY) > 0;
-      /* If we're mirroring and writing into an archive repo, and both checksum and
-       * bareuseronly are turned off, we can directly copy the content rather than
-       * paying the cost of exploding it, checksumming, and re-gzip.
+      /* If we're mirroring and writing into an archive repo (compressed the
+       * same way as the remote), and both checksum and bareuseronly are turned
+       * off, we can directly copy the content rather than paying the cost of
+       * exploding it, checksumming, and re-gzip.
        */
       const gboolean mirroring_into_archive =
-        pull_data->is_mirror && pull_data->repo->mode == OSTREE_REPO_MODE_ARCHIVE;
+        pull_data->is_mirror && pull_data->repo->mode == OSTREE_REPO_MODE_ARCHIVE &&
+        pull_data->repo->archive_compression == pull_data->remote_archive_compression;
       const gboolean import_trusted = !verifying_bareuseronly &&
         (pull_data->importflags & _OSTREE_REPO_IMPORT_FLAGS_TRUSTED) > 0;
       pull_data->trusted_http_direct = mirroring_into_archive && import_trusted;
@@ -4012,6 +5093,63 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
 
   pull_data->static_delta_superblocks = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
 
+  /* If the remote publishes a summary index, fetch just the parts of the
+   * summary for the refs we want.  Mirroring wants the whole summary, and
+   * its signature, so doesn't use it. */
+  if (!pull_data->summary && !pull_data->remote_repo_local && !pull_data->is_mirror &&
+      pull_data->remote_name != NULL)
+    {
+      gboolean use_summary_index = FALSE;
+      if (!ostree_repo_get_remote_boolean_option (self, pull_data->remote_name,
+                                                  "summary-index", FALSE,
+                                                  &use_summary_index, error))
+        goto out;
+
+      if (use_summary_index)
+        {
+          g_autoptr(GPtrArray) ref_names = g_ptr_array_new ();
+          /* Deltas to commits which refs don't point to are in their own shard */
+          gboolean all_deltas = (override_commit_ids != NULL);
+
+          if (refs_to_fetch != NULL)
+            {
+              for (char **it = refs_to_fetch; *it != NULL; it++)
+                {
+                  g_ptr_array_add (ref_names, *it);
+                  if (ostree_validate_checksum_string (*it, NULL))
+                    all_deltas = TRUE;
+                }
+            }
+          else if (opt_collection_refs_set)
+            {
+              g_autoptr(GVariantIter) it = g_variant_iter_copy (collection_refs_iter);
+              const char *ref_name, *checksum;
+              while (g_variant_iter_next (it, "(&s&s&s)", NULL, &ref_name, &checksum))
+                {
+                  g_ptr_array_add (ref_names, (char *) ref_name);
+                  if (*checksum != '\0')
+                    all_deltas = TRUE;
+                }
+            }
+          else if (configured_branches != NULL)
+            {
+              for (char **it = configured_branches; *it != NULL; it++)
+                g_ptr_array_add (ref_names, *it);
+            }
+          else
+            g_clear_pointer (&ref_names, g_ptr_array_unref);
+          if (ref_names != NULL)
+            g_ptr_array_add (ref_names, NULL);
+
+          if (!fetch_summary_from_index (pull_data,
+                                         ref_names ? (const char * const *) ref_names->pdata : NULL,
+                                         all_deltas, &bytes_summary,
+                                         cancellable, error))
+            goto out;
+          summary_from_index = (bytes_summary != NULL);
+        }
+    }
+
   {
     g_autoptr(GBytes) bytes_sig = NULL;
     gsize i, n;
@@ -4020,7 +5158,8 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
     g_autoptr(GVariant) additional_metadata = NULL;
     gboolean summary_from_cache = FALSE;
 
-    if (!pull_data->summary_data_sig)
+    /* The summary index has its own signature, checked above */
+    if (!summary_from_index && !pull_data->summary_data_sig)
       {
         if (!_ostree_fetcher_mirrored_request_to_membuf (pull_data->fetcher,
                                                          pull_data->meta_mirrorlist,
@@ -4074,7 +5213,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
         goto out;
       }
 
-    if (!bytes_sig && pull_data->gpg_verify_summary)
+    if (!summary_from_index && !bytes_sig && pull_data->gpg_verify_summary)
       {
         g_set_error (error, OSTREE_GPG_ERROR, OSTREE_GPG_ERROR_NO_SIGNATURE,
                      "GPG verification enabled, but no summary.sig found (use gpg-verify-summary=false in remote config to disable)");
@@ -4249,6 +5388,15 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
                                  g_strdup (delta),
                                  csum_data);
           }
+
+        /* Local pulls import objects (packed or not) directly */
+        g_autoptr(GVariant) packs =
+          g_variant_lookup_value (additional_metadata, OSTREE_SUMMARY_PACKS, G_VARIANT_TYPE_VARDICT);
+        if (packs && !pull_data->remote_repo_local && !pull_data->dry_run)
+          {
+            if (!load_remote_pack_indexes (pull_data, packs, cancellable, error))
+              goto out;
+          }
       }
   }
 
@@ -4727,9 +5875,16 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   g_clear_pointer (&pull_data->pending_fetch_metadata, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->pending_fetch_delta_superblocks, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->pending_fetch_deltaparts, (GDestroyNotify) g_hash_table_unref);
+  /* All parts have been applied (or we never got to run the main loop) */
+  if (pull_data->deltapart_pool)
+    g_thread_pool_free (pull_data->deltapart_pool, FALSE, TRUE);
+  g_queue_foreach (&pull_data->deltaparts_to_apply, (GFunc) fetch_static_delta_data_free, NULL);
+  g_queue_clear (&pull_data->deltaparts_to_apply);
   g_queue_foreach (&pull_data->scan_object_queue, (GFunc) scan_object_queue_data_free, NULL);
   g_queue_clear (&pull_data->scan_object_queue);
   g_clear_pointer (&pull_data->idle_src, (GDestroyNotify) g_source_destroy);
+  g_clear_pointer (&pull_data->pack_fetch_src, (GDestroyNotify) g_source_destroy);
+  g_clear_pointer (&pull_data->remote_packs, (GDestroyNotify) g_ptr_array_unref);
   g_clear_pointer (&pull_data->dirs, (GDestroyNotify) g_ptr_array_unref);
   g_clear_pointer (&remote_config, (GDestroyNotify) g_key_file_unref);
   return ret;
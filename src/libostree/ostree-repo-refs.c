@@ -25,6 +25,7 @@
 #include "ostree-repo-private.h"
 #include "otutil.h"
 #include "ot-fs-utils.h"
+#include <sys/file.h>
 
 /* This is polymorphic in @collection_id: if non-%NULL, @refs will be treated as of
  * type OstreeCollectionRef ↦ checksum. Otherwise, it will be treated as of type
@@ -66,6 +67,324 @@ add_ref_to_set (const char       *remote,
   return TRUE;
 }
 
+/* Refs may also be stored in a single packed-refs file, one
+ * "<checksum> <path>\n" line per ref after a header line, where <path> is
+ * relative to refs/ (e.g. heads/foo, remotes/origin/foo or
+ * mirrors/org.example.Os/foo), sorted bytewise by path.  The file is
+ * mmap()ed, and binary searched to resolve a ref.
+ *
+ * A loose ref file takes precedence over a packed ref of the same name, so
+ * single ref writes can keep writing loose files.  Batches of ref updates
+ * are written to packed-refs when core/packed-refs is set, and
+ * ostree_repo_pack_refs() moves loose refs into it.  Aliases are symlinks to
+ * loose files, so they and their targets are never packed.
+ */
+#define PACKED_REFS "refs/packed-refs"
+#define PACKED_REFS_LOCK "refs/packed-refs.lock"
+#define PACKED_REFS_HEADER "# ostree packed-refs\n"
+#define PACKED_REFS_HEADER_LEN (sizeof (PACKED_REFS_HEADER) - 1)
+
+/* Map the packed-refs file; @out_mfile is set to %NULL if there is none */
+static gboolean
+packed_refs_map (OstreeRepo    *self,
+                 GMappedFile  **out_mfile,
+                 GError       **error)
+{
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (self->repo_dir_fd, PACKED_REFS, &fd, error))
+    return FALSE;
+  if (fd == -1)
+    {
+      *out_mfile = NULL;
+      return TRUE;
+    }
+
+  g_autoptr(GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    return FALSE;
+
+  const char *contents = g_mapped_file_get_contents (mfile);
+  const gsize len = g_mapped_file_get_length (mfile);
+  if (len < PACKED_REFS_HEADER_LEN ||
+      memcmp (contents, PACKED_REFS_HEADER, PACKED_REFS_HEADER_LEN) != 0 ||
+      contents[len - 1] != '\n')
+    return glnx_throw (error, "Invalid header in %s", PACKED_REFS);
+
+  *out_mfile = g_steal_pointer (&mfile);
+  return TRUE;
+}
+
+/* Parse the line starting at @p, which must be before @end; neither @out_rev
+ * nor @out_path are nul-terminated.  Returns the start of the next line. */
+static const char *
+packed_refs_parse_line (const char   *p,
+                        const char   *end,
+                        const char  **out_rev,
+                        const char  **out_path,
+                        gsize        *out_path_len,
+                        GError      **error)
+{
+  const char *nl = memchr (p, '\n', end - p);
+  if (nl == NULL || nl - p <= OSTREE_SHA256_STRING_LEN + 1 ||
+      p[OSTREE_SHA256_STRING_LEN] != ' ')
+    return glnx_null_throw (error, "Invalid line in %s", PACKED_REFS);
+
+  *out_rev = p;
+  *out_path = p + OSTREE_SHA256_STRING_LEN + 1;
+  *out_path_len = nl - *out_path;
+  return nl + 1;
+}
+
+static char *
+packed_refs_dup_rev (const char  *rev,
+                     GError     **error)
+{
+  g_autofree char *ret_rev = g_strndup (rev, OSTREE_SHA256_STRING_LEN);
+  if (!ostree_validate_checksum_string (ret_rev, error))
+    return NULL;
+  return g_steal_pointer (&ret_rev);
+}
+
+typedef struct {
+  const char *p;
+  const char *end;
+} PackedRefsIter;
+
+static void
+packed_refs_iter_init (PackedRefsIter *iter,
+                       GMappedFile    *mfile)
+{
+  if (mfile == NULL)
+    {
+      iter->p = iter->end = NULL;
+      return;
+    }
+
+  const char *contents = g_mapped_file_get_contents (mfile);
+  iter->p = contents + PACKED_REFS_HEADER_LEN;
+  iter->end = contents + g_mapped_file_get_length (mfile);
+}
+
+/* Step to the next packed ref; @out_path is set to %NULL at the end.  The
+ * path and checksum are copies. */
+static gboolean
+packed_refs_iter_next (PackedRefsIter  *iter,
+                       char           **out_path,
+                       char           **out_rev,
+                       GError         **error)
+{
+  if (iter->p == iter->end)
+    {
+      *out_path = NULL;
+      return TRUE;
+    }
+
+  const char *rev, *path;
+  gsize path_len;
+  const char *next = packed_refs_parse_line (iter->p, iter->end, &rev, &path, &path_len, error);
+  if (next == NULL)
+    return FALSE;
+
+  g_autofree char *ret_rev = packed_refs_dup_rev (rev, error);
+  if (ret_rev == NULL)
+    return FALSE;
+
+  iter->p = next;
+  *out_path = g_strndup (path, path_len);
+  *out_rev = g_steal_pointer (&ret_rev);
+  return TRUE;
+}
+
+/* Binary search @mfile for the ref at @path, relative to refs/.  @out_rev is
+ * set to %NULL if it is not packed. */
+static gboolean
+packed_refs_lookup (GMappedFile  *mfile,
+                    const char   *path,
+                    char        **out_rev,
+                    GError      **error)
+{
+  *out_rev = NULL;
+  if (mfile == NULL)
+    return TRUE;
+
+  const gsize path_len = strlen (path);
+  const char *contents = g_mapped_file_get_contents (mfile);
+  const char *lo = contents + PACKED_REFS_HEADER_LEN;
+  const char *hi = contents + g_mapped_file_get_length (mfile);
+
+  /* @lo and @hi are always at the start of a line */
+  while (lo < hi)
+    {
+      const char *line = lo + (hi - lo) / 2;
+      while (line > lo && line[-1] != '\n')
+        line--;
+
+      const char *rev, *line_path;
+      gsize line_path_len;
+      const char *next = packed_refs_parse_line (line, hi, &rev, &line_path, &line_path_len, error);
+      if (next == NULL)
+        return FALSE;
+
+      int cmp = memcmp (path, line_path, MIN (path_len, line_path_len));
+      if (cmp == 0)
+        cmp = (path_len > line_path_len) - (path_len < line_path_len);
+
+      if (cmp == 0)
+        {
+          *out_rev = packed_refs_dup_rev (rev, error);
+          return *out_rev != NULL;
+        }
+      else if (cmp < 0)
+        hi = line;
+      else
+        lo = next;
+    }
+
+  return TRUE;
+}
+
+/* Load the packed refs as a path ↦ checksum table, which is empty if there
+ * is no packed-refs file */
+static gboolean
+packed_refs_load (OstreeRepo    *self,
+                  GHashTable   **out_refs,
+                  GError       **error)
+{
+  g_autoptr(GMappedFile) mfile = NULL;
+  if (!packed_refs_map (self, &mfile, error))
+    return FALSE;
+
+  g_autoptr(GHashTable) ret_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  PackedRefsIter iter;
+  packed_refs_iter_init (&iter, mfile);
+  while (TRUE)
+    {
+      char *path, *rev;
+      if (!packed_refs_iter_next (&iter, &path, &rev, error))
+        return FALSE;
+      if (path == NULL)
+        break;
+      g_hash_table_replace (ret_refs, path, rev);
+    }
+
+  *out_refs = g_steal_pointer (&ret_refs);
+  return TRUE;
+}
+
+static int
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return strcmp (*(const char *const *) a, *(const char *const *) b);
+}
+
+/* Apply @changes (path ↦ checksum, or ↦ %NULL to delete) to the packed refs,
+ * replacing the file with a single rename.
+ *
+ * Rewrites are serialized on their own lock file rather than the repo lock:
+ * this is called with the shared repo lock held by a transaction, and two
+ * committers upgrading to the exclusive lock would wait on each other until
+ * the lock timeout.  Readers don't need the lock, since they only ever see
+ * a complete file. */
+static gboolean
+packed_refs_update (OstreeRepo    *self,
+                    GHashTable    *changes,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  gboolean have_additions = FALSE;
+  GLNX_HASH_TABLE_FOREACH_V (changes, const char*, rev)
+    have_additions = have_additions || rev != NULL;
+
+  /* Deleting refs which aren't packed (the common case, since loose refs
+   * take precedence) mustn't cost a lock and a rewrite; checking without
+   * the lock is fine, as concurrent writers race on refs regardless. */
+  if (!have_additions)
+    {
+      g_autoptr(GMappedFile) mfile = NULL;
+      if (!packed_refs_map (self, &mfile, error))
+        return FALSE;
+
+      gboolean have_packed = FALSE;
+      GLNX_HASH_TABLE_FOREACH (changes, const char*, path)
+        {
+          g_autofree char *packed_rev = NULL;
+          if (!have_packed && !packed_refs_lookup (mfile, path, &packed_rev, error))
+            return FALSE;
+          have_packed = have_packed || packed_rev != NULL;
+        }
+      if (!have_packed)
+        return TRUE;
+    }
+
+  g_auto(GLnxLockFile) lock = { 0, };
+  if (!glnx_make_lock_file (self->repo_dir_fd, PACKED_REFS_LOCK, LOCK_EX, &lock, error))
+    return FALSE;
+
+  g_autoptr(GHashTable) packed = NULL;
+  if (!packed_refs_load (self, &packed, error))
+    return FALSE;
+
+  gboolean changed = FALSE;
+  GLNX_HASH_TABLE_FOREACH_KV (changes, const char*, path, const char*, rev)
+    {
+      if (rev == NULL)
+        changed = g_hash_table_remove (packed, path) || changed;
+      else if (g_strcmp0 (g_hash_table_lookup (packed, path), rev) != 0)
+        {
+          g_hash_table_replace (packed, g_strdup (path), g_strdup (rev));
+          changed = TRUE;
+        }
+    }
+  if (!changed)
+    return TRUE;
+
+  /* As with loose refs, a ref can't also be a directory of other refs */
+  g_autoptr(GHashTable) parents = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  GLNX_HASH_TABLE_FOREACH (packed, const char*, path)
+    {
+      for (const char *slash = strchr (path, '/'); slash; slash = strchr (slash + 1, '/'))
+        g_hash_table_add (parents, g_strndup (path, slash - path));
+    }
+  GLNX_HASH_TABLE_FOREACH (parents, const char*, parent)
+    {
+      if (g_hash_table_contains (packed, parent))
+        return glnx_throw (error, "Conflict: refs exist under %s when attempting write", parent);
+    }
+
+  if (g_hash_table_size (packed) == 0)
+    return ot_ensure_unlinked_at (self->repo_dir_fd, PACKED_REFS, error);
+
+  g_autoptr(GPtrArray) paths = g_hash_table_get_keys_as_ptr_array (packed);
+  g_ptr_array_sort (paths, compare_strings);
+
+  g_autoptr(GString) buf = g_string_new (PACKED_REFS_HEADER);
+  for (guint i = 0; i < paths->len; i++)
+    {
+      const char *path = paths->pdata[i];
+      g_string_append_printf (buf, "%s %s\n", (char*)g_hash_table_lookup (packed, path), path);
+    }
+
+  return _ostree_repo_file_replace_contents (self, self->repo_dir_fd, PACKED_REFS,
+                                             (guint8*)buf->str, buf->len,
+                                             cancellable, error);
+}
+
+/* The path of @ref relative to refs/, e.g. heads/foo */
+static char *
+ref_path (OstreeRepo                 *self,
+          const char                 *remote,
+          const OstreeCollectionRef  *ref)
+{
+  if (remote == NULL &&
+      (ref->collection_id == NULL || g_strcmp0 (ref->collection_id, ostree_repo_get_collection_id (self)) == 0))
+    return g_strconcat ("heads/", ref->ref_name, NULL);
+  else if (remote == NULL)
+    return g_strconcat ("mirrors/", ref->collection_id, "/", ref->ref_name, NULL);
+  else
+    return g_strconcat ("remotes/", remote, "/", ref->ref_name, NULL);
+}
+
 static gboolean
 write_checksum_file_at (OstreeRepo   *self,
                         int dfd,
@@ -184,6 +503,38 @@ find_ref_in_remotes (OstreeRepo         *self,
   return TRUE;
 }
 
+/* Like find_ref_in_remotes(), for packed refs */
+static gboolean
+find_packed_ref_in_remotes (GMappedFile  *packed,
+                            const char   *rev,
+                            char        **out_rev,
+                            GError      **error)
+{
+  PackedRefsIter iter;
+  packed_refs_iter_init (&iter, packed);
+  while (TRUE)
+    {
+      g_autofree char *path = NULL;
+      g_autofree char *checksum = NULL;
+      if (!packed_refs_iter_next (&iter, &path, &checksum, error))
+        return FALSE;
+      if (path == NULL)
+        break;
+
+      if (!g_str_has_prefix (path, "remotes/"))
+        continue;
+      const char *slash = strchr (path + strlen ("remotes/"), '/');
+      if (slash != NULL && strcmp (slash + 1, rev) == 0)
+        {
+          *out_rev = g_steal_pointer (&checksum);
+          return TRUE;
+        }
+    }
+
+  *out_rev = NULL;
+  return TRUE;
+}
+
 static gboolean
 resolve_refspec (OstreeRepo     *self,
                  const char     *remote,
@@ -266,36 +617,50 @@ resolve_refspec (OstreeRepo     *self,
       return TRUE;
     }
 
+  g_autoptr(GMappedFile) packed = NULL;
+  gboolean packed_mapped = FALSE;
+  const char *paths[2] = { NULL, };
   if (remote != NULL)
+    paths[0] = glnx_strjoina ("remotes/", remote, "/", ref);
+  else
     {
-      const char *remote_ref = glnx_strjoina ("refs/remotes/", remote, "/", ref);
-
-      if (!ot_openat_ignore_enoent (self->repo_dir_fd, remote_ref, &target_fd, error))
-        return FALSE;
+      paths[0] = glnx_strjoina ("heads/", ref);
+      if (fallback_remote)
+        paths[1] = glnx_strjoina ("remotes/", ref);
     }
-  else
+
+  /* Look for each loose ref, then for it in packed-refs */
+  for (guint i = 0; i < G_N_ELEMENTS (paths) && paths[i] != NULL && ret_rev == NULL; i++)
     {
-      const char *local_ref = glnx_strjoina ("refs/heads/", ref);
+      const char *loose_path = glnx_strjoina ("refs/", paths[i]);
 
-      if (!ot_openat_ignore_enoent (self->repo_dir_fd, local_ref, &target_fd, error))
+      if (!ot_openat_ignore_enoent (self->repo_dir_fd, loose_path, &target_fd, error))
         return FALSE;
+      if (target_fd != -1)
+        break;
 
-      if (target_fd == -1 && fallback_remote)
+      if (!packed_mapped)
         {
-          local_ref = glnx_strjoina ("refs/remotes/", ref);
-
-          if (!ot_openat_ignore_enoent (self->repo_dir_fd, local_ref, &target_fd, error))
+          if (!packed_refs_map (self, &packed, error))
             return FALSE;
-
-          if (target_fd == -1)
-            {
-              if (!find_ref_in_remotes (self, ref, &target_fd, error))
-                return FALSE;
-            }
+          packed_mapped = TRUE;
         }
+      if (!packed_refs_lookup (packed, paths[i], &ret_rev, error))
+        return FALSE;
     }
 
-  if (target_fd != -1)
+  if (target_fd == -1 && ret_rev == NULL && remote == NULL && fallback_remote)
+    {
+      if (!find_ref_in_remotes (self, ref, &target_fd, error))
+        return FALSE;
+      if (target_fd == -1 &&
+          !find_packed_ref_in_remotes (packed, ref, &ret_rev, error))
+        return FALSE;
+    }
+
+  if (ret_rev != NULL)
+    ;
+  else if (target_fd != -1)
     {
       ret_rev = glnx_fd_readall_utf8 (target_fd, NULL, NULL, error);
       if (!ret_rev)
@@ -729,6 +1094,10 @@ _ostree_repo_list_refs_internal (OstreeRepo       *self,
           path = glnx_strjoina (prefix_path, ref_prefix);
         }
 
+      g_autoptr(GString) base_path = g_string_new ("");
+      if (!cut_prefix)
+        g_string_printf (base_path, "%s/", ref_prefix);
+
       if (!glnx_fstatat_allow_noent (self->repo_dir_fd, path, &stbuf, 0, error))
         return FALSE;
       if (errno == 0)
@@ -736,9 +1105,6 @@ _ostree_repo_list_refs_internal (OstreeRepo       *self,
           if (S_ISDIR (stbuf.st_mode))
             {
               glnx_autofd int base_fd = -1;
-              g_autoptr(GString) base_path = g_string_new ("");
-              if (!cut_prefix)
-                g_string_printf (base_path, "%s/", ref_prefix);
 
               if (!glnx_opendirat (self->repo_dir_fd, cut_prefix ? path : prefix_path, TRUE, &base_fd, error))
                 return FALSE;
@@ -760,6 +1126,47 @@ _ostree_repo_list_refs_internal (OstreeRepo       *self,
                 return FALSE;
             }
         }
+
+      /* Add packed refs, unless a loose one was found; they're keyed the
+       * same way as the loose refs above */
+      if (!(flags & OSTREE_REPO_LIST_REFS_EXT_ALIASES))
+        {
+          const char *packed_prefix = path + strlen ("refs/");
+          if (g_str_equal (ref_prefix, "."))
+            packed_prefix = prefix_path + strlen ("refs/");
+          else
+            packed_prefix = glnx_strjoina (packed_prefix, "/");
+          const gsize packed_prefix_len = strlen (packed_prefix);
+
+          g_autoptr(GMappedFile) packed = NULL;
+          if (!packed_refs_map (self, &packed, error))
+            return FALSE;
+
+          PackedRefsIter iter;
+          packed_refs_iter_init (&iter, packed);
+          while (TRUE)
+            {
+              g_autofree char *packed_path = NULL;
+              g_autofree char *rev = NULL;
+              if (!packed_refs_iter_next (&iter, &packed_path, &rev, error))
+                return FALSE;
+              if (packed_path == NULL)
+                break;
+
+              g_autofree char *refspec = NULL;
+              if (strncmp (packed_path, packed_prefix, packed_prefix_len) == 0)
+                refspec = g_strconcat (remote ? remote : "", remote ? ":" : "",
+                                       base_path->str, packed_path + packed_prefix_len, NULL);
+              else if (strncmp (packed_path, path + strlen ("refs/"), packed_prefix_len - 1) == 0 &&
+                       packed_path[packed_prefix_len - 1] == '\0')
+                refspec = g_strconcat (remote ? remote : "", remote ? ":" : "", ref_prefix, NULL);
+              else
+                continue;
+
+              if (!g_hash_table_contains (ret_all_refs, refspec))
+                g_hash_table_insert (ret_all_refs, g_steal_pointer (&refspec), g_steal_pointer (&rev));
+            }
+        }
     }
   else
     {
@@ -805,6 +1212,45 @@ _ostree_repo_list_refs_internal (OstreeRepo       *self,
                 return FALSE;
             }
         }
+
+      /* Add packed refs, unless a loose one was found */
+      if (!(flags & OSTREE_REPO_LIST_REFS_EXT_ALIASES))
+        {
+          g_autoptr(GMappedFile) packed = NULL;
+          if (!packed_refs_map (self, &packed, error))
+            return FALSE;
+
+          PackedRefsIter iter;
+          packed_refs_iter_init (&iter, packed);
+          while (TRUE)
+            {
+              g_autofree char *packed_path = NULL;
+              g_autofree char *rev = NULL;
+              if (!packed_refs_iter_next (&iter, &packed_path, &rev, error))
+                return FALSE;
+              if (packed_path == NULL)
+                break;
+
+              g_autofree char *refspec = NULL;
+              if (g_str_has_prefix (packed_path, "heads/"))
+                refspec = g_strdup (packed_path + strlen ("heads/"));
+              else if (g_str_has_prefix (packed_path, "remotes/") &&
+                       !(flags & OSTREE_REPO_LIST_REFS_EXT_EXCLUDE_REMOTES))
+                {
+                  const char *remote_name = packed_path + strlen ("remotes/");
+                  char *slash = strchr (remote_name, '/');
+                  if (slash == NULL)
+                    continue;
+                  *slash = ':';
+                  refspec = g_strdup (remote_name);
+                }
+              else
+                continue;
+
+              if (!g_hash_table_contains (ret_all_refs, refspec))
+                g_hash_table_insert (ret_all_refs, g_steal_pointer (&refspec), g_steal_pointer (&rev));
+            }
+        }
     }
 
   ot_transfer_out_value (out_all_refs, &ret_all_refs);
@@ -1090,27 +1536,58 @@ relative_symlink_to (const char *relpath,
   return g_string_free (g_steal_pointer (&buf), FALSE);
 }
 
-/* May specify @rev or @alias */
-gboolean
-_ostree_repo_write_ref (OstreeRepo                 *self,
-                        const char                 *remote,
-                        const OstreeCollectionRef  *ref,
-                        const char                 *rev,
-                        const char                 *alias,
-                        GCancellable               *cancellable,
-                        GError                    **error)
+static gboolean
+validate_ref (const char                 *remote,
+              const OstreeCollectionRef  *ref,
+              GError                    **error)
 {
-  glnx_autofd int dfd = -1;
-
-  g_return_val_if_fail (remote == NULL || ref->collection_id == NULL, FALSE);
-  g_return_val_if_fail (!(rev != NULL && alias != NULL), FALSE);
-
   if (remote != NULL && !ostree_validate_remote_name (remote, error))
     return FALSE;
   if (ref->collection_id != NULL && !ostree_validate_collection_id (ref->collection_id, error))
     return FALSE;
   if (!ostree_validate_rev (ref->ref_name, error))
     return FALSE;
+  return TRUE;
+}
+
+/* Aliases are symlinks, so their target must be a loose ref; if it's only
+ * packed, write it out as a loose ref too. */
+static gboolean
+ensure_alias_target_loose (OstreeRepo    *self,
+                           int            dfd,
+                           const char    *alias,
+                           const char    *alias_path,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  if (!glnx_fstatat_allow_noent (dfd, alias, NULL, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  if (errno == 0)
+    return TRUE;
+
+  g_autoptr(GMappedFile) packed = NULL;
+  if (!packed_refs_map (self, &packed, error))
+    return FALSE;
+  g_autofree char *rev = NULL;
+  if (!packed_refs_lookup (packed, alias_path, &rev, error))
+    return FALSE;
+  if (rev == NULL)
+    return TRUE;
+
+  return write_checksum_file_at (self, dfd, alias, rev, cancellable, error);
+}
+
+/* May specify @rev or @alias */
+static gboolean
+write_loose_ref (OstreeRepo                 *self,
+                 const char                 *remote,
+                 const OstreeCollectionRef  *ref,
+                 const char                 *rev,
+                 const char                 *alias,
+                 GCancellable               *cancellable,
+                 GError                    **error)
+{
+  glnx_autofd int dfd = -1;
 
   if (remote == NULL &&
       (ref->collection_id == NULL || g_strcmp0 (ref->collection_id, ostree_repo_get_collection_id (self)) == 0))
@@ -1185,6 +1662,11 @@ _ostree_repo_write_ref (OstreeRepo                 *self,
             return FALSE;
         }
 
+      const OstreeCollectionRef alias_ref = { ref->collection_id, (char *) alias };
+      g_autofree char *alias_path = ref_path (self, remote, &alias_ref);
+      if (!ensure_alias_target_loose (self, dfd, alias, alias_path, cancellable, error))
+        return FALSE;
+
       g_autofree char *reltarget = relative_symlink_to (ref->ref_name, alias);
       g_autofree char *tmplink = NULL;
       if (!_ostree_make_temporary_symlink_at (self->tmp_dir_fd, reltarget,
@@ -1194,6 +1676,38 @@ _ostree_repo_write_ref (OstreeRepo                 *self,
         return FALSE;
     }
 
+  return TRUE;
+}
+
+/* May specify @rev or @alias */
+gboolean
+_ostree_repo_write_ref (OstreeRepo                 *self,
+                        const char                 *remote,
+                        const OstreeCollectionRef  *ref,
+                        const char                 *rev,
+                        const char                 *alias,
+                        GCancellable               *cancellable,
+                        GError                    **error)
+{
+  g_return_val_if_fail (remote == NULL || ref->collection_id == NULL, FALSE);
+  g_return_val_if_fail (!(rev != NULL && alias != NULL), FALSE);
+
+  if (!validate_ref (remote, ref, error))
+    return FALSE;
+
+  if (!write_loose_ref (self, remote, ref, rev, alias, cancellable, error))
+    return FALSE;
+
+  /* A single ref is written as a loose ref, which overrides any packed one;
+   * but deleting it must delete both. */
+  if (rev == NULL && alias == NULL)
+    {
+      g_autoptr(GHashTable) changes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_insert (changes, ref_path (self, remote, ref), NULL);
+      if (!packed_refs_update (self, changes, cancellable, error))
+        return FALSE;
+    }
+
   if (!_ostree_repo_update_mtime (self, error))
     return FALSE;
 
@@ -1205,12 +1719,74 @@ _ostree_repo_write_ref (OstreeRepo                 *self,
   return TRUE;
 }
 
+/* Add @ref to the batch of @packed_changes, or if there is a loose ref (or
+ * something else) in its place, update that instead. */
+static gboolean
+queue_packed_ref (OstreeRepo                 *self,
+                  const char                 *remote,
+                  const OstreeCollectionRef  *ref,
+                  const char                 *rev,
+                  GHashTable                 *packed_changes,
+                  GCancellable               *cancellable,
+                  GError                    **error)
+{
+  g_return_val_if_fail (remote == NULL || ref->collection_id == NULL, FALSE);
+
+  if (!validate_ref (remote, ref, error))
+    return FALSE;
+
+  g_autofree char *path = ref_path (self, remote, ref);
+
+  if (rev == NULL)
+    {
+      if (!write_loose_ref (self, remote, ref, NULL, NULL, cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      if (!ostree_validate_checksum_string (rev, error))
+        return FALSE;
+      if (ostree_validate_checksum_string (ref->ref_name, NULL))
+        return glnx_throw (error, "Rev name '%s' looks like a checksum", ref->ref_name);
+
+      const char *loose_path = glnx_strjoina ("refs/", path);
+      struct stat stbuf;
+      if (TEMP_FAILURE_RETRY (fstatat (self->repo_dir_fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW)) == 0 ||
+          errno != ENOENT)
+        return write_loose_ref (self, remote, ref, rev, NULL, cancellable, error);
+    }
+
+  g_hash_table_replace (packed_changes, g_steal_pointer (&path), (char*)rev);
+  return TRUE;
+}
+
+/* Write the batch of @packed_changes built by queue_packed_ref() */
+static gboolean
+commit_packed_refs (OstreeRepo    *self,
+                    GHashTable    *packed_changes,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  if (!packed_refs_update (self, packed_changes, cancellable, error))
+    return FALSE;
+
+  if (!_ostree_repo_update_mtime (self, error))
+    return FALSE;
+
+  if (!self->in_transaction && !_ostree_repo_maybe_regenerate_summary (self, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
 gboolean
 _ostree_repo_update_refs (OstreeRepo        *self,
                           GHashTable        *refs,  /* (element-type utf8 utf8) */
                           GCancellable      *cancellable,
                           GError           **error)
 {
+  g_autoptr(GHashTable) packed_changes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
   GLNX_HASH_TABLE_FOREACH_KV (refs, const char*, refspec, const char*, rev)
     {
       g_autofree char *remote = NULL;
@@ -1219,11 +1795,21 @@ _ostree_repo_update_refs (OstreeRepo        *self,
         return FALSE;
 
       const OstreeCollectionRef ref = { NULL, ref_name };
-      if (!_ostree_repo_write_ref (self, remote, &ref, rev, NULL,
-                                   cancellable, error))
+      if (self->packed_refs_enabled)
+        {
+          if (!queue_packed_ref (self, remote, &ref, rev, packed_changes,
+                                 cancellable, error))
+            return FALSE;
+        }
+      else if (!_ostree_repo_write_ref (self, remote, &ref, rev, NULL,
+                                        cancellable, error))
         return FALSE;
     }
 
+  if (g_hash_table_size (packed_changes) > 0 &&
+      !commit_packed_refs (self, packed_changes, cancellable, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -1233,6 +1819,7 @@ _ostree_repo_update_collection_refs (OstreeRepo        *self,
                                      GCancellable      *cancellable,
                                      GError           **error)
 {
+  g_autoptr(GHashTable) packed_changes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   GHashTableIter hash_iter;
   gpointer key, value;
 
@@ -1242,9 +1829,190 @@ _ostree_repo_update_collection_refs (OstreeRepo        *self,
       const OstreeCollectionRef *ref = key;
       const char *rev = value;
 
-      if (!_ostree_repo_write_ref (self, NULL, ref, rev, NULL,
-                                   cancellable, error))
+      if (self->packed_refs_enabled)
+        {
+          if (!queue_packed_ref (self, NULL, ref, rev, packed_changes,
+                                 cancellable, error))
+            return FALSE;
+        }
+      else if (!_ostree_repo_write_ref (self, NULL, ref, rev, NULL,
+                                        cancellable, error))
+        return FALSE;
+    }
+
+  if (g_hash_table_size (packed_changes) > 0 &&
+      !commit_packed_refs (self, packed_changes, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Collect the loose refs below @path (relative to refs/, ending in '/') as
+ * path ↦ checksum in @refs, the paths of alias targets in @alias_targets, and
+ * the directories they are in in @dirs, children first.  @ns_len is the
+ * length of the prefix of @path the refs are named relative to, such as
+ * heads/ or remotes/origin/, or 0 if that is further down. */
+static gboolean
+collect_loose_refs (OstreeRepo    *self,
+                    GString       *path,
+                    gsize          ns_len,
+                    GHashTable    *refs,
+                    GHashTable    *alias_targets,
+                    GPtrArray     *dirs,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  gboolean exists;
+  g_autofree char *dir_path = g_strconcat ("refs/", path->str, NULL);
+
+  if (!ot_dfd_iter_init_allow_noent (self->repo_dir_fd, dir_path, &dfd_iter, &exists, error))
+    return FALSE;
+  if (!exists)
+    return TRUE;
+
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
         return FALSE;
+      if (dent == NULL)
+        break;
+
+      if (!_ostree_validate_ref_fragment (dent->d_name, NULL))
+        continue;
+      if (ns_len == 0 && dent->d_type != DT_DIR)
+        continue;
+
+      const gsize len = path->len;
+      g_string_append (path, dent->d_name);
+
+      if (dent->d_type == DT_DIR)
+        {
+          g_string_append_c (path, '/');
+          if (!collect_loose_refs (self, path, ns_len > 0 ? ns_len : path->len,
+                                   refs, alias_targets, dirs, cancellable, error))
+            return FALSE;
+        }
+      else if (dent->d_type == DT_LNK)
+        {
+          g_autofree char *target = glnx_readlinkat_malloc (dfd_iter.fd, dent->d_name,
+                                                            cancellable, error);
+          if (!target)
+            return FALSE;
+          const char *resolved_target = target;
+          while (g_str_has_prefix (resolved_target, "../"))
+            resolved_target += 3;
+          g_hash_table_add (alias_targets, g_strdup_printf ("%.*s%s", (int) ns_len, path->str,
+                                                            resolved_target));
+        }
+      else if (dent->d_type == DT_REG)
+        {
+          g_autofree char *rev = glnx_file_get_contents_utf8_at (dfd_iter.fd, dent->d_name, NULL,
+                                                                 cancellable, error);
+          if (!rev)
+            return FALSE;
+          g_strchomp (rev);
+          if (!ostree_validate_checksum_string (rev, error))
+            return glnx_prefix_error (error, "Ref %s", path->str);
+          g_hash_table_insert (refs, g_strdup (path->str), g_steal_pointer (&rev));
+        }
+
+      g_string_truncate (path, len);
+    }
+
+  if (ns_len > 0 && path->len > ns_len)
+    g_ptr_array_add (dirs, g_steal_pointer (&dir_path));
+
+  return TRUE;
+}
+
+/**
+ * ostree_repo_pack_refs:
+ * @self: Repo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Move the loose refs of @self (one file per ref under `refs/`) into its
+ * `refs/packed-refs` file, which is read with a single mmap() when listing
+ * or resolving refs.  Aliases, and the refs they point to, stay loose.
+ *
+ * Setting the `core.packed-refs` option makes ref updates in transactions
+ * write to the packed-refs file too; otherwise they write loose refs, which
+ * take precedence over packed ones.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: 2019.3
+ */
+gboolean
+ostree_repo_pack_refs (OstreeRepo    *self,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Packing refs", error);
+
+  g_return_val_if_fail (OSTREE_IS_REPO (self), FALSE);
+
+  g_autoptr(OstreeRepoAutoLock) lock =
+    _ostree_repo_auto_lock_push (self, OSTREE_REPO_LOCK_EXCLUSIVE, cancellable, error);
+  if (!lock)
+    return FALSE;
+
+  g_autoptr(GHashTable) loose_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(GHashTable) alias_targets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GPtrArray) dirs = g_ptr_array_new_with_free_func (g_free);
+  const char *toplevel_dirs[] = { "heads/", "remotes/", "mirrors/" };
+
+  for (guint i = 0; i < G_N_ELEMENTS (toplevel_dirs); i++)
+    {
+      g_autoptr(GString) path = g_string_new (toplevel_dirs[i]);
+      /* Refs under remotes/ and mirrors/ are per remote or collection */
+      const gsize ns_len = g_str_equal (toplevel_dirs[i], "heads/") ? path->len : 0;
+
+      if (!collect_loose_refs (self, path, ns_len, loose_refs, alias_targets, dirs,
+                               cancellable, error))
+        return FALSE;
+    }
+
+  GLNX_HASH_TABLE_FOREACH (alias_targets, const char*, target)
+    g_hash_table_remove (loose_refs, target);
+
+  if (g_hash_table_size (loose_refs) == 0)
+    return TRUE;
+
+  if (!packed_refs_update (self, loose_refs, cancellable, error))
+    return FALSE;
+
+  /* Loose ref writes don't take the repo lock; a ref that changed since it
+   * was read above still overrides the packed one, so leave it */
+  GLNX_HASH_TABLE_FOREACH_KV (loose_refs, const char*, path, const char*, rev)
+    {
+      const char *loose_path = glnx_strjoina ("refs/", path);
+      glnx_autofd int fd = -1;
+
+      if (!ot_openat_ignore_enoent (self->repo_dir_fd, loose_path, &fd, error))
+        return FALSE;
+      if (fd == -1)
+        continue;
+
+      g_autofree char *contents = glnx_fd_readall_utf8 (fd, NULL, cancellable, error);
+      if (!contents)
+        return FALSE;
+      g_strchomp (contents);
+
+      if (g_str_equal (contents, rev) &&
+          !ot_ensure_unlinked_at (self->repo_dir_fd, loose_path, error))
+        return FALSE;
+    }
+
+  /* Remove the directories left empty, so listing doesn't walk them */
+  for (guint i = 0; i < dirs->len; i++)
+    {
+      const char *dir = dirs->pdata[i];
+      if (unlinkat (self->repo_dir_fd, dir, AT_REMOVEDIR) < 0 &&
+          !G_IN_SET (errno, ENOENT, ENOTEMPTY, EEXIST))
+        return glnx_throw_errno_prefix (error, "rmdir(%s)", dir);
     }
 
   return TRUE;
@@ -1393,6 +2161,79 @@ ostree_repo_list_collection_refs (OstreeRepo                 *self,
         }
     }
 
+  /* Add packed refs, unless a loose one was found */
+  if (!(flags & OSTREE_REPO_LIST_REFS_EXT_ALIASES))
+    {
+      g_autoptr(GMappedFile) packed = NULL;
+      if (!packed_refs_map (self, &packed, error))
+        return FALSE;
+
+      /* remote name ↦ collection ID, or %NULL if it has none */
+      g_autoptr(GHashTable) remote_collection_ids =
+        g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+      PackedRefsIter iter;
+      packed_refs_iter_init (&iter, packed);
+      while (TRUE)
+        {
+          g_autofree char *packed_path = NULL;
+          g_autofree char *rev = NULL;
+          if (!packed_refs_iter_next (&iter, &packed_path, &rev, error))
+            return FALSE;
+          if (packed_path == NULL)
+            break;
+
+          const char *current_collection_id = NULL;
+          const char *ref_name = NULL;
+          if (g_str_has_prefix (packed_path, "heads/"))
+            {
+              current_collection_id = main_collection_id;
+              ref_name = packed_path + strlen ("heads/");
+            }
+          else if (g_str_has_prefix (packed_path, "mirrors/") &&
+                   !(flags & OSTREE_REPO_LIST_REFS_EXT_EXCLUDE_MIRRORS))
+            {
+              char *slash = strchr (packed_path + strlen ("mirrors/"), '/');
+              if (slash == NULL)
+                continue;
+              *slash = '\0';
+              current_collection_id = packed_path + strlen ("mirrors/");
+              ref_name = slash + 1;
+            }
+          else if (g_str_has_prefix (packed_path, "remotes/") &&
+                   !(flags & OSTREE_REPO_LIST_REFS_EXT_EXCLUDE_REMOTES))
+            {
+              char *slash = strchr (packed_path + strlen ("remotes/"), '/');
+              if (slash == NULL)
+                continue;
+              *slash = '\0';
+              const char *remote_name = packed_path + strlen ("remotes/");
+              ref_name = slash + 1;
+
+              if (!g_hash_table_lookup_extended (remote_collection_ids, remote_name,
+                                                 NULL, (gpointer *) &current_collection_id))
+                {
+                  g_autofree gchar *remote_collection_id = NULL;
+                  if (!ostree_repo_get_remote_option (self, remote_name, "collection-id",
+                                                      NULL, &remote_collection_id, NULL) ||
+                      !ostree_validate_collection_id (remote_collection_id, NULL))
+                    g_clear_pointer (&remote_collection_id, g_free);
+                  current_collection_id = remote_collection_id;
+                  g_hash_table_insert (remote_collection_ids, g_strdup (remote_name),
+                                       g_steal_pointer (&remote_collection_id));
+                }
+            }
+
+          if (current_collection_id == NULL ||
+              (match_collection_id != NULL && g_strcmp0 (match_collection_id, current_collection_id) != 0))
+            continue;
+
+          g_autoptr(OstreeCollectionRef) ref = ostree_collection_ref_new (current_collection_id, ref_name);
+          if (!g_hash_table_contains (ret_all_refs, ref))
+            g_hash_table_insert (ret_all_refs, g_steal_pointer (&ref), g_steal_pointer (&rev));
+        }
+    }
+
   ot_transfer_out_value (out_all_refs, &ret_all_refs);
   return TRUE;
 }
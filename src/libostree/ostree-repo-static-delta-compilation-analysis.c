@@ -188,6 +188,24 @@ build_content_sizenames_filtered (OstreeRepo              *repo,
   return ret;
 }
 
+typedef struct {
+  OstreeRepo *repo;
+  GVariant *commit;
+  GCancellable *cancellable;
+  GPtrArray *sizenames;
+  GError *error;
+} BuildSizenamesData;
+
+static gpointer
+build_content_sizenames_thread (gpointer data)
+{
+  BuildSizenamesData *build = data;
+  (void) build_content_sizenames_filtered (build->repo, build->commit, NULL,
+                                           &build->sizenames,
+                                           build->cancellable, &build->error);
+  return NULL;
+}
+
 static gboolean
 string_array_nonempty_intersection (GPtrArray    *a,
                                     GPtrArray    *b,
@@ -257,6 +275,8 @@ sizename_is_delta_candidate (OstreeDeltaContentSizeNames *sizename)
  * @new_reachable_regfile_content is a Set<checksum> of new regular
  * file objects.
  *
+ * With @n_jobs > 1, the two commits are scanned concurrently.
+ *
  * Currently, @out_modified_regfile_content will be a Map<to checksum,from checksum>;
  * however in the future it would be easy to have this function return
  * multiple candidate matches.  The hard part would be changing
@@ -269,6 +289,7 @@ _ostree_delta_compute_similar_objects (OstreeRepo                 *repo,
                                        GVariant                   *to_commit,
                                        GHashTable                 *new_reachable_regfile_content,
                                        guint                       similarity_percent_threshold,
+                                       guint                       n_jobs,
                                        GHashTable                **out_modified_regfile_content,
                                        GCancellable               *cancellable,
                                        GError                    **error)
@@ -282,15 +303,35 @@ _ostree_delta_compute_similar_objects (OstreeRepo                 *repo,
   guint lower;
   guint upper;
 
-  if (!build_content_sizenames_filtered (repo, from_commit, NULL,
-                                         &from_sizes,
-                                         cancellable, error))
-    goto out;
-
-  if (!build_content_sizenames_filtered (repo, to_commit, new_reachable_regfile_content,
-                                         &to_sizes,
-                                         cancellable, error))
-    goto out;
+  BuildSizenamesData from_build = { repo, from_commit, cancellable, };
+  GThread *from_thread = NULL;
+  if (n_jobs > 1)
+    {
+      from_thread = g_thread_try_new ("ostree-delta-scan", build_content_sizenames_thread,
+                                      &from_build, error);
+      if (!from_thread)
+        goto out;
+    }
+  else
+    build_content_sizenames_thread (&from_build);
+
+  const gboolean to_ok =
+    build_content_sizenames_filtered (repo, to_commit, new_reachable_regfile_content,
+                                      &to_sizes,
+                                      cancellable, error);
+  if (from_thread)
+    g_thread_join (from_thread);
+  from_sizes = g_steal_pointer (&from_build.sizenames);
+  if (!to_ok)
+    {
+      g_clear_error (&from_build.error);
+      goto out;
+    }
+  if (from_build.error)
+    {
+      g_propagate_error (error, g_steal_pointer (&from_build.error));
+      goto out;
+    }
 
   /* Iterate over all newly added objects, find objects which have
    * similar basename and sizes.
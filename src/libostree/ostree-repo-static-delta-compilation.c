@@ -23,12 +23,17 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <gio/gunixoutputstream.h>
 #include <gio/gmemoryoutputstream.h>
 
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
 #include "ostree-lzma-compressor.h"
+#ifdef HAVE_ZSTD
+#include "ostree-zstd-common.h"
+#include "ostree-zstd-compressor.h"
+#endif
 #include "ostree-repo-static-delta-private.h"
 #include "ostree-diff.h"
 #include "ostree-rollsum.h"
@@ -38,6 +43,15 @@
 #include "bsdiff/bsdiff.h"
 
 #define CONTENT_SIZE_SIMILARITY_THRESHOLD_PERCENT (30)
+/* Roughly what compressing one part takes: the LZMA encoder at preset 8,
+ * plus the uncompressed and compressed part in memory */
+#define PART_COMPRESSION_MEMORY_BYTES (512 * 1024 * 1024)
+
+/* zstd decompression speed hardly depends on the level, so use a high one */
+#define DELTA_ZSTD_LEVEL 19
+/* Train dictionaries on up to this much data, from files up to this size */
+#define ZSTD_DICTIONARY_SAMPLES_BYTES (16 * 1024 * 1024)
+#define ZSTD_DICTIONARY_MAX_SAMPLE_SIZE (128 * 1024)
 
 typedef enum {
   DELTAOPT_FLAG_NONE = (1 << 0),
@@ -73,6 +87,18 @@ typedef struct {
   gboolean swap_endian;
   int parts_dfd;
   DeltaOpts delta_opts;
+  guint8 compression; /* See OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT_V0 */
+  gboolean use_zstd_dictionary;
+  GBytes *zstd_dictionary;
+
+  /* Parallel compilation; see run_delta_jobs() */
+  guint n_jobs;
+  guint max_compress_jobs;
+  GThreadPool *compress_pool;
+  GMutex compress_lock;
+  GCond compress_cond;
+  guint n_compressing; /* Protected by compress_lock */
+  GError *compress_error; /* Protected by compress_lock */
 } OstreeStaticDeltaBuilder;
 
 /* Get an input stream for a GVariant */
@@ -210,10 +236,15 @@ xattr_chunk_equals (const void *one, const void *two)
   return memcmp (g_variant_get_data (v1), g_variant_get_data (v2), l1) == 0;
 }
 
+/* Compress and write out a part whose content has been built; this is
+ * thread-safe, and run from the compression pool when using multiple jobs.
+ */
 static gboolean
-finish_part (OstreeStaticDeltaBuilder *builder, GError **error)
+compress_part (OstreeStaticDeltaBuilder     *builder,
+               OstreeStaticDeltaPartBuilder *part_builder,
+               GVariant                     *delta_part_content,
+               GError                      **error)
 {
-  OstreeStaticDeltaPartBuilder *part_builder = builder->parts->pdata[builder->parts->len - 1];
   g_autofree guchar *part_checksum = NULL;
   g_autoptr(GBytes) objtype_checksum_array = NULL;
   g_autoptr(GBytes) checksum_bytes = NULL;
@@ -223,56 +254,48 @@ finish_part (OstreeStaticDeltaBuilder *builder, GError **error)
   g_autoptr(GMemoryOutputStream) part_payload_out = NULL;
   g_autoptr(GConverterOutputStream) part_payload_compressor = NULL;
   g_autoptr(GConverter) compressor = NULL;
-  g_autoptr(GVariant) delta_part_content = NULL;
   g_autoptr(GVariant) delta_part = NULL;
   g_autoptr(GVariant) delta_part_header = NULL;
-  g_auto(GVariantBuilder) mode_builder = OT_VARIANT_BUILDER_INITIALIZER;
-  g_auto(GVariantBuilder) xattr_builder = OT_VARIANT_BUILDER_INITIALIZER;
-  guint8 compression_type_char;
-
-  g_variant_builder_init (&mode_builder, G_VARIANT_TYPE ("a(uuu)"));
-  g_variant_builder_init (&xattr_builder, G_VARIANT_TYPE ("aa(ayay)"));
-  guint j;
-
-  for (j = 0; j < part_builder->modes->len; j++)
-    g_variant_builder_add_value (&mode_builder, part_builder->modes->pdata[j]);
+  g_autoptr(GBytes) payload = NULL;
 
-  for (j = 0; j < part_builder->xattrs->len; j++)
-    g_variant_builder_add_value (&xattr_builder, part_builder->xattrs->pdata[j]);
-
-  {
-    g_autoptr(GBytes) payload_b = g_string_free_to_bytes (g_steal_pointer (&part_builder->payload));
-    g_autoptr(GBytes) operations_b = g_string_free_to_bytes (g_steal_pointer (&part_builder->operations));
+  switch (builder->compression)
+    {
+    case 'x':
+      compressor = (GConverter*)_ostree_lzma_compressor_new (NULL);
+      break;
+#ifdef HAVE_ZSTD
+    case 'z':
+      compressor = (GConverter*)_ostree_zstd_compressor_new (DELTA_ZSTD_LEVEL, builder->zstd_dictionary);
+      break;
+#endif
+    default:
+      g_assert (builder->compression == 0);
+      break;
+    }
 
-    delta_part_content = g_variant_new ("(a(uuu)aa(ayay)@ay@ay)",
-                                        &mode_builder, &xattr_builder,
-                                        ot_gvariant_new_ay_bytes (payload_b),
-                                        ot_gvariant_new_ay_bytes (operations_b));
-    g_variant_ref_sink (delta_part_content);
-  }
+  if (compressor)
+    {
+      part_payload_in = variant_to_inputstream (delta_part_content);
+      part_payload_out = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+      part_payload_compressor = (GConverterOutputStream*)g_converter_output_stream_new ((GOutputStream*)part_payload_out, compressor);
 
-  /* Hardcode xz for now */
-  compressor = (GConverter*)_ostree_lzma_compressor_new (NULL);
-  compression_type_char = 'x';
-  part_payload_in = variant_to_inputstream (delta_part_content);
-  part_payload_out = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-  part_payload_compressor = (GConverterOutputStream*)g_converter_output_stream_new ((GOutputStream*)part_payload_out, compressor);
+      {
+        gssize n_bytes_written = g_output_stream_splice ((GOutputStream*)part_payload_compressor, part_payload_in,
+                                                         G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET | G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                                         NULL, error);
+        if (n_bytes_written < 0)
+          return FALSE;
+      }
 
-  {
-    gssize n_bytes_written = g_output_stream_splice ((GOutputStream*)part_payload_compressor, part_payload_in,
-                                                     G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET | G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
-                                                     NULL, error);
-    if (n_bytes_written < 0)
-      return FALSE;
-  }
+      g_clear_object (&part_payload_in);
+      payload = g_memory_output_stream_steal_as_bytes (part_payload_out);
+    }
+  else
+    payload = g_variant_get_data_as_bytes (delta_part_content);
 
-  g_clear_pointer (&delta_part_content, g_variant_unref);
-
-  { g_autoptr(GBytes) payload = g_memory_output_stream_steal_as_bytes (part_payload_out);
-    delta_part = g_variant_ref_sink (g_variant_new ("(y@ay)",
-                                                    compression_type_char,
-                                                    ot_gvariant_new_ay_bytes (payload)));
-  }
+  delta_part = g_variant_ref_sink (g_variant_new ("(y@ay)",
+                                                  builder->compression,
+                                                  ot_gvariant_new_ay_bytes (payload)));
 
   if (!glnx_open_tmpfile_linkable_at (builder->parts_dfd, ".", O_RDWR | O_CLOEXEC,
                                       &part_builder->part_tmpf, error))
@@ -299,12 +322,116 @@ finish_part (OstreeStaticDeltaBuilder *builder, GError **error)
   part_builder->header = g_variant_ref (delta_part_header);
   part_builder->compressed_size = g_variant_get_size (delta_part);
 
-  if (builder->delta_opts & DELTAOPT_FLAG_VERBOSE)
+  return TRUE;
+}
+
+typedef struct {
+  OstreeStaticDeltaPartBuilder *part_builder;
+  GVariant *delta_part_content;
+} CompressPartJob;
+
+static void
+compress_part_job_run (gpointer data,
+                       gpointer user_data)
+{
+  CompressPartJob *job = data;
+  OstreeStaticDeltaBuilder *builder = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  g_mutex_lock (&builder->compress_lock);
+  const gboolean failed = builder->compress_error != NULL;
+  g_mutex_unlock (&builder->compress_lock);
+
+  if (!failed)
+    (void) compress_part (builder, job->part_builder, job->delta_part_content, &local_error);
+  g_variant_unref (job->delta_part_content);
+  g_free (job);
+
+  g_mutex_lock (&builder->compress_lock);
+  if (local_error && !builder->compress_error)
+    builder->compress_error = g_steal_pointer (&local_error);
+  builder->n_compressing--;
+  g_cond_broadcast (&builder->compress_cond);
+  g_mutex_unlock (&builder->compress_lock);
+}
+
+/* Wait for all parts to be compressed */
+static gboolean
+wait_for_parts (OstreeStaticDeltaBuilder *builder,
+                GError                  **error)
+{
+  if (builder->compress_pool)
     {
-      g_printerr ("part %u n:%u compressed:%" G_GUINT64_FORMAT " uncompressed:%" G_GUINT64_FORMAT "\n",
-                  builder->parts->len, part_builder->objects->len,
-                  part_builder->compressed_size,
-                  part_builder->uncompressed_size);
+      g_thread_pool_free (g_steal_pointer (&builder->compress_pool), FALSE, TRUE);
+      if (builder->compress_error)
+        {
+          g_propagate_error (error, g_steal_pointer (&builder->compress_error));
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+static gboolean
+finish_part (OstreeStaticDeltaBuilder *builder, GError **error)
+{
+  OstreeStaticDeltaPartBuilder *part_builder = builder->parts->pdata[builder->parts->len - 1];
+  g_autoptr(GVariant) delta_part_content = NULL;
+  g_auto(GVariantBuilder) mode_builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_auto(GVariantBuilder) xattr_builder = OT_VARIANT_BUILDER_INITIALIZER;
+
+  g_variant_builder_init (&mode_builder, G_VARIANT_TYPE ("a(uuu)"));
+  g_variant_builder_init (&xattr_builder, G_VARIANT_TYPE ("aa(ayay)"));
+  guint j;
+
+  for (j = 0; j < part_builder->modes->len; j++)
+    g_variant_builder_add_value (&mode_builder, part_builder->modes->pdata[j]);
+
+  for (j = 0; j < part_builder->xattrs->len; j++)
+    g_variant_builder_add_value (&xattr_builder, part_builder->xattrs->pdata[j]);
+
+  {
+    g_autoptr(GBytes) payload_b = g_string_free_to_bytes (g_steal_pointer (&part_builder->payload));
+    g_autoptr(GBytes) operations_b = g_string_free_to_bytes (g_steal_pointer (&part_builder->operations));
+
+    delta_part_content = g_variant_new ("(a(uuu)aa(ayay)@ay@ay)",
+                                        &mode_builder, &xattr_builder,
+                                        ot_gvariant_new_ay_bytes (payload_b),
+                                        ot_gvariant_new_ay_bytes (operations_b));
+    g_variant_ref_sink (delta_part_content);
+  }
+
+  if (builder->max_compress_jobs <= 1)
+    return compress_part (builder, part_builder, delta_part_content, error);
+
+  /* Hand the part off to the compression pool, waiting for a free slot so
+   * we bound the memory used by parts in flight.
+   */
+  if (!builder->compress_pool)
+    {
+      builder->compress_pool = g_thread_pool_new (compress_part_job_run, builder,
+                                                  builder->max_compress_jobs, FALSE, error);
+      if (!builder->compress_pool)
+        return FALSE;
+    }
+
+  g_mutex_lock (&builder->compress_lock);
+  while (builder->n_compressing >= builder->max_compress_jobs)
+    g_cond_wait (&builder->compress_cond, &builder->compress_lock);
+  builder->n_compressing++;
+  g_mutex_unlock (&builder->compress_lock);
+
+  CompressPartJob *job = g_new0 (CompressPartJob, 1);
+  job->part_builder = part_builder;
+  job->delta_part_content = g_steal_pointer (&delta_part_content);
+  if (!g_thread_pool_push (builder->compress_pool, job, error))
+    {
+      g_mutex_lock (&builder->compress_lock);
+      builder->n_compressing--;
+      g_mutex_unlock (&builder->compress_lock);
+      g_variant_unref (job->delta_part_content);
+      g_free (job);
+      return FALSE;
     }
 
   return TRUE;
@@ -615,7 +742,6 @@ try_content_bsdiff (OstreeRepo                       *repo,
 
 static gboolean
 try_content_rollsum (OstreeRepo                       *repo,
-                     DeltaOpts                        opts,
                      const char                       *from,
                      const char                       *to,
                      ContentRollsum                  **out_rollsum,
@@ -644,14 +770,6 @@ try_content_rollsum (OstreeRepo                       *repo,
   if (match_ratio < 50)
     return TRUE;
 
-  if (opts & DELTAOPT_FLAG_VERBOSE)
-    {
-      g_printerr ("rollsum for %s -> %s; crcs=%u bufs=%u total=%u matchsize=%llu\n",
-                  from, to, matches->crcmatches,
-                  matches->bufmatches,
-                  matches->total, (unsigned long long)matches->match_size);
-    }
-
   ContentRollsum *ret_rollsum = g_new0 (ContentRollsum, 1);
   ret_rollsum->from_checksum = g_strdup (from);
   ret_rollsum->matches = g_steal_pointer (&matches);
@@ -812,12 +930,57 @@ process_one_rollsum (OstreeRepo                       *repo,
   return TRUE;
 }
 
+/* Compute the bsdiff from @from_checksum to @to_checksum; this is the
+ * expensive part of process_one_bsdiff(), and is thread-safe.
+ */
+static gboolean
+compute_bsdiff (OstreeRepo                       *repo,
+                const char                       *from_checksum,
+                const char                       *to_checksum,
+                GBytes                          **out_payload,
+                GCancellable                     *cancellable,
+                GError                          **error)
+{
+  g_autoptr(GBytes) tmp_from = NULL;
+  if (!get_unpacked_unlinked_content (repo, from_checksum, &tmp_from,
+                                      cancellable, error))
+    return FALSE;
+  g_autoptr(GBytes) tmp_to = NULL;
+  if (!get_unpacked_unlinked_content (repo, to_checksum, &tmp_to,
+                                      cancellable, error))
+    return FALSE;
+
+  gsize tmp_to_len;
+  const guint8 *tmp_to_buf = g_bytes_get_data (tmp_to, &tmp_to_len);
+  gsize tmp_from_len;
+  const guint8 *tmp_from_buf = g_bytes_get_data (tmp_from, &tmp_from_len);
+
+  struct bsdiff_stream stream;
+  struct bzdiff_opaque_s op;
+  g_autoptr(GOutputStream) out = g_memory_output_stream_new_resizable ();
+  stream.malloc = malloc;
+  stream.free = free;
+  stream.write = bzdiff_write;
+  op.out = out;
+  op.cancellable = cancellable;
+  op.error = error;
+  stream.opaque = &op;
+  if (bsdiff (tmp_from_buf, tmp_from_len, tmp_to_buf, tmp_to_len, &stream) < 0)
+    return glnx_throw (error, "bsdiff generation failed");
+
+  if (!g_output_stream_close (out, cancellable, error))
+    return FALSE;
+  *out_payload = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (out));
+  return TRUE;
+}
+
 static gboolean
 process_one_bsdiff (OstreeRepo                       *repo,
                     OstreeStaticDeltaBuilder         *builder,
                     OstreeStaticDeltaPartBuilder    **current_part_val,
                     const char                       *to_checksum,
                     ContentBsdiff                   *bsdiff_content,
+                    GBytes                           *bsdiff_payload,
                     GCancellable                     *cancellable,
                     GError                          **error)
 {
@@ -833,20 +996,6 @@ process_one_bsdiff (OstreeRepo                       *repo,
       *current_part_val = current_part;
     }
 
-  g_autoptr(GBytes) tmp_from = NULL;
-  if (!get_unpacked_unlinked_content (repo, bsdiff_content->from_checksum, &tmp_from,
-                                      cancellable, error))
-    return FALSE;
-  g_autoptr(GBytes) tmp_to = NULL;
-  if (!get_unpacked_unlinked_content (repo, to_checksum, &tmp_to,
-                                      cancellable, error))
-    return FALSE;
-
-  gsize tmp_to_len;
-  const guint8 *tmp_to_buf = g_bytes_get_data (tmp_to, &tmp_to_len);
-  gsize tmp_from_len;
-  const guint8 *tmp_from_buf = g_bytes_get_data (tmp_from, &tmp_from_len);
-
   g_autoptr(GFileInfo) content_finfo = NULL;
   g_autoptr(GVariant) content_xattrs = NULL;
   if (!ostree_repo_load_file (repo, to_checksum, NULL,
@@ -854,7 +1003,6 @@ process_one_bsdiff (OstreeRepo                       *repo,
                               cancellable, error))
     return FALSE;
   const guint64 content_size = g_file_info_get_size (content_finfo);
-  g_assert_cmpint (tmp_to_len, ==, content_size);
 
   current_part->uncompressed_size += content_size;
 
@@ -879,23 +1027,8 @@ process_one_bsdiff (OstreeRepo                       *repo,
     _ostree_write_varuint64 (current_part->operations, content_size);
 
     {
-      struct bsdiff_stream stream;
-      struct bzdiff_opaque_s op;
-      const gchar *payload;
-      gssize payload_size;
-      g_autoptr(GOutputStream) out = g_memory_output_stream_new_resizable ();
-      stream.malloc = malloc;
-      stream.free = free;
-      stream.write = bzdiff_write;
-      op.out = out;
-      op.cancellable = cancellable;
-      op.error = error;
-      stream.opaque = &op;
-      if (bsdiff (tmp_from_buf, tmp_from_len, tmp_to_buf, tmp_to_len, &stream) < 0)
-        return glnx_throw (error, "bsdiff generation failed");
-
-      payload = g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (out));
-      payload_size = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (out));
+      gsize payload_size;
+      const guint8 *payload = g_bytes_get_data (bsdiff_payload, &payload_size);
 
       g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_BSPATCH);
       _ostree_write_varuint64 (current_part->operations, current_part->payload->len);
@@ -908,14 +1041,14 @@ process_one_bsdiff (OstreeRepo                       *repo,
        * hard/messy as it's quite optimized for execution now.
        */
 #if 0
-      g_printerr ("bspatch %s [%llu] → %s [%llu] bsdiff:%llu (%f)\n",
-                  bsdiff_content->from_checksum, (unsigned long long)tmp_from_len,
-                  to_checksum, (unsigned long long)tmp_to_len,
+      g_printerr ("bspatch %s → %s [%llu] bsdiff:%llu (%f)\n",
+                  bsdiff_content->from_checksum,
+                  to_checksum, (unsigned long long)content_size,
                   (unsigned long long)payload_size,
-                  ((double)payload_size)/tmp_to_len);
+                  ((double)payload_size)/content_size);
 #endif
 
-      g_string_append_len (current_part->payload, payload, payload_size);
+      g_string_append_len (current_part->payload, (const char*)payload, payload_size);
     }
     g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_CLOSE);
   }
@@ -944,6 +1077,239 @@ check_object_world_readable (OstreeRepo   *repo,
   return TRUE;
 }
 
+/* Parallel compilation.  Everything that decides the layout of the delta
+ * (which objects go into which part, in what order) still happens on the
+ * calling thread, in the same order as a single-threaded run.  Worker
+ * threads only compute things (rollsums, bsdiffs, compressed parts) whose
+ * results are then consumed in that order, so the output is byte-for-byte
+ * identical whatever the number of jobs.
+ */
+typedef gboolean (*DeltaJobFunc) (OstreeRepo   *repo,
+                                  gpointer      job,
+                                  GCancellable *cancellable,
+                                  GError      **error);
+
+typedef struct {
+  OstreeRepo *repo;
+  DeltaJobFunc func;
+  GCancellable *cancellable;
+  GMutex lock;
+  GError *error; /* Protected by lock */
+} DeltaJobBatch;
+
+static void
+delta_job_batch_run_one (gpointer data,
+                         gpointer user_data)
+{
+  DeltaJobBatch *batch = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  g_mutex_lock (&batch->lock);
+  const gboolean failed = batch->error != NULL;
+  g_mutex_unlock (&batch->lock);
+  if (failed)
+    return;
+
+  if (!batch->func (batch->repo, data, batch->cancellable, &local_error))
+    {
+      g_mutex_lock (&batch->lock);
+      if (!batch->error)
+        batch->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&batch->lock);
+    }
+}
+
+/* Run @func on each of @jobs, with up to builder->n_jobs threads */
+static gboolean
+run_delta_jobs (OstreeRepo               *repo,
+                OstreeStaticDeltaBuilder *builder,
+                GPtrArray                *jobs,
+                DeltaJobFunc              func,
+                GCancellable             *cancellable,
+                GError                  **error)
+{
+  if (builder->n_jobs <= 1 || jobs->len <= 1)
+    {
+      for (guint i = 0; i < jobs->len; i++)
+        {
+          if (!func (repo, jobs->pdata[i], cancellable, error))
+            return FALSE;
+        }
+      return TRUE;
+    }
+
+  DeltaJobBatch batch = { repo, func, cancellable, };
+  g_mutex_init (&batch.lock);
+  GThreadPool *pool = g_thread_pool_new (delta_job_batch_run_one, &batch,
+                                         MIN (builder->n_jobs, jobs->len), FALSE, error);
+  gboolean ret = pool != NULL;
+  for (guint i = 0; ret && i < jobs->len; i++)
+    ret = g_thread_pool_push (pool, jobs->pdata[i], error);
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
+  if (ret && batch.error)
+    {
+      g_propagate_error (error, g_steal_pointer (&batch.error));
+      ret = FALSE;
+    }
+  g_clear_error (&batch.error);
+  g_mutex_clear (&batch.lock);
+  return ret;
+}
+
+/* Decide how (if at all) to compute a modified file from its old version */
+typedef struct {
+  const char *from_checksum;
+  const char *to_checksum;
+  DeltaOpts opts;
+  guint64 max_bsdiff_size_bytes;
+
+  /* Results */
+  ContentRollsum *rollsum;
+  ContentBsdiff *bsdiff;
+} CandidateJob;
+
+static void
+candidate_job_free (CandidateJob *job)
+{
+  g_clear_pointer (&job->rollsum, content_rollsums_free);
+  g_clear_pointer (&job->bsdiff, content_bsdiffs_free);
+  g_free (job);
+}
+
+static gboolean
+candidate_job_run (OstreeRepo   *repo,
+                   gpointer      data,
+                   GCancellable *cancellable,
+                   GError      **error)
+{
+  CandidateJob *job = data;
+  gboolean from_world_readable = FALSE;
+
+  /* We only want to include in the delta objects that we are sure will
+   * be readable by the client when applying the delta, regardless its
+   * access privileges, so that we don't run into permissions problems
+   * when the client is trying to update a bare-user repository with a
+   * bare repository defined as its parent.
+   */
+  if (!check_object_world_readable (repo, job->from_checksum, &from_world_readable, cancellable, error))
+    return FALSE;
+  if (!from_world_readable)
+    return TRUE;
+
+  if (!try_content_rollsum (repo, job->from_checksum, job->to_checksum,
+                            &job->rollsum, cancellable, error))
+    return FALSE;
+
+  if (job->rollsum)
+    return TRUE;
+
+  if (!(job->opts & DELTAOPT_FLAG_DISABLE_BSDIFF))
+    {
+      if (!try_content_bsdiff (repo, job->from_checksum, job->to_checksum,
+                               &job->bsdiff, job->max_bsdiff_size_bytes,
+                               cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct {
+  const char *to_checksum;
+  ContentBsdiff *bsdiff;
+  GBytes *payload; /* Result */
+} BsdiffJob;
+
+static void
+bsdiff_job_free (BsdiffJob *job)
+{
+  g_clear_pointer (&job->payload, g_bytes_unref);
+  g_free (job);
+}
+
+static gboolean
+bsdiff_job_run (OstreeRepo   *repo,
+                gpointer      data,
+                GCancellable *cancellable,
+                GError      **error)
+{
+  BsdiffJob *job = data;
+  return compute_bsdiff (repo, job->bsdiff->from_checksum, job->to_checksum,
+                         &job->payload, cancellable, error);
+}
+
+#ifdef HAVE_ZSTD
+static int
+compare_checksums (gconstpointer a,
+                   gconstpointer b)
+{
+  return strcmp (*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Train the zstd dictionary for the parts on small regular files in
+ * @checksums: the content of the from commit, which new versions of
+ * files will mostly resemble, or the new content for deltas from scratch.
+ * The samples are picked in checksum order, so the dictionary (like the
+ * rest of the delta) is reproducible.
+ */
+static gboolean
+train_zstd_dictionary (OstreeRepo                *repo,
+                       OstreeStaticDeltaBuilder  *builder,
+                       GPtrArray                 *checksums,
+                       GCancellable              *cancellable,
+                       GError                   **error)
+{
+  g_autoptr(GByteArray) samples = g_byte_array_new ();
+  g_autoptr(GArray) sample_sizes = g_array_new (FALSE, FALSE, sizeof (size_t));
+
+  g_ptr_array_sort (checksums, compare_checksums);
+  for (guint i = 0; i < checksums->len && samples->len < ZSTD_DICTIONARY_SAMPLES_BYTES; i++)
+    {
+      const char *checksum = checksums->pdata[i];
+      g_autoptr(GInputStream) in = NULL;
+      g_autoptr(GFileInfo) file_info = NULL;
+
+      if (!ostree_repo_load_file (repo, checksum, &in, &file_info, NULL,
+                                  cancellable, error))
+        return FALSE;
+      if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_REGULAR)
+        continue;
+
+      const guint64 size = g_file_info_get_size (file_info);
+      if (size == 0 || size > ZSTD_DICTIONARY_MAX_SAMPLE_SIZE)
+        continue;
+
+      const guint offset = samples->len;
+      gsize bytes_read;
+      g_byte_array_set_size (samples, offset + size);
+      if (!g_input_stream_read_all (in, samples->data + offset, size, &bytes_read,
+                                    cancellable, error))
+        return FALSE;
+      g_byte_array_set_size (samples, offset + bytes_read);
+
+      size_t sample_size = bytes_read;
+      g_array_append_val (sample_sizes, sample_size);
+    }
+
+  /* Too few or too uniform samples just mean no dictionary */
+  g_autoptr(GError) local_error = NULL;
+  builder->zstd_dictionary = _ostree_zstd_train_dictionary (samples, sample_sizes,
+                                                            _OSTREE_ZSTD_MAX_DICTIONARY_SIZE,
+                                                            &local_error);
+  if (builder->delta_opts & DELTAOPT_FLAG_VERBOSE)
+    {
+      if (builder->zstd_dictionary)
+        g_printerr ("zstd dictionary: %" G_GSIZE_FORMAT " bytes from %u samples\n",
+                    g_bytes_get_size (builder->zstd_dictionary), sample_sizes->len);
+      else
+        g_printerr ("not using a zstd dictionary: %s\n", local_error->message);
+    }
+
+  return TRUE;
+}
+#endif
+
 static gboolean
 generate_delta_lowlatency (OstreeRepo                       *repo,
                            const char                       *from,
@@ -960,8 +1326,8 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
   g_autoptr(GVariant) from_commit = NULL;
   g_autoptr(GFile) root_to = NULL;
   g_autoptr(GVariant) to_commit = NULL;
-  g_autoptr(GHashTable) to_reachable_objects = NULL;
-  g_autoptr(GHashTable) from_reachable_objects = NULL;
+  g_autoptr(OstreeObjectSet) to_reachable_objects = NULL;
+  g_autoptr(OstreeObjectSet) from_reachable_objects = NULL;
   g_autoptr(GHashTable) new_reachable_metadata = NULL;
   g_autoptr(GHashTable) new_reachable_regfile_content = NULL;
   g_autoptr(GHashTable) new_reachable_symlink_content = NULL;
@@ -979,8 +1345,9 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                                      &from_commit, error))
         return FALSE;
 
-      if (!ostree_repo_traverse_commit (repo, from, 0, &from_reachable_objects,
-                                        cancellable, error))
+      from_reachable_objects = ostree_object_set_new (0);
+      if (!_ostree_repo_traverse_commit_union_set (repo, from, 0, from_reachable_objects,
+                                                   cancellable, error))
         return FALSE;
     }
 
@@ -991,28 +1358,30 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                                  &to_commit, error))
     return FALSE;
 
-  if (!ostree_repo_traverse_commit (repo, to, 0, &to_reachable_objects,
-                                    cancellable, error))
+  to_reachable_objects = ostree_object_set_new (0);
+  if (!_ostree_repo_traverse_commit_union_set (repo, to, 0, to_reachable_objects,
+                                               cancellable, error))
     return FALSE;
 
   new_reachable_metadata = ostree_repo_traverse_new_reachable ();
   new_reachable_regfile_content = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
   new_reachable_symlink_content = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
 
-  g_hash_table_iter_init (&hashiter, to_reachable_objects);
-  while (g_hash_table_iter_next (&hashiter, &key, &value))
+  gsize set_iter = 0;
+  const guint8 *set_csum;
+  OstreeObjectType set_objtype;
+  while (ostree_object_set_iter_next (to_reachable_objects, &set_iter, &set_csum, &set_objtype))
     {
-      GVariant *serialized_key = key;
-      const char *checksum;
-      OstreeObjectType objtype;
+      char checksum[OSTREE_SHA256_STRING_LEN+1];
 
-      if (from_reachable_objects && g_hash_table_contains (from_reachable_objects, serialized_key))
+      if (from_reachable_objects && ostree_object_set_contains (from_reachable_objects, set_csum, set_objtype))
         continue;
 
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+      ostree_checksum_inplace_from_bytes (set_csum, checksum);
 
-      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
-        g_hash_table_add (new_reachable_metadata, g_variant_ref (serialized_key));
+      if (OSTREE_OBJECT_TYPE_IS_META (set_objtype))
+        g_hash_table_add (new_reachable_metadata,
+                          g_variant_ref_sink (ostree_object_name_serialize (checksum, set_objtype)));
       else
         {
           g_autoptr(GFileInfo) finfo = NULL;
@@ -1037,6 +1406,7 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
       if (!_ostree_delta_compute_similar_objects (repo, from_commit, to_commit,
                                                   new_reachable_regfile_content,
                                                   CONTENT_SIZE_SIMILARITY_THRESHOLD_PERCENT,
+                                                  builder->n_jobs,
                                                   &modified_regfile_content,
                                                   cancellable, error))
         return FALSE;
@@ -1066,48 +1436,47 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                                                             g_free,
                                                             (GDestroyNotify) content_bsdiffs_free);
 
-  g_hash_table_iter_init (&hashiter, modified_regfile_content);
-  while (g_hash_table_iter_next (&hashiter, &key, &value))
-    {
-      const char *to_checksum = key;
-      const char *from_checksum = value;
-      ContentRollsum *rollsum;
-      ContentBsdiff *bsdiff;
-      gboolean from_world_readable = FALSE;
-
-      /* We only want to include in the delta objects that we are sure will
-       * be readable by the client when applying the delta, regardless its
-       * access privileges, so that we don't run into permissions problems
-       * when the client is trying to update a bare-user repository with a
-       * bare repository defined as its parent.
-       */
-      if (!check_object_world_readable (repo, from_checksum, &from_world_readable, cancellable, error))
-        return FALSE;
-      if (!from_world_readable)
-        continue;
-
-      if (!try_content_rollsum (repo, opts, from_checksum, to_checksum,
-                                &rollsum, cancellable, error))
-        return FALSE;
+  { g_autoptr(GPtrArray) candidates =
+      g_ptr_array_new_with_free_func ((GDestroyNotify) candidate_job_free);
 
-      if (rollsum)
-        {
-          g_hash_table_insert (rollsum_optimized_content_objects, g_strdup (to_checksum), rollsum);
-          builder->rollsum_size += rollsum->matches->match_size;
-          continue;
-        }
+    g_hash_table_iter_init (&hashiter, modified_regfile_content);
+    while (g_hash_table_iter_next (&hashiter, &key, &value))
+      {
+        CandidateJob *job = g_new0 (CandidateJob, 1);
+        job->to_checksum = key;
+        job->from_checksum = value;
+        job->opts = opts;
+        job->max_bsdiff_size_bytes = builder->max_bsdiff_size_bytes;
+        g_ptr_array_add (candidates, job);
+      }
 
-      if (!(opts & DELTAOPT_FLAG_DISABLE_BSDIFF))
-        {
-          if (!try_content_bsdiff (repo, from_checksum, to_checksum,
-                                   &bsdiff, builder->max_bsdiff_size_bytes,
-                                   cancellable, error))
-            return FALSE;
+    if (!run_delta_jobs (repo, builder, candidates, candidate_job_run,
+                         cancellable, error))
+      return FALSE;
 
-          if (bsdiff)
-            g_hash_table_insert (bsdiff_optimized_content_objects, g_strdup (to_checksum), bsdiff);
-        }
-    }
+    for (guint i = 0; i < candidates->len; i++)
+      {
+        CandidateJob *job = candidates->pdata[i];
+
+        if (job->rollsum)
+          {
+            OstreeRollsumMatches *matches = job->rollsum->matches;
+            if (opts & DELTAOPT_FLAG_VERBOSE)
+              {
+                g_printerr ("rollsum for %s -> %s; crcs=%u bufs=%u total=%u matchsize=%llu\n",
+                            job->from_checksum, job->to_checksum, matches->crcmatches,
+                            matches->bufmatches,
+                            matches->total, (unsigned long long)matches->match_size);
+              }
+            builder->rollsum_size += matches->match_size;
+            g_hash_table_insert (rollsum_optimized_content_objects, g_strdup (job->to_checksum),
+                                 g_steal_pointer (&job->rollsum));
+          }
+        else if (job->bsdiff)
+          g_hash_table_insert (bsdiff_optimized_content_objects, g_strdup (job->to_checksum),
+                               g_steal_pointer (&job->bsdiff));
+      }
+  }
 
   if (opts & DELTAOPT_FLAG_VERBOSE)
     {
@@ -1116,6 +1485,32 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                   g_hash_table_size (modified_regfile_content));
     }
 
+#ifdef HAVE_ZSTD
+  if (builder->use_zstd_dictionary)
+    {
+      g_autoptr(GPtrArray) checksums = g_ptr_array_new_with_free_func (g_free);
+
+      if (from_reachable_objects)
+        {
+          set_iter = 0;
+          while (ostree_object_set_iter_next (from_reachable_objects, &set_iter, &set_csum, &set_objtype))
+            {
+              if (set_objtype == OSTREE_OBJECT_TYPE_FILE)
+                g_ptr_array_add (checksums, ostree_checksum_from_bytes (set_csum));
+            }
+        }
+      else
+        {
+          g_hash_table_iter_init (&hashiter, new_reachable_regfile_content);
+          while (g_hash_table_iter_next (&hashiter, &key, &value))
+            g_ptr_array_add (checksums, g_strdup (key));
+        }
+
+      if (!train_zstd_dictionary (repo, builder, checksums, cancellable, error))
+        return FALSE;
+    }
+#endif
+
   current_part = allocate_part (builder, error);
   if (current_part == NULL)
     return FALSE;
@@ -1158,22 +1553,48 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
   if (n_bsdiff > 0)
     {
       const guint mod = n_bsdiff / 10;
+      /* Compute the bsdiffs a batch at a time, to bound memory usage */
+      const guint batch_size = builder->n_jobs > 1 ? builder->n_jobs * 2 : 1;
+      g_autoptr(GPtrArray) batch =
+        g_ptr_array_new_with_free_func ((GDestroyNotify) bsdiff_job_free);
+      gboolean done = FALSE;
+
       g_hash_table_iter_init (&hashiter, bsdiff_optimized_content_objects);
-      while (g_hash_table_iter_next (&hashiter, &key, &value))
+      while (!done)
         {
-          const char *checksum = key;
-          ContentBsdiff *bsdiff = value;
-
-          if (opts & DELTAOPT_FLAG_VERBOSE &&
-              (mod == 0 || builder->n_bsdiff % mod == 0))
-            g_printerr ("processing bsdiff: [%u/%u]\n", builder->n_bsdiff, n_bsdiff);
+          while (batch->len < batch_size)
+            {
+              if (!g_hash_table_iter_next (&hashiter, &key, &value))
+                {
+                  done = TRUE;
+                  break;
+                }
+              BsdiffJob *job = g_new0 (BsdiffJob, 1);
+              job->to_checksum = key;
+              job->bsdiff = value;
+              g_ptr_array_add (batch, job);
+            }
 
-          if (!process_one_bsdiff (repo, builder, &current_part,
-                                   checksum, bsdiff,
-                                   cancellable, error))
+          if (!run_delta_jobs (repo, builder, batch, bsdiff_job_run,
+                               cancellable, error))
             return FALSE;
 
-          builder->n_bsdiff++;
+          for (guint i = 0; i < batch->len; i++)
+            {
+              BsdiffJob *job = batch->pdata[i];
+
+              if (opts & DELTAOPT_FLAG_VERBOSE &&
+                  (mod == 0 || builder->n_bsdiff % mod == 0))
+                g_printerr ("processing bsdiff: [%u/%u]\n", builder->n_bsdiff, n_bsdiff);
+
+              if (!process_one_bsdiff (repo, builder, &current_part,
+                                       job->to_checksum, job->bsdiff, job->payload,
+                                       cancellable, error))
+                return FALSE;
+
+              builder->n_bsdiff++;
+            }
+          g_ptr_array_set_size (batch, 0);
         }
     }
 
@@ -1245,6 +1666,20 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
 
   if (!finish_part (builder, error))
     return FALSE;
+  if (!wait_for_parts (builder, error))
+    return FALSE;
+
+  if (opts & DELTAOPT_FLAG_VERBOSE)
+    {
+      for (guint i = 0; i < builder->parts->len; i++)
+        {
+          OstreeStaticDeltaPartBuilder *part_builder = builder->parts->pdata[i];
+          g_printerr ("part %u n:%u compressed:%" G_GUINT64_FORMAT " uncompressed:%" G_GUINT64_FORMAT "\n",
+                      i + 1, part_builder->objects->len,
+                      part_builder->compressed_size,
+                      part_builder->uncompressed_size);
+        }
+    }
 
   return TRUE;
 }
@@ -1329,12 +1764,14 @@ get_fallback_headers (OstreeRepo               *self,
  *   - max-chunk-size: u: Maximum size in megabytes of a delta part
  *   - max-bsdiff-size: u: Maximum size in megabytes to consider bsdiff compression
  *   for input files
- *   - compression: y: Compression type: 0=none, x=lzma, g=gzip
+ *   - compression: y: Compression type of the parts: 0=none, x=lzma, z=zstd (if ostree was built with zstd support).  Default x.
+ *   - zstd-dictionary: b: Compress zstd parts with a dictionary trained on the files of @from (or @to), which is stored in the superblock.  Helps most with small parts.  Default FALSE.  Since: 2019.3
  *   - bsdiff-enabled: b: Enable bsdiff compression.  Default TRUE.
  *   - inline-parts: b: Put part data in header, to get a single file delta.  Default FALSE.
  *   - verbose: b: Print diagnostic messages.  Default FALSE.
  *   - endianness: b: Deltas use host byte order by default; this option allows choosing (G_BIG_ENDIAN or G_LITTLE_ENDIAN)
  *   - filename: ay: Save delta superblock to this filename, and parts in the same directory.  Default saves to repository.
+ *   - jobs: u: Number of threads to use, or 0 for one per CPU.  The output does not depend on it.  Default 1.  Since: 2019.3
  */
 gboolean
 ostree_repo_static_delta_generate (OstreeRepo                   *self,
@@ -1406,6 +1843,56 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
   if (!g_variant_lookup (params, "filename", "^&ay", &opt_filename))
     opt_filename = NULL;
 
+  { guint n_jobs;
+    if (!g_variant_lookup (params, "jobs", "u", &n_jobs))
+      n_jobs = 1;
+    if (n_jobs == 0)
+      n_jobs = g_get_num_processors ();
+    builder.n_jobs = MAX (n_jobs, 1);
+
+    /* Compressing a part takes a lot of memory; don't use more than half
+     * of it for that.
+     */
+    const long n_pages = sysconf (_SC_PHYS_PAGES);
+    const long page_size = sysconf (_SC_PAGESIZE);
+    guint max_compress_jobs = builder.n_jobs;
+    if (n_pages > 0 && page_size > 0)
+      {
+        const guint64 mem_jobs = ((guint64) n_pages * page_size / 2) / PART_COMPRESSION_MEMORY_BYTES;
+        max_compress_jobs = MIN (max_compress_jobs, MAX (mem_jobs, 1));
+      }
+    builder.max_compress_jobs = max_compress_jobs;
+    g_mutex_init (&builder.compress_lock);
+    g_cond_init (&builder.compress_cond);
+  }
+
+  if (!g_variant_lookup (params, "compression", "y", &builder.compression))
+    builder.compression = 'x';
+  switch (builder.compression)
+    {
+    case 0:
+    case 'x':
+      break;
+    case 'z':
+#ifdef HAVE_ZSTD
+      break;
+#else
+      glnx_throw (error, "zstd compression is not supported by this version of ostree");
+      goto out;
+#endif
+    default:
+      glnx_throw (error, "Unknown delta compression type '%c'", builder.compression);
+      goto out;
+    }
+
+  if (!g_variant_lookup (params, "zstd-dictionary", "b", &builder.use_zstd_dictionary))
+    builder.use_zstd_dictionary = FALSE;
+  if (builder.use_zstd_dictionary && builder.compression != 'z')
+    {
+      glnx_throw (error, "A zstd dictionary requires zstd compression");
+      goto out;
+    }
+
   if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, to,
                                  &to_commit, error))
     goto out;
@@ -1486,6 +1973,13 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
       goto out;
   }
 
+  if (builder.zstd_dictionary)
+    {
+      if (!ot_variant_builder_add (descriptor_builder, error, "{sv}", OSTREE_STATIC_DELTA_META_ZSTD_DICTIONARY,
+                                   ot_gvariant_new_ay_bytes (builder.zstd_dictionary)))
+        goto out;
+    }
+
   part_headers = g_variant_builder_new (G_VARIANT_TYPE ("a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT));
   part_temp_paths = g_ptr_array_new_with_free_func ((GDestroyNotify)glnx_tmpfile_clear);
   for (i = 0; i < builder.parts->len; i++)
@@ -1600,7 +2094,14 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
 
   ret = TRUE;
  out:
+  /* On error, parts may still be being compressed */
+  if (builder.compress_pool)
+    g_thread_pool_free (builder.compress_pool, FALSE, TRUE);
+  g_clear_error (&builder.compress_error);
+  g_mutex_clear (&builder.compress_lock);
+  g_cond_clear (&builder.compress_cond);
   g_clear_pointer (&builder.parts, g_ptr_array_unref);
   g_clear_pointer (&builder.fallback_objects, g_ptr_array_unref);
+  g_clear_pointer (&builder.zstd_dictionary, g_bytes_unref);
   return ret;
 }
@@ -27,6 +27,9 @@
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
 #include "ostree-lzma-decompressor.h"
+#ifdef HAVE_ZSTD
+#include "ostree-zstd-decompressor.h"
+#endif
 #include "ostree-cmdprivate.h"
 #include "ostree-checksum-input-stream.h"
 #include "ostree-repo-static-delta-private.h"
@@ -303,6 +306,7 @@ ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
     return glnx_throw (error, "Cannot execute delta offline: contains nonempty http fallback entries");
 
   g_autoptr(GVariant) headers = g_variant_get_child_value (meta, 6);
+  g_autoptr(GBytes) dictionary = _ostree_delta_get_zstd_dictionary (metadata);
   const guint n = g_variant_n_children (headers);
   for (guint i = 0; i < n; i++)
     {
@@ -356,6 +360,7 @@ ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
 
           if (!_ostree_static_delta_part_open (part_in, inline_part_bytes, 
                                                delta_open_flags,
+                                               dictionary,
                                                NULL,
                                                &part,
                                                cancellable, error))
@@ -372,6 +377,7 @@ ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
 
           if (!_ostree_static_delta_part_open (part_in, NULL,
                                                delta_open_flags,
+                                               dictionary,
                                                checksum,
                                                &part,
                                                cancellable, error))
@@ -390,6 +396,7 @@ gboolean
 _ostree_static_delta_part_open (GInputStream   *part_in,
                                 GBytes         *inline_part_bytes,
                                 OstreeStaticDeltaOpenFlags flags,
+                                GBytes         *dictionary,
                                 const char     *expected_checksum,
                                 GVariant    **out_part,
                                 GCancellable *cancellable,
@@ -465,6 +472,22 @@ _ostree_static_delta_part_open (GInputStream   *part_in,
                                              buf, FALSE);
       }
       break;
+    case 'z':
+#ifdef HAVE_ZSTD
+      {
+        g_autoptr(GConverter) decomp = (GConverter*) _ostree_zstd_decompressor_new (dictionary);
+        g_autoptr(GInputStream) convin = g_converter_input_stream_new (source_in, decomp);
+        g_autoptr(GBytes) buf = ot_map_anonymous_tmpfile_from_content (convin, cancellable, error);
+        if (!buf)
+          return FALSE;
+
+        ret_part = g_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT_V0),
+                                             buf, FALSE);
+      }
+      break;
+#else
+      return glnx_throw (error, "Delta part is zstd compressed, but this version of ostree was built without zstd support");
+#endif
     default:
       return glnx_throw (error, "Invalid compression type '%u'", comptype);
     }
@@ -486,12 +509,29 @@ _ostree_static_delta_part_open (GInputStream   *part_in,
  * Displaying static delta parts
  */
 
+static const char *
+compression_type_to_string (guint8 comptype)
+{
+  switch (comptype)
+    {
+    case 0:
+      return "none";
+    case 'x':
+      return "lzma";
+    case 'z':
+      return "zstd";
+    default:
+      return "unknown";
+    }
+}
+
 static gboolean
 show_one_part (OstreeRepo                    *self,
                gboolean                       swap_endian,
                const char                    *from,
                const char                    *to,
                GVariant                      *meta_entries,
+               GBytes                        *dictionary,
                guint                          i,
                guint64                       *total_size_ref,
                guint64                       *total_usize_ref,
@@ -514,11 +554,22 @@ show_one_part (OstreeRepo                    *self,
   glnx_autofd int part_fd = openat (self->repo_dir_fd, part_path, O_RDONLY | O_CLOEXEC);
   if (part_fd < 0)
     return glnx_throw_errno_prefix (error, "openat(%s)", part_path);
+
+  /* The first byte of the part is its compression type */
+  guint8 comptype;
+  ssize_t n_read = TEMP_FAILURE_RETRY (pread (part_fd, &comptype, 1, 0));
+  if (n_read < 0)
+    return glnx_throw_errno_prefix (error, "pread(%s)", part_path);
+  else if (n_read == 0)
+    return glnx_throw (error, "Delta part %s is empty", part_path);
+  g_print ("PartCompression%u: %s\n", i, compression_type_to_string (comptype));
+
   g_autoptr(GInputStream) part_in = g_unix_input_stream_new (part_fd, FALSE);
 
   g_autoptr(GVariant) part = NULL;
   if (!_ostree_static_delta_part_open (part_in, NULL,
                                        OSTREE_STATIC_DELTA_OPEN_FLAGS_SKIP_CHECKSUM,
+                                       dictionary,
                                        NULL,
                                        &part,
                                        cancellable, error))
@@ -653,6 +704,20 @@ _ostree_delta_get_endianness (GVariant *superblock,
   }
 }
 
+/* Returns the zstd dictionary stored in the metadata of a delta
+ * superblock, or %NULL if there is none.
+ */
+GBytes *
+_ostree_delta_get_zstd_dictionary (GVariant *superblock_metadata)
+{
+  g_autoptr(GVariant) dictionary_v =
+    g_variant_lookup_value (superblock_metadata, OSTREE_STATIC_DELTA_META_ZSTD_DICTIONARY,
+                            G_VARIANT_TYPE_BYTESTRING);
+  if (!dictionary_v || g_variant_get_size (dictionary_v) == 0)
+    return NULL;
+  return g_variant_get_data_as_bytes (dictionary_v);
+}
+
 gboolean
 _ostree_delta_needs_byteswap (GVariant *superblock)
 {
@@ -811,6 +876,11 @@ _ostree_repo_static_delta_dump (OstreeRepo                    *self,
   g_variant_get_child (delta_superblock, 1, "t", &ts);
   g_print ("Timestamp: %" G_GUINT64_FORMAT "\n", GUINT64_FROM_BE (ts));
 
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (delta_superblock, 0);
+  g_autoptr(GBytes) dictionary = _ostree_delta_get_zstd_dictionary (metadata);
+  if (dictionary)
+    g_print ("Zstd dictionary size: %" G_GSIZE_FORMAT "\n", g_bytes_get_size (dictionary));
+
   g_autoptr(GVariant) recurse = NULL;
   g_variant_get_child (delta_superblock, 5, "@ay", &recurse);
   g_print ("Number of parents: %u\n", (guint)(g_variant_get_size (recurse) / (OSTREE_SHA256_DIGEST_LEN * 2)));
@@ -851,7 +921,7 @@ _ostree_repo_static_delta_dump (OstreeRepo                    *self,
 
   for (guint i = 0; i < n_parts; i++)
     {
-      if (!show_one_part (self, swap_endian, from_commit, to_commit, meta_entries, i,
+      if (!show_one_part (self, swap_endian, from_commit, to_commit, meta_entries, dictionary, i,
                           &total_size, &total_usize,
                           cancellable, error))
         return FALSE;
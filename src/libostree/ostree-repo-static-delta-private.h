@@ -32,10 +32,15 @@ G_BEGIN_DECLS
 
 #define OSTREE_SUMMARY_STATIC_DELTAS "ostree.static-deltas"
 
+/* Superblock metadata key (type "ay") holding the dictionary that
+ * zstd-compressed parts of the delta were compressed with, if any.
+ */
+#define OSTREE_STATIC_DELTA_META_ZSTD_DICTIONARY "ostree.zstd-dictionary"
+
 /**
  * OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT_V0:
  *
- *   y  compression type (0: none, 'x': lzma)
+ *   y  compression type (0: none, 'x': lzma, 'z': zstd)
  *   ---
  *   a(uuu) modes
  *   aa(ayay) xattrs
@@ -125,6 +130,7 @@ gboolean
 _ostree_static_delta_part_open (GInputStream   *part_in,
                                 GBytes         *inline_part_bytes,
                                 OstreeStaticDeltaOpenFlags flags,
+                                GBytes         *dictionary,
                                 const char     *expected_checksum,
                                 GVariant    **out_part,
                                 GCancellable *cancellable,
@@ -142,17 +148,6 @@ gboolean _ostree_static_delta_part_execute (OstreeRepo      *repo,
                                             GCancellable    *cancellable,
                                             GError         **error);
 
-void _ostree_static_delta_part_execute_async (OstreeRepo      *repo,
-                                              GVariant        *header,
-                                              GVariant        *part_payload,
-                                              GCancellable    *cancellable,
-                                              GAsyncReadyCallback  callback,
-                                              gpointer         user_data);
-
-gboolean _ostree_static_delta_part_execute_finish (OstreeRepo      *repo,
-                                                   GAsyncResult    *result,
-                                                   GError         **error); 
-
 gboolean
 _ostree_static_delta_parse_checksum_array (GVariant      *array,
                                            guint8       **out_checksums_array,
@@ -180,6 +175,7 @@ _ostree_delta_compute_similar_objects (OstreeRepo                 *repo,
                                        GVariant                   *to_commit,
                                        GHashTable                 *new_reachable_regfile_content,
                                        guint                       similarity_percent_threshold,
+                                       guint                       n_jobs,
                                        GHashTable                **out_modified_regfile_content,
                                        GCancellable               *cancellable,
                                        GError                    **error);
@@ -234,6 +230,8 @@ typedef enum {
 
 OstreeDeltaEndianness _ostree_delta_get_endianness (GVariant *superblock, gboolean *out_was_heuristic);
 
+GBytes *_ostree_delta_get_zstd_dictionary (GVariant *superblock_metadata);
+
 gboolean _ostree_delta_needs_byteswap (GVariant *superblock);
 
 G_END_DECLS
@@ -282,83 +282,6 @@ _ostree_static_delta_part_execute (OstreeRepo      *repo,
   return ret;
 }
 
-typedef struct {
-  OstreeRepo *repo;
-  GVariant *header;
-  GVariant *part;
-  GCancellable *cancellable;
-  GSimpleAsyncResult *result;
-} StaticDeltaPartExecuteAsyncData;
-
-static void
-static_delta_part_execute_async_data_free (gpointer user_data)
-{
-  StaticDeltaPartExecuteAsyncData *data = user_data;
-
-  g_clear_object (&data->repo);
-  g_variant_unref (data->header);
-  g_variant_unref (data->part);
-  g_clear_object (&data->cancellable);
-  g_free (data);
-}
-
-static void
-static_delta_part_execute_thread (GSimpleAsyncResult  *res,
-                                  GObject             *object,
-                                  GCancellable        *cancellable)
-{
-  GError *error = NULL;
-  StaticDeltaPartExecuteAsyncData *data;
-
-  data = g_simple_async_result_get_op_res_gpointer (res);
-  if (!_ostree_static_delta_part_execute (data->repo,
-                                          data->header,
-                                          data->part,
-                                          FALSE, NULL,
-                                          cancellable, &error))
-    g_simple_async_result_take_error (res, error);
-}
-
-void
-_ostree_static_delta_part_execute_async (OstreeRepo      *repo,
-                                         GVariant        *header,
-                                         GVariant        *part,
-                                         GCancellable    *cancellable,
-                                         GAsyncReadyCallback  callback,
-                                         gpointer         user_data)
-{
-  StaticDeltaPartExecuteAsyncData *asyncdata;
-
-  asyncdata = g_new0 (StaticDeltaPartExecuteAsyncData, 1);
-  asyncdata->repo = g_object_ref (repo);
-  asyncdata->header = g_variant_ref (header);
-  asyncdata->part = g_variant_ref (part);
-  asyncdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
-
-  asyncdata->result = g_simple_async_result_new ((GObject*) repo,
-                                                 callback, user_data,
-                                                 _ostree_static_delta_part_execute_async);
-
-  g_simple_async_result_set_op_res_gpointer (asyncdata->result, asyncdata,
-                                             static_delta_part_execute_async_data_free);
-  g_simple_async_result_run_in_thread (asyncdata->result, static_delta_part_execute_thread, G_PRIORITY_DEFAULT, cancellable);
-  g_object_unref (asyncdata->result);
-}
-
-gboolean
-_ostree_static_delta_part_execute_finish (OstreeRepo      *repo,
-                                          GAsyncResult    *result,
-                                          GError         **error)
-{
-  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
-
-  g_warn_if_fail (g_simple_async_result_get_source_tag (simple) == _ostree_static_delta_part_execute_async);
-
-  if (g_simple_async_result_propagate_error (simple, error))
-    return FALSE;
-  return TRUE;
-}
-
 static gboolean
 validate_ofs (StaticDeltaExecutionState  *state,
               guint64                     offset,
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include "ostree-core-private.h"
+
+G_BEGIN_DECLS
+
+/* A summary index lets clients fetch the summary in pieces.  When
+ * `core/summary-index` is set, the summary is also split into shards, each
+ * of which is itself in the summary format (see
+ * %OSTREE_SUMMARY_GVARIANT_FORMAT) and stored as summaries/<checksum>,
+ * named after the SHA256 of its contents:
+ *
+ *   refs/<n>: the refs (from the main refs and the collection map) whose
+ *     name hashes to bucket n, see _ostree_summary_index_ref_shard(), plus
+ *     the static deltas to the commits those refs point to;
+ *   deltas: all other static deltas.
+ *
+ * summary.idx (signed as summary.idx.sig) maps shard names to their
+ * checksums, and carries the rest of the summary metadata.  Clients only
+ * fetch the index and the shards for the refs they pull, and cache shards
+ * under _OSTREE_SUMMARY_SHARDS_CACHE_DIR, so an update to one ref costs one
+ * shard rather than the whole summary.  Merging all the shards with the
+ * index metadata gives back the summary.
+ */
+#define _OSTREE_SUMMARY_INDEX "summary.idx"
+#define _OSTREE_SUMMARY_INDEX_SIG "summary.idx.sig"
+#define _OSTREE_SUMMARY_SHARDS_DIR "summaries"
+#define _OSTREE_SUMMARY_DELTAS_SHARD "deltas"
+
+/* Under the repo's cache dir: copies of remote summary shards, per remote */
+#define _OSTREE_SUMMARY_SHARDS_CACHE_DIR "summary-shards"
+
+#define OSTREE_SUMMARY_INDEX_GVARIANT_STRING "(a{say}a{sv})"
+#define OSTREE_SUMMARY_INDEX_GVARIANT_FORMAT G_VARIANT_TYPE (OSTREE_SUMMARY_INDEX_GVARIANT_STRING)
+
+/* Index metadata key for the number of refs/<n> buckets (type "u", big endian) */
+#define OSTREE_SUMMARY_INDEX_BUCKETS "ostree.summary-index.buckets"
+
+/* Aim for shards of about this many refs */
+#define _OSTREE_SUMMARY_INDEX_REFS_PER_SHARD 512
+#define _OSTREE_SUMMARY_INDEX_MAX_BUCKETS 256
+
+char *
+_ostree_summary_index_ref_shard (GVariant   *index,
+                                 const char *ref_name);
+
+void
+_ostree_summary_index_split (GVariant     *summary,
+                             GVariant    **out_index,
+                             GHashTable  **out_shards);
+
+GVariant *
+_ostree_summary_index_merge (GVariant   *index,
+                             GPtrArray  *shards);
+
+gboolean
+_ostree_repo_update_summary_index (OstreeRepo    *self,
+                                   GVariant      *summary,
+                                   GCancellable  *cancellable,
+                                   GError       **error);
+
+G_END_DECLS
@@ -0,0 +1,534 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "ostree-repo-summary-index-private.h"
+#include "ostree-repo-static-delta-private.h"
+#include "ostree-autocleanups.h"
+#include "otutil.h"
+
+/* The bucket for a ref is taken from the SHA256 of its name, so that it
+ * doesn't depend on anything but the number of buckets, and refs spread
+ * evenly whatever their naming scheme. */
+static guint
+ref_bucket (const char *ref_name,
+            guint       n_buckets)
+{
+  g_auto(OtChecksum) hasher = { 0, };
+  guint8 digest[OSTREE_SHA256_DIGEST_LEN];
+
+  ot_checksum_init (&hasher);
+  ot_checksum_update (&hasher, (const guint8 *) ref_name, strlen (ref_name));
+  ot_checksum_get_digest (&hasher, digest, sizeof (digest));
+
+  guint32 v = ((guint32) digest[0] << 24) | ((guint32) digest[1] << 16) |
+    ((guint32) digest[2] << 8) | (guint32) digest[3];
+  return v & (n_buckets - 1);
+}
+
+static guint
+index_get_n_buckets (GVariant *index)
+{
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (index, 1);
+  guint32 n_buckets;
+
+  if (!g_variant_lookup (metadata, OSTREE_SUMMARY_INDEX_BUCKETS, "u", &n_buckets))
+    return 1;
+  n_buckets = GUINT32_FROM_BE (n_buckets);
+  /* Must be a power of 2 */
+  if (n_buckets == 0 || n_buckets > _OSTREE_SUMMARY_INDEX_MAX_BUCKETS ||
+      (n_buckets & (n_buckets - 1)) != 0)
+    return 1;
+  return n_buckets;
+}
+
+/* Return the name of the shard of @index which lists @ref_name, whatever
+ * its collection ID. */
+char *
+_ostree_summary_index_ref_shard (GVariant   *index,
+                                 const char *ref_name)
+{
+  return g_strdup_printf ("refs/%u", ref_bucket (ref_name, index_get_n_buckets (index)));
+}
+
+typedef struct {
+  const char *collection_id;  /* NULL for the main refs */
+  GVariant *refs;  /* a(s(taya{sv})) */
+  guint *buckets;
+} SummaryRefList;
+
+static void
+summary_ref_list_clear (SummaryRefList *list)
+{
+  g_variant_unref (list->refs);
+  g_free (list->buckets);
+}
+
+static void
+set_bucket (guint8 *bitmap,
+            guint   bucket)
+{
+  bitmap[bucket / 8] |= 1 << (bucket % 8);
+}
+
+static gboolean
+has_bucket (const guint8 *bitmap,
+            guint         bucket)
+{
+  return (bitmap[bucket / 8] & (1 << (bucket % 8))) != 0;
+}
+
+/* Build the shard for @bucket, or for the leftover deltas if @bucket is
+ * G_MAXUINT.  Returns %NULL if it would be empty. */
+static GVariant *
+build_shard (GArray        *ref_lists,
+             guint          bucket,
+             GVariant      *deltas,
+             const guint8 **delta_buckets)
+{
+  g_autoptr(GVariantBuilder) refs_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(s(taya{sv}))"));
+  g_autoptr(GVariantBuilder) collection_map_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sa(s(taya{sv}))}"));
+  g_auto(GVariantDict) metadata_builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_auto(GVariantDict) deltas_builder = OT_VARIANT_BUILDER_INITIALIZER;
+  gsize n_collection_refs = 0;
+  gsize n_entries = 0;
+
+  g_variant_dict_init (&metadata_builder, NULL);
+  g_variant_dict_init (&deltas_builder, NULL);
+
+  for (guint i = 0; bucket != G_MAXUINT && i < ref_lists->len; i++)
+    {
+      const SummaryRefList *list = &g_array_index (ref_lists, SummaryRefList, i);
+      const gsize n = g_variant_n_children (list->refs);
+      gboolean opened = FALSE;
+
+      for (gsize j = 0; j < n; j++)
+        {
+          if (list->buckets[j] != bucket)
+            continue;
+
+          g_autoptr(GVariant) entry = g_variant_get_child_value (list->refs, j);
+          if (list->collection_id == NULL)
+            g_variant_builder_add_value (refs_builder, entry);
+          else
+            {
+              if (!opened)
+                {
+                  g_variant_builder_open (collection_map_builder, G_VARIANT_TYPE ("{sa(s(taya{sv}))}"));
+                  g_variant_builder_add (collection_map_builder, "s", list->collection_id);
+                  g_variant_builder_open (collection_map_builder, G_VARIANT_TYPE ("a(s(taya{sv}))"));
+                  opened = TRUE;
+                }
+              g_variant_builder_add_value (collection_map_builder, entry);
+              n_collection_refs++;
+            }
+          n_entries++;
+        }
+
+      if (opened)
+        {
+          g_variant_builder_close (collection_map_builder);  /* array */
+          g_variant_builder_close (collection_map_builder);  /* dict entry */
+        }
+    }
+
+  gsize n_deltas = 0;
+  const gsize n_all_deltas = deltas ? g_variant_n_children (deltas) : 0;
+  for (gsize i = 0; i < n_all_deltas; i++)
+    {
+      const guint8 *bitmap = delta_buckets[i];
+      if (bucket == G_MAXUINT ? bitmap != NULL : (bitmap == NULL || !has_bucket (bitmap, bucket)))
+        continue;
+
+      const char *delta_name;
+      g_autoptr(GVariant) digest = NULL;
+      g_variant_get_child (deltas, i, "{&sv}", &delta_name, &digest);
+      g_variant_dict_insert_value (&deltas_builder, delta_name, digest);
+      n_deltas++;
+    }
+
+  if (n_entries == 0 && n_deltas == 0)
+    return NULL;
+
+  if (n_collection_refs > 0)
+    g_variant_dict_insert_value (&metadata_builder, OSTREE_SUMMARY_COLLECTION_MAP,
+                                 g_variant_builder_end (collection_map_builder));
+  if (n_deltas > 0)
+    g_variant_dict_insert_value (&metadata_builder, OSTREE_SUMMARY_STATIC_DELTAS,
+                                 g_variant_dict_end (&deltas_builder));
+
+  return g_variant_ref_sink (g_variant_new ("(@a(s(taya{sv}))@a{sv})",
+                                            g_variant_builder_end (refs_builder),
+                                            g_variant_dict_end (&metadata_builder)));
+}
+
+/* Split @summary into an index and a table of shard name ↦ shard. */
+void
+_ostree_summary_index_split (GVariant     *summary,
+                             GVariant    **out_index,
+                             GHashTable  **out_shards)
+{
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (summary, 1);
+  g_autoptr(GArray) ref_lists = g_array_new (FALSE, TRUE, sizeof (SummaryRefList));
+  g_array_set_clear_func (ref_lists, (GDestroyNotify) summary_ref_list_clear);
+
+  SummaryRefList main_refs = { NULL, g_variant_get_child_value (summary, 0), NULL };
+  g_array_append_val (ref_lists, main_refs);
+
+  g_autoptr(GVariant) collection_map =
+    g_variant_lookup_value (metadata, OSTREE_SUMMARY_COLLECTION_MAP, G_VARIANT_TYPE ("a{sa(s(taya{sv}))}"));
+  if (collection_map != NULL)
+    {
+      GVariantIter iter;
+      const char *collection_id;
+      GVariant *refs;
+      g_variant_iter_init (&iter, collection_map);
+      while (g_variant_iter_next (&iter, "{&s@a(s(taya{sv}))}", &collection_id, &refs))
+        {
+          SummaryRefList list = { collection_id, refs, NULL };
+          g_array_append_val (ref_lists, list);
+        }
+    }
+
+  gsize n_refs = 0;
+  for (guint i = 0; i < ref_lists->len; i++)
+    n_refs += g_variant_n_children (g_array_index (ref_lists, SummaryRefList, i).refs);
+
+  guint n_buckets = 1;
+  while (n_buckets < _OSTREE_SUMMARY_INDEX_MAX_BUCKETS &&
+         n_buckets * _OSTREE_SUMMARY_INDEX_REFS_PER_SHARD < n_refs)
+    n_buckets *= 2;
+
+  /* Commit checksum ↦ bitmap of the buckets with refs to it */
+  g_autoptr(GHashTable) commit_buckets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  for (guint i = 0; i < ref_lists->len; i++)
+    {
+      SummaryRefList *list = &g_array_index (ref_lists, SummaryRefList, i);
+      const gsize n = g_variant_n_children (list->refs);
+
+      list->buckets = g_new (guint, n);
+      for (gsize j = 0; j < n; j++)
+        {
+          const char *ref_name;
+          g_autoptr(GVariant) csum_v = NULL;
+          g_variant_get_child (list->refs, j, "(&s(t@aya{sv}))", &ref_name, NULL, &csum_v, NULL);
+
+          list->buckets[j] = ref_bucket (ref_name, n_buckets);
+
+          if (g_variant_n_children (csum_v) != OSTREE_SHA256_DIGEST_LEN)
+            continue;
+          g_autofree char *checksum = ostree_checksum_from_bytes_v (csum_v);
+          guint8 *bitmap = g_hash_table_lookup (commit_buckets, checksum);
+          if (bitmap == NULL)
+            {
+              bitmap = g_malloc0 (_OSTREE_SUMMARY_INDEX_MAX_BUCKETS / 8);
+              g_hash_table_insert (commit_buckets, g_steal_pointer (&checksum), bitmap);
+            }
+          set_bucket (bitmap, list->buckets[j]);
+        }
+    }
+
+  /* Deltas go with the refs to their target commit, so clients get the
+   * deltas to the current commits along with the refs. */
+  g_autoptr(GVariant) deltas =
+    g_variant_lookup_value (metadata, OSTREE_SUMMARY_STATIC_DELTAS, G_VARIANT_TYPE_VARDICT);
+  const gsize n_deltas = deltas ? g_variant_n_children (deltas) : 0;
+  g_autofree const guint8 **delta_buckets = g_new0 (const guint8 *, MAX (n_deltas, 1));
+  for (gsize i = 0; i < n_deltas; i++)
+    {
+      const char *delta_name;
+      g_autofree char *from = NULL;
+      g_autofree char *to = NULL;
+      g_variant_get_child (deltas, i, "{&sv}", &delta_name, NULL);
+      if (_ostree_parse_delta_name (delta_name, &from, &to, NULL))
+        delta_buckets[i] = g_hash_table_lookup (commit_buckets, to);
+    }
+
+  g_autoptr(GHashTable) shards = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                        g_free, (GDestroyNotify) g_variant_unref);
+  for (guint bucket = 0; bucket < n_buckets; bucket++)
+    {
+      GVariant *shard = build_shard (ref_lists, bucket, deltas, delta_buckets);
+      if (shard != NULL)
+        g_hash_table_insert (shards, g_strdup_printf ("refs/%u", bucket), shard);
+    }
+  {
+    GVariant *shard = build_shard (ref_lists, G_MAXUINT, deltas, delta_buckets);
+    if (shard != NULL)
+      g_hash_table_insert (shards, g_strdup (_OSTREE_SUMMARY_DELTAS_SHARD), shard);
+  }
+
+  g_autoptr(GVariantBuilder) shards_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{say}"));
+  g_autoptr(GList) shard_names = g_hash_table_get_keys (shards);
+  shard_names = g_list_sort (shard_names, (GCompareFunc) strcmp);
+  for (GList *l = shard_names; l != NULL; l = l->next)
+    {
+      GVariant *shard = g_hash_table_lookup (shards, l->data);
+      g_auto(OtChecksum) hasher = { 0, };
+      guint8 digest[OSTREE_SHA256_DIGEST_LEN];
+
+      ot_checksum_init (&hasher);
+      ot_checksum_update (&hasher, g_variant_get_data (shard), g_variant_get_size (shard));
+      ot_checksum_get_digest (&hasher, digest, sizeof (digest));
+      g_variant_builder_add (shards_builder, "{s@ay}", (const char *) l->data,
+                             ot_gvariant_new_bytearray (digest, sizeof (digest)));
+    }
+
+  g_auto(GVariantDict) index_metadata_builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_variant_dict_init (&index_metadata_builder, metadata);
+  g_variant_dict_remove (&index_metadata_builder, OSTREE_SUMMARY_COLLECTION_MAP);
+  g_variant_dict_remove (&index_metadata_builder, OSTREE_SUMMARY_STATIC_DELTAS);
+  g_variant_dict_insert_value (&index_metadata_builder, OSTREE_SUMMARY_INDEX_BUCKETS,
+                               g_variant_new_uint32 (GUINT32_TO_BE (n_buckets)));
+
+  *out_index = g_variant_ref_sink (g_variant_new ("(@a{say}@a{sv})",
+                                                  g_variant_builder_end (shards_builder),
+                                                  g_variant_dict_end (&index_metadata_builder)));
+  *out_shards = g_steal_pointer (&shards);
+}
+
+static int
+compare_ref_entries (gconstpointer a,
+                     gconstpointer b)
+{
+  const char *ref_a, *ref_b;
+  g_variant_get_child (*(GVariant **) a, 0, "&s", &ref_a);
+  g_variant_get_child (*(GVariant **) b, 0, "&s", &ref_b);
+  return strcmp (ref_a, ref_b);
+}
+
+static GVariant *
+ref_entries_to_variant (GPtrArray *entries)
+{
+  g_ptr_array_sort (entries, compare_ref_entries);
+  return g_variant_new_array (G_VARIANT_TYPE ("(s(taya{sv}))"),
+                              (GVariant * const *) entries->pdata, entries->len);
+}
+
+/* Merge @shards, fetched using @index, back into a summary.  If only some of
+ * the shards are given, the result lists only the refs and deltas in them. */
+GVariant *
+_ostree_summary_index_merge (GVariant   *index,
+                             GPtrArray  *shards)
+{
+  g_autoptr(GVariant) index_metadata = g_variant_get_child_value (index, 1);
+  g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  g_autoptr(GHashTable) collections = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                             (GDestroyNotify) g_ptr_array_unref);
+  g_auto(GVariantDict) deltas_builder = OT_VARIANT_BUILDER_INITIALIZER;
+  gsize n_deltas = 0;
+
+  g_variant_dict_init (&deltas_builder, NULL);
+
+  for (guint i = 0; i < shards->len; i++)
+    {
+      GVariant *shard = shards->pdata[i];
+      g_autoptr(GVariant) shard_refs = g_variant_get_child_value (shard, 0);
+      g_autoptr(GVariant) shard_metadata = g_variant_get_child_value (shard, 1);
+
+      for (gsize j = 0, n = g_variant_n_children (shard_refs); j < n; j++)
+        g_ptr_array_add (refs, g_variant_get_child_value (shard_refs, j));
+
+      g_autoptr(GVariant) collection_map =
+        g_variant_lookup_value (shard_metadata, OSTREE_SUMMARY_COLLECTION_MAP, G_VARIANT_TYPE ("a{sa(s(taya{sv}))}"));
+      if (collection_map != NULL)
+        {
+          GVariantIter iter;
+          const char *collection_id;
+          GVariant *collection_refs;
+          g_variant_iter_init (&iter, collection_map);
+          while (g_variant_iter_loop (&iter, "{&s@a(s(taya{sv}))}", &collection_id, &collection_refs))
+            {
+              GPtrArray *entries = g_hash_table_lookup (collections, collection_id);
+              if (entries == NULL)
+                {
+                  entries = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+                  g_hash_table_insert (collections, g_strdup (collection_id), entries);
+                }
+              for (gsize j = 0, n = g_variant_n_children (collection_refs); j < n; j++)
+                g_ptr_array_add (entries, g_variant_get_child_value (collection_refs, j));
+            }
+        }
+
+      g_autoptr(GVariant) deltas =
+        g_variant_lookup_value (shard_metadata, OSTREE_SUMMARY_STATIC_DELTAS, G_VARIANT_TYPE_VARDICT);
+      if (deltas != NULL)
+        {
+          GVariantIter iter;
+          const char *delta_name;
+          GVariant *digest;
+          g_variant_iter_init (&iter, deltas);
+          while (g_variant_iter_loop (&iter, "{&sv}", &delta_name, &digest))
+            {
+              g_variant_dict_insert_value (&deltas_builder, delta_name, digest);
+              n_deltas++;
+            }
+        }
+    }
+
+  g_auto(GVariantDict) metadata_builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_variant_dict_init (&metadata_builder, index_metadata);
+  g_variant_dict_remove (&metadata_builder, OSTREE_SUMMARY_INDEX_BUCKETS);
+
+  if (g_hash_table_size (collections) > 0)
+    {
+      g_autoptr(GVariantBuilder) collection_map_builder =
+        g_variant_builder_new (G_VARIANT_TYPE ("a{sa(s(taya{sv}))}"));
+      g_autoptr(GList) collection_ids = g_hash_table_get_keys (collections);
+      collection_ids = g_list_sort (collection_ids, (GCompareFunc) strcmp);
+      for (GList *l = collection_ids; l != NULL; l = l->next)
+        g_variant_builder_add (collection_map_builder, "{s@a(s(taya{sv}))}", (const char *) l->data,
+                               ref_entries_to_variant (g_hash_table_lookup (collections, l->data)));
+      g_variant_dict_insert_value (&metadata_builder, OSTREE_SUMMARY_COLLECTION_MAP,
+                                   g_variant_builder_end (collection_map_builder));
+    }
+  if (n_deltas > 0)
+    g_variant_dict_insert_value (&metadata_builder, OSTREE_SUMMARY_STATIC_DELTAS,
+                                 g_variant_dict_end (&deltas_builder));
+
+  return g_variant_ref_sink (g_variant_new ("(@a(s(taya{sv}))@a{sv})",
+                                            ref_entries_to_variant (refs),
+                                            g_variant_dict_end (&metadata_builder)));
+}
+
+/* Add the shard checksums listed in the existing summary.idx to @checksums */
+static gboolean
+add_current_index_shards (OstreeRepo  *self,
+                          GHashTable  *checksums,
+                          GError     **error)
+{
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (self->repo_dir_fd, _OSTREE_SUMMARY_INDEX, &fd, error))
+    return FALSE;
+  if (fd < 0)
+    return TRUE;
+
+  g_autoptr(GVariant) index = NULL;
+  if (!ot_variant_read_fd (fd, 0, OSTREE_SUMMARY_INDEX_GVARIANT_FORMAT, FALSE, &index, error))
+    return FALSE;
+
+  g_autoptr(GVariant) shards = g_variant_get_child_value (index, 0);
+  GVariantIter iter;
+  GVariant *digest;
+  g_variant_iter_init (&iter, shards);
+  while (g_variant_iter_loop (&iter, "{&s@ay}", NULL, &digest))
+    {
+      if (g_variant_n_children (digest) == OSTREE_SHA256_DIGEST_LEN)
+        g_hash_table_add (checksums, ostree_checksum_from_bytes_v (digest));
+    }
+
+  return TRUE;
+}
+
+/* Write summary.idx and the shards for @summary if `core/summary-index` is
+ * set, and remove shards neither it nor the previous index use.  Shards of
+ * the previous index are kept for clients which have just fetched it.  If
+ * the option isn't set, remove any index left over so that clients don't
+ * use a stale one. */
+gboolean
+_ostree_repo_update_summary_index (OstreeRepo    *self,
+                                   GVariant      *summary,
+                                   GCancellable  *cancellable,
+                                   GError       **error)
+{
+  gboolean enabled;
+  if (!ot_keyfile_get_boolean_with_default (self->config, "core", "summary-index", FALSE,
+                                            &enabled, error))
+    return FALSE;
+
+  if (!enabled)
+    {
+      if (!ot_ensure_unlinked_at (self->repo_dir_fd, _OSTREE_SUMMARY_INDEX, error))
+        return FALSE;
+      if (!ot_ensure_unlinked_at (self->repo_dir_fd, _OSTREE_SUMMARY_INDEX_SIG, error))
+        return FALSE;
+      return TRUE;
+    }
+
+  g_autoptr(GVariant) index = NULL;
+  g_autoptr(GHashTable) shards = NULL;
+  _ostree_summary_index_split (summary, &index, &shards);
+
+  g_autoptr(GHashTable) keep = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  if (!add_current_index_shards (self, keep, error))
+    return FALSE;
+
+  glnx_autofd int shards_dfd = -1;
+  if (!glnx_shutil_mkdir_p_at_open (self->repo_dir_fd, _OSTREE_SUMMARY_SHARDS_DIR, 0775,
+                                    &shards_dfd, cancellable, error))
+    return FALSE;
+
+  /* Shards are named after their contents, so existing ones are unchanged */
+  g_autoptr(GVariant) index_shards = g_variant_get_child_value (index, 0);
+  GVariantIter iter;
+  const char *shard_name;
+  GVariant *digest_v;
+  g_variant_iter_init (&iter, index_shards);
+  while (g_variant_iter_next (&iter, "{&s@ay}", &shard_name, &digest_v))
+    {
+      g_autoptr(GVariant) digest = digest_v;
+      g_autofree char *checksum = ostree_checksum_from_bytes_v (digest);
+      GVariant *shard = g_hash_table_lookup (shards, shard_name);
+      struct stat stbuf;
+
+      if (!glnx_fstatat_allow_noent (shards_dfd, checksum, &stbuf, 0, error))
+        return FALSE;
+      if (errno == ENOENT &&
+          !_ostree_repo_file_replace_contents (self, shards_dfd, checksum,
+                                               g_variant_get_data (shard),
+                                               g_variant_get_size (shard),
+                                               cancellable, error))
+        return FALSE;
+
+      g_hash_table_add (keep, g_steal_pointer (&checksum));
+    }
+
+  if (!_ostree_repo_file_replace_contents (self, self->repo_dir_fd, _OSTREE_SUMMARY_INDEX,
+                                           g_variant_get_data (index),
+                                           g_variant_get_size (index),
+                                           cancellable, error))
+    return FALSE;
+  if (!ot_ensure_unlinked_at (self->repo_dir_fd, _OSTREE_SUMMARY_INDEX_SIG, error))
+    return FALSE;
+
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (shards_dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+      if (dent->d_type != DT_REG || g_hash_table_contains (keep, dent->d_name))
+        continue;
+      if (!glnx_unlinkat (shards_dfd, dent->d_name, 0, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
@@ -25,6 +25,7 @@
 
 #include "libglnx.h"
 #include "ostree.h"
+#include "ostree-repo-private.h"
 #include "otutil.h"
 
 struct _OstreeRepoRealCommitTraverseIter {
@@ -691,3 +692,575 @@ ostree_repo_traverse_commit (OstreeRepo      *repo,
     *out_reachable = g_steal_pointer (&ret_reachable);
   return TRUE;
 }
+
+/* The equivalent of traverse_dirtree() for _ostree_repo_traverse_commit_union_set();
+ * this reads the dirtree variant directly rather than going through an
+ * #OstreeRepoCommitTraverseIter, to avoid converting every checksum to
+ * ASCII and back.
+ */
+static gboolean
+traverse_dirtree_set (OstreeRepo       *repo,
+                      const guint8     *csum,
+                      OstreeObjectSet  *inout_reachable,
+                      gboolean          ignore_missing_dirs,
+                      GCancellable     *cancellable,
+                      GError          **error)
+{
+  char checksum[OSTREE_SHA256_STRING_LEN+1];
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GVariant) dirtree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, checksum,
+                                 &dirtree, &local_error))
+    {
+      if (ignore_missing_dirs &&
+          g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_debug ("Ignoring not-found dirtree %s", checksum);
+          return TRUE; /* Early return */
+        }
+
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  g_debug ("Traversing dirtree %s", checksum);
+
+  g_autoptr(GVariant) files_variant = g_variant_get_child_value (dirtree, 0);
+  const gsize n_files = g_variant_n_children (files_variant);
+  for (gsize i = 0; i < n_files; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) content_csum_v = NULL;
+      g_variant_get_child (files_variant, i, "(&s@ay)", &name, &content_csum_v);
+
+      const guchar *content_csum = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+      if (!content_csum)
+        return FALSE;
+      ostree_object_set_add (inout_reachable, content_csum, OSTREE_OBJECT_TYPE_FILE);
+    }
+
+  g_autoptr(GVariant) dirs_variant = g_variant_get_child_value (dirtree, 1);
+  const gsize n_dirs = g_variant_n_children (dirs_variant);
+  for (gsize i = 0; i < n_dirs; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) content_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &name, &content_csum_v, &meta_csum_v);
+
+      const guchar *content_csum = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+      if (!content_csum)
+        return FALSE;
+      const guchar *meta_csum = ostree_checksum_bytes_peek_validate (meta_csum_v, error);
+      if (!meta_csum)
+        return FALSE;
+
+      ostree_object_set_add (inout_reachable, meta_csum, OSTREE_OBJECT_TYPE_DIR_META);
+      if (ostree_object_set_add (inout_reachable, content_csum, OSTREE_OBJECT_TYPE_DIR_TREE))
+        {
+          if (!traverse_dirtree_set (repo, content_csum, inout_reachable,
+                                     ignore_missing_dirs, cancellable, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+typedef struct {
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  gboolean ignore_missing_dirs;
+} TraverseRoot;
+
+/* Add the commits reachable from @commit_checksum, traversing @maxdepth
+ * parent commits, to @inout_reachable, and append the root dirtrees of the
+ * ones which weren't already there to @out_roots; the root dirtrees and
+ * dirmetas are added to @inout_reachable too.
+ */
+static gboolean
+traverse_commit_chain_set (OstreeRepo       *repo,
+                           const char       *commit_checksum,
+                           int               maxdepth,
+                           OstreeObjectSet  *inout_reachable,
+                           GArray           *out_roots,
+                           GCancellable     *cancellable,
+                           GError          **error)
+{
+  g_autofree char *tmp_checksum = NULL;
+
+  while (TRUE)
+    {
+      if (ostree_object_set_contains_checksum (inout_reachable, commit_checksum,
+                                               OSTREE_OBJECT_TYPE_COMMIT))
+        break;
+
+      g_autoptr(GVariant) commit = NULL;
+      OstreeRepoCommitState commitstate;
+      g_autoptr(GError) local_error = NULL;
+      if (!ostree_repo_load_commit (repo, commit_checksum, &commit, &commitstate,
+                                    &local_error))
+        {
+          /* Just return if the parent isn't found; we do expect most
+           * people to have partial repositories.
+           */
+          if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            break;
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      /* See if the commit is partial, if so it's not an error to lack objects */
+      gboolean ignore_missing_dirs = FALSE;
+      if ((commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL) != 0)
+        ignore_missing_dirs = TRUE;
+
+      ostree_object_set_add_checksum (inout_reachable, commit_checksum,
+                                      OSTREE_OBJECT_TYPE_COMMIT);
+
+      g_debug ("Traversing commit %s", commit_checksum);
+
+      g_autoptr(GVariant) content_csum_v = NULL;
+      g_variant_get_child (commit, 6, "@ay", &content_csum_v);
+      const guchar *content_csum = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+      if (!content_csum)
+        return FALSE;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_variant_get_child (commit, 7, "@ay", &meta_csum_v);
+      const guchar *meta_csum = ostree_checksum_bytes_peek_validate (meta_csum_v, error);
+      if (!meta_csum)
+        return FALSE;
+
+      /* As with the iterator, a partial commit's root is skipped entirely
+       * if its dirtree is missing. */
+      gboolean have_root = TRUE;
+      if (ignore_missing_dirs)
+        {
+          char root_checksum[OSTREE_SHA256_STRING_LEN+1];
+          ostree_checksum_inplace_from_bytes (content_csum, root_checksum);
+          if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_DIR_TREE, root_checksum,
+                                       &have_root, cancellable, error))
+            return FALSE;
+        }
+
+      if (have_root)
+        {
+          ostree_object_set_add (inout_reachable, meta_csum, OSTREE_OBJECT_TYPE_DIR_META);
+          if (ostree_object_set_add (inout_reachable, content_csum, OSTREE_OBJECT_TYPE_DIR_TREE))
+            {
+              TraverseRoot root = { { 0, }, ignore_missing_dirs };
+              memcpy (root.csum, content_csum, sizeof (root.csum));
+              g_array_append_val (out_roots, root);
+            }
+        }
+
+      gboolean recurse = FALSE;
+      if (maxdepth == -1 || maxdepth > 0)
+        {
+          g_free (tmp_checksum);
+          tmp_checksum = ostree_commit_get_parent (commit);
+          if (tmp_checksum)
+            {
+              commit_checksum = tmp_checksum;
+              if (maxdepth > 0)
+                maxdepth -= 1;
+              recurse = TRUE;
+            }
+        }
+      if (!recurse)
+        break;
+    }
+
+  return TRUE;
+}
+
+/* Like ostree_repo_traverse_commit_union(), but collecting the objects into
+ * an #OstreeObjectSet, which takes a fraction of the memory of the
+ * #GHashTable of serialized object names for large repositories.
+ */
+gboolean
+_ostree_repo_traverse_commit_union_set (OstreeRepo       *repo,
+                                        const char       *commit_checksum,
+                                        int               maxdepth,
+                                        OstreeObjectSet  *inout_reachable,
+                                        GCancellable     *cancellable,
+                                        GError          **error)
+{
+  g_autoptr(GArray) roots = g_array_new (FALSE, FALSE, sizeof (TraverseRoot));
+  if (!traverse_commit_chain_set (repo, commit_checksum, maxdepth, inout_reachable,
+                                  roots, cancellable, error))
+    return FALSE;
+
+  for (guint i = 0; i < roots->len; i++)
+    {
+      const TraverseRoot *root = &g_array_index (roots, TraverseRoot, i);
+      if (!traverse_dirtree_set (repo, root->csum, inout_reachable,
+                                 root->ignore_missing_dirs, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Parallel traversal.  The commits are walked on the calling thread, since
+ * there are few of them and each depends on the previous one; then every
+ * dirtree becomes a task on a GThreadPool, which loads it and queues tasks
+ * for the subdirectories not seen before.  The reachable set is shared,
+ * under a lock which is taken once per dirtree, so each subtree is only
+ * loaded once however many commits include it.
+ *
+ * Loading a dirtree is mostly waiting for I/O; when tasks are backing up
+ * in the queue, the workers ask the kernel to start reading the dirtrees
+ * they just queued, so the reads overlap with the processing of the
+ * tasks ahead of them.
+ */
+typedef struct {
+  OstreeRepo *repo;
+  GCancellable *cancellable;
+  GThreadPool *pool;
+  guint n_threads;
+
+  GMutex reachable_lock;
+  OstreeObjectSet *reachable;
+
+  volatile gint n_pending;
+
+  GMutex lock;
+  GCond cond;
+  gboolean done;
+  GError *error;
+} TraverseParallel;
+
+static void
+traverse_parallel_take_error (TraverseParallel *ctx,
+                              GError           *local_error)
+{
+  g_mutex_lock (&ctx->lock);
+  if (ctx->error == NULL)
+    ctx->error = g_steal_pointer (&local_error);
+  g_mutex_unlock (&ctx->lock);
+  g_clear_error (&local_error);
+}
+
+static gboolean
+traverse_parallel_should_stop (TraverseParallel *ctx)
+{
+  gboolean ret;
+  g_mutex_lock (&ctx->lock);
+  ret = ctx->error != NULL;
+  g_mutex_unlock (&ctx->lock);
+  return ret || g_cancellable_is_cancelled (ctx->cancellable);
+}
+
+static void
+traverse_parallel_task_complete (TraverseParallel *ctx,
+                                 TraverseRoot     *task)
+{
+  g_free (task);
+  if (g_atomic_int_dec_and_test (&ctx->n_pending))
+    {
+      g_mutex_lock (&ctx->lock);
+      ctx->done = TRUE;
+      g_cond_signal (&ctx->cond);
+      g_mutex_unlock (&ctx->lock);
+    }
+}
+
+/* Best effort; packed objects and those in a parent repo are skipped */
+static void
+traverse_parallel_readahead (TraverseParallel *ctx,
+                             const guint8     *csum)
+{
+  char checksum[OSTREE_SHA256_STRING_LEN+1];
+  char loose_path_buf[_OSTREE_LOOSE_PATH_MAX];
+
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+  _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_DIR_TREE, ctx->repo->mode);
+
+  glnx_autofd int fd = openat (ctx->repo->objects_dir_fd, loose_path_buf, O_RDONLY | O_CLOEXEC);
+  if (fd != -1)
+    (void) posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+}
+
+static gboolean
+traverse_parallel_push (TraverseParallel *ctx,
+                        const guint8     *csum,
+                        gboolean          ignore_missing_dirs,
+                        GError          **error)
+{
+  TraverseRoot *task = g_new0 (TraverseRoot, 1);
+  memcpy (task->csum, csum, sizeof (task->csum));
+  task->ignore_missing_dirs = ignore_missing_dirs;
+
+  g_atomic_int_inc (&ctx->n_pending);
+  if (!g_thread_pool_push (ctx->pool, task, error))
+    {
+      traverse_parallel_task_complete (ctx, task);
+      return FALSE;
+    }
+
+  if (g_thread_pool_unprocessed (ctx->pool) > ctx->n_threads)
+    traverse_parallel_readahead (ctx, csum);
+
+  return TRUE;
+}
+
+static gboolean
+traverse_parallel_task_process (TraverseParallel *ctx,
+                                TraverseRoot     *task,
+                                GError          **error)
+{
+  char checksum[OSTREE_SHA256_STRING_LEN+1];
+  ostree_checksum_inplace_from_bytes (task->csum, checksum);
+
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GVariant) dirtree = NULL;
+  if (!ostree_repo_load_variant (ctx->repo, OSTREE_OBJECT_TYPE_DIR_TREE, checksum,
+                                 &dirtree, &local_error))
+    {
+      if (task->ignore_missing_dirs &&
+          g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_debug ("Ignoring not-found dirtree %s", checksum);
+          return TRUE; /* Early return */
+        }
+
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  g_debug ("Traversing dirtree %s", checksum);
+
+  /* Validate everything up front, so the lock is only held for the
+   * insertions */
+  g_autoptr(GVariant) files_variant = g_variant_get_child_value (dirtree, 0);
+  g_autoptr(GVariant) dirs_variant = g_variant_get_child_value (dirtree, 1);
+  const gsize n_files = g_variant_n_children (files_variant);
+  const gsize n_dirs = g_variant_n_children (dirs_variant);
+  g_autofree const guchar **file_csums = g_new (const guchar *, n_files);
+  g_autofree const guchar **dir_csums = g_new (const guchar *, n_dirs * 2);
+  g_autoptr(GPtrArray) csum_variants = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+
+  for (gsize i = 0; i < n_files; i++)
+    {
+      const char *name;
+      GVariant *content_csum_v = NULL;
+      g_variant_get_child (files_variant, i, "(&s@ay)", &name, &content_csum_v);
+      g_ptr_array_add (csum_variants, content_csum_v);
+
+      file_csums[i] = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+      if (!file_csums[i])
+        return FALSE;
+    }
+
+  for (gsize i = 0; i < n_dirs; i++)
+    {
+      const char *name;
+      GVariant *content_csum_v = NULL;
+      GVariant *meta_csum_v = NULL;
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &name, &content_csum_v, &meta_csum_v);
+      g_ptr_array_add (csum_variants, content_csum_v);
+      g_ptr_array_add (csum_variants, meta_csum_v);
+
+      dir_csums[i * 2] = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+      if (!dir_csums[i * 2])
+        return FALSE;
+      dir_csums[i * 2 + 1] = ostree_checksum_bytes_peek_validate (meta_csum_v, error);
+      if (!dir_csums[i * 2 + 1])
+        return FALSE;
+    }
+
+  /* Reuse the content half of each entry to remember the new subtrees */
+  gsize n_new_dirs = 0;
+  g_mutex_lock (&ctx->reachable_lock);
+  for (gsize i = 0; i < n_files; i++)
+    ostree_object_set_add (ctx->reachable, file_csums[i], OSTREE_OBJECT_TYPE_FILE);
+  for (gsize i = 0; i < n_dirs; i++)
+    {
+      ostree_object_set_add (ctx->reachable, dir_csums[i * 2 + 1], OSTREE_OBJECT_TYPE_DIR_META);
+      if (ostree_object_set_add (ctx->reachable, dir_csums[i * 2], OSTREE_OBJECT_TYPE_DIR_TREE))
+        dir_csums[n_new_dirs++ * 2] = dir_csums[i * 2];
+    }
+  g_mutex_unlock (&ctx->reachable_lock);
+
+  for (gsize i = 0; i < n_new_dirs; i++)
+    {
+      if (!traverse_parallel_push (ctx, dir_csums[i * 2], task->ignore_missing_dirs, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+traverse_parallel_task_run (gpointer data,
+                            gpointer user_data)
+{
+  TraverseRoot *task = data;
+  TraverseParallel *ctx = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!traverse_parallel_should_stop (ctx) &&
+      !traverse_parallel_task_process (ctx, task, &local_error))
+    traverse_parallel_take_error (ctx, g_steal_pointer (&local_error));
+
+  traverse_parallel_task_complete (ctx, task);
+}
+
+/* Like _ostree_repo_traverse_commit_union_set(), for each of
+ * @commit_checksums, loading dirtrees with up to @n_threads threads (or
+ * one per CPU if 0).
+ */
+gboolean
+_ostree_repo_traverse_commits_union_set_parallel (OstreeRepo          *repo,
+                                                  const char * const  *commit_checksums,
+                                                  int                  maxdepth,
+                                                  OstreeObjectSet     *inout_reachable,
+                                                  guint                n_threads,
+                                                  GCancellable        *cancellable,
+                                                  GError             **error)
+{
+  if (n_threads == 0)
+    n_threads = MAX (g_get_num_processors (), 1);
+
+  g_autoptr(GArray) roots = g_array_new (FALSE, FALSE, sizeof (TraverseRoot));
+  for (const char * const *it = commit_checksums; it && *it; it++)
+    {
+      if (!traverse_commit_chain_set (repo, *it, maxdepth, inout_reachable,
+                                      roots, cancellable, error))
+        return FALSE;
+    }
+
+  if (n_threads == 1 || roots->len == 0)
+    {
+      for (guint i = 0; i < roots->len; i++)
+        {
+          const TraverseRoot *root = &g_array_index (roots, TraverseRoot, i);
+          if (!traverse_dirtree_set (repo, root->csum, inout_reachable,
+                                     root->ignore_missing_dirs, cancellable, error))
+            return FALSE;
+        }
+      return TRUE; /* Note early return */
+    }
+
+  TraverseParallel ctx = { 0, };
+  ctx.repo = repo;
+  ctx.cancellable = cancellable;
+  ctx.n_threads = n_threads;
+  ctx.reachable = inout_reachable;
+  g_mutex_init (&ctx.reachable_lock);
+  g_mutex_init (&ctx.lock);
+  g_cond_init (&ctx.cond);
+
+  ctx.pool = g_thread_pool_new (traverse_parallel_task_run, &ctx,
+                                n_threads, TRUE, error);
+  if (!ctx.pool)
+    {
+      g_mutex_clear (&ctx.reachable_lock);
+      g_mutex_clear (&ctx.lock);
+      g_cond_clear (&ctx.cond);
+      return FALSE;
+    }
+
+  /* Hold a reference of our own while queueing, so the count can't drop to
+   * zero before all the roots are in */
+  ctx.n_pending = 1;
+  for (guint i = 0; i < roots->len; i++)
+    {
+      const TraverseRoot *root = &g_array_index (roots, TraverseRoot, i);
+      g_autoptr(GError) local_error = NULL;
+      if (!traverse_parallel_push (&ctx, root->csum, root->ignore_missing_dirs, &local_error))
+        {
+          traverse_parallel_take_error (&ctx, g_steal_pointer (&local_error));
+          break;
+        }
+    }
+  traverse_parallel_task_complete (&ctx, NULL);
+
+  g_mutex_lock (&ctx.lock);
+  while (!ctx.done)
+    g_cond_wait (&ctx.cond, &ctx.lock);
+  g_mutex_unlock (&ctx.lock);
+
+  g_thread_pool_free (ctx.pool, FALSE, TRUE);
+  g_mutex_clear (&ctx.reachable_lock);
+  g_mutex_clear (&ctx.lock);
+  g_cond_clear (&ctx.cond);
+
+  if (ctx.error)
+    {
+      g_propagate_error (error, ctx.error);
+      return FALSE;
+    }
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * ostree_repo_traverse_commit_union_parallel: (skip)
+ * @repo: Repo
+ * @commit_checksums: (array zero-terminated=1): ASCII SHA256 checksums
+ * @maxdepth: Traverse this many parent commits, -1 for unlimited
+ * @inout_reachable: Set of reachable objects
+ * @n_threads: Number of threads to load directories with, or 0 for one per CPU
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Update the set @inout_reachable containing all objects reachable
+ * from each of @commit_checksums, traversing @maxdepth parent commits.
+ *
+ * This is equivalent to calling ostree_repo_traverse_commit_union() for
+ * each commit, but loads directory trees with up to @n_threads threads,
+ * and only once for all the commits; it is significantly faster for large
+ * sets of commits, or where reading objects has high latency.
+ *
+ * Since: 2019.3
+ */
+gboolean
+ostree_repo_traverse_commit_union_parallel (OstreeRepo          *repo,
+                                            const char * const  *commit_checksums,
+                                            int                  maxdepth,
+                                            GHashTable          *inout_reachable,
+                                            guint                n_threads,
+                                            GCancellable        *cancellable,
+                                            GError             **error)
+{
+  g_autoptr(OstreeObjectSet) reachable =
+    ostree_object_set_new (g_hash_table_size (inout_reachable));
+
+  /* Objects already in the set are the boundary of the traversal, as for
+   * ostree_repo_traverse_commit_union() */
+  GLNX_HASH_TABLE_FOREACH (inout_reachable, GVariant*, key)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+      ostree_object_set_add_checksum (reachable, checksum, objtype);
+    }
+
+  if (!_ostree_repo_traverse_commits_union_set_parallel (repo, commit_checksums, maxdepth,
+                                                         reachable, n_threads,
+                                                         cancellable, error))
+    return FALSE;
+
+  gsize iter = 0;
+  const guint8 *csum;
+  OstreeObjectType objtype;
+  while (ostree_object_set_iter_next (reachable, &iter, &csum, &objtype))
+    {
+      char checksum[OSTREE_SHA256_STRING_LEN+1];
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      g_hash_table_add (inout_reachable,
+                        g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype)));
+    }
+
+  return TRUE;
+}
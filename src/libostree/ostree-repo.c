@@ -36,6 +36,9 @@
 #include "ostree-sysroot-private.h"
 #include "ostree-remote-private.h"
 #include "ostree-repo-private.h"
+#include "ostree-repo-pack-private.h"
+#include "ostree-repo-object-index-private.h"
+#include "ostree-repo-summary-index-private.h"
 #include "ostree-repo-file.h"
 #include "ostree-repo-file-enumerator.h"
 #include "ostree-gpg-verifier.h"
@@ -1038,6 +1041,17 @@ ostree_repo_finalize (GObject *object)
   g_clear_error (&self->writable_error);
   g_clear_pointer (&self->object_sizes, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&self->dirmeta_cache, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&self->packs, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&self->object_index, _ostree_object_index_free);
+  g_clear_pointer (&self->metadata_map_cache, _ostree_lru_cache_free);
+  if (self->metadata_cache)
+    {
+      guint64 hits, misses;
+      _ostree_lru_cache_get_stats (self->metadata_cache, &hits, &misses);
+      g_debug ("Metadata cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses",
+               hits, misses);
+    }
+  g_clear_pointer (&self->metadata_cache, _ostree_lru_cache_free);
   g_mutex_clear (&self->cache_lock);
   g_mutex_clear (&self->txn_lock);
   g_free (self->collection_id);
@@ -2418,6 +2432,33 @@ ostree_repo_mode_from_string (const char      *mode,
   return TRUE;
 }
 
+/* Like ostree_repo_mode_from_string(), but also accepts "archive-zstd",
+ * which is an archive repository whose content objects are compressed with
+ * zstd rather than zlib.  Older versions of ostree reject that mode, both when
+ * opening such a repository and when pulling from it, which is why it is
+ * not a separate config key.
+ */
+gboolean
+_ostree_repo_mode_from_string (const char                *mode,
+                               OstreeRepoMode            *out_mode,
+                               OstreeArchiveCompression  *out_compression,
+                               GError                   **error)
+{
+  OstreeArchiveCompression compression = OSTREE_ARCHIVE_COMPRESSION_ZLIB;
+
+  if (strcmp (mode, "archive-zstd") == 0)
+    {
+      *out_mode = OSTREE_REPO_MODE_ARCHIVE;
+      compression = OSTREE_ARCHIVE_COMPRESSION_ZSTD;
+    }
+  else if (!ostree_repo_mode_from_string (mode, out_mode, error))
+    return FALSE;
+
+  if (out_compression)
+    *out_compression = compression;
+  return TRUE;
+}
+
 #define DEFAULT_CONFIG_CONTENTS ("[core]\n" \
                                  "repo_version=1\n")
 
@@ -2476,6 +2517,23 @@ repo_create_at_internal (int             dfd,
         return FALSE;
       g_assert (mode_str);
 
+      const char *archive_compression = NULL;
+      if (options)
+        g_variant_lookup (options, "archive-compression", "&s", &archive_compression);
+      if (archive_compression == NULL || g_str_equal (archive_compression, "zlib"))
+        ;
+      else if (g_str_equal (archive_compression, "zstd"))
+        {
+          if (mode != OSTREE_REPO_MODE_ARCHIVE)
+            return glnx_throw (error, "archive-compression is only supported in archive mode");
+#ifndef HAVE_ZSTD
+          return glnx_throw (error, "This version of ostree was built without zstd support");
+#endif
+          mode_str = "archive-zstd";
+        }
+      else
+        return glnx_throw (error, "Invalid archive-compression '%s'", archive_compression);
+
       g_string_append_printf (config_data, "mode=%s\n", mode_str);
 
       const char *collection_id = NULL;
@@ -2586,6 +2644,10 @@ ostree_repo_create (OstreeRepo     *self,
  * The @options dict may contain:
  *
  *   - collection-id: s: Set as collection ID in repo/config (Since 2017.9)
+ *   - archive-compression: s: For %OSTREE_REPO_MODE_ARCHIVE, how to compress
+ *     content objects: "zlib" (the default) or "zstd".  A zstd repository
+ *     has mode "archive-zstd" in repo/config, and can't be opened or pulled
+ *     from by versions of ostree older than 2019.3 (Since 2019.3)
  *
  * Returns: (transfer full): A new OSTree repository reference
  *
@@ -2884,7 +2946,7 @@ reload_core_config (OstreeRepo          *self,
   if (!ot_keyfile_get_value_with_default (self->config, "core", "mode",
                                           "bare", &mode, error))
     return FALSE;
-  if (!ostree_repo_mode_from_string (mode, &self->mode, error))
+  if (!_ostree_repo_mode_from_string (mode, &self->mode, &self->archive_compression, error))
     return FALSE;
 
   if (self->writable)
@@ -2956,6 +3018,24 @@ reload_core_config (OstreeRepo          *self,
       self->zlib_compression_level = OSTREE_ARCHIVE_DEFAULT_COMPRESSION_LEVEL;
   }
 
+  if (self->archive_compression == OSTREE_ARCHIVE_COMPRESSION_ZSTD)
+    {
+      g_autofree char *zstd_level_str = NULL;
+      if (!ot_keyfile_get_value_with_default (self->config, "archive", "zstd-level", NULL,
+                                              &zstd_level_str, error))
+        return FALSE;
+      if (zstd_level_str)
+        {
+          char *endp = NULL;
+          guint64 level = g_ascii_strtoull (zstd_level_str, &endp, 10);
+          if (*zstd_level_str == '\0' || *endp != '\0' || level < 1 || level > 19)
+            return glnx_throw (error, "Invalid archive.zstd-level '%s'", zstd_level_str);
+          self->zstd_compression_level = level;
+        }
+      else
+        self->zstd_compression_level = OSTREE_ARCHIVE_DEFAULT_ZSTD_COMPRESSION_LEVEL;
+    }
+
   {
     /* Try to parse both min-free-space-* config options first. If both are absent, fallback on 3% free space.
      * If both are present and are non-zero, use min-free-space-size unconditionally and display a warning.
@@ -3045,6 +3125,55 @@ reload_core_config (OstreeRepo          *self,
     self->payload_link_threshold = g_ascii_strtoull (payload_threshold, NULL, 10);
   }
 
+  if (!ot_keyfile_get_boolean_with_default (self->config, "core", "object-index",
+                                            FALSE, &self->object_index_enabled, error))
+    return FALSE;
+
+  if (!ot_keyfile_get_boolean_with_default (self->config, "core", "packed-refs",
+                                            FALSE, &self->packed_refs_enabled, error))
+    return FALSE;
+
+  { gboolean mmap_metadata = FALSE;
+    g_autofree char *cache_size = NULL;
+
+    if (!ot_keyfile_get_boolean_with_default (self->config, "core", "mmap-metadata",
+                                              FALSE, &mmap_metadata, error))
+      return FALSE;
+    /* Default to 64 MiB */
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "mmap-metadata-cache-size",
+                                            "67108864", &cache_size, error))
+      return FALSE;
+
+    char *endp = NULL;
+    const guint64 map_cache_size = g_ascii_strtoull (cache_size, &endp, 10);
+    if (*cache_size == '\0' || *endp != '\0')
+      return glnx_throw (error, "Invalid core.mmap-metadata-cache-size '%s'", cache_size);
+
+    g_clear_pointer (&self->metadata_map_cache, _ostree_lru_cache_free);
+    if (mmap_metadata)
+      self->metadata_map_cache = _ostree_lru_cache_new (map_cache_size,
+                                                        (GBoxedCopyFunc) g_bytes_ref,
+                                                        (GDestroyNotify) g_bytes_unref);
+  }
+
+  { g_autofree char *cache_size_str = NULL;
+
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "metadata-cache-size",
+                                            "0", &cache_size_str, error))
+      return FALSE;
+
+    char *endp = NULL;
+    const guint64 cache_size = g_ascii_strtoull (cache_size_str, &endp, 10);
+    if (*cache_size_str == '\0' || *endp != '\0')
+      return glnx_throw (error, "Invalid core.metadata-cache-size '%s'", cache_size_str);
+
+    g_clear_pointer (&self->metadata_cache, _ostree_lru_cache_free);
+    if (cache_size > 0)
+      self->metadata_cache = _ostree_lru_cache_new (cache_size,
+                                                    (GBoxedCopyFunc) g_variant_ref,
+                                                    (GDestroyNotify) g_variant_unref);
+  }
+
   { g_auto(GStrv) configured_finders = NULL;
     g_autoptr(GError) local_error = NULL;
 
@@ -3158,6 +3287,29 @@ reload_sysroot_config (OstreeRepo          *self,
     self->bootloader = g_steal_pointer (&bootloader);
   }
 
+  { g_autofree char *sync_mode = NULL;
+
+    if (!ot_keyfile_get_value_with_default_group_optional (self->config, "sysroot",
+                                                           "sync-mode", "full",
+                                                           &sync_mode, error))
+      return FALSE;
+
+    if (g_str_equal (sync_mode, "full"))
+      self->targeted_sync = FALSE;
+    else if (g_str_equal (sync_mode, "targeted"))
+      self->targeted_sync = TRUE;
+    else
+      return glnx_throw (error, "Invalid sync-mode configuration: '%s'", sync_mode);
+  }
+
+  if (!ot_keyfile_get_boolean_with_default (self->config, "sysroot", "prefinalize-staged",
+                                            FALSE, &self->prefinalize_staged, error))
+    return FALSE;
+
+  if (!ot_keyfile_get_boolean_with_default (self->config, "sysroot", "grub2-native",
+                                            FALSE, &self->grub2_native, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -3532,6 +3684,49 @@ ostree_repo_get_parent (OstreeRepo  *self)
   return self->parent_repo;
 }
 
+/* Parse the name of a loose object file @name in the two character object
+ * subdirectory @prefix; @out_checksum must hold OSTREE_SHA256_STRING_LEN+1
+ * bytes.  Returns %FALSE if @name isn't an object listed by
+ * ostree_repo_list_objects().
+ */
+gboolean
+_ostree_repo_parse_loose_object_name (OstreeRepo        *self,
+                                      const char        *prefix,
+                                      const char        *name,
+                                      char              *out_checksum,
+                                      OstreeObjectType  *out_objtype)
+{
+  const char *dot = strrchr (name, '.');
+  if (!dot)
+    return FALSE;
+
+  OstreeObjectType objtype;
+  if ((self->mode == OSTREE_REPO_MODE_ARCHIVE
+       && strcmp (dot, ".filez") == 0) ||
+      ((_ostree_repo_mode_is_bare (self->mode))
+       && strcmp (dot, ".file") == 0))
+    objtype = OSTREE_OBJECT_TYPE_FILE;
+  else if (strcmp (dot, ".dirtree") == 0)
+    objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
+  else if (strcmp (dot, ".dirmeta") == 0)
+    objtype = OSTREE_OBJECT_TYPE_DIR_META;
+  else if (strcmp (dot, ".commit") == 0)
+    objtype = OSTREE_OBJECT_TYPE_COMMIT;
+  else if (strcmp (dot, ".payload-link") == 0)
+    objtype = OSTREE_OBJECT_TYPE_PAYLOAD_LINK;
+  else
+    return FALSE;
+
+  if ((dot - name) != 62)
+    return FALSE;
+
+  memcpy (out_checksum, prefix, 2);
+  memcpy (out_checksum + 2, name, 62);
+  out_checksum[OSTREE_SHA256_STRING_LEN] = '\0';
+  *out_objtype = objtype;
+  return TRUE;
+}
+
 static gboolean
 list_loose_objects_at (OstreeRepo             *self,
                        GHashTable             *inout_objects,
@@ -3560,41 +3755,11 @@ list_loose_objects_at (OstreeRepo             *self,
       if (dent == NULL)
         break;
 
-      const char *name = dent->d_name;
-      if (strcmp (name, ".") == 0 ||
-          strcmp (name, "..") == 0)
-        continue;
-
-      const char *dot = strrchr (name, '.');
-      if (!dot)
-        continue;
-
+      char buf[OSTREE_SHA256_STRING_LEN+1];
       OstreeObjectType objtype;
-      if ((self->mode == OSTREE_REPO_MODE_ARCHIVE
-           && strcmp (dot, ".filez") == 0) ||
-          ((_ostree_repo_mode_is_bare (self->mode))
-           && strcmp (dot, ".file") == 0))
-        objtype = OSTREE_OBJECT_TYPE_FILE;
-      else if (strcmp (dot, ".dirtree") == 0)
-        objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
-      else if (strcmp (dot, ".dirmeta") == 0)
-        objtype = OSTREE_OBJECT_TYPE_DIR_META;
-      else if (strcmp (dot, ".commit") == 0)
-        objtype = OSTREE_OBJECT_TYPE_COMMIT;
-      else if (strcmp (dot, ".payload-link") == 0)
-        objtype = OSTREE_OBJECT_TYPE_PAYLOAD_LINK;
-      else
+      if (!_ostree_repo_parse_loose_object_name (self, prefix, dent->d_name, buf, &objtype))
         continue;
 
-      if ((dot - name) != 62)
-        continue;
-
-      char buf[OSTREE_SHA256_STRING_LEN+1];
-
-      memcpy (buf, prefix, 2);
-      memcpy (buf + 2, name, 62);
-      buf[sizeof(buf)-1] = '\0';
-
       /* if we passed in a "starting with" argument, then
          we only want to return .commit objects with a checksum
          that matches the commit_starting_with argument */
@@ -3686,28 +3851,87 @@ load_metadata_internal (OstreeRepo       *self,
 
   _ostree_loose_path (loose_path_buf, sha256, objtype, self->mode);
 
- if (!ot_openat_ignore_enoent (self->objects_dir_fd, loose_path_buf, &fd,
-                               error))
-    return FALSE;
+  /* The object's contents, if they're mapped or packed rather than read from @fd */
+  g_autoptr(GBytes) bytes = NULL;
 
-  if (fd < 0 && self->commit_stagedir.initialized)
+  /* Detached commit metadata can be rewritten in place, so it isn't cached */
+  const gboolean is_cachable = (objtype != OSTREE_OBJECT_TYPE_COMMIT_META);
+
+  /* With core.metadata-cache-size, the most recently loaded variants are
+   * kept around */
+  OstreeLruCache *variant_cache =
+    (is_cachable && out_variant && !out_stream) ? self->metadata_cache : NULL;
+  if (variant_cache)
+    ret_variant = _ostree_lru_cache_lookup (variant_cache, loose_path_buf);
+  const gboolean variant_cache_hit = (ret_variant != NULL);
+
+  /* With core.mmap-metadata, loose objects are mapped rather than read into
+   * memory, and the most recently used mappings are kept around */
+  OstreeLruCache *map_cache = is_cachable ? self->metadata_map_cache : NULL;
+  if (ret_variant == NULL && map_cache)
+    bytes = _ostree_lru_cache_lookup (map_cache, loose_path_buf);
+
+  if (ret_variant == NULL && bytes == NULL)
     {
-      if (!ot_openat_ignore_enoent (self->commit_stagedir.fd, loose_path_buf, &fd,
+      if (!ot_openat_ignore_enoent (self->objects_dir_fd, loose_path_buf, &fd,
                                     error))
         return FALSE;
+
+      if (fd < 0 && self->commit_stagedir.initialized)
+        {
+          if (!ot_openat_ignore_enoent (self->commit_stagedir.fd, loose_path_buf, &fd,
+                                        error))
+            return FALSE;
+
+          /* Don't cache objects that may yet be aborted */
+          if (fd >= 0)
+            map_cache = variant_cache = NULL;
+        }
+
+      if (fd >= 0 && map_cache)
+        {
+          g_autoptr(GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+          if (!mfile)
+            return FALSE;
+          bytes = g_mapped_file_get_bytes (mfile);
+
+          /* Mappings take whole pages */
+          const gsize page_size = sysconf (_SC_PAGESIZE);
+          const gsize mapped_size = (g_bytes_get_size (bytes) + page_size - 1) & ~(page_size - 1);
+          _ostree_lru_cache_insert (map_cache, loose_path_buf, bytes, mapped_size);
+        }
+      else if (fd < 0)
+        {
+          if (!_ostree_repo_load_packed_object (self, sha256, objtype, &bytes, error))
+            return FALSE;
+        }
     }
 
-  if (fd != -1)
+  if (ret_variant != NULL || fd != -1 || bytes != NULL)
     {
       struct stat stbuf;
-      if (!glnx_fstat (fd, &stbuf, error))
+      if (ret_variant)
+        stbuf.st_size = g_variant_get_size (ret_variant);
+      else if (bytes)
+        stbuf.st_size = g_bytes_get_size (bytes);
+      else if (!glnx_fstat (fd, &stbuf, error))
         return FALSE;
       if (out_variant)
         {
-          if (!ot_variant_read_fd (fd, 0, ostree_metadata_variant_type (objtype), TRUE,
-                                   &ret_variant, error))
+          if (variant_cache_hit)
+            ;
+          else if (bytes)
+            ret_variant = g_variant_ref_sink (g_variant_new_from_bytes (ostree_metadata_variant_type (objtype),
+                                                                        bytes, TRUE));
+          else if (!ot_variant_read_fd (fd, 0, ostree_metadata_variant_type (objtype), TRUE,
+                                        &ret_variant, error))
             return FALSE;
 
+          /* Count a rough overhead for the GVariant and the cache entry */
+          if (variant_cache && !variant_cache_hit)
+            _ostree_lru_cache_insert (variant_cache, loose_path_buf, ret_variant,
+                                      stbuf.st_size + 128);
+
           /* Now, let's put it in the cache */
           if (is_dirmeta_cachable)
             {
@@ -3718,6 +3942,8 @@ load_metadata_internal (OstreeRepo       *self,
               g_mutex_unlock (lock);
             }
         }
+      else if (out_stream && bytes)
+        ret_stream = g_memory_input_stream_new_from_bytes (bytes);
       else if (out_stream)
         {
           ret_stream = g_unix_input_stream_new (fd, TRUE);
@@ -3801,6 +4027,14 @@ repo_load_file_archive (OstreeRepo *self,
         return FALSE;
     }
 
+  g_autoptr(GBytes) packed_bytes = NULL;
+  if (fd < 0)
+    {
+      if (!_ostree_repo_load_packed_object (self, checksum, OSTREE_OBJECT_TYPE_FILE,
+                                            &packed_bytes, error))
+        return FALSE;
+    }
+
   if (fd != -1)
     {
       if (!glnx_fstat (fd, &stbuf, error))
@@ -3808,9 +4042,19 @@ repo_load_file_archive (OstreeRepo *self,
 
       g_autoptr(GInputStream) tmp_stream = g_unix_input_stream_new (glnx_steal_fd (&fd), TRUE);
       /* Note return here */
-      return ostree_content_stream_parse (TRUE, tmp_stream, stbuf.st_size, TRUE,
-                                          out_input, out_file_info, out_xattrs,
-                                          cancellable, error);
+      return _ostree_archive_stream_parse (self->archive_compression,
+                                           tmp_stream, stbuf.st_size, TRUE,
+                                           out_input, out_file_info, out_xattrs,
+                                           cancellable, error);
+    }
+  else if (packed_bytes)
+    {
+      g_autoptr(GInputStream) tmp_stream = g_memory_input_stream_new_from_bytes (packed_bytes);
+      /* Note return here */
+      return _ostree_archive_stream_parse (self->archive_compression,
+                                           tmp_stream, g_bytes_get_size (packed_bytes), TRUE,
+                                           out_input, out_file_info, out_xattrs,
+                                           cancellable, error);
     }
   else if (self->parent_repo)
     {
@@ -4156,11 +4400,22 @@ ostree_repo_has_object (OstreeRepo           *self,
 {
   gboolean ret_have_object;
 
-  if (!_ostree_repo_has_loose_object (self, checksum, objtype, &ret_have_object,
-                                      cancellable, error))
+  if (!_ostree_repo_object_index_lookup (self, checksum, objtype, &ret_have_object, error))
     return FALSE;
 
-  /* In the future, here is where we would also look up in metadata pack files */
+  if (!ret_have_object)
+    {
+      if (!_ostree_repo_has_loose_object (self, checksum, objtype, &ret_have_object,
+                                          cancellable, error))
+        return FALSE;
+    }
+
+  if (!ret_have_object)
+    {
+      if (!_ostree_repo_has_packed_object (self, checksum, objtype, &ret_have_object,
+                                           NULL, error))
+        return FALSE;
+    }
 
   if (!ret_have_object && self->parent_repo)
     {
@@ -4196,6 +4451,21 @@ ostree_repo_delete_object (OstreeRepo           *self,
   char loose_path[_OSTREE_LOOSE_PATH_MAX];
   _ostree_loose_path (loose_path, sha256, objtype, self->mode);
 
+  /* The object index must never list a deleted object, so record its
+   * removal first.  Tombstones aren't indexed, and are "deleted" on every
+   * commit write. */
+  g_autoptr(OstreeRepoAutoLock) lock = NULL;
+  if (self->object_index_enabled && objtype != OSTREE_OBJECT_TYPE_TOMBSTONE_COMMIT)
+    {
+      /* Keep concurrent transactions from re-adding it to the index */
+      lock = _ostree_repo_auto_lock_push (self, OSTREE_REPO_LOCK_EXCLUSIVE,
+                                          cancellable, error);
+      if (!lock)
+        return FALSE;
+      if (!_ostree_repo_object_index_remove (self, sha256, objtype, error))
+        return FALSE;
+    }
+
   if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
     {
       char meta_loose[_OSTREE_LOOSE_PATH_MAX];
@@ -4209,6 +4479,11 @@ ostree_repo_delete_object (OstreeRepo           *self,
   if (!glnx_unlinkat (self->objects_dir_fd, loose_path, 0, error))
     return glnx_prefix_error (error, "Deleting object %s.%s", sha256, ostree_object_type_to_string (objtype));
 
+  if (self->metadata_map_cache)
+    _ostree_lru_cache_remove (self->metadata_map_cache, loose_path);
+  if (self->metadata_cache)
+    _ostree_lru_cache_remove (self->metadata_cache, loose_path);
+
   /* If the repository is configured to use tombstone commits, create one when deleting a commit.  */
   if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
     {
@@ -4409,6 +4684,16 @@ ostree_repo_query_object_storage_size (OstreeRepo           *self,
   if (res < 0 && errno == ENOENT && self->commit_stagedir.initialized)
     res = TEMP_FAILURE_RETRY (fstatat (self->commit_stagedir.fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW));
 
+  if (res < 0 && errno == ENOENT)
+    {
+      gboolean is_packed = FALSE;
+      if (!_ostree_repo_has_packed_object (self, sha256, objtype, &is_packed, out_size, error))
+        return FALSE;
+      if (is_packed)
+        return TRUE;
+      errno = ENOENT;
+    }
+
   if (res < 0)
     return glnx_throw_errno_prefix (error, "Querying object %s.%s", sha256, ostree_object_type_to_string (objtype));
 
@@ -4532,13 +4817,91 @@ ostree_repo_list_objects (OstreeRepo                  *self,
 
   if (flags & OSTREE_REPO_LIST_OBJECTS_PACKED)
     {
-      /* Nothing for now... */
+      if (!_ostree_repo_list_packed_objects (self, ret_objects, cancellable, error))
+        return FALSE;
+      if ((flags & OSTREE_REPO_LIST_OBJECTS_NO_PARENTS) == 0 && self->parent_repo)
+        {
+          if (!_ostree_repo_list_packed_objects (self->parent_repo, ret_objects,
+                                                 cancellable, error))
+            return FALSE;
+        }
     }
 
   ot_transfer_out_value (out_objects, &ret_objects);
   return TRUE;
 }
 
+static gboolean
+list_loose_objects_set (OstreeRepo       *self,
+                        OstreeObjectSet  *inout_objects,
+                        GCancellable     *cancellable,
+                        GError          **error)
+{
+  static const gchar hexchars[] = "0123456789abcdef";
+
+  for (guint c = 0; c < 256; c++)
+    {
+      char prefix[3] = { hexchars[c >> 4], hexchars[c & 0xF], '\0' };
+
+      g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+      gboolean exists;
+      if (!ot_dfd_iter_init_allow_noent (self->objects_dir_fd, prefix, &dfd_iter, &exists, error))
+        return FALSE;
+      if (!exists)
+        continue;
+
+      while (TRUE)
+        {
+          struct dirent *dent;
+          if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+            return FALSE;
+          if (dent == NULL)
+            break;
+
+          char checksum[OSTREE_SHA256_STRING_LEN+1];
+          OstreeObjectType objtype;
+          if (!_ostree_repo_parse_loose_object_name (self, prefix, dent->d_name, checksum, &objtype))
+            continue;
+
+          ostree_object_set_add_checksum (inout_objects, checksum, objtype);
+        }
+    }
+
+  return TRUE;
+}
+
+/* Like ostree_repo_list_objects(), but only collects the names of the
+ * objects, into the more compact @inout_objects.
+ */
+gboolean
+_ostree_repo_list_objects_set (OstreeRepo                  *self,
+                               OstreeRepoListObjectsFlags   flags,
+                               OstreeObjectSet             *inout_objects,
+                               GCancellable                *cancellable,
+                               GError                     **error)
+{
+  if (flags & OSTREE_REPO_LIST_OBJECTS_ALL)
+    flags |= (OSTREE_REPO_LIST_OBJECTS_LOOSE | OSTREE_REPO_LIST_OBJECTS_PACKED);
+
+  for (OstreeRepo *repo = self; repo != NULL; repo = repo->parent_repo)
+    {
+      if (flags & OSTREE_REPO_LIST_OBJECTS_LOOSE)
+        {
+          if (!list_loose_objects_set (repo, inout_objects, cancellable, error))
+            return FALSE;
+        }
+      if (flags & OSTREE_REPO_LIST_OBJECTS_PACKED)
+        {
+          if (!_ostree_repo_list_packed_objects_set (repo, inout_objects, cancellable, error))
+            return FALSE;
+        }
+      if (flags & OSTREE_REPO_LIST_OBJECTS_NO_PARENTS)
+        break;
+    }
+
+  return TRUE;
+}
+
 /**
  * ostree_repo_list_commit_objects_starting_with:
  * @self: Repo
@@ -5089,26 +5452,31 @@ ostree_repo_sign_delta (OstreeRepo     *self,
   return FALSE;
 }
 
-/**
- * ostree_repo_add_gpg_signature_summary:
- * @self: Self
- * @key_id: (array zero-terminated=1) (element-type utf8): NULL-terminated array of GPG keys.
- * @homedir: (allow-none): GPG home directory, or %NULL
- * @cancellable: A #GCancellable
- * @error: a #GError
- *
- * Add a GPG signature to a summary file.
- */
-gboolean
-ostree_repo_add_gpg_signature_summary (OstreeRepo     *self,
-                                       const gchar    **key_id,
-                                       const gchar    *homedir,
-                                       GCancellable   *cancellable,
-                                       GError        **error)
+/* Append signatures with each of @key_id for the file @name to @sig_name.
+ * If @required is %FALSE, a missing @name is ignored. */
+static gboolean
+sign_summary_file (OstreeRepo     *self,
+                   const char     *name,
+                   const char     *sig_name,
+                   gboolean        required,
+                   const gchar   **key_id,
+                   const gchar    *homedir,
+                   GCancellable   *cancellable,
+                   GError        **error)
 {
   glnx_autofd int fd = -1;
-  if (!glnx_openat_rdonly (self->repo_dir_fd, "summary", TRUE, &fd, error))
-    return FALSE;
+  if (required)
+    {
+      if (!glnx_openat_rdonly (self->repo_dir_fd, name, TRUE, &fd, error))
+        return FALSE;
+    }
+  else
+    {
+      if (!ot_openat_ignore_enoent (self->repo_dir_fd, name, &fd, error))
+        return FALSE;
+      if (fd < 0)
+        return TRUE;
+    }
   g_autoptr(GBytes) summary_data = ot_fd_readall_or_mmap (fd, 0, error);
   if (!summary_data)
     return FALSE;
@@ -5116,7 +5484,7 @@ ostree_repo_add_gpg_signature_summary (OstreeRepo     *self,
   glnx_close_fd (&fd);
 
   g_autoptr(GVariant) metadata = NULL;
-  if (!ot_openat_ignore_enoent (self->repo_dir_fd, "summary.sig", &fd, error))
+  if (!ot_openat_ignore_enoent (self->repo_dir_fd, sig_name, &fd, error))
     return FALSE;
   if (fd >= 0)
     {
@@ -5141,7 +5509,7 @@ ostree_repo_add_gpg_signature_summary (OstreeRepo     *self,
 
   if (!_ostree_repo_file_replace_contents (self,
                                            self->repo_dir_fd,
-                                           "summary.sig",
+                                           sig_name,
                                            g_variant_get_data (normalized),
                                            g_variant_get_size (normalized),
                                            cancellable, error))
@@ -5150,6 +5518,36 @@ ostree_repo_add_gpg_signature_summary (OstreeRepo     *self,
   return TRUE;
 }
 
+/**
+ * ostree_repo_add_gpg_signature_summary:
+ * @self: Self
+ * @key_id: (array zero-terminated=1) (element-type utf8): NULL-terminated array of GPG keys.
+ * @homedir: (allow-none): GPG home directory, or %NULL
+ * @cancellable: A #GCancellable
+ * @error: a #GError
+ *
+ * Add a GPG signature to a summary file.  If the repository has a summary
+ * index (see `core/summary-index` in ostree.repo-config(5)), it is signed as
+ * well.
+ */
+gboolean
+ostree_repo_add_gpg_signature_summary (OstreeRepo     *self,
+                                       const gchar    **key_id,
+                                       const gchar    *homedir,
+                                       GCancellable   *cancellable,
+                                       GError        **error)
+{
+  if (!sign_summary_file (self, "summary", "summary.sig", TRUE, key_id, homedir,
+                          cancellable, error))
+    return FALSE;
+
+  if (!sign_summary_file (self, _OSTREE_SUMMARY_INDEX, _OSTREE_SUMMARY_INDEX_SIG, FALSE,
+                          key_id, homedir, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
 /* Special remote for _ostree_repo_gpg_verify_with_metadata() */
 static const char *OSTREE_ALL_REMOTES = "__OSTREE_ALL_REMOTES__";
 
@@ -5568,11 +5966,13 @@ ostree_repo_verify_summary (OstreeRepo    *self,
 
 /* Add an entry for a @ref ↦ @checksum mapping to an `a(s(t@ay@a{sv}))`
  * @refs_builder to go into a `summary` file. This includes building the
- * standard additional metadata keys for the ref. */
+ * standard additional metadata keys for the ref, unless @previous_commits
+ * (checksum ↦ `(taya{sv})`) already has them for @checksum. */
 static gboolean
 summary_add_ref_entry (OstreeRepo       *self,
                        const char       *ref,
                        const char       *checksum,
+                       GHashTable       *previous_commits,
                        GVariantBuilder  *refs_builder,
                        GError          **error)
 {
@@ -5588,6 +5988,15 @@ summary_add_ref_entry (OstreeRepo       *self,
   if (remotename != NULL)
     return TRUE;
 
+  /* The rest of the entry only depends on the commit */
+  GVariant *previous = previous_commits ? g_hash_table_lookup (previous_commits, checksum) : NULL;
+  if (previous != NULL)
+    {
+      g_variant_builder_add_value (refs_builder,
+                                   g_variant_new ("(s@(taya{sv}))", ref, previous));
+      return TRUE;
+    }
+
   g_autoptr(GVariant) commit_obj = NULL;
   if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, checksum, &commit_obj, error))
     return FALSE;
@@ -5611,49 +6020,138 @@ summary_add_ref_entry (OstreeRepo       *self,
   return TRUE;
 }
 
-/**
- * ostree_repo_regenerate_summary:
- * @self: Repo
- * @additional_metadata: (allow-none): A GVariant of type a{sv}, or %NULL
- * @cancellable: Cancellable
- * @error: Error
- *
- * An OSTree repository can contain a high level "summary" file that
- * describes the available branches and other metadata.
- *
- * If the timetable for making commits and updating the summary file is fairly
- * regular, setting the `ostree.summary.expires` key in @additional_metadata
- * will aid clients in working out when to check for updates.
- *
- * It is regenerated automatically after any ref is
- * added, removed, or updated if `core/auto-update-summary` is set.
- *
- * If the `core/collection-id` key is set in the configuration, it will be
- * included as %OSTREE_SUMMARY_COLLECTION_ID in the summary file. Refs that
- * have associated collection IDs will be included in the generated summary
- * file, listed under the %OSTREE_SUMMARY_COLLECTION_MAP key. Collection IDs
- * and refs in %OSTREE_SUMMARY_COLLECTION_MAP are guaranteed to be in
- * lexicographic order.
- *
- * Locking: exclusive
- */
-gboolean
-ostree_repo_regenerate_summary (OstreeRepo     *self,
-                                GVariant       *additional_metadata,
-                                GCancellable   *cancellable,
-                                GError        **error)
+/* Index the ref entries of a previous summary file by commit checksum, for
+ * summary_add_ref_entry(). */
+static GHashTable *
+summary_index_commits (GVariant *summary)
 {
-  /* Take an exclusive lock. This makes sure the commits and deltas don't get
-   * deleted while generating the summary. It also means we can be sure refs
-   * won't be created/updated/deleted during the operation, without having to
-   * add exclusive locks to those operations which would prevent concurrent
-   * commits from working.
-   */
-  g_autoptr(OstreeRepoAutoLock) lock = NULL;
-  lock = _ostree_repo_auto_lock_push (self, OSTREE_REPO_LOCK_EXCLUSIVE,
-                                      cancellable, error);
-  if (!lock)
-    return FALSE;
+  g_autoptr(GHashTable) commits = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                         g_free, (GDestroyNotify) g_variant_unref);
+  g_autoptr(GPtrArray) ref_arrays = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+
+  g_ptr_array_add (ref_arrays, g_variant_get_child_value (summary, 0));
+
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (summary, 1);
+  g_autoptr(GVariant) collection_map =
+    g_variant_lookup_value (metadata, OSTREE_SUMMARY_COLLECTION_MAP, G_VARIANT_TYPE ("a{sa(s(taya{sv}))}"));
+  if (collection_map != NULL)
+    {
+      const char *collection_id;
+      GVariant *refs;
+      GVariantIter iter;
+      g_variant_iter_init (&iter, collection_map);
+      while (g_variant_iter_next (&iter, "{&s@a(s(taya{sv}))}", &collection_id, &refs))
+        g_ptr_array_add (ref_arrays, refs);
+    }
+
+  for (guint i = 0; i < ref_arrays->len; i++)
+    {
+      GVariant *refs = ref_arrays->pdata[i];
+      const gsize n = g_variant_n_children (refs);
+      for (gsize j = 0; j < n; j++)
+        {
+          g_autoptr(GVariant) ref_entry = g_variant_get_child_value (refs, j);
+          g_autoptr(GVariant) commit_entry = g_variant_get_child_value (ref_entry, 1);
+          g_autoptr(GVariant) csum_v = g_variant_get_child_value (commit_entry, 1);
+          if (g_variant_n_children (csum_v) != OSTREE_SHA256_DIGEST_LEN)
+            continue;
+
+          g_hash_table_replace (commits, ostree_checksum_from_bytes_v (csum_v),
+                                g_steal_pointer (&commit_entry));
+        }
+    }
+
+  return g_steal_pointer (&commits);
+}
+
+/* Load the static delta digests cached by the last summary_build(), if any.
+ * This is only a cache, so any problem with it just means we don't use it. */
+static GVariant *
+summary_deltas_cache_load (OstreeRepo *self)
+{
+  if (self->cache_dir_fd == -1)
+    return NULL;
+
+  g_autoptr(GError) local_error = NULL;
+  glnx_autofd int fd = -1;
+  g_autoptr(GVariant) ret = NULL;
+  if (!ot_openat_ignore_enoent (self->cache_dir_fd, _OSTREE_SUMMARY_DELTAS_CACHE, &fd, &local_error) ||
+      (fd != -1 &&
+       !ot_variant_read_fd (fd, 0, G_VARIANT_TYPE (_OSTREE_SUMMARY_DELTAS_CACHE_GVARIANT_STRING),
+                            FALSE, &ret, &local_error)))
+    {
+      g_debug ("Ignoring cached summary delta digests: %s", local_error->message);
+      return NULL;
+    }
+
+  return g_steal_pointer (&ret);
+}
+
+static void
+summary_deltas_cache_save (OstreeRepo *self,
+                           GVariant   *cache)
+{
+  g_autoptr(GVariant) cache_ref = g_variant_ref_sink (cache);
+  if (self->cache_dir_fd == -1)
+    return;
+
+  g_autoptr(GError) local_error = NULL;
+  if (!glnx_file_replace_contents_at (self->cache_dir_fd, _OSTREE_SUMMARY_DELTAS_CACHE,
+                                      g_variant_get_data (cache_ref),
+                                      g_variant_get_size (cache_ref),
+                                      GLNX_FILE_REPLACE_NODATASYNC,
+                                      NULL, &local_error))
+    g_debug ("Failed to cache summary delta digests: %s", local_error->message);
+}
+
+/* Return the digest of the superblock @stbuf describes from @cached_deltas,
+ * if it hasn't changed since the digest was computed. */
+static GVariant *
+summary_deltas_cache_lookup (GVariant           *cached_deltas,
+                             const char         *delta_name,
+                             const struct stat  *stbuf)
+{
+  if (cached_deltas == NULL)
+    return NULL;
+
+  g_autoptr(GVariant) entry = g_variant_lookup_value (cached_deltas, delta_name,
+                                                      G_VARIANT_TYPE ("(tttttay)"));
+  if (entry == NULL)
+    return NULL;
+
+  guint64 dev, ino, size, mtime_sec, mtime_nsec;
+  g_autoptr(GVariant) digest = NULL;
+  g_variant_get (entry, "(ttttt@ay)", &dev, &ino, &size, &mtime_sec, &mtime_nsec, &digest);
+  if (dev != (guint64) stbuf->st_dev || ino != (guint64) stbuf->st_ino ||
+      size != (guint64) stbuf->st_size ||
+      mtime_sec != (guint64) stbuf->st_mtim.tv_sec ||
+      mtime_nsec != (guint64) stbuf->st_mtim.tv_nsec ||
+      g_variant_n_children (digest) != OSTREE_SHA256_DIGEST_LEN)
+    return NULL;
+
+  return g_steal_pointer (&digest);
+}
+
+/* Build the contents of a `summary` file.  If @previous is set, it is the
+ * current summary file; ref entries for commits it already lists are copied
+ * from it rather than loading every commit again, and static delta checksums
+ * are reused for superblocks whose device, inode, size and mtime are those
+ * we last computed them from (see summary_deltas_cache_lookup()). */
+static gboolean
+summary_build (OstreeRepo         *self,
+               GVariant           *additional_metadata,
+               GVariant           *previous,
+               GVariant          **out_summary,
+               GCancellable       *cancellable,
+               GError            **error)
+{
+  g_autoptr(GHashTable) previous_commits = NULL;
+  g_autoptr(GVariant) cached_deltas = NULL;
+  if (previous != NULL)
+    {
+      previous_commits = summary_index_commits (previous);
+      cached_deltas = summary_deltas_cache_load (self);
+    }
 
   g_auto(GVariantDict) additional_metadata_builder = OT_VARIANT_BUILDER_INITIALIZER;
   g_variant_dict_init (&additional_metadata_builder, additional_metadata);
@@ -5676,7 +6174,7 @@ ostree_repo_regenerate_summary (OstreeRepo     *self,
             const char *ref = iter->data;
             const char *commit = g_hash_table_lookup (refs, ref);
 
-            if (!summary_add_ref_entry (self, ref, commit, refs_builder, error))
+            if (!summary_add_ref_entry (self, ref, commit, previous_commits, refs_builder, error))
               return FALSE;
           }
       }
@@ -5685,11 +6183,13 @@ ostree_repo_regenerate_summary (OstreeRepo     *self,
   {
     g_autoptr(GPtrArray) delta_names = NULL;
     g_auto(GVariantDict) deltas_builder = OT_VARIANT_BUILDER_INITIALIZER;
+    g_auto(GVariantBuilder) cache_builder = OT_VARIANT_BUILDER_INITIALIZER;
 
     if (!ostree_repo_list_static_delta_names (self, &delta_names, cancellable, error))
       return FALSE;
 
     g_variant_dict_init (&deltas_builder, NULL);
+    g_variant_builder_init (&cache_builder, G_VARIANT_TYPE (_OSTREE_SUMMARY_DELTAS_CACHE_GVARIANT_STRING));
     for (guint i = 0; i < delta_names->len; i++)
       {
         g_autofree char *from = NULL;
@@ -5703,20 +6203,62 @@ ostree_repo_regenerate_summary (OstreeRepo     *self,
         if (!glnx_openat_rdonly (self->repo_dir_fd, superblock, TRUE, &superblock_file_fd, error))
           return FALSE;
 
-        g_autoptr(GBytes) superblock_content = ot_fd_readall_or_mmap (superblock_file_fd, 0, error);
-        if (!superblock_content)
+        struct stat stbuf;
+        if (!glnx_fstat (superblock_file_fd, &stbuf, error))
           return FALSE;
-        g_auto(OtChecksum) hasher = { 0, };
-        ot_checksum_init (&hasher);
-        ot_checksum_update_bytes (&hasher, superblock_content);
-        guint8 digest[OSTREE_SHA256_DIGEST_LEN];
-        ot_checksum_get_digest (&hasher, digest, sizeof (digest));
 
-        g_variant_dict_insert_value (&deltas_builder, delta_names->pdata[i], ot_gvariant_new_bytearray (digest, sizeof (digest)));
+        g_autoptr(GVariant) digest_v =
+          summary_deltas_cache_lookup (cached_deltas, delta_names->pdata[i], &stbuf);
+        if (digest_v == NULL)
+          {
+            g_autoptr(GBytes) superblock_content = ot_fd_readall_or_mmap (superblock_file_fd, 0, error);
+            if (!superblock_content)
+              return FALSE;
+            g_auto(OtChecksum) hasher = { 0, };
+            ot_checksum_init (&hasher);
+            ot_checksum_update_bytes (&hasher, superblock_content);
+            guint8 digest[OSTREE_SHA256_DIGEST_LEN];
+            ot_checksum_get_digest (&hasher, digest, sizeof (digest));
+            digest_v = g_variant_ref_sink (ot_gvariant_new_bytearray (digest, sizeof (digest)));
+          }
+
+        g_variant_dict_insert_value (&deltas_builder, delta_names->pdata[i], digest_v);
+        g_variant_builder_add (&cache_builder, "{s(ttttt@ay)}", delta_names->pdata[i],
+                               (guint64) stbuf.st_dev, (guint64) stbuf.st_ino,
+                               (guint64) stbuf.st_size, (guint64) stbuf.st_mtim.tv_sec,
+                               (guint64) stbuf.st_mtim.tv_nsec, digest_v);
       }
 
     if (delta_names->len > 0)
       g_variant_dict_insert_value (&additional_metadata_builder, OSTREE_SUMMARY_STATIC_DELTAS, g_variant_dict_end (&deltas_builder));
+    summary_deltas_cache_save (self, g_variant_builder_end (&cache_builder));
+  }
+
+  {
+    g_autoptr(GPtrArray) packs = NULL;
+    if (!_ostree_repo_list_packs (self, &packs, error))
+      return FALSE;
+
+    g_auto(GVariantDict) packs_builder = OT_VARIANT_BUILDER_INITIALIZER;
+    g_variant_dict_init (&packs_builder, NULL);
+    for (guint i = 0; i < packs->len; i++)
+      {
+        const char *pack = packs->pdata[i];
+        g_autofree char *index_path =
+          g_strconcat (_OSTREE_PACK_DIR "/" _OSTREE_PACK_PREFIX, pack, _OSTREE_PACK_INDEX_SUFFIX, NULL);
+        g_autofree char *index_checksum =
+          ot_checksum_file_at (self->objects_dir_fd, index_path, G_CHECKSUM_SHA256,
+                               cancellable, error);
+        if (!index_checksum)
+          return FALSE;
+
+        g_variant_dict_insert_value (&packs_builder, pack,
+                                     ostree_checksum_to_bytes_v (index_checksum));
+      }
+
+    if (packs->len > 0)
+      g_variant_dict_insert_value (&additional_metadata_builder, OSTREE_SUMMARY_PACKS,
+                                   g_variant_dict_end (&packs_builder));
   }
 
   {
@@ -5784,7 +6326,7 @@ ostree_repo_regenerate_summary (OstreeRepo     *self,
             const char *commit = g_hash_table_lookup (ref_map, ref);
             GVariantBuilder *builder = is_main_collection_id ? refs_builder : collection_refs_builder;
 
-            if (!summary_add_ref_entry (self, ref, commit, builder, error))
+            if (!summary_add_ref_entry (self, ref, commit, previous_commits, builder, error))
               return FALSE;
 
             if (!is_main_collection_id)
@@ -5817,6 +6359,65 @@ ostree_repo_regenerate_summary (OstreeRepo     *self,
     g_variant_ref_sink (summary);
   }
 
+  *out_summary = g_steal_pointer (&summary);
+  return TRUE;
+}
+
+/**
+ * ostree_repo_regenerate_summary:
+ * @self: Repo
+ * @additional_metadata: (allow-none): A GVariant of type a{sv}, or %NULL
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * An OSTree repository can contain a high level "summary" file that
+ * describes the available branches and other metadata.
+ *
+ * If the timetable for making commits and updating the summary file is fairly
+ * regular, setting the `ostree.summary.expires` key in @additional_metadata
+ * will aid clients in working out when to check for updates.
+ *
+ * It is regenerated automatically after any ref is
+ * added, removed, or updated if `core/auto-update-summary` is set.  That
+ * reuses the entries of the previous summary file for commits and static
+ * deltas which haven't changed, and drops any @additional_metadata.
+ *
+ * If the repository has pack files (see ostree_repo_repack()), they are listed
+ * under the `ostree.packs` key, along with the checksums of their indexes, so
+ * that clients can fetch objects from them with HTTP range requests.
+ *
+ * If the `core/collection-id` key is set in the configuration, it will be
+ * included as %OSTREE_SUMMARY_COLLECTION_ID in the summary file. Refs that
+ * have associated collection IDs will be included in the generated summary
+ * file, listed under the %OSTREE_SUMMARY_COLLECTION_MAP key. Collection IDs
+ * and refs in %OSTREE_SUMMARY_COLLECTION_MAP are guaranteed to be in
+ * lexicographic order.
+ *
+ * Locking: exclusive
+ */
+gboolean
+ostree_repo_regenerate_summary (OstreeRepo     *self,
+                                GVariant       *additional_metadata,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  /* Take an exclusive lock. This makes sure the commits and deltas don't get
+   * deleted while generating the summary. It also means we can be sure refs
+   * won't be created/updated/deleted during the operation, without having to
+   * add exclusive locks to those operations which would prevent concurrent
+   * commits from working.
+   */
+  g_autoptr(OstreeRepoAutoLock) lock = NULL;
+  lock = _ostree_repo_auto_lock_push (self, OSTREE_REPO_LOCK_EXCLUSIVE,
+                                      cancellable, error);
+  if (!lock)
+    return FALSE;
+
+  g_autoptr(GVariant) summary = NULL;
+  if (!summary_build (self, additional_metadata, NULL, &summary,
+                      cancellable, error))
+    return FALSE;
+
   if (!_ostree_repo_file_replace_contents (self,
                                            self->repo_dir_fd,
                                            "summary",
@@ -5829,15 +6430,106 @@ ostree_repo_regenerate_summary (OstreeRepo     *self,
   if (!ot_ensure_unlinked_at (self->repo_dir_fd, "summary.sig", error))
     return FALSE;
 
+  if (!_ostree_repo_update_summary_index (self, summary, cancellable, error))
+    return FALSE;
+
   return TRUE;
 }
 
+/* Like ostree_repo_regenerate_summary() without additional metadata, but
+ * patching the existing summary file: only commits that it doesn't list yet
+ * and static deltas which changed since the last summary are loaded.  It is
+ * built under a shared lock, and the exclusive lock is only taken to replace
+ * the file, so this doesn't block concurrent commits for long.  If another
+ * process replaced the summary in the meantime, start again from its version.
+ *
+ * Locking: shared, exclusive to replace the summary
+ */
+gboolean
+_ostree_repo_regenerate_summary_incremental (OstreeRepo    *self,
+                                             GCancellable  *cancellable,
+                                             GError       **error)
+{
+  for (guint attempt = 0; attempt < 3; attempt++)
+    {
+      g_autoptr(OstreeRepoAutoLock) lock = NULL;
+      lock = _ostree_repo_auto_lock_push (self, OSTREE_REPO_LOCK_SHARED,
+                                          cancellable, error);
+      if (!lock)
+        return FALSE;
+
+      glnx_autofd int fd = -1;
+      if (!ot_openat_ignore_enoent (self->repo_dir_fd, "summary", &fd, error))
+        return FALSE;
+      if (fd < 0)
+        break;
+
+      struct stat stbuf;
+      if (!glnx_fstat (fd, &stbuf, error))
+        return FALSE;
+
+      g_autoptr(GVariant) previous = NULL;
+      if (!ot_variant_read_fd (fd, 0, OSTREE_SUMMARY_GVARIANT_FORMAT, FALSE,
+                               &previous, error))
+        return FALSE;
+
+      g_autoptr(GVariant) summary = NULL;
+      if (!summary_build (self, NULL, previous, &summary,
+                          cancellable, error))
+        return FALSE;
+
+      g_auto(GLnxTmpfile) tmpf = { 0, };
+      if (!glnx_open_tmpfile_linkable_at (self->repo_dir_fd, ".", O_WRONLY | O_CLOEXEC,
+                                          &tmpf, error))
+        return FALSE;
+      if (glnx_loop_write (tmpf.fd, g_variant_get_data (summary), g_variant_get_size (summary)) < 0)
+        return glnx_throw_errno_prefix (error, "write");
+      if (!glnx_fchmod (tmpf.fd, 0644, error))
+        return FALSE;
+      if (!self->disable_fsync && fdatasync (tmpf.fd) < 0)
+        return glnx_throw_errno_prefix (error, "fdatasync");
+
+      g_autoptr(OstreeRepoAutoLock) exclusive_lock = NULL;
+      exclusive_lock = _ostree_repo_auto_lock_push (self, OSTREE_REPO_LOCK_EXCLUSIVE,
+                                                    cancellable, error);
+      if (!exclusive_lock)
+        return FALSE;
+
+      struct stat current_stbuf;
+      if (!glnx_fstatat_allow_noent (self->repo_dir_fd, "summary", &current_stbuf, 0, error))
+        return FALSE;
+      if (errno == ENOENT ||
+          current_stbuf.st_dev != stbuf.st_dev || current_stbuf.st_ino != stbuf.st_ino ||
+          current_stbuf.st_mtim.tv_sec != stbuf.st_mtim.tv_sec ||
+          current_stbuf.st_mtim.tv_nsec != stbuf.st_mtim.tv_nsec)
+        {
+          g_debug ("Summary changed while regenerating it; retrying");
+          continue;
+        }
+
+      if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE,
+                                 self->repo_dir_fd, "summary", error))
+        return FALSE;
+
+      if (!ot_ensure_unlinked_at (self->repo_dir_fd, "summary.sig", error))
+        return FALSE;
+
+      if (!_ostree_repo_update_summary_index (self, summary, cancellable, error))
+        return FALSE;
+
+      return TRUE;
+    }
+
+  return ostree_repo_regenerate_summary (self, NULL, cancellable, error);
+}
+
 /* Regenerate the summary if `core/auto-update-summary` is set. We default to FALSE for
  * this setting because OSTree supports multiple processes committing to the same repo (but
  * different refs) concurrently, and in fact gnome-continuous actually does this.  In that
  * context it's best to update the summary explicitly once at the end of multiple
  * transactions instead of automatically here.  `auto-update-summary` only updates
- * atomically within a transaction. */
+ * atomically within a transaction.  The previous summary is patched rather than
+ * regenerated from scratch, see _ostree_repo_regenerate_summary_incremental(). */
 gboolean
 _ostree_repo_maybe_regenerate_summary (OstreeRepo    *self,
                                        GCancellable  *cancellable,
@@ -5857,7 +6549,7 @@ _ostree_repo_maybe_regenerate_summary (OstreeRepo    *self,
     return FALSE;
 
   if ((auto_update_summary || commit_update_summary) &&
-      !ostree_repo_regenerate_summary (self, NULL, cancellable, error))
+      !_ostree_repo_regenerate_summary_incremental (self, cancellable, error))
     return FALSE;
 
   return TRUE;
@@ -6057,6 +6749,42 @@ _ostree_repo_memory_cache_ref_destroy (OstreeRepoMemoryCacheRef *state)
   g_object_unref (repo);
 }
 
+/**
+ * ostree_repo_get_metadata_cache_stats:
+ * @self: Repo
+ * @out_hits: (out) (optional): Number of metadata loads served from the cache
+ * @out_misses: (out) (optional): Number of metadata loads which missed it
+ * @out_size: (out) (optional): Approximate number of bytes cached
+ *
+ * Get statistics for the cache of commit, dirtree and dirmeta objects kept
+ * when the `core.metadata-cache-size` option is set.  All are 0 if it isn't.
+ *
+ * Since: 2019.3
+ */
+void
+ostree_repo_get_metadata_cache_stats (OstreeRepo  *self,
+                                      guint64     *out_hits,
+                                      guint64     *out_misses,
+                                      guint64     *out_size)
+{
+  guint64 hits = 0, misses = 0, size = 0;
+
+  g_return_if_fail (OSTREE_IS_REPO (self));
+
+  if (self->metadata_cache)
+    {
+      _ostree_lru_cache_get_stats (self->metadata_cache, &hits, &misses);
+      size = _ostree_lru_cache_get_size (self->metadata_cache);
+    }
+
+  if (out_hits)
+    *out_hits = hits;
+  if (out_misses)
+    *out_misses = misses;
+  if (out_size)
+    *out_size = size;
+}
+
 /**
  * ostree_repo_get_collection_id:
  * @self: an #OstreeRepo
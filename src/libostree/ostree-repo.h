@@ -518,6 +518,11 @@ gboolean      ostree_repo_list_refs_ext (OstreeRepo                 *self,
                                          GCancellable               *cancellable,
                                          GError                     **error);
 
+_OSTREE_PUBLIC
+gboolean      ostree_repo_pack_refs (OstreeRepo    *self,
+                                     GCancellable  *cancellable,
+                                     GError       **error);
+
 _OSTREE_PUBLIC
 gboolean ostree_repo_remote_list_refs (OstreeRepo       *self,
                                        const char       *remote_name,
@@ -626,6 +631,29 @@ gboolean      ostree_repo_fsck_object (OstreeRepo           *self,
                                        GCancellable         *cancellable,
                                        GError              **error);
 
+/**
+ * OstreeRepoFsckObjectsFlags:
+ * @OSTREE_REPO_FSCK_OBJECTS_FLAGS_NONE: No special options
+ * @OSTREE_REPO_FSCK_OBJECTS_FLAGS_STOP_ON_CORRUPTION: Stop after the first
+ *   object which is present but fails to verify
+ *
+ * Since: 2019.3
+ */
+typedef enum {
+  OSTREE_REPO_FSCK_OBJECTS_FLAGS_NONE = 0,
+  OSTREE_REPO_FSCK_OBJECTS_FLAGS_STOP_ON_CORRUPTION = (1 << 0),
+} OstreeRepoFsckObjectsFlags;
+
+_OSTREE_PUBLIC
+gboolean      ostree_repo_fsck_objects (OstreeRepo                  *self,
+                                        GHashTable                  *objects,
+                                        OstreeRepoFsckObjectsFlags   flags,
+                                        guint                        n_threads,
+                                        OstreeAsyncProgress         *progress,
+                                        GHashTable                 **out_failures,
+                                        GCancellable                *cancellable,
+                                        GError                     **error);
+
 /** 
  * OstreeRepoCommitFilterResult:
  * @OSTREE_REPO_COMMIT_FILTER_ALLOW: Do commit this object
@@ -705,6 +733,10 @@ _OSTREE_PUBLIC
 void ostree_repo_commit_modifier_set_devino_cache (OstreeRepoCommitModifier              *modifier,
                                                    OstreeRepoDevInoCache                 *cache);
 
+_OSTREE_PUBLIC
+void ostree_repo_commit_modifier_set_n_threads (OstreeRepoCommitModifier *modifier,
+                                                guint                     n_threads);
+
 _OSTREE_PUBLIC
 OstreeRepoCommitModifier *ostree_repo_commit_modifier_ref (OstreeRepoCommitModifier *modifier);
 _OSTREE_PUBLIC
@@ -945,6 +977,17 @@ typedef OstreeRepoCheckoutFilterResult (*OstreeRepoCheckoutFilter) (OstreeRepo
  * options.  This is used by ostree_repo_checkout_at() which
  * supercedes previous separate enumeration usage in
  * ostree_repo_checkout_tree() and ostree_repo_checkout_tree_at().
+ *
+ * If `n_threads` is greater than 1, directories are checked out in
+ * parallel across that many worker threads, up to 4 per CPU.  In that
+ * case, `filter` may be invoked concurrently from multiple threads.
+ * Checkouts using `sepolicy` are always done on the calling thread.
+ *
+ * If `reflink` is set, files are copied rather than hardlinked (it implies
+ * `force_copy`), but their data is cloned from the repository with
+ * `FICLONE` where the filesystem supports it, e.g. on XFS or Btrfs.  For
+ * archive repositories, this clones from the uncompressed object cache if
+ * `enable_uncompressed_cache` is set, populating it as needed.
  */
 typedef struct {
   OstreeRepoCheckoutMode mode;
@@ -957,14 +1000,16 @@ typedef struct {
   gboolean force_copy; /* Since: 2017.6 */
   gboolean bareuseronly_dirs; /* Since: 2017.7 */
   gboolean force_copy_zerosized; /* Since: 2018.9 */
-  gboolean unused_bools[4];
+  gboolean reflink; /* Since: 2019.3 */
+  gboolean unused_bools[3];
   /* 4 byte hole on 64 bit */
 
   const char *subpath;
 
   OstreeRepoDevInoCache *devino_to_csum_cache;
 
-  int unused_ints[6];
+  int n_threads; /* Since: 2019.3 */
+  int unused_ints[5];
   gpointer unused_ptrs[3];
   OstreeRepoCheckoutFilter filter; /* Since: 2018.2 */
   gpointer filter_user_data; /* Since: 2018.2 */
@@ -1109,6 +1154,14 @@ gboolean ostree_repo_traverse_commit_union_with_parents (OstreeRepo         *rep
                                                          GHashTable         *inout_parents,
                                                          GCancellable       *cancellable,
                                                          GError            **error);
+_OSTREE_PUBLIC
+gboolean ostree_repo_traverse_commit_union_parallel (OstreeRepo          *repo,
+                                                     const char * const  *commit_checksums,
+                                                     int                  maxdepth,
+                                                     GHashTable          *inout_reachable,
+                                                     guint                n_threads,
+                                                     GCancellable        *cancellable,
+                                                     GError             **error);
 
 struct _OstreeRepoCommitTraverseIter {
   gboolean initialized;
@@ -1175,11 +1228,15 @@ void ostree_repo_commit_traverse_iter_cleanup (void *p);
  * @OSTREE_REPO_PRUNE_FLAGS_NONE: No special options for pruning
  * @OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE: Don't actually delete objects
  * @OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY: Do not traverse individual commit objects, only follow refs
+ * @OSTREE_REPO_PRUNE_FLAGS_INCREMENTAL: Only visit the commits which stopped being
+ *   reachable since the last incremental prune; requires
+ *   %OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY.  Since: 2019.3
  */
 typedef enum {
   OSTREE_REPO_PRUNE_FLAGS_NONE,
   OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE,
-  OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY
+  OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY,
+  OSTREE_REPO_PRUNE_FLAGS_INCREMENTAL = (1 << 2),
 } OstreeRepoPruneFlags;
 
 _OSTREE_PUBLIC
@@ -1188,6 +1245,25 @@ ostree_repo_prune_static_deltas (OstreeRepo *self, const char *commit,
                                  GCancellable      *cancellable,
                                  GError           **error);
 
+_OSTREE_PUBLIC
+gboolean ostree_repo_repack (OstreeRepo    *self,
+                             GVariant      *options,
+                             guint         *out_n_packed,
+                             guint64       *out_pack_size,
+                             GCancellable  *cancellable,
+                             GError       **error);
+
+_OSTREE_PUBLIC
+gboolean ostree_repo_regenerate_object_index (OstreeRepo    *self,
+                                              GCancellable  *cancellable,
+                                              GError       **error);
+
+_OSTREE_PUBLIC
+void ostree_repo_get_metadata_cache_stats (OstreeRepo  *self,
+                                           guint64     *out_hits,
+                                           guint64     *out_misses,
+                                           guint64     *out_size);
+
 _OSTREE_PUBLIC
 gboolean ostree_repo_prune (OstreeRepo        *self,
                             OstreeRepoPruneFlags   flags,
@@ -21,6 +21,7 @@
 
 #include "config.h"
 
+#include <sys/xattr.h>
 #ifdef HAVE_SELINUX
 #include <selinux/selinux.h>
 #include <selinux/label.h>
@@ -51,6 +52,7 @@ struct OstreeSePolicy {
 #ifdef HAVE_SELINUX
   GFile *selinux_policy_root;
   struct selabel_handle *selinux_hnd;
+  GMutex selinux_hnd_lock; /* Serializes lookups, for relabeling threads */
   char *selinux_policy_name;
   char *selinux_policy_csum;
 #endif
@@ -89,6 +91,7 @@ ostree_sepolicy_finalize (GObject *object)
       selabel_close (self->selinux_hnd);
       self->selinux_hnd = NULL;
     }
+  g_mutex_clear (&self->selinux_hnd_lock);
 #endif
 
   G_OBJECT_CLASS (ostree_sepolicy_parent_class)->finalize (object);
@@ -399,6 +402,9 @@ ostree_sepolicy_init (OstreeSePolicy *self)
 {
   self->rootfs_dfd = -1;
   self->rootfs_dfd_owned = -1;
+#ifdef HAVE_SELINUX
+  g_mutex_init (&self->selinux_hnd_lock);
+#endif
 }
 
 static void
@@ -520,7 +526,11 @@ ostree_sepolicy_get_label (OstreeSePolicy    *self,
     relpath = "/mnt";
 
   char *con = NULL;
+  g_mutex_lock (&self->selinux_hnd_lock);
   int res = selabel_lookup_raw (self->selinux_hnd, &con, relpath, unix_mode);
+  int errsv = errno;
+  g_mutex_unlock (&self->selinux_hnd_lock);
+  errno = errsv;
   if (res != 0)
     {
       if (errno == ENOENT)
@@ -614,6 +624,291 @@ ostree_sepolicy_restorecon (OstreeSePolicy    *self,
   return TRUE;
 }
 
+#ifdef HAVE_SELINUX
+/* Parallel relabeling.  Each directory is a task on a GThreadPool, which
+ * labels the directory's entries and queues its subdirectories.  Everything
+ * is relative to the directory fds, using the d_type from readdir() as the
+ * mode for lookups, so a file costs a readdir entry, a getxattr() and (if
+ * the label is wrong) a setxattr().  Lookups in the policy are serialized,
+ * so the threads mostly overlap the I/O.
+ */
+typedef struct {
+  OstreeSePolicy *self;
+  int root_dfd;
+  OstreeSePolicyRestoreconFlags flags;
+  OstreeSePolicyRelabelFunc relabeled;
+  gpointer user_data;
+  GCancellable *cancellable;
+  GThreadPool *pool;
+
+  GMutex lock;
+  GCond cond;
+  guint n_pending; /* Queued or running directories */
+  GError *error;   /* The first error, if any */
+} RelabelContext;
+
+typedef struct {
+  char *target; /* Relative to root_dfd */
+  char *path;   /* Path for policy lookups */
+} RelabelDir;
+
+static void
+relabel_dir_free (RelabelDir *dir)
+{
+  g_free (dir->target);
+  g_free (dir->path);
+  g_free (dir);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RelabelDir, relabel_dir_free)
+
+static guint32
+dtype_to_mode (unsigned char d_type)
+{
+  switch (d_type)
+    {
+    case DT_DIR: return S_IFDIR;
+    case DT_LNK: return S_IFLNK;
+    case DT_CHR: return S_IFCHR;
+    case DT_BLK: return S_IFBLK;
+    case DT_FIFO: return S_IFIFO;
+    case DT_SOCK: return S_IFSOCK;
+    default: return S_IFREG;
+    }
+}
+
+static gboolean
+relabel_one (RelabelContext *ctx,
+             int             dfd,
+             const char     *name,
+             const char     *path,
+             guint32         mode,
+             GError        **error)
+{
+  /* Without a policy there's no label to look up, and the filesystem may not
+   * even support xattrs */
+  if (!ctx->self->selinux_hnd)
+    {
+      if (!(ctx->flags & OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL))
+        return glnx_throw (error, "No label found for '%s'", path);
+      return TRUE;
+    }
+
+  /* Through /proc so symlinks are handled without following them */
+  g_autofree char *abspath = glnx_fdrel_abspath (dfd, name);
+  char existing[256];
+  ssize_t existing_len = lgetxattr (abspath, "security.selinux", existing, sizeof (existing) - 1);
+  gboolean have_existing = existing_len > 0;
+  if (existing_len < 0)
+    {
+      if (errno == ERANGE)
+        have_existing = TRUE; /* Too long to compare, so we'll set it again */
+      else if (!G_IN_SET (errno, ENODATA, ENOTSUP, EOPNOTSUPP))
+        return glnx_throw_errno_prefix (error, "lgetxattr(%s)", path);
+    }
+
+  if ((ctx->flags & OSTREE_SEPOLICY_RESTORECON_FLAGS_KEEP_EXISTING) && have_existing)
+    return TRUE;
+
+  g_autofree char *label = NULL;
+  if (!ostree_sepolicy_get_label (ctx->self, path, mode, &label, ctx->cancellable, error))
+    return FALSE;
+  if (!label)
+    {
+      if (!(ctx->flags & OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL))
+        return glnx_throw (error, "No label found for '%s'", path);
+      return TRUE;
+    }
+
+  /* The kernel may or may not include the trailing NUL */
+  const size_t label_len = strlen (label);
+  if (existing_len > 0)
+    {
+      existing[existing_len] = '\0';
+      if (strlen (existing) == label_len && memcmp (existing, label, label_len) == 0)
+        return TRUE;
+    }
+
+  if (lsetxattr (abspath, "security.selinux", label, label_len + 1, 0) < 0)
+    return glnx_throw_errno_prefix (error, "lsetxattr(%s)", path);
+
+  if (ctx->relabeled)
+    {
+      g_mutex_lock (&ctx->lock);
+      ctx->relabeled (ctx->self, path, label, ctx->user_data);
+      g_mutex_unlock (&ctx->lock);
+    }
+
+  return TRUE;
+}
+
+static char *
+relabel_child_path (const char *parent,
+                    const char *name)
+{
+  if (g_str_has_suffix (parent, "/"))
+    return g_strconcat (parent, name, NULL);
+  return g_strconcat (parent, "/", name, NULL);
+}
+
+static void
+relabel_queue_dir (RelabelContext *ctx,
+                   char           *target,
+                   char           *path)
+{
+  RelabelDir *dir = g_new0 (RelabelDir, 1);
+  dir->target = target;
+  dir->path = path;
+
+  g_mutex_lock (&ctx->lock);
+  ctx->n_pending++;
+  g_mutex_unlock (&ctx->lock);
+  /* Exclusive pools start their threads up front, so this can't fail */
+  g_thread_pool_push (ctx->pool, dir, NULL);
+}
+
+static gboolean
+relabel_dir_contents (RelabelContext *ctx,
+                      RelabelDir     *dir,
+                      GError        **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (ctx->root_dfd, dir->target, FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, ctx->cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      g_autofree char *path = relabel_child_path (dir->path, dent->d_name);
+      if (!relabel_one (ctx, dfd_iter.fd, dent->d_name, path, dtype_to_mode (dent->d_type), error))
+        return FALSE;
+
+      if (dent->d_type == DT_DIR)
+        relabel_queue_dir (ctx, relabel_child_path (dir->target, dent->d_name),
+                           g_steal_pointer (&path));
+    }
+
+  return TRUE;
+}
+
+static void
+relabel_dir_run (gpointer data,
+                 gpointer user_data)
+{
+  RelabelContext *ctx = user_data;
+  g_autoptr(RelabelDir) dir = data;
+  GError *local_error = NULL;
+
+  /* Once something has failed, just drain the queue */
+  g_mutex_lock (&ctx->lock);
+  gboolean failed = ctx->error != NULL;
+  g_mutex_unlock (&ctx->lock);
+
+  if (!failed
+      && !g_cancellable_set_error_if_cancelled (ctx->cancellable, &local_error))
+    (void) relabel_dir_contents (ctx, dir, &local_error);
+
+  g_mutex_lock (&ctx->lock);
+  if (local_error)
+    {
+      if (ctx->error == NULL)
+        ctx->error = g_steal_pointer (&local_error);
+      else
+        g_clear_error (&local_error);
+    }
+  ctx->n_pending--;
+  if (ctx->n_pending == 0)
+    g_cond_signal (&ctx->cond);
+  g_mutex_unlock (&ctx->lock);
+}
+#endif
+
+/**
+ * ostree_sepolicy_restorecon_recursive_at:
+ * @self: Self
+ * @dfd: Directory fd
+ * @target: Directory to relabel, relative to @dfd
+ * @path: Path string to use for policy lookup for @target, e.g. `/var`
+ * @flags: Flags controlling behavior
+ * @n_threads: Number of threads to use; 0 means the number of CPUs
+ * @relabeled: (allow-none) (scope call): Called for each file whose label is changed
+ * @user_data: User data for @relabeled
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Reset the security context of @target and everything under it based on
+ * the SELinux policy, like ostree_sepolicy_restorecon() for each file.
+ * Files which already have the right label are left alone.  Directories are
+ * processed in parallel across @n_threads threads; @relabeled may be called
+ * from any of them, but never concurrently.
+ *
+ * If @self has no policy, nothing is changed, and unless
+ * %OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL is set an error is
+ * returned.  Filesystems without xattr support are treated as having no
+ * existing labels.
+ *
+ * Since: 2019.3
+ */
+gboolean
+ostree_sepolicy_restorecon_recursive_at (OstreeSePolicy   *self,
+                                         int               dfd,
+                                         const char       *target,
+                                         const char       *path,
+                                         OstreeSePolicyRestoreconFlags flags,
+                                         guint             n_threads,
+                                         OstreeSePolicyRelabelFunc relabeled,
+                                         gpointer          user_data,
+                                         GCancellable     *cancellable,
+                                         GError          **error)
+{
+#ifdef HAVE_SELINUX
+  glnx_autofd int root_dfd = -1;
+  if (!glnx_opendirat (dfd, target, FALSE, &root_dfd, error))
+    return FALSE;
+
+  if (n_threads == 0)
+    n_threads = MAX (g_get_num_processors (), 1);
+
+  RelabelContext ctx = { 0, };
+  ctx.self = self;
+  ctx.root_dfd = root_dfd;
+  ctx.flags = flags;
+  ctx.relabeled = relabeled;
+  ctx.user_data = user_data;
+  ctx.cancellable = cancellable;
+  g_mutex_init (&ctx.lock);
+  g_cond_init (&ctx.cond);
+
+  /* Without a policy, there's nothing to do below @target either */
+  if (relabel_one (&ctx, dfd, target, path, S_IFDIR, &ctx.error) && self->selinux_hnd)
+    ctx.pool = g_thread_pool_new (relabel_dir_run, &ctx, n_threads, TRUE, &ctx.error);
+  if (ctx.pool)
+    {
+      relabel_queue_dir (&ctx, g_strdup ("."), g_strdup (path));
+
+      g_mutex_lock (&ctx.lock);
+      while (ctx.n_pending > 0)
+        g_cond_wait (&ctx.cond, &ctx.lock);
+      g_mutex_unlock (&ctx.lock);
+
+      g_thread_pool_free (ctx.pool, FALSE, TRUE);
+    }
+  g_mutex_clear (&ctx.lock);
+  g_cond_clear (&ctx.cond);
+
+  if (ctx.error)
+    {
+      g_propagate_error (error, ctx.error);
+      return FALSE;
+    }
+#endif
+  return TRUE;
+}
+
 /**
  * ostree_sepolicy_setfscreatecon:
  * @self: Policy
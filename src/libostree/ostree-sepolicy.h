@@ -78,6 +78,35 @@ gboolean ostree_sepolicy_restorecon (OstreeSePolicy   *self,
                                      GCancellable     *cancellable,
                                      GError          **error);
 
+/**
+ * OstreeSePolicyRelabelFunc:
+ * @self: Policy
+ * @path: Path string used for policy lookup
+ * @new_label: The label which was set
+ * @user_data: User data
+ *
+ * Called by ostree_sepolicy_restorecon_recursive_at() for each file it
+ * relabels.
+ *
+ * Since: 2019.3
+ */
+typedef void (*OstreeSePolicyRelabelFunc) (OstreeSePolicy *self,
+                                           const char     *path,
+                                           const char     *new_label,
+                                           gpointer        user_data);
+
+_OSTREE_PUBLIC
+gboolean ostree_sepolicy_restorecon_recursive_at (OstreeSePolicy   *self,
+                                                  int               dfd,
+                                                  const char       *target,
+                                                  const char       *path,
+                                                  OstreeSePolicyRestoreconFlags flags,
+                                                  guint             n_threads,
+                                                  OstreeSePolicyRelabelFunc relabeled,
+                                                  gpointer          user_data,
+                                                  GCancellable     *cancellable,
+                                                  GError          **error);
+
 _OSTREE_PUBLIC
 gboolean ostree_sepolicy_setfscreatecon (OstreeSePolicy   *self,
                                          const char       *path,
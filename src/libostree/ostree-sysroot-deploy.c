@@ -46,6 +46,7 @@
 #include "ostree-deployment-private.h"
 #include "ostree-core-private.h"
 #include "ostree-linuxfsutil.h"
+#include "ostree-repo-private.h"
 #include "libglnx.h"
 
 #ifdef HAVE_LIBSYSTEMD
@@ -301,7 +302,8 @@ ensure_directory_from_template (int                 orig_etc_fd,
 
 /* Copy (relative) @path from @modified_etc_fd to @new_etc_fd, overwriting any
  * existing file there. The @path may refer to a regular file, a symbolic link,
- * or a directory. Directories will be copied recursively.
+ * or a directory. Directories will be copied recursively, unless one already
+ * exists in @new_etc_fd; @out_copied_tree says whether that happened.
  */
 static gboolean
 copy_modified_config_file (int                 orig_etc_fd,
@@ -309,12 +311,15 @@ copy_modified_config_file (int                 orig_etc_fd,
                            int                 new_etc_fd,
                            const char         *path,
                            OstreeSysrootDebugFlags flags,
+                           gboolean           *out_copied_tree,
                            GCancellable       *cancellable,
                            GError            **error)
 {
   struct stat modified_stbuf;
   struct stat new_stbuf;
 
+  *out_copied_tree = FALSE;
+
   if (!glnx_fstatat (modified_etc_fd, path, &modified_stbuf, AT_SYMLINK_NOFOLLOW, error))
     return glnx_prefix_error (error, "Reading modified config file");
 
@@ -368,6 +373,7 @@ copy_modified_config_file (int                 orig_etc_fd,
       if (!copy_dir_recurse (modified_etc_fd, new_etc_fd, path, flags,
                              cancellable, error))
         return FALSE;
+      *out_copied_tree = TRUE;
     }
   else if (S_ISLNK (modified_stbuf.st_mode) || S_ISREG (modified_stbuf.st_mode))
     {
@@ -387,6 +393,296 @@ copy_modified_config_file (int                 orig_etc_fd,
   return TRUE;
 }
 
+/* State for merging /etc, shared by the worker threads */
+typedef struct {
+  int orig_etc_fd;
+  int modified_etc_fd;
+  int new_etc_fd;
+  OstreeSysrootDebugFlags flags;
+  GCancellable *cancellable;
+  GThreadPool *pool;
+
+  gint n_modified;
+  gint n_removed;
+  gint n_added;
+
+  GMutex lock;
+  GCond cond;
+  guint n_pending; /* Queued or running directories */
+  GError *error;   /* The first error, if any */
+} EtcMerge;
+
+typedef struct {
+  char *path;          /* Relative to the /etc roots; NULL for the roots */
+  gboolean orig_exists; /* FALSE if only in /etc */
+} EtcMergeDir;
+
+static void
+etc_merge_dir_free (EtcMergeDir *dir)
+{
+  g_free (dir->path);
+  g_free (dir);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(EtcMergeDir, etc_merge_dir_free)
+
+/* Compare two regular files of the same size byte by byte; this is cheaper
+ * than checksumming them, and stops at the first difference.
+ */
+static gboolean
+config_files_equal (int            a_dfd,
+                    int            b_dfd,
+                    const char    *name,
+                    gboolean      *out_equal,
+                    GError       **error)
+{
+  glnx_autofd int a_fd = -1;
+  glnx_autofd int b_fd = -1;
+  char a_buf[16384];
+  char b_buf[16384];
+
+  if (!glnx_openat_rdonly (a_dfd, name, FALSE, &a_fd, error))
+    return FALSE;
+  if (!glnx_openat_rdonly (b_dfd, name, FALSE, &b_fd, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      ssize_t a_len = glnx_loop_read (a_fd, a_buf, sizeof (a_buf));
+      if (a_len < 0)
+        return glnx_throw_errno_prefix (error, "read");
+      ssize_t b_len = glnx_loop_read (b_fd, b_buf, sizeof (b_buf));
+      if (b_len < 0)
+        return glnx_throw_errno_prefix (error, "read");
+
+      if (a_len != b_len || memcmp (a_buf, b_buf, a_len) != 0)
+        {
+          *out_equal = FALSE;
+          return TRUE;
+        }
+      if (a_len == 0)
+        break;
+    }
+
+  *out_equal = TRUE;
+  return TRUE;
+}
+
+/* Whether @name is the same in /usr/etc and /etc.  Like the checksums
+ * ostree_diff_dirs() compares, this covers the type, mode, ownership and
+ * content (or symlink target), but not xattrs, since security.selinux
+ * differs between the two.  For directories, only the metadata is compared.
+ */
+static gboolean
+config_entries_equal (int                 orig_dfd,
+                      int                 modified_dfd,
+                      const char         *name,
+                      const struct stat  *orig_stbuf,
+                      const struct stat  *modified_stbuf,
+                      gboolean           *out_equal,
+                      GError            **error)
+{
+  /* Fast paths: hardlinks of each other, or obviously different */
+  if (orig_stbuf->st_dev == modified_stbuf->st_dev &&
+      orig_stbuf->st_ino == modified_stbuf->st_ino)
+    {
+      *out_equal = TRUE;
+      return TRUE;
+    }
+  if (orig_stbuf->st_mode != modified_stbuf->st_mode ||
+      orig_stbuf->st_uid != modified_stbuf->st_uid ||
+      orig_stbuf->st_gid != modified_stbuf->st_gid)
+    {
+      *out_equal = FALSE;
+      return TRUE;
+    }
+
+  if (S_ISDIR (orig_stbuf->st_mode))
+    *out_equal = TRUE;
+  else if (orig_stbuf->st_size != modified_stbuf->st_size)
+    *out_equal = FALSE;
+  else if (S_ISREG (orig_stbuf->st_mode))
+    return config_files_equal (orig_dfd, modified_dfd, name, out_equal, error);
+  else if (S_ISLNK (orig_stbuf->st_mode))
+    {
+      g_autofree char *orig_target = glnx_readlinkat_malloc (orig_dfd, name, NULL, error);
+      if (!orig_target)
+        return FALSE;
+      g_autofree char *modified_target = glnx_readlinkat_malloc (modified_dfd, name, NULL, error);
+      if (!modified_target)
+        return FALSE;
+      *out_equal = g_str_equal (orig_target, modified_target);
+    }
+  else
+    *out_equal = orig_stbuf->st_rdev == modified_stbuf->st_rdev;
+
+  return TRUE;
+}
+
+static void
+etc_merge_queue_dir (EtcMerge   *merge,
+                     char       *path,
+                     gboolean    orig_exists)
+{
+  EtcMergeDir *dir = g_new0 (EtcMergeDir, 1);
+  dir->path = path;
+  dir->orig_exists = orig_exists;
+
+  g_mutex_lock (&merge->lock);
+  merge->n_pending++;
+  g_mutex_unlock (&merge->lock);
+  /* Exclusive pools start their threads up front, so this can't fail */
+  g_thread_pool_push (merge->pool, dir, NULL);
+}
+
+/* Merge the changes directly in the directory @path (relative to the /etc
+ * roots, or %NULL for the roots themselves), and queue its subdirectories.
+ * If @orig_exists is %FALSE, the directory was added in /etc, so everything
+ * in it is too.
+ */
+static gboolean
+etc_merge_dir (EtcMerge    *merge,
+               const char  *path,
+               gboolean     orig_exists,
+               GError     **error)
+{
+  GCancellable *cancellable = merge->cancellable;
+  /* Subdirectories in both /usr/etc and /etc, then those only in /etc */
+  g_autoptr(GPtrArray) subdirs = g_ptr_array_new_with_free_func (g_free);
+  guint n_orig_subdirs = 0;
+
+  glnx_autofd int modified_dfd = -1;
+  if (!glnx_opendirat (merge->modified_etc_fd, path ?: ".", FALSE, &modified_dfd, error))
+    return FALSE;
+
+  g_auto(GLnxDirFdIterator) orig_iter = { 0, };
+  if (orig_exists)
+    {
+      if (!glnx_dirfd_iterator_init_at (merge->orig_etc_fd, path ?: ".", FALSE, &orig_iter, error))
+        return FALSE;
+
+      /* Removed and modified entries */
+      while (TRUE)
+        {
+          struct dirent *dent;
+          if (!glnx_dirfd_iterator_next_dent (&orig_iter, &dent, cancellable, error))
+            return FALSE;
+          if (dent == NULL)
+            break;
+
+          g_autofree char *child_path =
+            path ? g_build_filename (path, dent->d_name, NULL) : g_strdup (dent->d_name);
+          struct stat orig_stbuf;
+          if (!glnx_fstatat (orig_iter.fd, dent->d_name, &orig_stbuf, AT_SYMLINK_NOFOLLOW, error))
+            return FALSE;
+          struct stat modified_stbuf;
+          if (!glnx_fstatat_allow_noent (modified_dfd, dent->d_name, &modified_stbuf,
+                                         AT_SYMLINK_NOFOLLOW, error))
+            return FALSE;
+          if (errno == ENOENT)
+            {
+              g_atomic_int_inc (&merge->n_removed);
+              if (!glnx_shutil_rm_rf_at (merge->new_etc_fd, child_path, cancellable, error))
+                return FALSE;
+              continue;
+            }
+
+          gboolean equal;
+          if (!config_entries_equal (orig_iter.fd, modified_dfd, dent->d_name,
+                                     &orig_stbuf, &modified_stbuf, &equal, error))
+            return FALSE;
+
+          gboolean copied_tree = FALSE;
+          if (!equal)
+            {
+              g_atomic_int_inc (&merge->n_modified);
+              if (!copy_modified_config_file (merge->orig_etc_fd, merge->modified_etc_fd,
+                                              merge->new_etc_fd, child_path, merge->flags,
+                                              &copied_tree, cancellable, error))
+                return FALSE;
+            }
+
+          /* A directory copied as a whole doesn't need merging */
+          if (S_ISDIR (orig_stbuf.st_mode) && S_ISDIR (modified_stbuf.st_mode) && !copied_tree)
+            g_ptr_array_add (subdirs, g_steal_pointer (&child_path));
+        }
+      n_orig_subdirs = subdirs->len;
+    }
+
+  /* Added entries */
+  g_auto(GLnxDirFdIterator) modified_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (modified_dfd, ".", FALSE, &modified_iter, error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&modified_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      if (orig_exists)
+        {
+          struct stat orig_stbuf;
+          if (!glnx_fstatat_allow_noent (orig_iter.fd, dent->d_name, &orig_stbuf,
+                                         AT_SYMLINK_NOFOLLOW, error))
+            return FALSE;
+          if (errno == 0)
+            continue;
+        }
+
+      g_autofree char *child_path =
+        path ? g_build_filename (path, dent->d_name, NULL) : g_strdup (dent->d_name);
+      gboolean copied_tree = FALSE;
+      g_atomic_int_inc (&merge->n_added);
+      if (!copy_modified_config_file (merge->orig_etc_fd, merge->modified_etc_fd,
+                                      merge->new_etc_fd, child_path, merge->flags,
+                                      &copied_tree, cancellable, error))
+        return FALSE;
+
+      /* If the new /etc already has this directory, its contents need
+       * copying one by one.
+       */
+      if (dent->d_type == DT_DIR && !copied_tree)
+        g_ptr_array_add (subdirs, g_steal_pointer (&child_path));
+    }
+
+  for (guint i = 0; i < subdirs->len; i++)
+    etc_merge_queue_dir (merge, g_steal_pointer (&subdirs->pdata[i]), i < n_orig_subdirs);
+
+  return TRUE;
+}
+
+static void
+etc_merge_dir_run (gpointer data,
+                   gpointer user_data)
+{
+  EtcMerge *merge = user_data;
+  g_autoptr(EtcMergeDir) dir = data;
+  GError *local_error = NULL;
+
+  /* Once something has failed, just drain the queue */
+  g_mutex_lock (&merge->lock);
+  gboolean failed = merge->error != NULL;
+  g_mutex_unlock (&merge->lock);
+
+  if (!failed
+      && !g_cancellable_set_error_if_cancelled (merge->cancellable, &local_error))
+    (void) etc_merge_dir (merge, dir->path, dir->orig_exists, &local_error);
+
+  g_mutex_lock (&merge->lock);
+  if (local_error)
+    {
+      if (merge->error == NULL)
+        merge->error = g_steal_pointer (&local_error);
+      else
+        g_clear_error (&local_error);
+    }
+  merge->n_pending--;
+  if (merge->n_pending == 0)
+    g_cond_signal (&merge->cond);
+  g_mutex_unlock (&merge->lock);
+}
+
 /*
  * merge_configuration_from:
  * @sysroot: Sysroot
@@ -403,6 +699,9 @@ copy_modified_config_file (int                 orig_etc_fd,
  * approximately equivalent to "diff -unR orig_etc modified_etc",
  * except that rather than attempting a 3-way merge if a file is also
  * changed in @new_etc, the modified version always wins.
+ *
+ * Each directory is compared and merged as a separate task, so that
+ * independent subtrees are processed in parallel.
  */
 static gboolean
 merge_configuration_from (OstreeSysroot    *sysroot,
@@ -413,7 +712,6 @@ merge_configuration_from (OstreeSysroot    *sysroot,
                           GError          **error)
 {
   GLNX_AUTO_PREFIX_ERROR ("During /etc merge", error);
-  const OstreeSysrootDebugFlags flags = sysroot->debug_flags;
 
   g_assert (merge_deployment != NULL && new_deployment != NULL);
   g_assert (new_deployment_dfd != -1);
@@ -424,38 +722,6 @@ merge_configuration_from (OstreeSysroot    *sysroot,
                        &merge_deployment_dfd, error))
     return FALSE;
 
-  /* TODO: get rid of GFile usage here */
-  g_autoptr(GFile) orig_etc = ot_fdrel_to_gfile (merge_deployment_dfd, "usr/etc");
-  g_autoptr(GFile) modified_etc = ot_fdrel_to_gfile (merge_deployment_dfd, "etc");
-  /* Return values for below */
-  g_autoptr(GPtrArray) modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
-  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  /* For now, ignore changes to xattrs; the problem is that
-   * security.selinux will be different between the /usr/etc labels
-   * and the ones in the real /etc, so they all show up as different.
-   *
-   * This means that if you want to change the security context of a
-   * file, to have that change persist across upgrades, you must also
-   * modify the content of the file.
-   */
-  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_IGNORE_XATTRS,
-                         orig_etc, modified_etc, modified, removed, added,
-                         cancellable, error))
-    return glnx_prefix_error (error, "While computing configuration diff");
-
-  { g_autofree char *msg =
-      g_strdup_printf ("Copying /etc changes: %u modified, %u removed, %u added",
-                       modified->len, removed->len, added->len);
-    ot_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL(OSTREE_CONFIGMERGE_ID),
-                     "MESSAGE=%s", msg,
-                     "ETC_N_MODIFIED=%u", modified->len,
-                     "ETC_N_REMOVED=%u", removed->len,
-                     "ETC_N_ADDED=%u", added->len,
-                     NULL);
-    _ostree_sysroot_emit_journal_msg (sysroot, msg);
-  }
-
   glnx_autofd int orig_etc_fd = -1;
   if (!glnx_opendirat (merge_deployment_dfd, "usr/etc", TRUE, &orig_etc_fd, error))
     return FALSE;
@@ -466,41 +732,49 @@ merge_configuration_from (OstreeSysroot    *sysroot,
   if (!glnx_opendirat (new_deployment_dfd, "etc", TRUE, &new_etc_fd, error))
     return FALSE;
 
-  for (guint i = 0; i < removed->len; i++)
-    {
-      GFile *file = removed->pdata[i];
-      g_autofree char *path = NULL;
+  EtcMerge merge = { 0, };
+  merge.orig_etc_fd = orig_etc_fd;
+  merge.modified_etc_fd = modified_etc_fd;
+  merge.new_etc_fd = new_etc_fd;
+  merge.flags = sysroot->debug_flags;
+  merge.cancellable = cancellable;
+  g_mutex_init (&merge.lock);
+  g_cond_init (&merge.cond);
 
-      path = g_file_get_relative_path (orig_etc, file);
-      g_assert (path);
+  merge.pool = g_thread_pool_new (etc_merge_dir_run, &merge,
+                                  MAX (g_get_num_processors (), 1), TRUE, error);
+  if (!merge.pool)
+    return FALSE;
 
-      if (!glnx_shutil_rm_rf_at (new_etc_fd, path, cancellable, error))
-        return FALSE;
-    }
+  etc_merge_queue_dir (&merge, NULL, TRUE);
 
-  for (guint i = 0; i < modified->len; i++)
-    {
-      OstreeDiffItem *diff = modified->pdata[i];
-      g_autofree char *path = g_file_get_relative_path (modified_etc, diff->target);
+  g_mutex_lock (&merge.lock);
+  while (merge.n_pending > 0)
+    g_cond_wait (&merge.cond, &merge.lock);
+  g_mutex_unlock (&merge.lock);
 
-      g_assert (path);
+  g_thread_pool_free (merge.pool, FALSE, TRUE);
+  g_mutex_clear (&merge.lock);
+  g_cond_clear (&merge.cond);
 
-      if (!copy_modified_config_file (orig_etc_fd, modified_etc_fd, new_etc_fd, path,
-                                      flags, cancellable, error))
-        return FALSE;
-    }
-  for (guint i = 0; i < added->len; i++)
+  if (merge.error)
     {
-      GFile *file = added->pdata[i];
-      g_autofree char *path = g_file_get_relative_path (modified_etc, file);
-
-      g_assert (path);
-
-      if (!copy_modified_config_file (orig_etc_fd, modified_etc_fd, new_etc_fd, path,
-                                      flags, cancellable, error))
-        return FALSE;
+      g_propagate_error (error, merge.error);
+      return FALSE;
     }
 
+  { g_autofree char *msg =
+      g_strdup_printf ("Copied /etc changes: %u modified, %u removed, %u added",
+                       merge.n_modified, merge.n_removed, merge.n_added);
+    ot_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL(OSTREE_CONFIGMERGE_ID),
+                     "MESSAGE=%s", msg,
+                     "ETC_N_MODIFIED=%u", merge.n_modified,
+                     "ETC_N_REMOVED=%u", merge.n_removed,
+                     "ETC_N_ADDED=%u", merge.n_added,
+                     NULL);
+    _ostree_sysroot_emit_journal_msg (sysroot, msg);
+  }
+
   return TRUE;
 }
 
@@ -512,6 +786,7 @@ static gboolean
 checkout_deployment_tree (OstreeSysroot     *sysroot,
                           OstreeRepo        *repo,
                           OstreeDeployment  *deployment,
+                          int                n_threads,
                           int               *out_deployment_dfd,
                           GCancellable      *cancellable,
                           GError           **error)
@@ -535,7 +810,7 @@ checkout_deployment_tree (OstreeSysroot     *sysroot,
     return FALSE;
 
   /* Generate hardlink farm, then opendir it */
-  OstreeRepoCheckoutAtOptions checkout_opts = { 0, };
+  OstreeRepoCheckoutAtOptions checkout_opts = { .n_threads = n_threads, };
   if (!ostree_repo_checkout_at (repo, &checkout_opts, osdeploy_dfd,
                                 checkout_target_name, csum,
                                 cancellable, error))
@@ -545,138 +820,6 @@ checkout_deployment_tree (OstreeSysroot     *sysroot,
                          error);
 }
 
-static char *
-ptrarray_path_join (GPtrArray  *path)
-{
-  GString *path_buf;
-
-  path_buf = g_string_new ("");
-
-  if (path->len == 0)
-    g_string_append_c (path_buf, '/');
-  else
-    {
-      guint i;
-      for (i = 0; i < path->len; i++)
-        {
-          const char *elt = path->pdata[i];
-
-          g_string_append_c (path_buf, '/');
-          g_string_append (path_buf, elt);
-        }
-    }
-
-  return g_string_free (path_buf, FALSE);
-}
-
-static gboolean
-relabel_one_path (OstreeSysroot  *sysroot,
-                  OstreeSePolicy *sepolicy,
-                  GFile         *path,
-                  GFileInfo     *info,
-                  GPtrArray     *path_parts,
-                  GCancellable   *cancellable,
-                  GError        **error)
-{
-  gboolean ret = FALSE;
-  g_autofree char *relpath = NULL;
-
-  relpath = ptrarray_path_join (path_parts);
-  if (!ostree_sepolicy_restorecon (sepolicy, relpath,
-                                   info, path,
-                                   OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL,
-                                   NULL,
-                                   cancellable, error))
-    goto out;
-
-  ret = TRUE;
- out:
-  return ret;
-}
-
-static gboolean
-relabel_recursively (OstreeSysroot  *sysroot,
-                     OstreeSePolicy *sepolicy,
-                     GFile          *dir,
-                     GFileInfo      *dir_info,
-                     GPtrArray      *path_parts,
-                     GCancellable   *cancellable,
-                     GError        **error)
-{
-  gboolean ret = FALSE;
-  g_autoptr(GFileEnumerator) direnum = NULL;
-
-  if (!relabel_one_path (sysroot, sepolicy, dir, dir_info, path_parts,
-                         cancellable, error))
-    goto out;
-
-  direnum = g_file_enumerate_children (dir, OSTREE_GIO_FAST_QUERYINFO,
-                                       G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                       cancellable, error);
-  if (!direnum)
-    goto out;
-
-  while (TRUE)
-    {
-      GFileInfo *file_info;
-      GFile *child;
-      GFileType ftype;
-
-      if (!g_file_enumerator_iterate (direnum, &file_info, &child,
-                                      cancellable, error))
-        goto out;
-      if (file_info == NULL)
-        break;
-
-      g_ptr_array_add (path_parts, (char*)g_file_info_get_name (file_info));
-
-      ftype = g_file_info_get_file_type (file_info);
-      if (ftype == G_FILE_TYPE_DIRECTORY)
-        {
-          if (!relabel_recursively (sysroot, sepolicy, child, file_info, path_parts,
-                                    cancellable, error))
-            goto out;
-        }
-      else
-        {
-          if (!relabel_one_path (sysroot, sepolicy, child, file_info, path_parts,
-                                 cancellable, error))
-            goto out;
-        }
-
-      g_ptr_array_remove_index (path_parts, path_parts->len - 1);
-    }
-
-  ret = TRUE;
- out:
-  return ret;
-}
-
-static gboolean
-selinux_relabel_dir (OstreeSysroot                 *sysroot,
-                     OstreeSePolicy                *sepolicy,
-                     GFile                         *dir,
-                     const char                    *prefix,
-                     GCancellable                  *cancellable,
-                     GError                       **error)
-{
-
-  g_autoptr(GFileInfo) root_info =
-    g_file_query_info (dir, OSTREE_GIO_FAST_QUERYINFO,
-                       G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                       cancellable, error);
-  if (!root_info)
-    return FALSE;
-
-  g_autoptr(GPtrArray) path_parts = g_ptr_array_new ();
-  g_ptr_array_add (path_parts, (char*)prefix);
-  if (!relabel_recursively (sysroot, sepolicy, dir, root_info, path_parts,
-                            cancellable, error))
-    return glnx_prefix_error (error, "Relabeling /%s", prefix);
-
-  return TRUE;
-}
-
 /* Handles SELinux labeling for /var; this is slated to be deleted.  See
  * https://github.com/ostreedev/ostree/pull/872
  */
@@ -705,10 +848,9 @@ selinux_relabel_var_if_needed (OstreeSysroot                 *sysroot,
         _ostree_sysroot_emit_journal_msg (sysroot, msg);
       }
 
-      g_autoptr(GFile) deployment_var_path = ot_fdrel_to_gfile (os_deploy_dfd, "var");
-      if (!selinux_relabel_dir (sysroot, sepolicy,
-                                deployment_var_path, "var",
-                                cancellable, error))
+      if (!ostree_sepolicy_restorecon_recursive_at (sepolicy, os_deploy_dfd, "var", "/var",
+                                                    OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL,
+                                                    0, NULL, NULL, cancellable, error))
         {
           g_prefix_error (error, "Relabeling /var: ");
           return FALSE;
@@ -1405,22 +1547,111 @@ fsfreeze_thaw_cycle (OstreeSysroot *self,
 }
 
 typedef struct {
+  gboolean targeted;
+  guint extra_syncfs_count;
   guint64 root_syncfs_msec;
   guint64 boot_syncfs_msec;
   guint64 extra_syncfs_msec;
 } SyncStats;
 
+/* Add the filesystem holding @path (relative to @dfd) to @filesystems,
+ * keyed by st_dev, unless it's @sysroot_dev, which is synced separately.
+ * Paths which don't exist are ignored.
+ */
+static gboolean
+add_sync_target (GHashTable     *filesystems,
+                 dev_t           sysroot_dev,
+                 int             dfd,
+                 const char     *path,
+                 GError        **error)
+{
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (dfd, path, &stbuf, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    return TRUE;
+  gint64 dev = stbuf.st_dev;
+  if (stbuf.st_dev == sysroot_dev || g_hash_table_contains (filesystems, &dev))
+    return TRUE;
+
+  glnx_autofd int fd = -1;
+  if (!glnx_opendirat (dfd, path, TRUE, &fd, error))
+    return FALSE;
+  g_hash_table_insert (filesystems, g_memdup (&dev, sizeof (dev)),
+                       GINT_TO_POINTER (glnx_steal_fd (&fd)));
+  return TRUE;
+}
+
+static void
+close_sync_target (gpointer data)
+{
+  int fd = GPOINTER_TO_INT (data);
+  (void) close (fd);
+}
+
+/* Sync every filesystem other than the sysroot's which holds data written
+ * for @new_deployments: their deployment roots and stateroot /var, plus
+ * the real /var if we're operating on the booted sysroot, since it may be
+ * a separate mount that isn't visible from inside the sysroot.
+ */
+static gboolean
+sync_deployment_filesystems (OstreeSysroot     *self,
+                             GPtrArray         *new_deployments,
+                             guint             *out_count,
+                             GCancellable      *cancellable,
+                             GError           **error)
+{
+  struct stat sysroot_stbuf;
+  if (!glnx_fstat (self->sysroot_fd, &sysroot_stbuf, error))
+    return FALSE;
+  g_autoptr(GHashTable) filesystems =
+    g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, close_sync_target);
+
+  for (guint i = 0; i < new_deployments->len; i++)
+    {
+      OstreeDeployment *deployment = new_deployments->pdata[i];
+      g_autofree char *deployment_dirpath =
+        ostree_sysroot_get_deployment_dirpath (self, deployment);
+      if (!add_sync_target (filesystems, sysroot_stbuf.st_dev, self->sysroot_fd, deployment_dirpath, error))
+        return FALSE;
+      g_autofree char *vardir =
+        g_strdup_printf ("ostree/deploy/%s/var", ostree_deployment_get_osname (deployment));
+      if (!add_sync_target (filesystems, sysroot_stbuf.st_dev, self->sysroot_fd, vardir, error))
+        return FALSE;
+    }
+  if (self->booted_deployment)
+    {
+      if (!add_sync_target (filesystems, sysroot_stbuf.st_dev, AT_FDCWD, "/var", error))
+        return FALSE;
+    }
+
+  GLNX_HASH_TABLE_FOREACH_V (filesystems, gpointer, fdp)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+      if (TEMP_FAILURE_RETRY (syncfs (GPOINTER_TO_INT (fdp))) != 0)
+        return glnx_throw_errno_prefix (error, "syncfs");
+    }
+
+  *out_count = g_hash_table_size (filesystems);
+  return TRUE;
+}
+
 /* First, sync the root directory as well as /var and /boot which may
  * be separate mount points.  Then *in addition*, do a global
- * `sync()`.
+ * `sync()`; or with sysroot.sync-mode=targeted, only sync the other
+ * filesystems the new deployments live on.
  */
 static gboolean
 full_system_sync (OstreeSysroot     *self,
+                  GPtrArray         *new_deployments,
                   SyncStats         *out_stats,
                   GCancellable      *cancellable,
                   GError           **error)
 {
   GLNX_AUTO_PREFIX_ERROR ("Full sync", error);
+  out_stats->targeted = ostree_sysroot_repo (self)->targeted_sync;
+
   guint64 start_msec = g_get_monotonic_time () / 1000;
   if (syncfs (self->sysroot_fd) != 0)
     return glnx_throw_errno_prefix (error, "syncfs(sysroot)");
@@ -1437,14 +1668,24 @@ full_system_sync (OstreeSysroot     *self,
   end_msec = g_get_monotonic_time () / 1000;
   out_stats->boot_syncfs_msec = (end_msec - start_msec);
 
-  /* And now out of an excess of conservativism, we still invoke
-   * sync().  The advantage of still using `syncfs()` above is that we
-   * actually get error codes out of that API, and we more clearly
-   * delineate what we actually want to sync in the future when this
-   * global sync call is removed.
-   */
   start_msec = g_get_monotonic_time () / 1000;
-  sync ();
+  if (out_stats->targeted)
+    {
+      if (!sync_deployment_filesystems (self, new_deployments,
+                                        &out_stats->extra_syncfs_count,
+                                        cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      /* And now out of an excess of conservativism, we still invoke
+       * sync().  The advantage of still using `syncfs()` above is that we
+       * actually get error codes out of that API, and we more clearly
+       * delineate what we actually want to sync in the future when this
+       * global sync call is removed.
+       */
+      sync ();
+    }
   end_msec = g_get_monotonic_time () / 1000;
   out_stats->extra_syncfs_msec = (end_msec - start_msec);
 
@@ -1582,34 +1823,20 @@ parse_os_release (const char *contents,
   return ret;
 }
 
-/* Given @deployment, prepare it to be booted; basically copying its
- * kernel/initramfs into /boot/ostree (if needed) and writing out an entry in
- * /boot/loader/entries.
+/* Copy the kernel/initramfs/devicetree of @deployment into
+ * /boot/ostree/osname-${bootcsum}, unless they're there already.  This only
+ * depends on the deployment's content, so it's also done ahead of time for
+ * staged deployments when sysroot.prefinalize-staged is set.
  */
 static gboolean
-install_deployment_kernel (OstreeSysroot   *sysroot,
-                           OstreeRepo      *repo,
-                           int             new_bootversion,
-                           OstreeDeployment   *deployment,
-                           guint           n_deployments,
-                           gboolean        show_osname,
-                           GCancellable   *cancellable,
-                           GError        **error)
-
+install_deployment_boot_files (OstreeSysroot       *sysroot,
+                               OstreeDeployment    *deployment,
+                               int                  deployment_dfd,
+                               OstreeSePolicy      *sepolicy,
+                               OstreeKernelLayout **out_layout,
+                               GCancellable        *cancellable,
+                               GError             **error)
 {
-  GLNX_AUTO_PREFIX_ERROR ("Installing kernel", error);
-  OstreeBootconfigParser *bootconfig = ostree_deployment_get_bootconfig (deployment);
-  g_autofree char *deployment_dirpath = ostree_sysroot_get_deployment_dirpath (sysroot, deployment);
-  glnx_autofd int deployment_dfd = -1;
-  if (!glnx_opendirat (sysroot->sysroot_fd, deployment_dirpath, FALSE,
-                       &deployment_dfd, error))
-    return FALSE;
-
-  /* We need to label the kernels */
-  g_autoptr(OstreeSePolicy) sepolicy = ostree_sepolicy_new_at (deployment_dfd, cancellable, error);
-  if (!sepolicy)
-    return FALSE;
-
   /* Find the kernel/initramfs/devicetree in the tree */
   g_autoptr(OstreeKernelLayout) kernel_layout = NULL;
   if (!get_kernel_from_tree (deployment_dfd, &kernel_layout,
@@ -1624,10 +1851,6 @@ install_deployment_kernel (OstreeSysroot   *sysroot,
   const char *bootcsum = ostree_deployment_get_bootcsum (deployment);
   g_assert_cmpstr (kernel_layout->bootcsum, ==, bootcsum);
   g_autofree char *bootcsumdir = g_strdup_printf ("ostree/%s-%s", osname, bootcsum);
-  g_autofree char *bootconfdir = g_strdup_printf ("loader.%d/entries", new_bootversion);
-  g_autofree char *bootconf_name = g_strdup_printf ("ostree-%d-%s.conf",
-                                   n_deployments - ostree_deployment_get_index (deployment),
-                                   osname);
   if (!glnx_shutil_mkdir_p_at (boot_dfd, bootcsumdir, 0775, cancellable, error))
     return FALSE;
 
@@ -1635,9 +1858,6 @@ install_deployment_kernel (OstreeSysroot   *sysroot,
   if (!glnx_opendirat (boot_dfd, bootcsumdir, TRUE, &bootcsum_dfd, error))
     return FALSE;
 
-  if (!glnx_shutil_mkdir_p_at (boot_dfd, bootconfdir, 0775, cancellable, error))
-    return FALSE;
-
   /* Install (hardlink/copy) the kernel into /boot/ostree/osname-${bootcsum} if
    * it doesn't exist already.
    */
@@ -1671,21 +1891,74 @@ install_deployment_kernel (OstreeSysroot   *sysroot,
         }
     }
 
-  if (kernel_layout->devicetree_srcpath)
-    {
-      g_assert (kernel_layout->devicetree_namever);
-      if (!glnx_fstatat_allow_noent (bootcsum_dfd, kernel_layout->devicetree_namever, &stbuf, 0, error))
-        return FALSE;
-      if (errno == ENOENT)
-        {
-          if (!install_into_boot (sepolicy, kernel_layout->boot_dfd, kernel_layout->devicetree_srcpath,
-                                  bootcsum_dfd, kernel_layout->devicetree_namever,
-                                  sysroot->debug_flags,
-                                  cancellable, error))
-            return FALSE;
-        }
-    }
+  if (kernel_layout->devicetree_srcpath)
+    {
+      g_assert (kernel_layout->devicetree_namever);
+      if (!glnx_fstatat_allow_noent (bootcsum_dfd, kernel_layout->devicetree_namever, &stbuf, 0, error))
+        return FALSE;
+      if (errno == ENOENT)
+        {
+          if (!install_into_boot (sepolicy, kernel_layout->boot_dfd, kernel_layout->devicetree_srcpath,
+                                  bootcsum_dfd, kernel_layout->devicetree_namever,
+                                  sysroot->debug_flags,
+                                  cancellable, error))
+            return FALSE;
+        }
+    }
+
+  if (out_layout)
+    *out_layout = g_steal_pointer (&kernel_layout);
+  return TRUE;
+}
+
+/* Given @deployment, prepare it to be booted; basically copying its
+ * kernel/initramfs into /boot/ostree (if needed) and writing out an entry in
+ * /boot/loader/entries.
+ */
+static gboolean
+install_deployment_kernel (OstreeSysroot   *sysroot,
+                           OstreeRepo      *repo,
+                           int             new_bootversion,
+                           OstreeDeployment   *deployment,
+                           guint           n_deployments,
+                           gboolean        show_osname,
+                           GCancellable   *cancellable,
+                           GError        **error)
+
+{
+  GLNX_AUTO_PREFIX_ERROR ("Installing kernel", error);
+  OstreeBootconfigParser *bootconfig = ostree_deployment_get_bootconfig (deployment);
+  g_autofree char *deployment_dirpath = ostree_sysroot_get_deployment_dirpath (sysroot, deployment);
+  glnx_autofd int deployment_dfd = -1;
+  if (!glnx_opendirat (sysroot->sysroot_fd, deployment_dirpath, FALSE,
+                       &deployment_dfd, error))
+    return FALSE;
+
+  /* We need to label the kernels */
+  g_autoptr(OstreeSePolicy) sepolicy = ostree_sepolicy_new_at (deployment_dfd, cancellable, error);
+  if (!sepolicy)
+    return FALSE;
+
+  g_autoptr(OstreeKernelLayout) kernel_layout = NULL;
+  if (!install_deployment_boot_files (sysroot, deployment, deployment_dfd, sepolicy,
+                                      &kernel_layout, cancellable, error))
+    return FALSE;
+
+  glnx_autofd int boot_dfd = -1;
+  if (!glnx_opendirat (sysroot->sysroot_fd, "boot", TRUE, &boot_dfd, error))
+    return FALSE;
+
+  const char *osname = ostree_deployment_get_osname (deployment);
+  const char *bootcsum = ostree_deployment_get_bootcsum (deployment);
+  g_autofree char *bootcsumdir = g_strdup_printf ("ostree/%s-%s", osname, bootcsum);
+  g_autofree char *bootconfdir = g_strdup_printf ("loader.%d/entries", new_bootversion);
+  g_autofree char *bootconf_name = g_strdup_printf ("ostree-%d-%s.conf",
+                                   n_deployments - ostree_deployment_get_index (deployment),
+                                   osname);
+  if (!glnx_shutil_mkdir_p_at (boot_dfd, bootconfdir, 0775, cancellable, error))
+    return FALSE;
 
+  struct stat stbuf;
   g_autofree char *contents = NULL;
   if (!glnx_fstatat_allow_noent (deployment_dfd, "usr/lib/os-release", &stbuf, 0, error))
     return FALSE;
@@ -2127,7 +2400,7 @@ write_deployments_bootswap (OstreeSysroot     *self,
                                     cancellable, error))
     return FALSE;
 
-  if (!full_system_sync (self, out_syncstats, cancellable, error))
+  if (!full_system_sync (self, new_deployments, out_syncstats, cancellable, error))
     return FALSE;
 
   if (!swap_bootloader (self, self->bootversion, new_bootversion,
@@ -2317,7 +2590,7 @@ ostree_sysroot_write_deployments_with_options (OstreeSysroot     *self,
                                  cancellable, error))
         return FALSE;
 
-      if (!full_system_sync (self, &syncstats, cancellable, error))
+      if (!full_system_sync (self, new_deployments, &syncstats, cancellable, error))
         return FALSE;
 
       if (!swap_bootlinks (self, self->bootversion,
@@ -2395,6 +2668,8 @@ ostree_sysroot_write_deployments_with_options (OstreeSysroot     *self,
                      "OSTREE_SYNCFS_ROOT_MSEC=%" G_GUINT64_FORMAT, syncstats.root_syncfs_msec,
                      "OSTREE_SYNCFS_BOOT_MSEC=%" G_GUINT64_FORMAT, syncstats.boot_syncfs_msec,
                      "OSTREE_SYNCFS_EXTRA_MSEC=%" G_GUINT64_FORMAT, syncstats.extra_syncfs_msec,
+                     "OSTREE_SYNC_MODE=%s", syncstats.targeted ? "targeted" : "full",
+                     "OSTREE_SYNCFS_EXTRA_COUNT=%u", syncstats.extra_syncfs_count,
                      NULL);
     _ostree_sysroot_emit_journal_msg (self, msg);
   }
@@ -2478,7 +2753,7 @@ sysroot_initialize_deployment (OstreeSysroot     *self,
                                const char        *osname,
                                const char        *revision,
                                GKeyFile          *origin,
-                               char             **override_kernel_argv,
+                               OstreeSysrootDeployTreeOpts *opts,
                                OstreeDeployment **out_new_deployment,
                                GCancellable      *cancellable,
                                GError           **error)
@@ -2503,8 +2778,8 @@ sysroot_initialize_deployment (OstreeSysroot     *self,
 
   /* Check out the userspace tree onto the filesystem */
   glnx_autofd int deployment_dfd = -1;
-  if (!checkout_deployment_tree (self, repo, new_deployment, &deployment_dfd,
-                                 cancellable, error))
+  if (!checkout_deployment_tree (self, repo, new_deployment, opts->n_checkout_threads,
+                                 &deployment_dfd, cancellable, error))
     return FALSE;
 
   g_autoptr(OstreeKernelLayout) kernel_layout = NULL;
@@ -2513,7 +2788,7 @@ sysroot_initialize_deployment (OstreeSysroot     *self,
     return FALSE;
 
   _ostree_deployment_set_bootcsum (new_deployment, kernel_layout->bootcsum);
-  _ostree_deployment_set_bootconfig_from_kargs (new_deployment, override_kernel_argv);
+  _ostree_deployment_set_bootconfig_from_kargs (new_deployment, opts->override_kernel_argv);
 
   if (!prepare_deployment_etc (self, repo, new_deployment, deployment_dfd,
                                cancellable, error))
@@ -2523,6 +2798,303 @@ sysroot_initialize_deployment (OstreeSysroot     *self,
   return TRUE;
 }
 
+/* Format of the /etc snapshot taken when pre-finalizing a staged deployment:
+ * path relative to /etc -> (mode, uid, gid, inode, ctime in nanoseconds).
+ */
+#define ETC_SNAPSHOT_GVARIANT_STRING "a{s(uuutt)}"
+
+/* Entries changed this close to the snapshot might change again without
+ * their ctime moving, given the timestamp granularity; always treat them as
+ * changed.
+ */
+#define ETC_SNAPSHOT_RACY_NSEC (G_GUINT64_CONSTANT(1000000000))
+
+static gboolean
+snapshot_etc_recurse (int               etc_fd,
+                      const char       *path,
+                      guint64           racy_ctime,
+                      GVariantBuilder  *builder,
+                      GCancellable     *cancellable,
+                      GError          **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (etc_fd, path ?: ".", FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      struct stat stbuf;
+      if (!glnx_fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      g_autofree char *child_path =
+        path ? g_build_filename (path, dent->d_name, NULL) : g_strdup (dent->d_name);
+      guint64 ctime_ns = (guint64)stbuf.st_ctim.tv_sec * G_GUINT64_CONSTANT(1000000000) + stbuf.st_ctim.tv_nsec;
+      if (ctime_ns >= racy_ctime)
+        ctime_ns = 0;
+      g_variant_builder_add (builder, "{s(uuutt)}", child_path,
+                             (guint32)stbuf.st_mode, (guint32)stbuf.st_uid,
+                             (guint32)stbuf.st_gid, (guint64)stbuf.st_ino, ctime_ns);
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          if (!snapshot_etc_recurse (etc_fd, child_path, racy_ctime, builder,
+                                     cancellable, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Record the identity of everything in @etc_fd, so that
+ * merge_configuration_delta() can find what changed since.
+ */
+static GVariant *
+snapshot_etc (int            etc_fd,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+  guint64 now = (guint64)g_get_real_time () * 1000;
+  g_auto(GVariantBuilder) builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_variant_builder_init (&builder, (GVariantType*)ETC_SNAPSHOT_GVARIANT_STRING);
+  if (!snapshot_etc_recurse (etc_fd, NULL, now - ETC_SNAPSHOT_RACY_NSEC, &builder,
+                             cancellable, error))
+    return NULL;
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/* Compare @etc_fd against @snapshot, removing the entries seen from it.
+ * Changed and added non-directories are appended to @changed; any change to
+ * a directory itself sets @out_need_full, since it may affect everything
+ * below it.
+ */
+static gboolean
+etc_delta_scan (int             etc_fd,
+                const char     *path,
+                GHashTable     *snapshot,
+                GPtrArray      *changed,
+                gboolean       *out_need_full,
+                GCancellable   *cancellable,
+                GError        **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (etc_fd, path ?: ".", FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      struct stat stbuf;
+      if (!glnx_fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      g_autofree char *child_path =
+        path ? g_build_filename (path, dent->d_name, NULL) : g_strdup (dent->d_name);
+      const gboolean is_dir = S_ISDIR (stbuf.st_mode);
+
+      GVariant *v = g_hash_table_lookup (snapshot, child_path);
+      if (!v)
+        {
+          if (is_dir)
+            {
+              *out_need_full = TRUE;
+              return TRUE;
+            }
+          g_ptr_array_add (changed, g_steal_pointer (&child_path));
+          continue;
+        }
+
+      guint32 mode, uid, gid;
+      guint64 ino, ctime_ns;
+      g_variant_get (v, "(uuutt)", &mode, &uid, &gid, &ino, &ctime_ns);
+      const gboolean same_meta =
+        mode == stbuf.st_mode && uid == stbuf.st_uid && gid == stbuf.st_gid;
+      g_hash_table_remove (snapshot, child_path);
+
+      if (is_dir || S_ISDIR (mode))
+        {
+          if (!same_meta)
+            {
+              *out_need_full = TRUE;
+              return TRUE;
+            }
+          if (!etc_delta_scan (etc_fd, child_path, snapshot, changed, out_need_full,
+                               cancellable, error))
+            return FALSE;
+          if (*out_need_full)
+            return TRUE;
+        }
+      else if (!same_meta || ino != stbuf.st_ino ||
+               ctime_ns != (guint64)stbuf.st_ctim.tv_sec * G_GUINT64_CONSTANT(1000000000) + stbuf.st_ctim.tv_nsec)
+        g_ptr_array_add (changed, g_steal_pointer (&child_path));
+    }
+
+  return TRUE;
+}
+
+/* Redo the merge of the non-directory @path, as merge_configuration_from()
+ * would.  Restoring the new deployment's default isn't handled here, as it
+ * needs relabeling; that sets @out_need_full instead.
+ */
+static gboolean
+etc_delta_apply (int                 orig_etc_fd,
+                 int                 modified_etc_fd,
+                 int                 new_etc_fd,
+                 int                 new_usretc_fd,
+                 const char         *path,
+                 OstreeSysrootDebugFlags flags,
+                 gboolean           *out_need_full,
+                 GCancellable       *cancellable,
+                 GError            **error)
+{
+  struct stat modified_stbuf;
+  if (!glnx_fstatat_allow_noent (modified_etc_fd, path, &modified_stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  const gboolean modified_exists = (errno == 0);
+  struct stat orig_stbuf;
+  if (!glnx_fstatat_allow_noent (orig_etc_fd, path, &orig_stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  const gboolean orig_exists = (errno == 0);
+
+  if (modified_exists)
+    {
+      if (S_ISDIR (modified_stbuf.st_mode))
+        {
+          *out_need_full = TRUE;
+          return TRUE;
+        }
+
+      gboolean equal = FALSE;
+      if (orig_exists &&
+          !config_entries_equal (orig_etc_fd, modified_etc_fd, path,
+                                 &orig_stbuf, &modified_stbuf, &equal, error))
+        return FALSE;
+      if (!equal)
+        {
+          gboolean copied_tree;
+          return copy_modified_config_file (orig_etc_fd, modified_etc_fd, new_etc_fd,
+                                            path, flags, &copied_tree,
+                                            cancellable, error);
+        }
+    }
+  else if (orig_exists)
+    {
+      /* Removed */
+      return glnx_shutil_rm_rf_at (new_etc_fd, path, cancellable, error);
+    }
+
+  /* Unmodified, or no longer added; the new deployment's default applies */
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (new_usretc_fd, path, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  if (errno == 0)
+    {
+      *out_need_full = TRUE;
+      return TRUE;
+    }
+  return glnx_shutil_rm_rf_at (new_etc_fd, path, cancellable, error);
+}
+
+/* Update the /etc merge done when @new_deployment was staged with the changes
+ * to @merge_deployment's /etc since then, as recorded by @etc_snapshot.  If
+ * that can't be done incrementally, @out_need_full is set and the caller
+ * should redo the whole merge.
+ */
+static gboolean
+merge_configuration_delta (OstreeSysroot    *sysroot,
+                           OstreeDeployment *merge_deployment,
+                           int               new_deployment_dfd,
+                           GVariant         *etc_snapshot,
+                           gboolean         *out_need_full,
+                           GCancellable     *cancellable,
+                           GError          **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("During incremental /etc merge", error);
+
+  g_autofree char *merge_deployment_path = ostree_sysroot_get_deployment_dirpath (sysroot, merge_deployment);
+  glnx_autofd int merge_deployment_dfd = -1;
+  if (!glnx_opendirat (sysroot->sysroot_fd, merge_deployment_path, FALSE,
+                       &merge_deployment_dfd, error))
+    return FALSE;
+
+  glnx_autofd int orig_etc_fd = -1;
+  if (!glnx_opendirat (merge_deployment_dfd, "usr/etc", TRUE, &orig_etc_fd, error))
+    return FALSE;
+  glnx_autofd int modified_etc_fd = -1;
+  if (!glnx_opendirat (merge_deployment_dfd, "etc", TRUE, &modified_etc_fd, error))
+    return FALSE;
+  glnx_autofd int new_etc_fd = -1;
+  if (!glnx_opendirat (new_deployment_dfd, "etc", TRUE, &new_etc_fd, error))
+    return FALSE;
+  glnx_autofd int new_usretc_fd = -1;
+  if (!glnx_opendirat (new_deployment_dfd, "usr/etc", TRUE, &new_usretc_fd, error))
+    return FALSE;
+
+  g_autoptr(GHashTable) snapshot =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+  { GVariantIter viter;
+    char *path;
+    GVariant *v;
+    g_variant_iter_init (&viter, etc_snapshot);
+    while (g_variant_iter_next (&viter, "{s@(uuutt)}", &path, &v))
+      g_hash_table_insert (snapshot, path, v);
+  }
+
+  g_autoptr(GPtrArray) changed = g_ptr_array_new_with_free_func (g_free);
+  gboolean need_full = FALSE;
+  if (!etc_delta_scan (modified_etc_fd, NULL, snapshot, changed, &need_full,
+                       cancellable, error))
+    return FALSE;
+
+  /* What's left was removed since staging */
+  if (!need_full)
+    {
+      GLNX_HASH_TABLE_FOREACH_KV (snapshot, const char*, path, GVariant*, v)
+        {
+          guint32 mode;
+          g_variant_get_child (v, 0, "u", &mode);
+          if (S_ISDIR (mode))
+            {
+              need_full = TRUE;
+              break;
+            }
+          g_ptr_array_add (changed, g_strdup (path));
+        }
+    }
+
+  for (guint i = 0; i < changed->len && !need_full; i++)
+    {
+      if (!etc_delta_apply (orig_etc_fd, modified_etc_fd, new_etc_fd, new_usretc_fd,
+                            changed->pdata[i], sysroot->debug_flags, &need_full,
+                            cancellable, error))
+        return FALSE;
+    }
+
+  if (!need_full)
+    {
+      g_autofree char *msg =
+        g_strdup_printf ("Copied /etc changes since staging: %u changed", changed->len);
+      ot_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL(OSTREE_CONFIGMERGE_ID),
+                       "MESSAGE=%s", msg,
+                       "ETC_N_CHANGED=%u", changed->len,
+                       NULL);
+      _ostree_sysroot_emit_journal_msg (sysroot, msg);
+    }
+
+  *out_need_full = need_full;
+  return TRUE;
+}
+
 /* Get a directory fd for the /var of @deployment.
  * Before we supported having /var be a separate mount point,
  * this was easy. However, as https://github.com/ostreedev/ostree/issues/1729
@@ -2564,11 +3136,15 @@ get_var_dfd (OstreeSysroot      *self,
   return glnx_opendirat (base_dfd, base_path, TRUE, ret_fd, error);
 }
 
+/* If @etc_snapshot is set, the /etc merge was already done when staging
+ * @deployment, and only needs updating.
+ */
 static gboolean
 sysroot_finalize_deployment (OstreeSysroot     *self,
                              OstreeDeployment  *deployment,
                              char             **override_kernel_argv,
                              OstreeDeployment  *merge_deployment,
+                             GVariant          *etc_snapshot,
                              GCancellable      *cancellable,
                              GError           **error)
 {
@@ -2592,8 +3168,27 @@ sysroot_finalize_deployment (OstreeSysroot     *self,
 
   if (merge_deployment)
     {
+      gboolean need_full = TRUE;
+      if (etc_snapshot)
+        {
+          if (!merge_configuration_delta (self, merge_deployment, deployment_dfd,
+                                          etc_snapshot, &need_full, cancellable, error))
+            return FALSE;
+          /* Start over from the pristine /etc */
+          if (need_full)
+            {
+              ot_journal_print (LOG_INFO, "Redoing /etc merge from scratch");
+              if (!glnx_shutil_rm_rf_at (deployment_dfd, "etc", cancellable, error))
+                return FALSE;
+              if (!prepare_deployment_etc (self, ostree_sysroot_repo (self), deployment,
+                                           deployment_dfd, cancellable, error))
+                return FALSE;
+            }
+        }
+
       /* And do the /etc merge */
-      if (!merge_configuration_from (self, merge_deployment, deployment, deployment_dfd,
+      if (need_full &&
+          !merge_configuration_from (self, merge_deployment, deployment, deployment_dfd,
                                      cancellable, error))
         return FALSE;
     }
@@ -2671,13 +3266,52 @@ ostree_sysroot_deploy_tree (OstreeSysroot     *self,
                             GCancellable      *cancellable,
                             GError           **error)
 {
+  OstreeSysrootDeployTreeOpts opts = { .override_kernel_argv = override_kernel_argv };
+  return ostree_sysroot_deploy_tree_with_options (self, osname, revision, origin,
+                                                  provided_merge_deployment, &opts,
+                                                  out_new_deployment,
+                                                  cancellable, error);
+}
+
+/**
+ * ostree_sysroot_deploy_tree_with_options:
+ * @self: Sysroot
+ * @osname: (allow-none): osname to use for merge deployment
+ * @revision: Checksum to add
+ * @origin: (allow-none): Origin to use for upgrades
+ * @provided_merge_deployment: (allow-none): Use this deployment for merge path
+ * @opts: (allow-none): Options
+ * @out_new_deployment: (out): The new deployment path
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_sysroot_deploy_tree(), but takes an extensible options
+ * structure.
+ *
+ * Since: 2019.3
+ */
+gboolean
+ostree_sysroot_deploy_tree_with_options (OstreeSysroot     *self,
+                                         const char        *osname,
+                                         const char        *revision,
+                                         GKeyFile          *origin,
+                                         OstreeDeployment  *provided_merge_deployment,
+                                         OstreeSysrootDeployTreeOpts *opts,
+                                         OstreeDeployment **out_new_deployment,
+                                         GCancellable      *cancellable,
+                                         GError           **error)
+{
+  OstreeSysrootDeployTreeOpts default_opts = { 0, };
+  if (!opts)
+    opts = &default_opts;
+
   g_autoptr(OstreeDeployment) deployment = NULL;
-  if (!sysroot_initialize_deployment (self, osname, revision, origin, override_kernel_argv,
+  if (!sysroot_initialize_deployment (self, osname, revision, origin, opts,
                                       &deployment, cancellable, error))
     return FALSE;
 
-  if (!sysroot_finalize_deployment (self, deployment, override_kernel_argv,
-                                    provided_merge_deployment,
+  if (!sysroot_finalize_deployment (self, deployment, opts->override_kernel_argv,
+                                    provided_merge_deployment, NULL,
                                     cancellable, error))
     return FALSE;
 
@@ -2744,6 +3378,62 @@ _ostree_sysroot_deserialize_deployment_from_variant (GVariant *v,
 }
 
 
+/* With sysroot.prefinalize-staged, do the work of finalizing @deployment that
+ * doesn't depend on the final set of deployments now rather than at shutdown:
+ * the /etc merge, returning a snapshot of @merge_deployment's /etc to find
+ * what changed since, and installing the kernel into /boot.
+ */
+static gboolean
+prefinalize_staged_deployment (OstreeSysroot     *self,
+                               OstreeDeployment  *deployment,
+                               OstreeDeployment  *merge_deployment,
+                               GVariant         **out_etc_snapshot,
+                               GCancellable      *cancellable,
+                               GError           **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Pre-finalizing staged deployment", error);
+  g_autofree char *deployment_path = ostree_sysroot_get_deployment_dirpath (self, deployment);
+  glnx_autofd int deployment_dfd = -1;
+  if (!glnx_opendirat (self->sysroot_fd, deployment_path, FALSE, &deployment_dfd, error))
+    return FALSE;
+
+  g_autoptr(GVariant) etc_snapshot = NULL;
+  if (merge_deployment)
+    {
+      g_autofree char *merge_deployment_path =
+        ostree_sysroot_get_deployment_dirpath (self, merge_deployment);
+      glnx_autofd int modified_etc_fd = -1;
+      if (!glnx_opendirat (self->sysroot_fd, glnx_strjoina (merge_deployment_path, "/etc"),
+                           TRUE, &modified_etc_fd, error))
+        return FALSE;
+      /* Snapshot first, so anything changed during the merge is redone */
+      etc_snapshot = snapshot_etc (modified_etc_fd, cancellable, error);
+      if (!etc_snapshot)
+        return FALSE;
+      if (!merge_configuration_from (self, merge_deployment, deployment, deployment_dfd,
+                                     cancellable, error))
+        return FALSE;
+    }
+
+  /* Like write_deployments(), but rather than remounting /boot here we leave
+   * it to finalization.
+   */
+  if (is_ro_mount ("/boot"))
+    g_debug ("/boot is read-only; not installing kernel ahead of time");
+  else
+    {
+      g_autoptr(OstreeSePolicy) sepolicy = ostree_sepolicy_new_at (deployment_dfd, cancellable, error);
+      if (!sepolicy)
+        return FALSE;
+      if (!install_deployment_boot_files (self, deployment, deployment_dfd, sepolicy,
+                                          NULL, cancellable, error))
+        return FALSE;
+    }
+
+  ot_transfer_out_value (out_etc_snapshot, &etc_snapshot);
+  return TRUE;
+}
+
 /**
  * ostree_sysroot_stage_tree:
  * @self: Sysroot
@@ -2772,6 +3462,46 @@ ostree_sysroot_stage_tree (OstreeSysroot     *self,
                            GCancellable      *cancellable,
                            GError           **error)
 {
+  OstreeSysrootDeployTreeOpts opts = { .override_kernel_argv = override_kernel_argv };
+  return ostree_sysroot_stage_tree_with_options (self, osname, revision, origin,
+                                                 merge_deployment, &opts,
+                                                 out_new_deployment,
+                                                 cancellable, error);
+}
+
+/**
+ * ostree_sysroot_stage_tree_with_options:
+ * @self: Sysroot
+ * @osname: (allow-none): osname to use for merge deployment
+ * @revision: Checksum to add
+ * @origin: (allow-none): Origin to use for upgrades
+ * @merge_deployment: (allow-none): Use this deployment for merge path
+ * @opts: (allow-none): Options
+ * @out_new_deployment: (out): The new deployment path
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_sysroot_stage_tree(), but takes an extensible options
+ * structure.
+ *
+ * Since: 2019.3
+ */
+gboolean
+ostree_sysroot_stage_tree_with_options (OstreeSysroot     *self,
+                                        const char        *osname,
+                                        const char        *revision,
+                                        GKeyFile          *origin,
+                                        OstreeDeployment  *merge_deployment,
+                                        OstreeSysrootDeployTreeOpts *opts,
+                                        OstreeDeployment **out_new_deployment,
+                                        GCancellable      *cancellable,
+                                        GError           **error)
+{
+  OstreeSysrootDeployTreeOpts default_opts = { 0, };
+  if (!opts)
+    opts = &default_opts;
+  char **override_kernel_argv = opts->override_kernel_argv;
+
   OstreeDeployment *booted_deployment = ostree_sysroot_get_booted_deployment (self);
   if (booted_deployment == NULL)
     return glnx_throw (error, "Cannot stage a deployment when not currently booted into an OSTree system");
@@ -2799,7 +3529,7 @@ ostree_sysroot_stage_tree (OstreeSysroot     *self,
     } /* OSTREE_SYSROOT_DEBUG_TEST_STAGED_PATH */
 
   g_autoptr(OstreeDeployment) deployment = NULL;
-  if (!sysroot_initialize_deployment (self, osname, revision, origin, override_kernel_argv,
+  if (!sysroot_initialize_deployment (self, osname, revision, origin, opts,
                                       &deployment, cancellable, error))
     return FALSE;
 
@@ -2822,6 +3552,14 @@ ostree_sysroot_stage_tree (OstreeSysroot     *self,
       return FALSE;
   }
 
+  g_autoptr(GVariant) etc_snapshot = NULL;
+  if (ostree_sysroot_repo (self)->prefinalize_staged)
+    {
+      if (!prefinalize_staged_deployment (self, deployment, merge_deployment,
+                                          &etc_snapshot, cancellable, error))
+        return FALSE;
+    }
+
   /* After here we defer action until shutdown. The remaining arguments (merge
    * deployment, kargs) are serialized to a state file in /run.
    */
@@ -2839,6 +3577,9 @@ ostree_sysroot_stage_tree (OstreeSysroot     *self,
     g_variant_builder_add (builder, "{sv}", "kargs",
                            g_variant_new_strv ((const char *const*)override_kernel_argv, -1));
 
+  if (etc_snapshot)
+    g_variant_builder_add (builder, "{sv}", "etc-snapshot", etc_snapshot);
+
   const char *parent = dirname (strdupa (_OSTREE_SYSROOT_RUNSTATE_STAGED));
   if (!glnx_shutil_mkdir_p_at (AT_FDCWD, parent, 0755, cancellable, error))
     return FALSE;
@@ -2942,6 +3683,9 @@ _ostree_sysroot_finalize_staged (OstreeSysroot *self,
     }
   g_autofree char **kargs = NULL;
   g_variant_lookup (self->staged_deployment_data, "kargs", "^a&s", &kargs);
+  g_autoptr(GVariant) etc_snapshot = NULL;
+  g_variant_lookup (self->staged_deployment_data, "etc-snapshot",
+                    "@" ETC_SNAPSHOT_GVARIANT_STRING, &etc_snapshot);
 
   /* Unlink the staged state now; if we're interrupted in the middle,
    * we don't want e.g. deal with the partially written /etc merge.
@@ -2950,7 +3694,7 @@ _ostree_sysroot_finalize_staged (OstreeSysroot *self,
     return FALSE;
 
   if (!sysroot_finalize_deployment (self, self->staged_deployment, kargs, merge_deployment,
-                                    cancellable, error))
+                                    etc_snapshot, cancellable, error))
     return FALSE;
 
   /* Now, take ownership of the staged state, as normally the API below strips
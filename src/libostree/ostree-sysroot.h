@@ -197,6 +197,45 @@ gboolean ostree_sysroot_stage_tree (OstreeSysroot     *self,
                                     GCancellable      *cancellable,
                                     GError           **error);
 
+/**
+ * OstreeSysrootDeployTreeOpts:
+ * @n_checkout_threads: Number of threads to use for checking out the tree;
+ *   0 or 1 means the checkout is done on the calling thread
+ * @override_kernel_argv: Use these as kernel arguments; if %NULL, inherit
+ *   options from the merge deployment
+ *
+ * Since: 2019.3
+ */
+typedef struct {
+  gboolean unused_bools[8];
+  int n_checkout_threads;
+  int unused_ints[7];
+  char **override_kernel_argv;
+  gpointer unused_ptrs[7];
+} OstreeSysrootDeployTreeOpts;
+
+_OSTREE_PUBLIC
+gboolean ostree_sysroot_deploy_tree_with_options (OstreeSysroot     *self,
+                                                  const char        *osname,
+                                                  const char        *revision,
+                                                  GKeyFile          *origin,
+                                                  OstreeDeployment  *provided_merge_deployment,
+                                                  OstreeSysrootDeployTreeOpts *opts,
+                                                  OstreeDeployment **out_new_deployment,
+                                                  GCancellable      *cancellable,
+                                                  GError           **error);
+
+_OSTREE_PUBLIC
+gboolean ostree_sysroot_stage_tree_with_options (OstreeSysroot     *self,
+                                                 const char        *osname,
+                                                 const char        *revision,
+                                                 GKeyFile          *origin,
+                                                 OstreeDeployment  *merge_deployment,
+                                                 OstreeSysrootDeployTreeOpts *opts,
+                                                 OstreeDeployment **out_new_deployment,
+                                                 GCancellable      *cancellable,
+                                                 GError           **error);
+
 _OSTREE_PUBLIC
 gboolean ostree_sysroot_deployment_set_mutable (OstreeSysroot     *self,
                                                 OstreeDeployment  *deployment,
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ostree-zstd-common.h"
+
+#include <zstd.h>
+#include <zdict.h>
+
+/* Map a zstd return code to a GConverterResult; only errors are
+ * handled here, callers decide what a successful code means.
+ */
+GConverterResult
+_ostree_zstd_return (size_t     code,
+                     GError   **error)
+{
+  if (!ZSTD_isError (code))
+    return G_CONVERTER_CONVERTED;
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+               "zstd: %s", ZSTD_getErrorName (code));
+  return G_CONVERTER_ERROR;
+}
+
+/* Train a dictionary of at most @max_size bytes from @samples, which is
+ * the concatenation of samples whose sizes (as size_t) are in
+ * @sample_sizes.  zstd needs a reasonable amount of input for this to
+ * work; callers should treat an error as "no dictionary".
+ */
+GBytes *
+_ostree_zstd_train_dictionary (GByteArray  *samples,
+                               GArray      *sample_sizes,
+                               gsize        max_size,
+                               GError     **error)
+{
+  g_autofree guint8 *buf = g_malloc (max_size);
+  size_t len = ZDICT_trainFromBuffer (buf, max_size, samples->data,
+                                      (const size_t *) sample_sizes->data,
+                                      sample_sizes->len);
+  if (ZDICT_isError (len))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Training zstd dictionary: %s", ZDICT_getErrorName (len));
+      return NULL;
+    }
+
+  return g_bytes_new_take (g_realloc (g_steal_pointer (&buf), len), len);
+}
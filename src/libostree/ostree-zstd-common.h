@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Largest dictionary we train; this is the zstd default, and a good
+ * tradeoff between the dictionary's own size and its efficiency.
+ */
+#define _OSTREE_ZSTD_MAX_DICTIONARY_SIZE (110 * 1024)
+
+GConverterResult _ostree_zstd_return (size_t code, GError **error);
+
+GBytes *_ostree_zstd_train_dictionary (GByteArray  *samples,
+                                       GArray      *sample_sizes,
+                                       gsize        max_size,
+                                       GError     **error);
+
+G_END_DECLS
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ostree-zstd-compressor.h"
+#include "ostree-zstd-common.h"
+
+#include <zstd.h>
+
+/**
+ * SECTION:ostree-zstd-compressor
+ * @title: zstd compressor
+ *
+ * An implementation of #GConverter that compresses data using
+ * zstd, optionally with a dictionary.
+ */
+
+static void _ostree_zstd_compressor_iface_init          (GConverterIface *iface);
+
+struct _OstreeZstdCompressor
+{
+  GObject parent_instance;
+
+  int level;
+  GBytes *dictionary;
+  ZSTD_CCtx *cctx;
+  gboolean initialized;
+};
+
+G_DEFINE_TYPE_WITH_CODE (OstreeZstdCompressor, _ostree_zstd_compressor,
+                         G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER,
+                                                _ostree_zstd_compressor_iface_init))
+
+static void
+_ostree_zstd_compressor_finalize (GObject *object)
+{
+  OstreeZstdCompressor *self = OSTREE_ZSTD_COMPRESSOR (object);
+
+  ZSTD_freeCCtx (self->cctx);
+  g_clear_pointer (&self->dictionary, (GDestroyNotify)g_bytes_unref);
+
+  G_OBJECT_CLASS (_ostree_zstd_compressor_parent_class)->finalize (object);
+}
+
+static void
+_ostree_zstd_compressor_init (OstreeZstdCompressor *self)
+{
+}
+
+static void
+_ostree_zstd_compressor_class_init (OstreeZstdCompressorClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = _ostree_zstd_compressor_finalize;
+}
+
+OstreeZstdCompressor *
+_ostree_zstd_compressor_new (int     level,
+                             GBytes *dictionary)
+{
+  OstreeZstdCompressor *self = g_object_new (OSTREE_TYPE_ZSTD_COMPRESSOR, NULL);
+  self->level = level;
+  self->dictionary = dictionary ? g_bytes_ref (dictionary) : NULL;
+  return self;
+}
+
+static void
+_ostree_zstd_compressor_reset (GConverter *converter)
+{
+  OstreeZstdCompressor *self = OSTREE_ZSTD_COMPRESSOR (converter);
+
+  if (self->initialized)
+    {
+      (void) ZSTD_CCtx_reset (self->cctx, ZSTD_reset_session_and_parameters);
+      self->initialized = FALSE;
+    }
+}
+
+static GConverterResult
+_ostree_zstd_compressor_convert (GConverter *converter,
+                                 const void *inbuf,
+                                 gsize       inbuf_size,
+                                 void       *outbuf,
+                                 gsize       outbuf_size,
+                                 GConverterFlags flags,
+                                 gsize      *bytes_read,
+                                 gsize      *bytes_written,
+                                 GError    **error)
+{
+  OstreeZstdCompressor *self = OSTREE_ZSTD_COMPRESSOR (converter);
+  size_t res;
+
+  if (inbuf_size != 0 && outbuf_size == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+         "Output buffer too small");
+      return G_CONVERTER_ERROR;
+    }
+
+  if (!self->initialized)
+    {
+      if (!self->cctx)
+        {
+          self->cctx = ZSTD_createCCtx ();
+          if (!self->cctx)
+            {
+              g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                   "Out of memory");
+              return G_CONVERTER_ERROR;
+            }
+        }
+
+      res = ZSTD_CCtx_setParameter (self->cctx, ZSTD_c_compressionLevel, self->level);
+      if (ZSTD_isError (res))
+        return _ostree_zstd_return (res, error);
+      res = ZSTD_CCtx_setParameter (self->cctx, ZSTD_c_checksumFlag, 1);
+      if (ZSTD_isError (res))
+        return _ostree_zstd_return (res, error);
+      if (self->dictionary)
+        {
+          res = ZSTD_CCtx_loadDictionary (self->cctx,
+                                          g_bytes_get_data (self->dictionary, NULL),
+                                          g_bytes_get_size (self->dictionary));
+          if (ZSTD_isError (res))
+            return _ostree_zstd_return (res, error);
+        }
+      self->initialized = TRUE;
+    }
+
+  ZSTD_inBuffer in = { inbuf, inbuf_size, 0 };
+  ZSTD_outBuffer out = { outbuf, outbuf_size, 0 };
+
+  ZSTD_EndDirective mode = ZSTD_e_continue;
+  if (flags & G_CONVERTER_INPUT_AT_END)
+    mode = ZSTD_e_end;
+  else if (flags & G_CONVERTER_FLUSH)
+    mode = ZSTD_e_flush;
+
+  /* This returns how much is left to flush for the given mode */
+  res = ZSTD_compressStream2 (self->cctx, &out, &in, mode);
+  if (ZSTD_isError (res))
+    return _ostree_zstd_return (res, error);
+
+  *bytes_read = in.pos;
+  *bytes_written = out.pos;
+
+  if (res == 0 && in.pos == inbuf_size)
+    {
+      if (mode == ZSTD_e_end)
+        return G_CONVERTER_FINISHED;
+      else if (mode == ZSTD_e_flush)
+        return G_CONVERTER_FLUSHED;
+    }
+  return G_CONVERTER_CONVERTED;
+}
+
+static void
+_ostree_zstd_compressor_iface_init (GConverterIface *iface)
+{
+  iface->convert = _ostree_zstd_compressor_convert;
+  iface->reset = _ostree_zstd_compressor_reset;
+}
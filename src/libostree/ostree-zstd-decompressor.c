@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ostree-zstd-decompressor.h"
+#include "ostree-zstd-common.h"
+
+#include <zstd.h>
+
+/**
+ * SECTION:ostree-zstd-decompressor
+ * @title: zstd decompressor
+ *
+ * An implementation of #GConverter that decompresses a zstd frame,
+ * using the dictionary it was compressed with (if any).
+ */
+
+static void _ostree_zstd_decompressor_iface_init          (GConverterIface *iface);
+
+struct _OstreeZstdDecompressor
+{
+  GObject parent_instance;
+
+  GBytes *dictionary;
+  ZSTD_DCtx *dctx;
+  gboolean initialized;
+};
+
+G_DEFINE_TYPE_WITH_CODE (OstreeZstdDecompressor, _ostree_zstd_decompressor,
+                         G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER,
+                                                _ostree_zstd_decompressor_iface_init))
+
+static void
+_ostree_zstd_decompressor_finalize (GObject *object)
+{
+  OstreeZstdDecompressor *self = OSTREE_ZSTD_DECOMPRESSOR (object);
+
+  ZSTD_freeDCtx (self->dctx);
+  g_clear_pointer (&self->dictionary, (GDestroyNotify)g_bytes_unref);
+
+  G_OBJECT_CLASS (_ostree_zstd_decompressor_parent_class)->finalize (object);
+}
+
+static void
+_ostree_zstd_decompressor_init (OstreeZstdDecompressor *self)
+{
+}
+
+static void
+_ostree_zstd_decompressor_class_init (OstreeZstdDecompressorClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = _ostree_zstd_decompressor_finalize;
+}
+
+OstreeZstdDecompressor *
+_ostree_zstd_decompressor_new (GBytes *dictionary)
+{
+  OstreeZstdDecompressor *self = g_object_new (OSTREE_TYPE_ZSTD_DECOMPRESSOR, NULL);
+  self->dictionary = dictionary ? g_bytes_ref (dictionary) : NULL;
+  return self;
+}
+
+static void
+_ostree_zstd_decompressor_reset (GConverter *converter)
+{
+  OstreeZstdDecompressor *self = OSTREE_ZSTD_DECOMPRESSOR (converter);
+
+  if (self->initialized)
+    {
+      (void) ZSTD_DCtx_reset (self->dctx, ZSTD_reset_session_and_parameters);
+      self->initialized = FALSE;
+    }
+}
+
+static GConverterResult
+_ostree_zstd_decompressor_convert (GConverter *converter,
+                                   const void *inbuf,
+                                   gsize       inbuf_size,
+                                   void       *outbuf,
+                                   gsize       outbuf_size,
+                                   GConverterFlags flags,
+                                   gsize      *bytes_read,
+                                   gsize      *bytes_written,
+                                   GError    **error)
+{
+  OstreeZstdDecompressor *self = OSTREE_ZSTD_DECOMPRESSOR (converter);
+  size_t res;
+
+  if (inbuf_size != 0 && outbuf_size == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+         "Output buffer too small");
+      return G_CONVERTER_ERROR;
+    }
+
+  if (!self->initialized)
+    {
+      if (!self->dctx)
+        {
+          self->dctx = ZSTD_createDCtx ();
+          if (!self->dctx)
+            {
+              g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                   "Out of memory");
+              return G_CONVERTER_ERROR;
+            }
+        }
+
+      if (self->dictionary)
+        {
+          res = ZSTD_DCtx_loadDictionary (self->dctx,
+                                          g_bytes_get_data (self->dictionary, NULL),
+                                          g_bytes_get_size (self->dictionary));
+          if (ZSTD_isError (res))
+            return _ostree_zstd_return (res, error);
+        }
+      self->initialized = TRUE;
+    }
+
+  ZSTD_inBuffer in = { inbuf, inbuf_size, 0 };
+  ZSTD_outBuffer out = { outbuf, outbuf_size, 0 };
+
+  /* This returns 0 once the frame is complete and fully flushed */
+  res = ZSTD_decompressStream (self->dctx, &out, &in);
+  if (ZSTD_isError (res))
+    return _ostree_zstd_return (res, error);
+
+  *bytes_read = in.pos;
+  *bytes_written = out.pos;
+
+  if (res == 0)
+    return G_CONVERTER_FINISHED;
+  if (in.pos == 0 && out.pos == 0)
+    {
+      if (flags & G_CONVERTER_INPUT_AT_END)
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Truncated zstd stream");
+      else
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                             "Input buffer too small");
+      return G_CONVERTER_ERROR;
+    }
+  return G_CONVERTER_CONVERTED;
+}
+
+static void
+_ostree_zstd_decompressor_iface_init (GConverterIface *iface)
+{
+  iface->convert = _ostree_zstd_decompressor_convert;
+  iface->reset = _ostree_zstd_decompressor_reset;
+}
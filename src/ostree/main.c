@@ -101,6 +101,9 @@ static OstreeCommand commands[] = {
   { "remote", OSTREE_BUILTIN_FLAG_NO_REPO,
     ostree_builtin_remote,
     "Remote commands that may involve internet access" },
+  { "repack", OSTREE_BUILTIN_FLAG_NONE,
+    ostree_builtin_repack,
+    "Move loose objects into pack files" },
   { "reset", OSTREE_BUILTIN_FLAG_NONE,
     ostree_builtin_reset,
     "Reset a REF to a previous COMMIT" },
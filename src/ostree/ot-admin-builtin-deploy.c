@@ -43,6 +43,7 @@ static gboolean opt_kernel_proc_cmdline;
 static char *opt_osname;
 static char *opt_origin_path;
 static gboolean opt_kernel_arg_none;
+static int opt_checkout_threads;
 
 static GOptionEntry options[] = {
   { "os", 0, 0, G_OPTION_ARG_STRING, &opt_osname, "Use a different operating system root than the current one", "OSNAME" },
@@ -57,6 +58,7 @@ static GOptionEntry options[] = {
   { "karg", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_kernel_argv, "Set kernel argument, like root=/dev/sda1; this overrides any earlier argument with the same name", "NAME=VALUE" },
   { "karg-append", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_kernel_argv_append, "Append kernel argument; useful with e.g. console= that can be used multiple times", "NAME=VALUE" },
   { "karg-none", 0, 0, G_OPTION_ARG_NONE, &opt_kernel_arg_none, "Do not import kernel arguments", NULL },
+  { "checkout-threads", 0, 0, G_OPTION_ARG_INT, &opt_checkout_threads, "Check out the deployment tree using N threads (default: 1)", "N" },
   { NULL }
 };
 
@@ -167,21 +169,25 @@ ot_admin_builtin_deploy (int argc, char **argv, OstreeCommandInvocation *invocat
 
   g_autoptr(OstreeDeployment) new_deployment = NULL;
   g_auto(GStrv) kargs_strv = kargs ? ostree_kernel_args_to_strv (kargs) : NULL;
+  OstreeSysrootDeployTreeOpts deploy_opts = { .n_checkout_threads = opt_checkout_threads,
+                                              .override_kernel_argv = kargs_strv };
   if (opt_stage)
     {
       if (opt_retain_pending || opt_retain_rollback)
         return glnx_throw (error, "--stage cannot currently be combined with --retain arguments");
       if (opt_not_as_default)
         return glnx_throw (error, "--stage cannot currently be combined with --not-as-default");
-      if (!ostree_sysroot_stage_tree (sysroot, opt_osname, revision, origin, merge_deployment,
-                                      kargs_strv, &new_deployment, cancellable, error))
+      if (!ostree_sysroot_stage_tree_with_options (sysroot, opt_osname, revision, origin,
+                                                   merge_deployment, &deploy_opts,
+                                                   &new_deployment, cancellable, error))
         return FALSE;
       g_assert (new_deployment);
     }
   else
     {
-      if (!ostree_sysroot_deploy_tree (sysroot, opt_osname, revision, origin, merge_deployment,
-                                       kargs_strv, &new_deployment, cancellable, error))
+      if (!ostree_sysroot_deploy_tree_with_options (sysroot, opt_osname, revision, origin,
+                                                    merge_deployment, &deploy_opts,
+                                                    &new_deployment, cancellable, error))
         return FALSE;
       g_assert (new_deployment);
 
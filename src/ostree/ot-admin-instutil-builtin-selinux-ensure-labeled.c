@@ -27,150 +27,13 @@
 
 #include "otutil.h"
 
-static char *
-ptrarray_path_join (GPtrArray  *path)
+static void
+print_relabeled (OstreeSePolicy *sepolicy,
+                 const char     *path,
+                 const char     *new_label,
+                 gpointer        user_data)
 {
-  GString *path_buf;
-
-  path_buf = g_string_new ("");
-
-  if (path->len == 0)
-    g_string_append_c (path_buf, '/');
-  else
-    {
-      guint i;
-      for (i = 0; i < path->len; i++)
-        {
-          const char *elt = path->pdata[i];
-
-          g_string_append_c (path_buf, '/');
-          g_string_append (path_buf, elt);
-        }
-    }
-
-  return g_string_free (path_buf, FALSE);
-}
-
-static gboolean
-relabel_one_path (OstreeSePolicy *sepolicy,
-                  GFile          *path,
-                  GFileInfo      *info,
-                  GPtrArray      *path_parts,
-                  GCancellable   *cancellable,
-                  GError        **error)
-{
-  gboolean ret = FALSE;
-  g_autofree char *relpath = NULL;
-  g_autofree char *new_label = NULL;
-
-  relpath = ptrarray_path_join (path_parts);
-  if (!ostree_sepolicy_restorecon (sepolicy, relpath,
-                                   info, path,
-                                   OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL |
-                                   OSTREE_SEPOLICY_RESTORECON_FLAGS_KEEP_EXISTING,
-                                   &new_label,
-                                   cancellable, error))
-    {
-      g_prefix_error (error, "Setting context of %s: ", gs_file_get_path_cached (path));
-      goto out;
-    }
-
-  if (new_label)
-    g_print ("Set label of '%s' (as '%s') to '%s'\n",
-             gs_file_get_path_cached (path),
-             relpath,
-             new_label);
-
-  ret = TRUE;
- out:
-  return ret;
-}
-
-static gboolean
-relabel_recursively (OstreeSePolicy *sepolicy,
-                     GFile          *dir,
-                     GFileInfo      *dir_info,
-                     GPtrArray      *path_parts,
-                     GCancellable   *cancellable,
-                     GError        **error)
-{
-  gboolean ret = FALSE;
-  g_autoptr(GFileEnumerator) direnum = NULL;
-
-  if (!relabel_one_path (sepolicy, dir, dir_info, path_parts,
-                         cancellable, error))
-    goto out;
-
-  direnum = g_file_enumerate_children (dir, OSTREE_GIO_FAST_QUERYINFO,
-                                       G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                       cancellable, error);
-  if (!direnum)
-    goto out;
-  
-  while (TRUE)
-    {
-      GFileInfo *file_info;
-      GFile *child;
-      GFileType ftype;
-
-      if (!g_file_enumerator_iterate (direnum, &file_info, &child,
-                                      cancellable, error))
-        goto out;
-      if (file_info == NULL)
-        break;
-
-      g_ptr_array_add (path_parts, (char*)g_file_info_get_name (file_info));
-
-      ftype = g_file_info_get_file_type (file_info);
-      if (ftype == G_FILE_TYPE_DIRECTORY)
-        {
-          if (!relabel_recursively (sepolicy, child, file_info, path_parts,
-                                    cancellable, error))
-            goto out;
-        }
-      else
-        {
-          if (!relabel_one_path (sepolicy, child, file_info, path_parts,
-                                 cancellable, error))
-            goto out;
-        }
-
-      g_ptr_array_remove_index (path_parts, path_parts->len - 1);
-    }
-
-  ret = TRUE;
- out:
-  return ret;
-}
-
-static gboolean
-selinux_relabel_dir (OstreeSePolicy                *sepolicy,
-                     GFile                         *dir,
-                     const char                    *prefix,
-                     GCancellable                  *cancellable,
-                     GError                       **error)
-{
-  gboolean ret = FALSE;
-  g_autoptr(GPtrArray) path_parts = g_ptr_array_new ();
-  g_autoptr(GFileInfo) root_info = NULL;
-
-  root_info = g_file_query_info (dir, OSTREE_GIO_FAST_QUERYINFO,
-                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                 cancellable, error);
-  if (!root_info)
-    goto out;
-  
-  g_ptr_array_add (path_parts, (char*)prefix);
-  if (!relabel_recursively (sepolicy, dir, root_info, path_parts,
-                            cancellable, error))
-    {
-      g_prefix_error (error, "Relabeling /%s: ", prefix);
-      goto out;
-    }
-
-  ret = TRUE;
- out:
-  return ret;
+  g_print ("Set label of '%s' to '%s'\n", path, new_label);
 }
 
 static GOptionEntry options[] = {
@@ -182,7 +45,7 @@ ot_admin_instutil_builtin_selinux_ensure_labeled (int argc, char **argv, OstreeC
 {
   gboolean ret = FALSE;
   const char *policy_name;
-  g_autoptr(GFile) subpath = NULL;
+  const char *subpath = NULL;
   const char *prefix = NULL;
   g_autoptr(OstreeSePolicy) sepolicy = NULL;
   g_autoptr(GPtrArray) deployments = NULL;
@@ -210,12 +73,12 @@ ot_admin_instutil_builtin_selinux_ensure_labeled (int argc, char **argv, OstreeC
 
   if (argc >= 2)
     {
-      subpath = g_file_new_for_path (argv[1]);
+      subpath = argv[1];
       prefix = argv[2];
     }
   else
     {
-      subpath = g_object_ref (deployment_path);
+      subpath = gs_file_get_path_cached (deployment_path);
       prefix = "";
     }
 
@@ -226,10 +89,18 @@ ot_admin_instutil_builtin_selinux_ensure_labeled (int argc, char **argv, OstreeC
   policy_name = ostree_sepolicy_get_name (sepolicy);
   if (policy_name)
     {
+      g_autofree char *path = g_strconcat ("/", prefix, NULL);
+
       g_print ("Relabeling using policy '%s'\n", policy_name);
-      if (!selinux_relabel_dir (sepolicy, subpath, prefix,
-                                cancellable, error))
-        goto out;
+      if (!ostree_sepolicy_restorecon_recursive_at (sepolicy, AT_FDCWD, subpath, path,
+                                                    OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL |
+                                                    OSTREE_SEPOLICY_RESTORECON_FLAGS_KEEP_EXISTING,
+                                                    0, print_relabeled, NULL,
+                                                    cancellable, error))
+        {
+          g_prefix_error (error, "Relabeling %s: ", path);
+          goto out;
+        }
     }
   else
     g_print ("No SELinux policy found in deployment '%s'\n",
@@ -45,10 +45,12 @@ static gboolean opt_disable_fsync;
 static gboolean opt_require_hardlinks;
 static gboolean opt_force_copy;
 static gboolean opt_force_copy_zerosized;
+static gboolean opt_reflink;
 static gboolean opt_bareuseronly_dirs;
 static char *opt_skiplist_file;
 static char *opt_selinux_policy;
 static char *opt_selinux_prefix;
+static int opt_threads = 1;
 
 static gboolean
 parse_fsync_cb (const char  *option_name,
@@ -86,10 +88,12 @@ static GOptionEntry options[] = {
   { "require-hardlinks", 'H', 0, G_OPTION_ARG_NONE, &opt_require_hardlinks, "Do not fall back to full copies if hardlinking fails", NULL },
   { "force-copy-zerosized", 'z', 0, G_OPTION_ARG_NONE, &opt_force_copy_zerosized, "Do not hardlink zero-sized files", NULL },
   { "force-copy", 'C', 0, G_OPTION_ARG_NONE, &opt_force_copy, "Never hardlink (but may reflink if available)", NULL },
+  { "reflink", 0, 0, G_OPTION_ARG_NONE, &opt_reflink, "Clone file data where the filesystem supports it, otherwise copy; implies --force-copy", NULL },
   { "bareuseronly-dirs", 'M', 0, G_OPTION_ARG_NONE, &opt_bareuseronly_dirs, "Suppress mode bits outside of 0775 for directories (suid, world writable, etc.)", NULL },
   { "skip-list", 0, 0, G_OPTION_ARG_FILENAME, &opt_skiplist_file, "File containing list of files to skip", "PATH" },
   { "selinux-policy", 0, 0, G_OPTION_ARG_FILENAME, &opt_selinux_policy, "Set SELinux labels based on policy in root filesystem PATH (may be /); implies --force-copy", "PATH" },
   { "selinux-prefix", 0, 0, G_OPTION_ARG_STRING, &opt_selinux_prefix, "When setting SELinux labels, prefix all paths by PREFIX", "PREFIX" },
+  { "threads", 0, 0, G_OPTION_ARG_INT, &opt_threads, "Check out directories in parallel using N threads (default: 1)", "N" },
   { NULL }
 };
 
@@ -131,14 +135,15 @@ process_one_checkout (OstreeRepo           *repo,
    * convenient infrastructure for testing C APIs with data.
    */
   if (opt_disable_cache || opt_whiteouts || opt_require_hardlinks ||
-      opt_union_add || opt_force_copy || opt_force_copy_zerosized ||
+      opt_union_add || opt_force_copy || opt_force_copy_zerosized || opt_reflink ||
       opt_bareuseronly_dirs || opt_union_identical ||
-      opt_skiplist_file || opt_selinux_policy || opt_selinux_prefix)
+      opt_skiplist_file || opt_selinux_policy || opt_selinux_prefix ||
+      opt_threads > 1)
     {
       OstreeRepoCheckoutAtOptions options = { 0, };
 
       /* do this early so option checking also catches force copy conflicts */
-      if (opt_selinux_policy)
+      if (opt_selinux_policy || opt_reflink)
         opt_force_copy = TRUE;
 
       if (opt_user_mode)
@@ -221,7 +226,11 @@ process_one_checkout (OstreeRepo           *repo,
       options.no_copy_fallback = opt_require_hardlinks;
       options.force_copy = opt_force_copy;
       options.force_copy_zerosized = opt_force_copy_zerosized;
+      options.reflink = opt_reflink;
+      /* Reflink checkouts of archive repos clone from the cache */
+      options.enable_uncompressed_cache = opt_reflink && !opt_disable_cache;
       options.bareuseronly_dirs = opt_bareuseronly_dirs;
+      options.n_threads = opt_threads;
 
       if (!ostree_repo_checkout_at (repo, &options,
                                     AT_FDCWD, destination,
@@ -364,6 +373,12 @@ ostree_builtin_checkout (int argc, char **argv, OstreeCommandInvocation *invocat
   if (!ostree_option_context_parse (context, options, &argc, &argv, invocation, &repo, cancellable, error))
     goto out;
 
+  if (opt_threads < 1)
+    {
+      glnx_throw (error, "Invalid number of threads: %d", opt_threads);
+      goto out;
+    }
+
   if (opt_disable_fsync)
     ostree_repo_set_disable_fsync (repo, TRUE);
 
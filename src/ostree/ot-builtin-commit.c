@@ -65,6 +65,7 @@ static char *opt_gpg_homedir;
 static gboolean opt_generate_sizes;
 static gboolean opt_disable_fsync;
 static char *opt_timestamp;
+static int opt_threads;
 
 static gboolean
 parse_fsync_cb (const char  *option_name,
@@ -120,6 +121,7 @@ static GOptionEntry options[] = {
   { "disable-fsync", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &opt_disable_fsync, "Do not invoke fsync()", NULL },
   { "fsync", 0, 0, G_OPTION_ARG_CALLBACK, parse_fsync_cb, "Specify how to invoke fsync()", "POLICY" },
   { "timestamp", 0, 0, G_OPTION_ARG_STRING, &opt_timestamp, "Override the timestamp of the commit", "TIMESTAMP" },
+  { "threads", 0, 0, G_OPTION_ARG_INT, &opt_threads, "Read and checksum files using N threads", "N" },
   { NULL }
 };
 
@@ -553,7 +555,8 @@ ostree_builtin_commit (int argc, char **argv, OstreeCommandInvocation *invocatio
       || opt_statoverride_file != NULL
       || opt_skiplist_file != NULL
       || opt_no_xattrs
-      || opt_selinux_policy)
+      || opt_selinux_policy
+      || opt_threads > 1)
     {
       filter_data.mode_adds = mode_adds;
       filter_data.skip_list = skip_list;
@@ -572,6 +575,8 @@ ostree_builtin_commit (int argc, char **argv, OstreeCommandInvocation *invocatio
             goto out;
           ostree_repo_commit_modifier_set_sepolicy (modifier, policy);
         }
+      if (opt_threads > 1)
+        ostree_repo_commit_modifier_set_n_threads (modifier, opt_threads);
     }
 
   if (opt_editor)
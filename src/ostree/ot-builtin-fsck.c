@@ -35,6 +35,8 @@ static gboolean opt_all;
 static gboolean opt_add_tombstones;
 static gboolean opt_verify_bindings;
 static gboolean opt_verify_back_refs;
+static gboolean opt_rebuild_object_index;
+static int opt_jobs = 1;
 
 /* ATTENTION:
  * Please remember to update the bash-completion script (bash/ostree) and
@@ -48,88 +50,85 @@ static GOptionEntry options[] = {
   { "delete", 0, 0, G_OPTION_ARG_NONE, &opt_delete, "Remove corrupted objects", NULL },
   { "verify-bindings", 0, 0, G_OPTION_ARG_NONE, &opt_verify_bindings, "Verify ref bindings", NULL },
   { "verify-back-refs", 0, 0, G_OPTION_ARG_NONE, &opt_verify_back_refs, "Verify back-references (implies --verify-bindings)", NULL },
+  { "rebuild-object-index", 0, 0, G_OPTION_ARG_NONE, &opt_rebuild_object_index, "Rebuild the object index after verifying the repository", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Verify objects using N threads (0 for one per CPU)", "N" },
   { NULL }
 };
 
+/* Report @failure, the result of verifying an object; @parent_commits are
+ * the commits containing it, if known.  Depending on the options, this
+ * deletes the object and marks those commits partial. */
 static gboolean
-fsck_one_object (OstreeRepo            *repo,
-                 const char            *checksum,
-                 OstreeObjectType       objtype,
-                 GHashTable            *object_parents,
-                 GVariant              *key,
-                 gboolean              *out_found_corruption,
-                 GCancellable          *cancellable,
-                 GError               **error)
+fsck_handle_failure (OstreeRepo            *repo,
+                     const char            *checksum,
+                     OstreeObjectType       objtype,
+                     char                 **parent_commits,
+                     const GError          *failure,
+                     gboolean              *out_found_corruption,
+                     GCancellable          *cancellable,
+                     GError               **error)
 {
-  g_autoptr(GError) temp_error = NULL;
-  if (!ostree_repo_fsck_object (repo, objtype, checksum, cancellable, &temp_error))
+  gboolean object_missing = FALSE;
+  g_autofree char *parent_commits_str = NULL;
+
+  if (parent_commits)
+    parent_commits_str = g_strjoinv (", ", parent_commits);
+
+  if (g_error_matches (failure, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
     {
-      gboolean object_missing = FALSE;
-      g_auto(GStrv) parent_commits = NULL;
-      g_autofree char *parent_commits_str = NULL;
+      if (parent_commits_str)
+        g_printerr ("Object missing in commits %s: %s.%s\n", parent_commits_str, checksum,
+                    ostree_object_type_to_string (objtype));
+      else
+        g_printerr ("Object missing: %s.%s\n", checksum,
+                    ostree_object_type_to_string (objtype));
+      object_missing = TRUE;
+    }
+  else
+    {
+      g_autoptr(GError) temp_error = g_error_copy (failure);
+      if (parent_commits_str)
+        g_prefix_error (&temp_error, "In commits %s: ", parent_commits_str);
 
-      if (object_parents)
+      if (opt_delete)
         {
-          parent_commits = ostree_repo_traverse_parents_get_commits (object_parents, key);
-          parent_commits_str = g_strjoinv (", ", parent_commits);
+          g_printerr ("%s\n", temp_error->message);
+          (void) ostree_repo_delete_object (repo, objtype, checksum, cancellable, NULL);
+          object_missing = TRUE;
         }
-
-      if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+      else if (opt_all)
         {
-          g_clear_error (&temp_error);
-          if (parent_commits_str)
-            g_printerr ("Object missing in commits %s: %s.%s\n", parent_commits_str, checksum,
-                        ostree_object_type_to_string (objtype));
-          else
-            g_printerr ("Object missing: %s.%s\n", checksum,
-                        ostree_object_type_to_string (objtype));
-          object_missing = TRUE;
+          *out_found_corruption = TRUE;
+          g_printerr ("%s\n", temp_error->message);
         }
       else
         {
-          if (parent_commits_str)
-            g_prefix_error (&temp_error, "In commits %s: ", parent_commits_str);
-
-          if (opt_delete)
-            {
-              g_printerr ("%s\n", temp_error->message);
-              (void) ostree_repo_delete_object (repo, objtype, checksum, cancellable, NULL);
-              object_missing = TRUE;
-            }
-          else if (opt_all)
-            {
-              *out_found_corruption = TRUE;
-              g_printerr ("%s\n", temp_error->message);
-            }
-          else
-            {
-              g_propagate_error (error, g_steal_pointer (&temp_error));
-              return FALSE;
-            }
+          g_propagate_error (error, g_steal_pointer (&temp_error));
+          return FALSE;
         }
+    }
 
-      if (object_missing)
+  if (object_missing)
+    {
+      *out_found_corruption = TRUE;
+
+      if (parent_commits != NULL && objtype != OSTREE_OBJECT_TYPE_COMMIT)
         {
-          *out_found_corruption = TRUE;
+          int i;
 
-          if (parent_commits != NULL && objtype != OSTREE_OBJECT_TYPE_COMMIT)
+          /* The commit was missing or deleted, mark the commit partial */
+          for (i = 0; parent_commits[i] != NULL; i++)
             {
-              int i;
-
-              /* The commit was missing or deleted, mark the commit partial */
-              for (i = 0; parent_commits[i] != NULL; i++)
+              const char *parent_commit = parent_commits[i];
+              OstreeRepoCommitState state;
+              if (!ostree_repo_load_commit (repo, parent_commit, NULL,
+                                            &state, error))
+                return FALSE;
+              if ((state & OSTREE_REPO_COMMIT_STATE_PARTIAL) == 0)
                 {
-                  const char *parent_commit = parent_commits[i];
-                  OstreeRepoCommitState state;
-                  if (!ostree_repo_load_commit (repo, parent_commit, NULL,
-                                                &state, error))
+                  g_printerr ("Marking commit as partial: %s\n", parent_commit);
+                  if (!ostree_repo_mark_commit_partial (repo, parent_commit, TRUE, error))
                     return FALSE;
-                  if ((state & OSTREE_REPO_COMMIT_STATE_PARTIAL) == 0)
-                    {
-                      g_printerr ("Marking commit as partial: %s\n", parent_commit);
-                      if (!ostree_repo_mark_commit_partial (repo, parent_commit, TRUE, error))
-                        return FALSE;
-                    }
                 }
             }
         }
@@ -138,6 +137,43 @@ fsck_one_object (OstreeRepo            *repo,
   return TRUE;
 }
 
+static gboolean
+fsck_one_object (OstreeRepo            *repo,
+                 const char            *checksum,
+                 OstreeObjectType       objtype,
+                 gboolean              *out_found_corruption,
+                 GCancellable          *cancellable,
+                 GError               **error)
+{
+  g_autoptr(GError) temp_error = NULL;
+  if (!ostree_repo_fsck_object (repo, objtype, checksum, cancellable, &temp_error))
+    return fsck_handle_failure (repo, checksum, objtype, NULL, temp_error,
+                                out_found_corruption, cancellable, error);
+
+  return TRUE;
+}
+
+static void
+fsck_progress_changed (OstreeAsyncProgress *progress,
+                       gpointer             user_data)
+{
+  guint objects_checked, objects_total;
+  guint64 bytes_per_second, seconds_remaining;
+
+  ostree_async_progress_get (progress,
+                             "objects-checked", "u", &objects_checked,
+                             "objects-total", "u", &objects_total,
+                             "bytes-per-second", "t", &bytes_per_second,
+                             "seconds-remaining", "t", &seconds_remaining,
+                             NULL);
+
+  g_autofree char *formatted_rate = g_format_size (bytes_per_second);
+  g_autofree char *text =
+    g_strdup_printf ("fsck objects %s/s %" G_GUINT64_FORMAT ":%02u remaining",
+                     formatted_rate, seconds_remaining / 60, (guint) (seconds_remaining % 60));
+  glnx_console_progress_n_items (text, objects_checked, objects_total);
+}
+
 static gboolean
 fsck_reachable_objects_from_commits (OstreeRepo            *repo,
                                      GHashTable            *commits,
@@ -145,15 +181,9 @@ fsck_reachable_objects_from_commits (OstreeRepo            *repo,
                                      GCancellable          *cancellable,
                                      GError               **error)
 {
-  g_autoptr(GHashTable) reachable_objects = ostree_repo_traverse_new_reachable ();
-  g_autoptr(GHashTable) object_parents = ostree_repo_traverse_new_parents ();
-
-  GHashTableIter hash_iter;
-  gpointer key, value;
-  g_hash_table_iter_init (&hash_iter, commits);
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+  g_autoptr(GPtrArray) commit_checksums = g_ptr_array_new ();
+  GLNX_HASH_TABLE_FOREACH (commits, GVariant*, serialized_key)
     {
-      GVariant *serialized_key = key;
       const char *checksum;
       OstreeObjectType objtype;
 
@@ -161,32 +191,59 @@ fsck_reachable_objects_from_commits (OstreeRepo            *repo,
 
       g_assert (objtype == OSTREE_OBJECT_TYPE_COMMIT);
 
-      if (!ostree_repo_traverse_commit_union_with_parents (repo, checksum, 0, reachable_objects, object_parents,
+      g_ptr_array_add (commit_checksums, (char*)checksum);
+    }
+  g_ptr_array_add (commit_checksums, NULL);
+
+  g_autoptr(GHashTable) reachable_objects = ostree_repo_traverse_new_reachable ();
+  if (!ostree_repo_traverse_commit_union_parallel (repo, (const char * const *)commit_checksums->pdata,
+                                                   0, reachable_objects, opt_jobs,
+                                                   cancellable, error))
+    return FALSE;
+
+  OstreeRepoFsckObjectsFlags flags = OSTREE_REPO_FSCK_OBJECTS_FLAGS_NONE;
+  if (!opt_all && !opt_delete)
+    flags |= OSTREE_REPO_FSCK_OBJECTS_FLAGS_STOP_ON_CORRUPTION;
+
+  g_autoptr(GHashTable) failures = NULL;
+  { g_auto(GLnxConsoleRef) console = { 0, };
+    glnx_console_lock (&console);
+
+    g_autoptr(OstreeAsyncProgress) progress =
+      ostree_async_progress_new_and_connect (fsck_progress_changed, NULL);
+    if (!ostree_repo_fsck_objects (repo, reachable_objects, flags, opt_jobs, progress,
+                                   &failures, cancellable, error))
+      return FALSE;
+    ostree_async_progress_finish (progress);
+  }
+
+  if (g_hash_table_size (failures) == 0)
+    return TRUE;
+
+  /* Only now work out which commits contain the objects which failed, since
+   * the map takes a lot of memory for large repositories. */
+  g_hash_table_remove_all (reachable_objects);
+  g_autoptr(GHashTable) object_parents = ostree_repo_traverse_new_parents ();
+  for (guint i = 0; i < commit_checksums->len - 1; i++)
+    {
+      if (!ostree_repo_traverse_commit_union_with_parents (repo, commit_checksums->pdata[i], 0,
+                                                           reachable_objects, object_parents,
                                                            cancellable, error))
         return FALSE;
     }
 
-  g_auto(GLnxConsoleRef) console = { 0, };
-  glnx_console_lock (&console);
-
-  const guint count = g_hash_table_size (reachable_objects);
-  guint i = 0;
-  g_hash_table_iter_init (&hash_iter, reachable_objects);
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+  GLNX_HASH_TABLE_FOREACH_KV (failures, GVariant*, serialized_key, const GError*, failure)
     {
-      GVariant *serialized_key = key;
       const char *checksum;
       OstreeObjectType objtype;
 
       ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
 
-      if (!fsck_one_object (repo, checksum, objtype,
-                            object_parents, serialized_key,
-                            out_found_corruption, cancellable, error))
+      g_auto(GStrv) parent_commits =
+        ostree_repo_traverse_parents_get_commits (object_parents, serialized_key);
+      if (!fsck_handle_failure (repo, checksum, objtype, parent_commits, failure,
+                                out_found_corruption, cancellable, error))
         return FALSE;
-
-      i++;
-      glnx_console_progress_n_items ("fsck objects", i, count);
     }
 
   return TRUE;
@@ -204,8 +261,7 @@ fsck_commit_for_ref (OstreeRepo    *repo,
                      GError       **error)
 {
   if (!fsck_one_object (repo, checksum, OSTREE_OBJECT_TYPE_COMMIT,
-                        NULL, NULL, found_corruption,
-                        cancellable, error))
+                        found_corruption, cancellable, error))
     return FALSE;
 
   /* Check the commit exists. */
@@ -240,6 +296,9 @@ ostree_builtin_fsck (int argc, char **argv, OstreeCommandInvocation *invocation,
   if (!ostree_option_context_parse (context, options, &argc, &argv, invocation, &repo, cancellable, error))
     return FALSE;
 
+  if (opt_jobs < 0)
+    return glnx_throw (error, "Invalid number of jobs: %d", opt_jobs);
+
   if (!opt_quiet)
     g_print ("Validating refs...\n");
 
@@ -450,5 +509,13 @@ ostree_builtin_fsck (int argc, char **argv, OstreeCommandInvocation *invocation,
   if (found_corruption)
     return glnx_throw (error, "Repository corruption encountered");
 
+  if (opt_rebuild_object_index)
+    {
+      if (!opt_quiet)
+        g_print ("Rebuilding object index...\n");
+      if (!ostree_repo_regenerate_object_index (repo, cancellable, error))
+        return FALSE;
+    }
+
   return TRUE;
 }
@@ -36,7 +36,7 @@ static char *opt_collection_id = NULL;
  */
 
 static GOptionEntry options[] = {
-  { "mode", 0, 0, G_OPTION_ARG_STRING, &opt_mode, "Initialize repository in given mode (bare, bare-user, bare-user-only, archive)", NULL },
+  { "mode", 0, 0, G_OPTION_ARG_STRING, &opt_mode, "Initialize repository in given mode (bare, bare-user, bare-user-only, archive, archive-zstd)", NULL },
   { "collection-id", 0, 0, G_OPTION_ARG_STRING, &opt_collection_id,
     "Globally unique ID for this repository as an collection of refs for redistribution to other repositories", "COLLECTION-ID" },
   { NULL }
@@ -55,6 +55,25 @@ ostree_builtin_init (int argc, char **argv,OstreeCommandInvocation *invocation,
   if (!ostree_option_context_parse (context, options, &argc, &argv, invocation, &repo, cancellable, error))
     goto out;
 
+  /* Like archive, but stored with its own mode name; see ostree_repo_create_at() */
+  if (g_str_equal (opt_mode, "archive-zstd"))
+    {
+      g_autoptr(GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
+      g_variant_builder_add (builder, "{s@v}", "archive-compression",
+                             g_variant_new_variant (g_variant_new_string ("zstd")));
+      if (opt_collection_id)
+        g_variant_builder_add (builder, "{s@v}", "collection-id",
+                               g_variant_new_variant (g_variant_new_string (opt_collection_id)));
+      g_autoptr(GVariant) create_opts = g_variant_ref_sink (g_variant_builder_end (builder));
+      g_autoptr(OstreeRepo) new_repo =
+        ostree_repo_create_at (AT_FDCWD, gs_file_get_path_cached (ostree_repo_get_path (repo)),
+                               OSTREE_REPO_MODE_ARCHIVE, create_opts, cancellable, error);
+      if (!new_repo)
+        goto out;
+      ret = TRUE;
+      goto out;
+    }
+
   if (!ostree_repo_mode_from_string (opt_mode, &mode, error))
     goto out;
   if (!ostree_repo_set_collection_id (repo, opt_collection_id, error))
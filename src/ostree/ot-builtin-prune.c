@@ -33,6 +33,7 @@ static gboolean opt_no_prune;
 static gboolean opt_static_deltas_only;
 static gint opt_depth = -1;
 static gboolean opt_refs_only;
+static gboolean opt_incremental;
 static char *opt_delete_commit;
 static char *opt_keep_younger_than;
 static char **opt_retain_branch_depth;
@@ -46,6 +47,7 @@ static char **opt_only_branches;
 static GOptionEntry options[] = {
   { "no-prune", 0, 0, G_OPTION_ARG_NONE, &opt_no_prune, "Only display unreachable objects; don't delete", NULL },
   { "refs-only", 0, 0, G_OPTION_ARG_NONE, &opt_refs_only, "Only compute reachability via refs", NULL },
+  { "incremental", 0, 0, G_OPTION_ARG_NONE, &opt_incremental, "Only visit commits which became unreachable since the last incremental prune (requires --refs-only)", NULL },
   { "depth", 0, 0, G_OPTION_ARG_INT, &opt_depth, "Only traverse DEPTH parents for each commit (default: -1=infinite)", "DEPTH" },
   { "delete-commit", 0, 0, G_OPTION_ARG_STRING, &opt_delete_commit, "Specify a commit to delete", "COMMIT" },
   { "keep-younger-than", 0, 0, G_OPTION_ARG_STRING, &opt_keep_younger_than, "Prune all commits older than the specified date", "DATE" },
@@ -185,6 +187,14 @@ ostree_builtin_prune (int argc, char **argv, OstreeCommandInvocation *invocation
     pruneflags |= OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY;
   if (opt_no_prune)
     pruneflags |= OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE;
+  if (opt_incremental)
+    {
+      if (!opt_refs_only)
+        return glnx_throw (error, "--incremental requires --refs-only");
+      if (opt_retain_branch_depth || opt_keep_younger_than || opt_only_branches)
+        return glnx_throw (error, "--incremental cannot be combined with --retain-branch-depth, --keep-younger-than or --only-branch");
+      pruneflags |= OSTREE_REPO_PRUNE_FLAGS_INCREMENTAL;
+    }
 
   /* If no newer more complex options are specified, drop down to the original
    * prune API - both to avoid code duplication, and to keep it run from the
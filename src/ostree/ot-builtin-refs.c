@@ -33,6 +33,7 @@ static gboolean opt_alias;
 static char *opt_create;
 static gboolean opt_collections;
 static gboolean opt_force;
+static gboolean opt_pack;
 
 /* ATTENTION:
  * Please remember to update the bash-completion script (bash/ostree) and
@@ -46,6 +47,7 @@ static GOptionEntry options[] = {
   { "create", 0, 0, G_OPTION_ARG_STRING, &opt_create, "Create a new ref for an existing commit", "NEWREF" },
   { "collections", 'c', 0, G_OPTION_ARG_NONE, &opt_collections, "Enable listing collection IDs for refs", NULL },
   { "force", 0, 0, G_OPTION_ARG_NONE, &opt_force, "Overwrite existing refs when creating", NULL },
+  { "pack", 0, 0, G_OPTION_ARG_NONE, &opt_pack, "Move refs into the packed-refs file", NULL },
   { NULL }
 };
 
@@ -289,7 +291,19 @@ ostree_builtin_refs (int argc, char **argv, OstreeCommandInvocation *invocation,
   if (!ostree_option_context_parse (context, options, &argc, &argv, invocation, &repo, cancellable, error))
     goto out;
 
-  if (argc >= 2)
+  if (opt_pack)
+    {
+      if (argc >= 2 || opt_delete || opt_create || opt_alias || opt_list || opt_collections)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "--pack takes no other options or arguments");
+          goto out;
+        }
+
+      if (!ostree_repo_pack_refs (repo, cancellable, error))
+        goto out;
+    }
+  else if (argc >= 2)
     {
       if (opt_create && argc > 2)
         {
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ot-main.h"
+#include "ot-builtins.h"
+#include "ostree.h"
+#include "otutil.h"
+
+static gint64 opt_max_object_size;
+
+/* ATTENTION:
+ * Please remember to update the bash-completion script (bash/ostree) and
+ * man page (man/ostree-repack.xml) when changing the option list.
+ */
+
+static GOptionEntry options[] = {
+  { "max-object-size", 0, 0, G_OPTION_ARG_INT64, &opt_max_object_size, "Leave objects larger than SIZE bytes loose", "SIZE" },
+  { NULL }
+};
+
+gboolean
+ostree_builtin_repack (int argc, char **argv, OstreeCommandInvocation *invocation, GCancellable *cancellable, GError **error)
+{
+  g_autoptr(GOptionContext) context = g_option_context_new ("");
+  g_autoptr(OstreeRepo) repo = NULL;
+  if (!ostree_option_context_parse (context, options, &argc, &argv, invocation, &repo, cancellable, error))
+    return FALSE;
+
+  if (!ostree_ensure_repo_writable (repo, error))
+    return FALSE;
+
+  if (opt_max_object_size < 0)
+    return glnx_throw (error, "Invalid --max-object-size %" G_GINT64_FORMAT, opt_max_object_size);
+
+  g_auto(GVariantBuilder) builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  if (opt_max_object_size > 0)
+    g_variant_builder_add (&builder, "{sv}", "max-object-size",
+                           g_variant_new_uint64 (opt_max_object_size));
+  g_autoptr(GVariant) opts = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  guint n_packed = 0;
+  guint64 pack_size = 0;
+  if (!ostree_repo_repack (repo, opts, &n_packed, &pack_size, cancellable, error))
+    return FALSE;
+
+  if (n_packed == 0)
+    g_print ("No loose objects to pack\n");
+  else
+    {
+      g_autofree char *formatted_size = g_format_size_full (pack_size, 0);
+      g_print ("Packed %u objects, %s\n", n_packed, formatted_size);
+    }
+
+  return TRUE;
+}
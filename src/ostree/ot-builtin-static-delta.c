@@ -40,6 +40,9 @@ static gboolean opt_swap_endianness;
 static gboolean opt_inline;
 static gboolean opt_disable_bsdiff;
 static gboolean opt_if_not_exists;
+static int opt_jobs = 1;
+static char *opt_compression;
+static gboolean opt_zstd_dictionary;
 
 #define BUILTINPROTO(name) static gboolean ot_static_delta_builtin_ ## name (int argc, char **argv, OstreeCommandInvocation *invocation, GCancellable *cancellable, GError **error)
 
@@ -88,6 +91,9 @@ static GOptionEntry generate_options[] = {
   { "max-bsdiff-size", 0, 0, G_OPTION_ARG_STRING, &opt_max_bsdiff_size, "Maximum size in megabytes to consider bsdiff compression for input files", NULL},
   { "max-chunk-size", 0, 0, G_OPTION_ARG_STRING, &opt_max_chunk_size, "Maximum size of delta chunks in megabytes", NULL},
   { "filename", 0, 0, G_OPTION_ARG_FILENAME, &opt_filename, "Write the delta content to PATH (a directory).  If not specified, the OSTree repository is used", "PATH"},
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Use N threads (0 for one per CPU)", "N"},
+  { "compression", 0, 0, G_OPTION_ARG_STRING, &opt_compression, "Compress delta parts with TYPE ('lzma', 'zstd' or 'none'); default 'lzma'", "TYPE"},
+  { "zstd-dictionary", 0, 0, G_OPTION_ARG_NONE, &opt_zstd_dictionary, "Train a dictionary for zstd compression on the source commit", NULL},
   { NULL }
 };
 
@@ -230,6 +236,9 @@ ot_static_delta_builtin_generate (int argc, char **argv, OstreeCommandInvocation
 
       g_assert (opt_to_rev);
 
+      if (opt_jobs < 0)
+        return glnx_throw (error, "Invalid number of jobs: %d", opt_jobs);
+
       if (opt_empty)
         {
           if (opt_from_rev)
@@ -271,6 +280,19 @@ ot_static_delta_builtin_generate (int argc, char **argv, OstreeCommandInvocation
             }
         }
 
+      guint8 compression = 'x';
+      if (opt_compression)
+        {
+          if (strcmp (opt_compression, "lzma") == 0)
+            compression = 'x';
+          else if (strcmp (opt_compression, "zstd") == 0)
+            compression = 'z';
+          else if (strcmp (opt_compression, "none") == 0)
+            compression = 0;
+          else
+            return glnx_throw (error, "Invalid compression '%s'", opt_compression);
+        }
+
       if (opt_endianness)
         {
           if (strcmp (opt_endianness, "l") == 0)
@@ -321,6 +343,15 @@ ot_static_delta_builtin_generate (int argc, char **argv, OstreeCommandInvocation
       if (opt_filename)
         g_variant_builder_add (parambuilder, "{sv}",
                                "filename", g_variant_new_bytestring (opt_filename));
+      if (opt_jobs != 1)
+        g_variant_builder_add (parambuilder, "{sv}",
+                               "jobs", g_variant_new_uint32 (opt_jobs));
+      if (opt_compression)
+        g_variant_builder_add (parambuilder, "{sv}",
+                               "compression", g_variant_new_byte (compression));
+      if (opt_zstd_dictionary)
+        g_variant_builder_add (parambuilder, "{sv}",
+                               "zstd-dictionary", g_variant_new_boolean (TRUE));
 
       g_variant_builder_add (parambuilder, "{sv}", "verbose", g_variant_new_boolean (TRUE));
       if (opt_endianness || opt_swap_endianness)
@@ -49,6 +49,7 @@ BUILTINPROTO(pull_local);
 BUILTINPROTO(ls);
 BUILTINPROTO(prune);
 BUILTINPROTO(refs);
+BUILTINPROTO(repack);
 BUILTINPROTO(reset);
 BUILTINPROTO(fsck);
 BUILTINPROTO(show);
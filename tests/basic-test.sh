@@ -21,7 +21,7 @@
 
 set -euo pipefail
 
-echo "1..$((88 + ${extra_basic_tests:-0}))"
+echo "1..$((90 + ${extra_basic_tests:-0}))"
 
 CHECKOUT_U_ARG=""
 CHECKOUT_H_ARGS="-H"
@@ -270,6 +270,18 @@ fi
 assert_file_has_content err.txt "No such metadata object"
 echo "ok commit orphaned"
 
+cd ${test_tmpdir}
+rm -rf checkout-test2-threads
+$OSTREE checkout test2 checkout-test2-threads
+for i in $(seq 50); do echo "threaded $i" > checkout-test2-threads/yet/another/file-$i; done
+# Commit with threads first so the workers actually write the new objects
+threads_rev=$($OSTREE commit ${COMMIT_ARGS} --orphan -s threads --timestamp="2005-10-29 12:43:29 +0000" --threads=4 checkout-test2-threads)
+serial_rev=$($OSTREE commit ${COMMIT_ARGS} --orphan -s threads --timestamp="2005-10-29 12:43:29 +0000" checkout-test2-threads)
+assert_streq "${serial_rev}" "${threads_rev}"
+$OSTREE fsck >/dev/null
+rm -rf checkout-test2-threads
+echo "ok commit --threads"
+
 cd ${test_tmpdir}
 # in bare-user-only mode, we canonicalize ownership to 0:0, so checksums won't
 # match -- we could add a --ignore-ownership option I suppose?
@@ -642,6 +654,35 @@ test -f cow
 test -d another
 echo "ok checkout skip-list with subpath"
 
+cd ${test_tmpdir}
+rm -rf checkout-test2-serial checkout-test2-threads
+$OSTREE checkout ${CHECKOUT_U_ARG} test2 checkout-test2-serial
+$OSTREE checkout ${CHECKOUT_U_ARG} --threads=4 test2 checkout-test2-threads
+(cd checkout-test2-serial && find . -printf '%p %m %s %l\n' | sort) > serial-files.txt
+(cd checkout-test2-threads && find . -printf '%p %m %s %l\n' | sort) > threads-files.txt
+diff -u serial-files.txt threads-files.txt
+diff -r checkout-test2-serial checkout-test2-threads
+$OSTREE checkout ${CHECKOUT_U_ARG} --union --threads=4 test2 checkout-test2-threads
+(cd checkout-test2-threads && find . -printf '%p %m %s %l\n' | sort) > threads-files.txt
+diff -u serial-files.txt threads-files.txt
+rm -rf checkout-test2-threads
+$OSTREE checkout ${CHECKOUT_U_ARG} --threads=4 --skip-list test-skiplist.txt --subpath /baz \
+  test2 checkout-test2-threads
+! test -f checkout-test2-threads/saucer
+! test -d checkout-test2-threads/deeper
+test -d checkout-test2-threads/another
+# An absurd thread count is clamped rather than honoured
+$OSTREE checkout ${CHECKOUT_U_ARG} --threads=100000 test2 checkout-test2-threads-many
+diff -r checkout-test2-serial checkout-test2-threads-many
+for n in 0 -1; do
+  if $OSTREE checkout ${CHECKOUT_U_ARG} --threads=${n} test2 checkout-test2-threads-bad 2>err.txt; then
+    fatal "checkout --threads=${n} unexpectedly succeeded"
+  fi
+  assert_file_has_content err.txt "Invalid number of threads"
+done
+rm -rf checkout-test2-serial checkout-test2-threads checkout-test2-threads-many
+echo "ok checkout --threads"
+
 cd ${test_tmpdir}
 $OSTREE checkout  --union test2 checkout-test2-union
 find checkout-test2-union | wc -l > union-files-count
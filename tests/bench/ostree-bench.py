@@ -0,0 +1,273 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2019 Collabora Ltd.
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+# Time the main repository operations on synthetic content, and print the
+# results as JSON so runs against different builds can be compared.  See
+# tests/bench/README.md.
+
+from __future__ import division
+from __future__ import print_function
+import argparse
+import json
+import os
+import random
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+OPERATIONS = ['commit', 'delta-generate', 'pull', 'delta-apply',
+              'checkout', 'fsck', 'prune']
+
+def fatal(msg):
+    sys.stderr.write(msg)
+    sys.stderr.write('\n')
+    sys.exit(1)
+
+def log(*args):
+    print(*args, file=sys.stderr)
+
+def parse_size(s):
+    suffixes = {'k': 1 << 10, 'm': 1 << 20, 'g': 1 << 30}
+    s = s.strip().lower()
+    mult = 1
+    if s and s[-1] in suffixes:
+        mult = suffixes[s[-1]]
+        s = s[:-1]
+    return int(s) * mult
+
+# "SIZE:WEIGHT,..." e.g. "4k:70,64k:25,1m:5"
+def parse_distribution(s):
+    dist = []
+    for item in s.split(','):
+        size, _, weight = item.partition(':')
+        dist.append((parse_size(size), int(weight or 1)))
+    if not dist or sum(w for _, w in dist) <= 0:
+        raise argparse.ArgumentTypeError('invalid size distribution: ' + s)
+    return dist
+
+class Tree(object):
+    """A synthetic filesystem tree of a given shape.  The content is
+    generated from a seeded PRNG, so the same arguments always produce the
+    same tree (and hence the same object checksums)."""
+    def __init__(self, args):
+        self.rng = random.Random(args.seed)
+        self.sizes = [s for s, _ in args.size_distribution]
+        self.weights = [w for _, w in args.size_distribution]
+        self.dirs = ['']
+        level = ['']
+        for depth in range(args.depth):
+            level = [os.path.join(d, 'd{}'.format(i))
+                     for d in level for i in range(args.dirs_per_level)]
+            self.dirs.extend(level)
+        self.files = ['{}/f{}'.format(self.rng.choice(self.dirs), i).lstrip('/')
+                      for i in range(args.files)]
+
+    def _content(self, n):
+        # Half random, half a repeat of it, so compression has some work
+        # to do without making it trivial.
+        half = n // 2
+        data = self.rng.getrandbits(8 * half).to_bytes(half, 'little') if half else b''
+        return data + data + bytes(n - 2 * half)
+
+    def _write(self, root, path):
+        size = self.rng.choices(self.sizes, self.weights)[0]
+        with open(os.path.join(root, path), 'wb') as f:
+            f.write(self._content(size))
+
+    def create(self, root):
+        for d in self.dirs:
+            os.makedirs(os.path.join(root, d), exist_ok=True)
+        for path in self.files:
+            self._write(root, path)
+
+    def modify(self, root, percent):
+        """Rewrite @percent of the files, and add as many new ones."""
+        n = max(1, len(self.files) * percent // 100)
+        for path in self.rng.sample(self.files, min(n, len(self.files))):
+            self._write(root, path)
+        for i in range(n):
+            path = '{}/new{}'.format(self.rng.choice(self.dirs), i).lstrip('/')
+            self._write(root, path)
+
+class Bench(object):
+    def __init__(self, args, workdir):
+        self.args = args
+        self.workdir = workdir
+        self.ostree = [args.ostree]
+        self.httpd = None
+        self.url = None
+        self.results = {op: [] for op in args.operations}
+
+    def run(self, *argv, **kwargs):
+        cmd = self.ostree + list(argv)
+        if self.args.verbose:
+            log('+', *cmd)
+        subprocess.check_call(cmd, stdout=subprocess.DEVNULL, **kwargs)
+
+    def output(self, *argv):
+        return subprocess.check_output(self.ostree + list(argv)).decode('utf-8').strip()
+
+    def timed(self, op, *argv, **kwargs):
+        start = time.monotonic()
+        self.run(*argv, **kwargs)
+        elapsed = time.monotonic() - start
+        if op in self.results:
+            self.results[op].append(elapsed)
+            log('{}: {:.3f}s'.format(op, elapsed))
+
+    def start_httpd(self):
+        port_file = os.path.join(self.workdir, 'httpd-port')
+        cmd = self.args.httpd.split() + ['--autoexit', '--daemonize',
+                                         '-p', port_file,
+                                         '--log-file', os.path.join(self.workdir, 'httpd.log'),
+                                         self.workdir]
+        subprocess.check_call(cmd, cwd=self.workdir)
+        with open(port_file) as f:
+            self.url = 'http://127.0.0.1:{}'.format(f.read().strip())
+
+    def iteration(self, n, tree_a, tree_b):
+        d = os.path.join(self.workdir, 'iter{}'.format(n))
+        os.mkdir(d)
+        src = os.path.join(d, 'src')
+        dst = os.path.join(d, 'dst')
+
+        self.run('--repo=' + src, 'init', '--mode=archive')
+        self.timed('commit', '--repo=' + src, 'commit', '-b', 'bench',
+                   '--tree=dir=' + tree_a, '--no-xattrs')
+        rev_a = self.output('--repo=' + src, 'rev-parse', 'bench')
+        self.run('--repo=' + src, 'commit', '-b', 'bench',
+                 '--tree=dir=' + tree_b, '--no-xattrs')
+        rev_b = self.output('--repo=' + src, 'rev-parse', 'bench')
+        self.timed('delta-generate', '--repo=' + src, 'static-delta', 'generate',
+                   '--from=' + rev_a, '--to=' + rev_b)
+        self.run('--repo=' + src, 'summary', '-u')
+
+        self.run('--repo=' + dst, 'init', '--mode=bare-user')
+        self.run('--repo=' + dst, 'remote', 'add', '--set=gpg-verify=false',
+                 'origin', '{}/iter{}/src'.format(self.url, n))
+        self.timed('pull', '--repo=' + dst, 'pull', '--disable-static-deltas',
+                   'origin', 'bench@' + rev_a)
+        self.timed('delta-apply', '--repo=' + dst, 'pull', '--require-static-deltas',
+                   'origin', 'bench')
+        self.timed('checkout', '--repo=' + dst, 'checkout', '-U', 'origin:bench',
+                   os.path.join(d, 'checkout'))
+        self.timed('fsck', '--repo=' + dst, 'fsck', '-q')
+        self.timed('prune', '--repo=' + src, 'prune', '--refs-only', '--depth=0')
+
+        shutil.rmtree(d)
+
+    def execute(self):
+        log('Generating trees...')
+        tree = Tree(self.args)
+        tree_a = os.path.join(self.workdir, 'tree-a')
+        tree_b = os.path.join(self.workdir, 'tree-b')
+        tree.create(tree_a)
+        shutil.copytree(tree_a, tree_b, symlinks=True)
+        tree.modify(tree_b, self.args.change_percent)
+
+        self.start_httpd()
+        for n in range(self.args.iterations):
+            log('Iteration {}/{}'.format(n + 1, self.args.iterations))
+            self.iteration(n, tree_a, tree_b)
+
+    def report(self):
+        version = self.output('--version')
+        results = {}
+        for op, samples in self.results.items():
+            results[op] = {
+                'samples': samples,
+                'min': min(samples),
+                'max': max(samples),
+                'mean': statistics.mean(samples),
+                'median': statistics.median(samples),
+            }
+        return {
+            'ostree-version': version,
+            'config': {
+                'files': self.args.files,
+                'size-distribution': [[s, w] for s, w in self.args.size_distribution],
+                'depth': self.args.depth,
+                'dirs-per-level': self.args.dirs_per_level,
+                'change-percent': self.args.change_percent,
+                'seed': self.args.seed,
+                'iterations': self.args.iterations,
+            },
+            'results': results,
+        }
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark ostree operations on a synthetic repository')
+    parser.add_argument('--builddir', help='Use the ostree binaries from this build directory')
+    parser.add_argument('--ostree', default='ostree', help='ostree binary (default: %(default)s)')
+    parser.add_argument('--httpd', help='ostree-trivial-httpd command line')
+    parser.add_argument('--files', type=int, default=2000, help='Number of files (default: %(default)s)')
+    parser.add_argument('--size-distribution', type=parse_distribution, default='1k:40,16k:40,256k:15,4m:5',
+                        help='File sizes as SIZE:WEIGHT,... (default: %(default)s)')
+    parser.add_argument('--depth', type=int, default=3, help='Directory depth (default: %(default)s)')
+    parser.add_argument('--dirs-per-level', type=int, default=4,
+                        help='Subdirectories per directory (default: %(default)s)')
+    parser.add_argument('--change-percent', type=int, default=10,
+                        help='Percentage of files changed between the two commits (default: %(default)s)')
+    parser.add_argument('--seed', type=int, default=0, help='Seed for content generation (default: %(default)s)')
+    parser.add_argument('--iterations', type=int, default=3, help='Number of runs (default: %(default)s)')
+    parser.add_argument('--operations', default=','.join(OPERATIONS),
+                        help='Comma-separated operations to report (default: %(default)s)')
+    parser.add_argument('--workdir', help='Directory for temporary files (default: $TMPDIR)')
+    parser.add_argument('--output', '-o', help='Write JSON results here rather than to stdout')
+    parser.add_argument('--verbose', '-v', action='store_true', help='Print commands as they are run')
+    args = parser.parse_args()
+
+    args.operations = [op for op in args.operations.split(',') if op]
+    for op in args.operations:
+        if op not in OPERATIONS:
+            fatal('Unknown operation: {}'.format(op))
+    if args.iterations < 1:
+        fatal('--iterations must be at least 1')
+
+    if args.builddir:
+        args.ostree = os.path.join(args.builddir, 'ostree')
+        if args.httpd is None:
+            args.httpd = os.path.join(args.builddir, 'ostree-trivial-httpd')
+    if args.httpd is None:
+        args.httpd = args.ostree + ' trivial-httpd'
+
+    workdir = tempfile.mkdtemp(prefix='ostree-bench.', dir=args.workdir)
+    try:
+        bench = Bench(args, workdir)
+        bench.execute()
+        report = bench.report()
+    finally:
+        # Also makes the --autoexit httpd go away
+        shutil.rmtree(workdir)
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+            f.write('\n')
+    else:
+        json.dump(report, sys.stdout, indent=2, sort_keys=True)
+        sys.stdout.write('\n')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include "ostree-adaptive-limit-private.h"
+
+/* Complete one window's worth of operations, each taking @latency µs and
+ * (if @bytes_per_op is nonzero) transferring @bytes_per_op bytes.
+ */
+static void
+run_window (OstreeAdaptiveLimit *limit,
+            guint64             *now,
+            guint64             *total_bytes,
+            guint64              latency,
+            guint64              bytes_per_op)
+{
+  const guint n = _ostree_adaptive_limit_get (limit);
+  for (guint i = 0; i < n; i++)
+    {
+      *now += 1000;
+      *total_bytes += bytes_per_op;
+      _ostree_adaptive_limit_sample (limit, *now, latency, *total_bytes);
+    }
+}
+
+static void
+test_slow_start (void)
+{
+  OstreeAdaptiveLimit limit;
+  guint64 now = 0;
+  guint64 total_bytes = 0;
+
+  _ostree_adaptive_limit_init (&limit, 8, 2, 64);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 8);
+
+  /* No throughput information, and latency stays flat */
+  run_window (&limit, &now, &total_bytes, 10000, 0);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 16);
+  run_window (&limit, &now, &total_bytes, 10000, 0);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 32);
+  run_window (&limit, &now, &total_bytes, 10000, 0);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 64);
+  run_window (&limit, &now, &total_bytes, 10000, 0);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 64);
+}
+
+static void
+test_throughput_plateau (void)
+{
+  OstreeAdaptiveLimit limit;
+  guint64 now = 0;
+  guint64 total_bytes = 0;
+
+  _ostree_adaptive_limit_init (&limit, 8, 2, 64);
+  run_window (&limit, &now, &total_bytes, 10000, 4096);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 16);
+  /* Same throughput as before: leave slow start and hold */
+  run_window (&limit, &now, &total_bytes, 10000, 4096);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 16);
+  g_assert (!limit.slow_start);
+  /* Latency still fine: additive increase */
+  run_window (&limit, &now, &total_bytes, 10000, 4096);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 17);
+  /* Latency inflated with no throughput gain: multiplicative decrease */
+  run_window (&limit, &now, &total_bytes, 50000, 4096);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 12);
+}
+
+static void
+test_latency_only (void)
+{
+  OstreeAdaptiveLimit limit;
+  guint64 now = 0;
+  guint64 total_bytes = 0;
+
+  _ostree_adaptive_limit_init (&limit, 16, 4, 64);
+  run_window (&limit, &now, &total_bytes, 2000, 0);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 32);
+  /* Writes are backing up */
+  run_window (&limit, &now, &total_bytes, 9000, 0);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 24);
+  run_window (&limit, &now, &total_bytes, 9000, 0);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 18);
+  run_window (&limit, &now, &total_bytes, 3000, 0);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 19);
+  for (guint i = 0; i < 20; i++)
+    run_window (&limit, &now, &total_bytes, 90000, 0);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 4);
+}
+
+static void
+test_backoff (void)
+{
+  OstreeAdaptiveLimit limit;
+
+  _ostree_adaptive_limit_init (&limit, 8, 2, 64);
+  _ostree_adaptive_limit_backoff (&limit);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 4);
+  g_assert (!limit.slow_start);
+  _ostree_adaptive_limit_backoff (&limit);
+  _ostree_adaptive_limit_backoff (&limit);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 2);
+}
+
+static void
+test_fixed (void)
+{
+  OstreeAdaptiveLimit limit;
+  guint64 now = 0;
+  guint64 total_bytes = 0;
+
+  _ostree_adaptive_limit_init (&limit, 8, 2, 64);
+  _ostree_adaptive_limit_set_fixed (&limit, 3);
+  run_window (&limit, &now, &total_bytes, 10000, 4096);
+  run_window (&limit, &now, &total_bytes, 90000, 4096);
+  _ostree_adaptive_limit_backoff (&limit);
+  g_assert_cmpuint (_ostree_adaptive_limit_get (&limit), ==, 3);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/adaptive-limit/slow-start", test_slow_start);
+  g_test_add_func ("/adaptive-limit/throughput-plateau", test_throughput_plateau);
+  g_test_add_func ("/adaptive-limit/latency-only", test_latency_only);
+  g_test_add_func ("/adaptive-limit/backoff", test_backoff);
+  g_test_add_func ("/adaptive-limit/fixed", test_fixed);
+  return g_test_run();
+}
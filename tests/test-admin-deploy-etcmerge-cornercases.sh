@@ -26,7 +26,7 @@ set -euo pipefail
 # Exports OSTREE_SYSROOT so --sysroot not needed.
 setup_os_repository "archive" "syslinux"
 
-echo "1..2"
+echo "1..3"
 
 ${CMD_PREFIX} ostree --repo=sysroot/ostree/repo pull-local --remote=testos testos-repo testos/buildmaster/x86_64-runtime
 rev=$(${CMD_PREFIX} ostree --repo=sysroot/ostree/repo rev-parse testos/buildmaster/x86_64-runtime)
@@ -142,3 +142,21 @@ assert_has_file sysroot/ostree/deploy/testos/deploy/${rev}.0/etc/initially-empty
 rm ${newconfpath}
 
 echo "ok"
+
+# Changes the size, mode and timestamps don't show must still be found
+etc=sysroot/ostree/deploy/testos/deploy/${rev}.0/etc
+echo "A config file" > ${etc}/aconfigfile
+touch -r sysroot/ostree/deploy/testos/deploy/${rev}.0/usr/etc/aconfigfile ${etc}/aconfigfile
+chmod 600 ${etc}/NetworkManager/nm.conf
+mkdir -p ${etc}/new-default-dir/sub
+echo "a local file" > ${etc}/new-default-dir/sub/local
+${CMD_PREFIX} ostree --repo=${test_tmpdir}/testos-repo commit -b testos/buildmaster/x86_64-runtime -s "Same tree" --tree=ref=testos/buildmaster/x86_64-runtime
+${CMD_PREFIX} ostree admin upgrade --os=testos
+rev=$(${CMD_PREFIX} ostree --repo=sysroot/ostree/repo rev-parse testos/buildmaster/x86_64-runtime)
+newetc=sysroot/ostree/deploy/testos/deploy/${rev}.0/etc
+assert_file_has_content ${newetc}/aconfigfile "A config file"
+assert_file_has_mode ${newetc}/NetworkManager/nm.conf 600
+assert_file_has_content ${newetc}/new-default-dir/moo "a new default dir and file"
+assert_file_has_content ${newetc}/new-default-dir/sub/local "a local file"
+
+echo "ok"
@@ -0,0 +1,86 @@
+#!/bin/bash
+#
+# Copyright (C) 2019 Collabora Ltd.
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+# Exports OSTREE_SYSROOT so --sysroot not needed.
+setup_os_repository "archive" "grub2"
+${CMD_PREFIX} ostree --repo=sysroot/ostree/repo config set sysroot.grub2-native true
+
+echo "1..4"
+
+# A stand-in for grub2-mkconfig which wraps our entries like 15_ostree does,
+# and records how often it's run.
+cat > ${test_tmpdir}/fake-grub2-mkconfig <<EOS
+#!/bin/sh
+set -eu
+echo run >> ${test_tmpdir}/mkconfig-runs
+{
+  echo "set timeout=5"
+  echo "### BEGIN /etc/grub.d/15_ostree ###"
+  GRUB2_BOOT_DEVICE_ID=fakeid GRUB2_PREPARE_ROOT_CACHE="search --set=root fakeid" ostree admin instutil grub2-generate
+  echo "### END /etc/grub.d/15_ostree ###"
+  echo "menuentry 'custom' {"
+  echo "}"
+} > \$2
+EOS
+chmod +x ${test_tmpdir}/fake-grub2-mkconfig
+export OSTREE_GRUB2_EXEC=${test_tmpdir}/fake-grub2-mkconfig
+
+cd ${test_tmpdir}
+${CMD_PREFIX} ostree --repo=sysroot/ostree/repo pull-local --remote=testos testos-repo testos/buildmaster/x86_64-runtime
+${CMD_PREFIX} ostree admin deploy --karg=root=LABEL=MOO --os=testos testos:testos/buildmaster/x86_64-runtime
+assert_streq "$(wc -l < mkconfig-runs)" "1"
+assert_has_file sysroot/boot/grub2/grub.cfg.ostree-template
+cp sysroot/boot/loader/grub.cfg mkconfig-first.cfg
+echo "ok capture grub2 template"
+
+${CMD_PREFIX} ostree admin deploy --karg=root=LABEL=MOO --karg=quiet --os=testos testos:testos/buildmaster/x86_64-runtime
+assert_streq "$(wc -l < mkconfig-runs)" "1"
+assert_file_has_content sysroot/boot/loader/grub.cfg "^set timeout=5"
+assert_file_has_content sysroot/boot/loader/grub.cfg "^menuentry 'custom'"
+assert_file_has_content sysroot/boot/loader/grub.cfg "'ostree-0-fakeid'"
+assert_file_has_content sysroot/boot/loader/grub.cfg "^search --set=root fakeid"
+assert_file_has_content sysroot/boot/loader/grub.cfg "root=LABEL=MOO quiet"
+# The output is the same as that of the generator
+bootversion=$(readlink sysroot/boot/loader | sed -e 's,loader\.,,')
+_OSTREE_GRUB2_BOOTVERSION=${bootversion} ${test_tmpdir}/fake-grub2-mkconfig -o mkconfig.cfg
+diff -u mkconfig.cfg sysroot/boot/loader/grub.cfg
+echo "ok native grub2 config"
+
+# Back to the first deployment set (and the same boot version), the native
+# config must be byte for byte what grub2-mkconfig generated for it
+${CMD_PREFIX} ostree admin undeploy 0
+assert_streq "$(wc -l < mkconfig-runs)" "1"
+cmp mkconfig-first.cfg sysroot/boot/loader/grub.cfg
+echo "ok native grub2 config matches grub2-mkconfig"
+
+# Changing the generator's inputs invalidates the template
+sed -i -e 's/set timeout=5/set timeout=10/' fake-grub2-mkconfig
+${CMD_PREFIX} ostree admin deploy --karg=root=LABEL=MOO --os=testos testos:testos/buildmaster/x86_64-runtime
+assert_streq "$(wc -l < mkconfig-runs)" "2"
+assert_file_has_content sysroot/boot/loader/grub.cfg "^set timeout=10"
+${CMD_PREFIX} ostree admin deploy --karg=root=LABEL=MOO --karg=quiet --os=testos testos:testos/buildmaster/x86_64-runtime
+assert_streq "$(wc -l < mkconfig-runs)" "2"
+assert_file_has_content sysroot/boot/loader/grub.cfg "^set timeout=10"
+echo "ok grub2 template recaptured when the generator changes"
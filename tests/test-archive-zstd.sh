@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# Copyright (C) 2019 Collabora Ltd.
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+if ! ${CMD_PREFIX} ostree --version | grep -q -e '- zstd'; then
+    skip "ostree built without zstd"
+fi
+
+setup_fake_remote_repo1 "archive-zstd"
+
+echo '1..4'
+
+repopath=${test_tmpdir}/ostree-srv/gnomerepo
+assert_file_has_content ${repopath}/config 'mode=archive-zstd'
+${CMD_PREFIX} ostree --repo=${repopath} fsck
+# The zstd frame magic follows the file header of each regular file
+objpath=$(find ${repopath}/objects -name '*.filez' -size +0 | head -1)
+od -An -tx1 ${objpath} | tr -d ' \n' > obj.hex
+assert_file_has_content obj.hex '28b52ffd'
+echo "ok archive-zstd repo"
+
+cd ${test_tmpdir}
+rm repo -rf
+ostree_repo_init repo --mode=bare-user
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+${OSTREE} checkout -U origin:main checkout-bare-user
+assert_file_has_content checkout-bare-user/baz/cow moo
+assert_file_has_content checkout-bare-user/baz/another/y x
+echo "ok pull from archive-zstd into bare-user"
+
+# Mirroring into a zlib archive must recompress rather than copy objects
+rm repo -rf
+ostree_repo_init repo --mode=archive
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull --mirror origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+${OSTREE} checkout -U main checkout-archive
+diff -r checkout-bare-user checkout-archive
+echo "ok mirror from archive-zstd into archive"
+
+# And the other way round, locally
+rm zstd-repo -rf
+ostree_repo_init zstd-repo --mode=archive-zstd
+${CMD_PREFIX} ostree --repo=zstd-repo pull-local repo main
+${CMD_PREFIX} ostree --repo=zstd-repo fsck
+${CMD_PREFIX} ostree --repo=zstd-repo checkout -U main checkout-zstd
+diff -r checkout-bare-user checkout-zstd
+echo "ok pull-local from archive into archive-zstd"
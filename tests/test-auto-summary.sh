@@ -22,7 +22,7 @@
 
 set -euo pipefail
 
-echo "1..4"
+echo "1..6"
 
 . $(dirname $0)/libtest.sh
 
@@ -101,3 +101,31 @@ OLD_MD5=$(md5sum repo/summary)
 $OSTREE refs --delete test
 
 assert_not_streq "$OLD_MD5" "$(md5sum repo/summary)"
+
+# Check that the incrementally updated summary matches a full regeneration,
+# including static deltas which were regenerated since the last update
+echo hello3 > test/a
+$OSTREE commit -b test -s "A commit" test
+$OSTREE commit -b test3 -s "Another ref" test
+$OSTREE static-delta generate --empty --to=test
+echo hello4 > test/a
+$OSTREE commit -b test -s "Another commit" test
+$OSTREE static-delta generate --empty --to=test3
+$OSTREE static-delta generate --empty --to=test3 --inline
+$OSTREE reset test3 test
+$OSTREE summary --view | grep -v '^Last-Modified' > incremental.txt
+$OSTREE summary --update
+$OSTREE summary --view | grep -v '^Last-Modified' > full.txt
+diff -u full.txt incremental.txt
+echo "ok incremental auto-update-summary"
+
+# A superblock replaced since the last update is rehashed even if its mtime
+# is older than the summary
+$OSTREE static-delta generate --empty --to=test3
+find repo/deltas -name superblock -exec touch -d '2000-01-01' {} +
+$OSTREE commit -b test4 -s "Yet another ref" test
+$OSTREE summary --view | grep -v '^Last-Modified' > incremental.txt
+$OSTREE summary --update
+$OSTREE summary --view | grep -v '^Last-Modified' > full.txt
+diff -u full.txt incremental.txt
+echo "ok incremental auto-update-summary with replaced superblock"
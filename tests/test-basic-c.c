@@ -187,6 +187,43 @@ static gboolean hi_content_stream_new (GInputStream **out_stream,
   return ostree_raw_file_to_content_stream ((GInputStream*)hi_memstream, finfo, NULL, out_stream, out_length, NULL, error);
 }
 
+static void
+test_traverse_parallel (gconstpointer data)
+{
+  OstreeRepo *repo = OSTREE_REPO (data);
+  g_autoptr(GError) error = NULL;
+  g_autofree char *test2 = NULL;
+  g_autofree char *main_rev = NULL;
+
+  ostree_repo_resolve_rev (repo, "test2", FALSE, &test2, &error);
+  g_assert_no_error (error);
+  ostree_repo_resolve_rev (repo, "main", TRUE, &main_rev, &error);
+  g_assert_no_error (error);
+
+  g_autoptr(GHashTable) serial = ostree_repo_traverse_new_reachable ();
+  ostree_repo_traverse_commit_union (repo, test2, -1, serial, NULL, &error);
+  g_assert_no_error (error);
+  if (main_rev)
+    {
+      ostree_repo_traverse_commit_union (repo, main_rev, -1, serial, NULL, &error);
+      g_assert_no_error (error);
+    }
+
+  const char *commits[] = { test2, main_rev, NULL };
+  for (guint n_threads = 1; n_threads <= 4; n_threads++)
+    {
+      g_autoptr(GHashTable) parallel = ostree_repo_traverse_new_reachable ();
+      gboolean ret = ostree_repo_traverse_commit_union_parallel (repo, commits, -1, parallel,
+                                                                 n_threads, NULL, &error);
+      g_assert_no_error (error);
+      g_assert (ret);
+
+      g_assert_cmpuint (g_hash_table_size (parallel), ==, g_hash_table_size (serial));
+      GLNX_HASH_TABLE_FOREACH (serial, GVariant*, key)
+        g_assert (g_hash_table_contains (parallel, key));
+    }
+}
+
 static void
 test_validate_remotename (void)
 {
@@ -492,6 +529,7 @@ int main (int argc, char **argv)
   g_test_add_data_func ("/repo-not-system", repo, test_repo_is_not_system);
   g_test_add_data_func ("/raw-file-to-archive-stream", repo, test_raw_file_to_archive_stream);
   g_test_add_data_func ("/objectwrites", repo, test_object_writes);
+  g_test_add_data_func ("/traverse-parallel", repo, test_traverse_parallel);
   g_test_add_func ("/xattrs-devino-cache", test_devino_cache_xattrs);
   g_test_add_func ("/break-hardlink", test_break_hardlink);
   g_test_add_func ("/remotename", test_validate_remotename);
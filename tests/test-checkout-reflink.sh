@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# Copyright (C) 2019 Collabora Ltd.
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+echo "1..3"
+
+cd ${test_tmpdir}
+mkdir -p tree/root/sub
+echo a > tree/root/a
+seq 10000 > tree/root/sub/big
+ln -s a tree/root/link
+
+ostree_repo_init repo-bare-user --mode=bare-user
+${CMD_PREFIX} ostree --repo=repo-bare-user commit --branch=test -m test tree
+${CMD_PREFIX} ostree --repo=repo-bare-user checkout -U --reflink test co-bare-user
+diff -r tree co-bare-user
+# Files must be copies, whether or not the data was cloned
+assert_streq "$(stat -c '%h' co-bare-user/root/sub/big)" 1
+assert_streq "$(readlink co-bare-user/root/link)" a
+echo "ok checkout --reflink bare-user"
+
+ostree_repo_init repo-archive --mode=archive
+${CMD_PREFIX} ostree --repo=repo-archive pull-local repo-bare-user test
+${CMD_PREFIX} ostree --repo=repo-archive checkout -U --reflink test co-archive
+diff -r tree co-archive
+assert_streq "$(stat -c '%h' co-archive/root/sub/big)" 1
+# The data comes from the uncompressed object cache
+find repo-archive/uncompressed-objects-cache -type f > cached.txt
+assert_file_has_content cached.txt '\.file$'
+# And checking out again reuses it
+rm co-archive -rf
+${CMD_PREFIX} ostree --repo=repo-archive checkout -U --reflink test co-archive
+diff -r tree co-archive
+rm co-archive -rf
+${CMD_PREFIX} ostree --repo=repo-archive checkout -U --reflink --disable-cache test co-archive
+diff -r tree co-archive
+rm co-archive -rf
+# A read-only repository without a cache falls back to copying
+rm repo-archive/uncompressed-objects-cache -rf
+chmod -R a-w repo-archive
+${CMD_PREFIX} ostree --repo=repo-archive checkout -U --reflink test co-archive
+chmod -R u+w repo-archive
+diff -r tree co-archive
+echo "ok checkout --reflink archive"
+
+if ${CMD_PREFIX} ostree --repo=repo-bare-user checkout -U --reflink --require-hardlinks test co-fail 2>err.txt; then
+    fatal "checkout --reflink --require-hardlinks unexpectedly succeeded"
+fi
+assert_file_has_content err.txt "Cannot specify both --require-hardlinks and --force-copy"
+echo "ok checkout --reflink --require-hardlinks"
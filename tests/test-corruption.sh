@@ -21,7 +21,7 @@
 
 set -euo pipefail
 
-echo "1..9"
+echo "1..10"
 
 . $(dirname $0)/libtest.sh
 
@@ -152,3 +152,24 @@ assert_file_has_content_literal err.txt "Marking commit as partial: $rev"
 assert_has_file repo/state/${rev}.commitpartial
 
 echo "ok fsck --all"
+
+cd ${test_tmpdir}
+rm repo files -rf
+setup_test_repository "bare"
+
+rev=$($OSTREE rev-parse test2)
+$OSTREE fsck -q --jobs=4
+$OSTREE fsck -q --jobs=0
+firstfilechecksum=$(ostree_file_path_to_checksum repo test2 /firstfile)
+echo corrupted >> repo/$(ostree_checksum_to_relative_object_path repo $firstfilechecksum)
+secondfilechecksum=$(ostree_file_path_to_checksum repo test2 /baz/cow)
+rm repo/$(ostree_checksum_to_relative_object_path repo $secondfilechecksum)
+
+if $OSTREE fsck -a --jobs=4 2>err.txt; then
+    assert_not_reached "fsck unexpectedly succeeded"
+fi
+assert_file_has_content err.txt "Corrupted file object.*${firstfilechecksum}"
+assert_file_has_content err.txt "Object missing in commits ${rev}: ${secondfilechecksum}.file"
+assert_file_has_content_literal err.txt "Marking commit as partial: $rev"
+
+echo "ok fsck --jobs"
@@ -28,7 +28,7 @@ skip_without_user_xattrs
 bindatafiles="bash true ostree"
 morebindatafiles="false ls"
 
-echo '1..12'
+echo '1..16'
 
 mkdir repo
 ostree_repo_init repo --mode=archive
@@ -134,6 +134,24 @@ rm temp-repo -rf
 
 echo 'ok generate'
 
+# Multithreaded generation must produce the same parts
+mkdir serial-delta parallel-delta
+${CMD_PREFIX} ostree --repo=repo static-delta generate --max-bsdiff-size=10000 --max-chunk-size=1 \
+              --from=${origrev} --to=${newrev} --filename=serial-delta/superblock
+${CMD_PREFIX} ostree --repo=repo static-delta generate --max-bsdiff-size=10000 --max-chunk-size=1 \
+              --jobs=4 --from=${origrev} --to=${newrev} --filename=parallel-delta/superblock
+(cd serial-delta && ls) > serial-parts.txt
+(cd parallel-delta && ls) > parallel-parts.txt
+diff -u serial-parts.txt parallel-parts.txt
+for part in $(cat serial-parts.txt); do
+    if test ${part} != superblock; then
+        cmp serial-delta/${part} parallel-delta/${part}
+    fi
+done
+rm serial-delta parallel-delta -rf
+
+echo 'ok generate with jobs'
+
 ${CMD_PREFIX} ostree --repo=repo static-delta show ${origrev}-${newrev} > show.txt
 assert_file_has_content show.txt "From: ${origrev}"
 assert_file_has_content show.txt "To: ${newrev}"
@@ -209,6 +227,73 @@ ${CMD_PREFIX} ostree --repo=repo2 ls ${newrev} >/dev/null
 
 echo 'ok apply offline inline'
 
+if ${CMD_PREFIX} ostree --version | grep -q -e '- zstd'; then
+    rm -rf repo/deltas/${deltaprefix}/${deltadir}/*
+    ${CMD_PREFIX} ostree --repo=repo static-delta generate --from=${origrev} --to=${newrev} \
+                  --compression=zstd --zstd-dictionary --max-chunk-size=1
+    ${CMD_PREFIX} ostree --repo=repo static-delta show ${origrev}-${newrev} > show-zstd.txt
+    assert_file_has_content show-zstd.txt 'PartCompression0: zstd'
+    assert_not_file_has_content show-zstd.txt 'PartCompression.*: lzma'
+
+    rm repo2 -rf
+    ostree_repo_init repo2 --mode=bare-user
+    ${CMD_PREFIX} ostree --repo=repo2 pull-local repo ${origrev}
+    ${CMD_PREFIX} ostree --repo=repo2 static-delta apply-offline repo/deltas/${deltaprefix}/${deltadir}
+    ${CMD_PREFIX} ostree --repo=repo2 fsck
+    ${CMD_PREFIX} ostree --repo=repo2 ls ${newrev} >/dev/null
+    echo 'ok apply offline zstd'
+else
+    echo 'ok # SKIP ostree built without zstd'
+fi
+
+# Parts applied in parallel, with fewer apply jobs than parts, must give the
+# same result as applying them one at a time
+rm -rf repo/deltas/${deltaprefix}/${deltadir}/*
+${CMD_PREFIX} ostree --repo=repo static-delta generate --max-chunk-size=1 --from=${origrev} --to=${newrev}
+${CMD_PREFIX} ostree --repo=repo static-delta show ${origrev}-${newrev} > show-parts.txt
+nparts=$(sed -ne 's/^Number of parts: //p' show-parts.txt)
+test "${nparts}" -ge 2 || fatal "expected several delta parts, got ${nparts}"
+${CMD_PREFIX} ostree --repo=repo summary -u
+for jobs in 1 2; do
+    rm repo-jobs${jobs} -rf
+    ostree_repo_init repo-jobs${jobs} --mode=bare-user
+    ${CMD_PREFIX} ostree --repo=repo-jobs${jobs} remote add --set=gpg-verify=false \
+                  --set=max-concurrent-delta-parts=${jobs} origin file://$(pwd)/repo
+    ${CMD_PREFIX} ostree --repo=repo-jobs${jobs} pull-local repo ${origrev}
+    ${CMD_PREFIX} ostree --repo=repo-jobs${jobs} pull --require-static-deltas origin test
+    ${CMD_PREFIX} ostree --repo=repo-jobs${jobs} fsck
+    assert_streq "$(${CMD_PREFIX} ostree --repo=repo-jobs${jobs} rev-parse origin:test)" "${newrev}"
+    rm checkout-jobs${jobs} -rf
+    ${CMD_PREFIX} ostree --repo=repo-jobs${jobs} checkout -U ${newrev} checkout-jobs${jobs}
+done
+diff -r checkout-jobs1 checkout-jobs2
+rm repo-jobs1 repo-jobs2 checkout-jobs1 checkout-jobs2 -rf
+
+echo 'ok pull delta parts in parallel'
+
+# An error applying one part fails the whole pull
+mkdir parts-orig
+cp repo/deltas/${deltaprefix}/${deltadir}/[0-9]* parts-orig
+for part in $(seq 1 $((nparts - 1))); do
+    cp parts-orig/0 repo/deltas/${deltaprefix}/${deltadir}/${part}
+done
+rm repo-bad -rf
+ostree_repo_init repo-bad --mode=bare-user
+${CMD_PREFIX} ostree --repo=repo-bad remote add --set=gpg-verify=false \
+              --set=max-concurrent-delta-parts=2 origin file://$(pwd)/repo
+${CMD_PREFIX} ostree --repo=repo-bad pull-local repo ${origrev}
+if ${CMD_PREFIX} ostree --repo=repo-bad pull --require-static-deltas origin test 2>err.txt; then
+    assert_not_reached "pull with corrupt delta part unexpectedly succeeded"
+fi
+assert_file_has_content err.txt "Checksum mismatch in static delta part"
+if ${CMD_PREFIX} ostree --repo=repo-bad rev-parse origin:test 2>/dev/null; then
+    assert_not_reached "ref updated despite corrupt delta part"
+fi
+cp parts-orig/* repo/deltas/${deltaprefix}/${deltadir}
+rm parts-orig repo-bad -rf
+
+echo 'ok pull delta part error'
+
 ${CMD_PREFIX} ostree --repo=repo static-delta list | grep ^${origrev}-${newrev}$ || exit 1
 ${CMD_PREFIX} ostree --repo=repo static-delta list | grep ^${origrev}$ || exit 1
 
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <string.h>
+
+#include "ostree-lru-cache-private.h"
+
+static GBytes *
+make_bytes (const char *str)
+{
+  return g_bytes_new (str, strlen (str));
+}
+
+static void
+assert_cached (OstreeLruCache *cache,
+               const char     *key,
+               const char     *expected)
+{
+  g_autoptr(GBytes) bytes = _ostree_lru_cache_lookup (cache, key);
+  if (expected == NULL)
+    {
+      g_assert_null (bytes);
+      return;
+    }
+  g_assert_nonnull (bytes);
+  g_assert_cmpmem (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+                   expected, strlen (expected));
+}
+
+/* Test that the least recently used entries are evicted first. */
+static void
+test_lru_cache_evict (void)
+{
+  g_autoptr(OstreeLruCache) cache =
+    _ostree_lru_cache_new (10, (GBoxedCopyFunc) g_bytes_ref, (GDestroyNotify) g_bytes_unref);
+
+  for (guint i = 0; i < 3; i++)
+    {
+      g_autofree char *key = g_strdup_printf ("%u", i);
+      g_autoptr(GBytes) bytes = make_bytes (key);
+      _ostree_lru_cache_insert (cache, key, bytes, 3);
+    }
+  g_assert_cmpuint (_ostree_lru_cache_get_size (cache), ==, 9);
+
+  /* Make 0 the most recently used */
+  assert_cached (cache, "0", "0");
+
+  g_autoptr(GBytes) bytes = make_bytes ("3");
+  _ostree_lru_cache_insert (cache, "3", bytes, 3);
+  g_assert_cmpuint (_ostree_lru_cache_get_size (cache), ==, 9);
+  assert_cached (cache, "0", "0");
+  assert_cached (cache, "1", NULL);
+  assert_cached (cache, "2", "2");
+  assert_cached (cache, "3", "3");
+
+  /* Too big for the cache */
+  _ostree_lru_cache_insert (cache, "4", bytes, 11);
+  assert_cached (cache, "4", NULL);
+  g_assert_cmpuint (_ostree_lru_cache_get_size (cache), ==, 9);
+
+  guint64 hits, misses;
+  _ostree_lru_cache_get_stats (cache, &hits, &misses);
+  g_assert_cmpuint (hits, ==, 4);
+  g_assert_cmpuint (misses, ==, 2);
+}
+
+/* Test replacing and removing entries. */
+static void
+test_lru_cache_replace (void)
+{
+  g_autoptr(OstreeLruCache) cache =
+    _ostree_lru_cache_new (100, (GBoxedCopyFunc) g_bytes_ref, (GDestroyNotify) g_bytes_unref);
+  g_autoptr(GBytes) a = make_bytes ("a");
+  g_autoptr(GBytes) b = make_bytes ("b");
+
+  _ostree_lru_cache_insert (cache, "key", a, 10);
+  _ostree_lru_cache_insert (cache, "key", b, 20);
+  g_assert_cmpuint (_ostree_lru_cache_get_size (cache), ==, 20);
+  assert_cached (cache, "key", "b");
+
+  _ostree_lru_cache_remove (cache, "key");
+  _ostree_lru_cache_remove (cache, "missing");
+  g_assert_cmpuint (_ostree_lru_cache_get_size (cache), ==, 0);
+  assert_cached (cache, "key", NULL);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/lru-cache/evict", test_lru_cache_evict);
+  g_test_add_func ("/lru-cache/replace", test_lru_cache_replace);
+
+  return g_test_run ();
+}
@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# Copyright (C) 2019 Collabora Ltd.
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+echo '1..3'
+
+setup_test_repository "archive"
+
+cd ${test_tmpdir}
+
+count_objects () {
+    find $1/objects -name '*.dirtree' -o -name '*.dirmeta' -o -name '*.filez' -o -name '*.commit' | wc -l
+}
+
+assert_index_matches_objects () {
+    local repo=$1
+    assert_has_file ${repo}/tmp/cache/object-index
+    assert_not_has_file ${repo}/tmp/cache/object-index.journal
+    assert_streq "$(stat -c %s ${repo}/tmp/cache/object-index)" "$((16 + 40 * $(count_objects ${repo})))"
+}
+
+${CMD_PREFIX} ostree --repo=repo config set core.object-index true
+assert_not_has_file repo/tmp/cache/object-index
+cd ${test_tmpdir}/files
+echo "indexed" > baz/indexed
+${CMD_PREFIX} ostree --repo=${test_tmpdir}/repo commit -b test2 -s "Indexed commit"
+cd ${test_tmpdir}
+assert_index_matches_objects repo
+index_size=$(stat -c %s repo/tmp/cache/object-index)
+n_objects=$(count_objects repo)
+echo "new" > files/baz/indexed
+cd ${test_tmpdir}/files
+${CMD_PREFIX} ostree --repo=${test_tmpdir}/repo commit -b test2 -s "Indexed commit 2"
+cd ${test_tmpdir}
+# New objects are journaled rather than rewriting the index
+assert_streq "$(stat -c %s repo/tmp/cache/object-index)" "${index_size}"
+assert_streq "$(stat -c %s repo/tmp/cache/object-index.journal)" "$((40 * ($(count_objects repo) - n_objects)))"
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok commit updates object index"
+
+${CMD_PREFIX} ostree --repo=repo fsck --rebuild-object-index > fsck.txt
+assert_file_has_content fsck.txt "Rebuilding object index"
+assert_index_matches_objects repo
+rm repo/tmp/cache/object-index
+${CMD_PREFIX} ostree --repo=repo fsck --rebuild-object-index > fsck.txt
+assert_index_matches_objects repo
+echo "ok fsck --rebuild-object-index"
+
+ostree_repo_init repo2 --mode=archive
+${CMD_PREFIX} ostree --repo=repo2 config set core.object-index true
+${CMD_PREFIX} ostree --repo=repo2 pull-local repo test2
+assert_index_matches_objects repo2
+index_size=$(stat -c %s repo2/tmp/cache/object-index)
+n_objects=$(count_objects repo2)
+${CMD_PREFIX} ostree --repo=repo2 refs --delete test2
+${CMD_PREFIX} ostree --repo=repo2 prune --refs-only
+assert_streq "$(find repo2/objects -name '*.commit' | wc -l)" "0"
+# Each pruned object is journaled as removed
+assert_streq "$(stat -c %s repo2/tmp/cache/object-index)" "${index_size}"
+assert_streq "$(stat -c %s repo2/tmp/cache/object-index.journal)" "$((40 * (n_objects - $(count_objects repo2))))"
+# Stale index entries would make us skip refetching the pruned objects
+${CMD_PREFIX} ostree --repo=repo2 pull-local repo test2
+${CMD_PREFIX} ostree --repo=repo2 fsck
+${CMD_PREFIX} ostree --repo=repo2 checkout -U test2 checkout-test2
+assert_file_has_content checkout-test2/baz/indexed new
+echo "ok prune keeps object index consistent"
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <string.h>
+
+#include "ostree-object-set-private.h"
+
+static void
+make_csum (guint        seed,
+           guint8      *csum)
+{
+  g_autofree char *str = g_strdup_printf ("%u", seed);
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  gsize len = OSTREE_SHA256_DIGEST_LEN;
+
+  g_checksum_update (checksum, (const guint8 *) str, strlen (str));
+  g_checksum_get_digest (checksum, csum, &len);
+  g_assert_cmpuint (len, ==, OSTREE_SHA256_DIGEST_LEN);
+}
+
+/* Test adding and looking up objects, including growing the table. */
+static void
+test_object_set_add (void)
+{
+  g_autoptr(OstreeObjectSet) set = ostree_object_set_new (0);
+  const guint n = 10000;
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+
+  g_assert_cmpuint (ostree_object_set_get_size (set), ==, 0);
+
+  for (guint i = 0; i < n; i++)
+    {
+      make_csum (i, csum);
+      g_assert_true (ostree_object_set_add (set, csum, OSTREE_OBJECT_TYPE_FILE));
+      g_assert_false (ostree_object_set_add (set, csum, OSTREE_OBJECT_TYPE_FILE));
+    }
+  g_assert_cmpuint (ostree_object_set_get_size (set), ==, n);
+
+  for (guint i = 0; i < n; i++)
+    {
+      make_csum (i, csum);
+      g_assert_true (ostree_object_set_contains (set, csum, OSTREE_OBJECT_TYPE_FILE));
+      /* The object type is part of the name */
+      g_assert_false (ostree_object_set_contains (set, csum, OSTREE_OBJECT_TYPE_DIR_TREE));
+    }
+
+  make_csum (n, csum);
+  g_assert_false (ostree_object_set_contains (set, csum, OSTREE_OBJECT_TYPE_FILE));
+}
+
+/* Test the ASCII checksum variants match the binary ones. */
+static void
+test_object_set_checksum (void)
+{
+  g_autoptr(OstreeObjectSet) set = ostree_object_set_new (4);
+  const char *checksum = "d6a0ae1bd2e0ec5fc5b6dc8b6a0a0b2ec0a5b2c6e0b5a1a2d4b7e3a4f8c2e1d9";
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+
+  g_assert_true (ostree_object_set_add_checksum (set, checksum, OSTREE_OBJECT_TYPE_COMMIT));
+  g_assert_true (ostree_object_set_contains (set, csum, OSTREE_OBJECT_TYPE_COMMIT));
+  g_assert_true (ostree_object_set_contains_checksum (set, checksum, OSTREE_OBJECT_TYPE_COMMIT));
+  g_assert_false (ostree_object_set_add (set, csum, OSTREE_OBJECT_TYPE_COMMIT));
+  g_assert_true (ostree_object_set_add (set, csum, OSTREE_OBJECT_TYPE_DIR_META));
+  g_assert_cmpuint (ostree_object_set_get_size (set), ==, 2);
+}
+
+/* Test iterating returns every object exactly once. */
+static void
+test_object_set_iter (void)
+{
+  g_autoptr(OstreeObjectSet) set = ostree_object_set_new (0);
+  g_autoptr(GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  const guint n = 1000;
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+
+  for (guint i = 0; i < n; i++)
+    {
+      make_csum (i, csum);
+      ostree_object_set_add (set, csum, (i % 2) ? OSTREE_OBJECT_TYPE_FILE : OSTREE_OBJECT_TYPE_DIR_TREE);
+    }
+
+  gsize iter = 0;
+  const guint8 *iter_csum;
+  OstreeObjectType objtype;
+  while (ostree_object_set_iter_next (set, &iter, &iter_csum, &objtype))
+    {
+      char checksum[OSTREE_SHA256_STRING_LEN+1];
+      ostree_checksum_inplace_from_bytes (iter_csum, checksum);
+      g_assert_true (g_hash_table_add (seen, g_strdup (checksum)));
+      g_assert_true (objtype == OSTREE_OBJECT_TYPE_FILE || objtype == OSTREE_OBJECT_TYPE_DIR_TREE);
+    }
+  g_assert_cmpuint (g_hash_table_size (seen), ==, n);
+
+  /* Iteration stays finished */
+  g_assert_false (ostree_object_set_iter_next (set, &iter, &iter_csum, &objtype));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/object-set/add", test_object_set_add);
+  g_test_add_func ("/object-set/checksum", test_object_set_checksum);
+  g_test_add_func ("/object-set/iter", test_object_set_iter);
+
+  return g_test_run ();
+}
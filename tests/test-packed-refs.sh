@@ -0,0 +1,112 @@
+#!/bin/bash
+#
+# Copyright (C) 2019 Collabora Ltd.
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+echo "1..5"
+
+cd ${test_tmpdir}
+mkdir -p tree/root
+echo a > tree/root/a
+
+ostree_repo_init repo --mode=archive
+${CMD_PREFIX} ostree --repo=repo config set core.packed-refs true
+${CMD_PREFIX} ostree --repo=repo commit --branch=foo/bar -m foo -s foo tree
+echo b >> tree/root/a
+${CMD_PREFIX} ostree --repo=repo commit --branch=baz -m baz -s baz tree
+foo_rev=$(${CMD_PREFIX} ostree --repo=repo rev-parse foo/bar)
+baz_rev=$(${CMD_PREFIX} ostree --repo=repo rev-parse baz)
+assert_not_has_file repo/refs/heads/foo/bar
+assert_not_has_file repo/refs/heads/baz
+assert_file_has_content_literal repo/refs/packed-refs "${foo_rev} heads/foo/bar"
+assert_file_has_content_literal repo/refs/packed-refs "${baz_rev} heads/baz"
+${CMD_PREFIX} ostree --repo=repo refs > refs.txt
+assert_file_has_content_literal refs.txt foo/bar
+assert_file_has_content_literal refs.txt baz
+${CMD_PREFIX} ostree --repo=repo refs foo > refs.txt
+assert_file_has_content '^bar$' refs.txt
+echo "ok commit writes packed refs"
+
+# A loose ref overrides a packed one, and deleting it deletes both
+${CMD_PREFIX} ostree --repo=repo refs --force --create=baz foo/bar
+assert_has_file repo/refs/heads/baz
+assert_streq $(${CMD_PREFIX} ostree --repo=repo rev-parse baz) ${foo_rev}
+${CMD_PREFIX} ostree --repo=repo refs --delete baz
+assert_not_has_file repo/refs/heads/baz
+assert_not_file_has_content repo/refs/packed-refs "heads/baz"
+if ${CMD_PREFIX} ostree --repo=repo rev-parse baz 2>err.txt; then
+    assert_not_reached "rev-parse of deleted packed ref unexpectedly succeeded"
+fi
+assert_streq $(${CMD_PREFIX} ostree --repo=repo rev-parse foo/bar) ${foo_rev}
+echo "ok loose refs override packed refs"
+
+ostree_repo_init repo2 --mode=archive
+${CMD_PREFIX} ostree --repo=repo2 config set core.packed-refs true
+${CMD_PREFIX} ostree --repo=repo2 remote add --no-gpg-verify origin file://$(pwd)/repo
+${CMD_PREFIX} ostree --repo=repo2 pull-local --remote=origin repo foo/bar
+assert_not_has_file repo2/refs/remotes/origin/foo/bar
+assert_file_has_content_literal repo2/refs/packed-refs "${foo_rev} remotes/origin/foo/bar"
+assert_streq $(${CMD_PREFIX} ostree --repo=repo2 rev-parse origin:foo/bar) ${foo_rev}
+${CMD_PREFIX} ostree --repo=repo2 refs > refs.txt
+assert_file_has_content_literal refs.txt origin:foo/bar
+echo "ok pull writes packed remote refs"
+
+# Refs written before enabling packed-refs stay loose until packed
+ostree_repo_init repo3 --mode=archive
+${CMD_PREFIX} ostree --repo=repo3 commit --branch=a -m a -s a tree
+${CMD_PREFIX} ostree --repo=repo3 commit --branch=b/c -m b -s b tree
+${CMD_PREFIX} ostree --repo=repo3 refs -A a --create=alias
+a_rev=$(${CMD_PREFIX} ostree --repo=repo3 rev-parse a)
+c_rev=$(${CMD_PREFIX} ostree --repo=repo3 rev-parse b/c)
+assert_has_file repo3/refs/heads/b/c
+assert_not_has_file repo3/refs/packed-refs
+${CMD_PREFIX} ostree --repo=repo3 refs --pack
+assert_not_has_dir repo3/refs/heads/b
+assert_file_has_content_literal repo3/refs/packed-refs "${c_rev} heads/b/c"
+# Aliases and their targets stay loose
+assert_has_file repo3/refs/heads/a
+assert_not_file_has_content repo3/refs/packed-refs "heads/a"
+assert_streq $(${CMD_PREFIX} ostree --repo=repo3 rev-parse b/c) ${c_rev}
+assert_streq $(${CMD_PREFIX} ostree --repo=repo3 rev-parse alias) ${a_rev}
+${CMD_PREFIX} ostree --repo=repo3 refs > refs.txt
+for ref in a alias b/c; do
+    assert_file_has_content_literal refs.txt ${ref}
+done
+echo "ok refs --pack"
+
+# Concurrent transactions updating packed refs mustn't wait on each other's
+# shared repo lock
+${CMD_PREFIX} ostree --repo=repo config set core.lock-timeout-secs 5
+pids=
+for i in $(seq 8); do
+    ${CMD_PREFIX} ostree --repo=repo commit --branch=concurrent/${i} -m ${i} -s ${i} tree &
+    pids="${pids} $!"
+done
+for pid in ${pids}; do
+    wait ${pid}
+done
+for i in $(seq 8); do
+    assert_file_has_content_literal repo/refs/packed-refs "heads/concurrent/${i}"
+done
+assert_not_has_file repo/refs/packed-refs.lock
+echo "ok concurrent packed ref updates"
@@ -27,7 +27,7 @@ skip_without_user_xattrs
 
 setup_fake_remote_repo1 "archive"
 
-echo '1..12'
+echo '1..14'
 
 cd ${test_tmpdir}
 mkdir repo
@@ -296,3 +296,47 @@ if ${CMD_PREFIX} ostree --repo=repo prune --only-branch=BACON 2>err.txt; then
 fi
 assert_file_has_content err.txt "Refspec.*BACON.*not found"
 echo "ok --only-branch=BACON"
+
+# Incremental prune should delete the same objects as a regular one
+rm repo repo-full -rf
+ostree_repo_init repo --mode=archive
+rm inctree -rf
+mkdir -p inctree/sub
+for x in $(seq 4); do
+    echo "build $x" > inctree/version
+    echo "$x" >> inctree/sub/log
+    ${CMD_PREFIX} ostree --repo=repo commit --branch=inc -m test -s "inc build $x" inctree
+    ${CMD_PREFIX} ostree --repo=repo commit --branch=inc2 -m test -s "inc2 build $x" inctree/sub
+done
+${CMD_PREFIX} ostree --repo=repo prune --refs-only --incremental
+assert_has_file repo/tmp/cache/prune-refcounts
+assert_repo_has_n_commits repo 8
+cp -a repo repo-full
+${CMD_PREFIX} ostree --repo=repo prune --refs-only --incremental --depth=1 | tee prune.txt
+assert_file_has_content prune.txt 'Deleted [1-9][0-9]* objects'
+${CMD_PREFIX} ostree --repo=repo-full prune --refs-only --depth=1
+(cd repo/objects && find . -type f | sort) > incremental.txt
+(cd repo-full/objects && find . -type f | sort) > full.txt
+diff -u full.txt incremental.txt
+assert_repo_has_n_commits repo 4
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok prune --incremental"
+
+${CMD_PREFIX} ostree --repo=repo refs --delete inc2
+${CMD_PREFIX} ostree --repo=repo prune --refs-only --incremental --depth=1
+${CMD_PREFIX} ostree --repo=repo-full refs --delete inc2
+${CMD_PREFIX} ostree --repo=repo-full prune --refs-only --depth=1
+(cd repo/objects && find . -type f | sort) > incremental.txt
+(cd repo-full/objects && find . -type f | sort) > full.txt
+diff -u full.txt incremental.txt
+assert_repo_has_n_commits repo 2
+# A commit we retained being deleted behind our back means starting over
+${CMD_PREFIX} ostree --repo=repo prune --delete-commit=$(ostree --repo=repo rev-parse inc^)
+${CMD_PREFIX} ostree --repo=repo prune --refs-only --incremental --depth=0
+assert_repo_has_n_commits repo 1
+${CMD_PREFIX} ostree --repo=repo fsck
+if ${CMD_PREFIX} ostree --repo=repo prune --incremental 2>err.txt; then
+    fatal "--incremental without --refs-only succeeded"
+fi
+assert_file_has_content err.txt "requires --refs-only"
+echo "ok prune --incremental after deleting refs"
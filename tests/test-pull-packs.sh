@@ -0,0 +1,103 @@
+#!/bin/bash
+#
+# Copyright (C) 2019 Collabora Ltd.
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+setup_fake_remote_repo1 "archive"
+
+echo '1..5'
+
+repopath=${test_tmpdir}/ostree-srv/gnomerepo
+${CMD_PREFIX} ostree --repo=${repopath} repack
+${CMD_PREFIX} ostree --repo=${repopath} summary -u
+${CMD_PREFIX} ostree --repo=${repopath} summary -v > summary.txt
+assert_file_has_content summary.txt "ostree.packs"
+
+cd ${test_tmpdir}
+rm repo -rf
+ostree_repo_init repo --mode=archive
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+${OSTREE} checkout -U origin:main checkout-origin-main
+assert_file_has_content checkout-origin-main/baz/cow moo
+assert_file_has_content checkout-origin-main/baz/another/y x
+# The repack removed the loose objects, so they must have come from the pack
+assert_file_has_content httpd/httpd.log "serving /ostree/gnomerepo/objects/pack/pack-.*\.pack"
+assert_not_file_has_content httpd/httpd.log "\.filez"
+assert_streq "$(ls repo/tmp/cache/pack-indexes/origin/ | wc -l)" "1"
+echo "ok pull from packs"
+
+rm repo -rf
+ostree_repo_init repo --mode=bare-user
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+${OSTREE} checkout -U origin:main checkout-bare-user
+diff -r checkout-origin-main checkout-bare-user
+echo "ok pull from packs into bare-user repo"
+
+# A new commit with a second pack; the cached index for the first is reused
+cd ${test_tmpdir}
+mkdir files
+echo "packed again" > files/newfile
+${CMD_PREFIX} ostree --repo=${repopath} commit -b main --tree=ref=main --tree=dir=files -s "More content"
+${CMD_PREFIX} ostree --repo=${repopath} repack
+${CMD_PREFIX} ostree --repo=${repopath} summary -u
+truncate -s0 httpd/httpd.log
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+${OSTREE} cat origin:main /newfile > newfile.txt
+assert_file_has_content newfile.txt "packed again"
+assert_streq "$(grep -c 'serving .*\.idx' httpd/httpd.log)" "1"
+assert_streq "$(ls repo/tmp/cache/pack-indexes/origin/ | wc -l)" "2"
+echo "ok pull from new pack"
+
+# Cached indexes which don't match the summary are refetched
+for idx in repo/tmp/cache/pack-indexes/origin/*.idx; do
+    echo corrupt >> ${idx}
+done
+truncate -s0 httpd/httpd.log
+${CMD_PREFIX} ostree --repo=repo pull origin main
+assert_streq "$(grep -c 'serving .*\.idx' httpd/httpd.log)" "2"
+for idx in repo/tmp/cache/pack-indexes/origin/*.idx; do
+    cmp ${idx} ${repopath}/objects/pack/$(basename ${idx})
+done
+echo "ok refetch corrupt cached pack index"
+
+# A served index which doesn't match the summary is an error
+rm repo -rf
+ostree_repo_init repo --mode=archive
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+for idx in ${repopath}/objects/pack/*.idx; do
+    cp ${idx} ${idx}.orig
+    echo corrupt >> ${idx}
+done
+if ${CMD_PREFIX} ostree --repo=repo pull origin main 2>err.txt; then
+    fatal "pulled with corrupt pack index"
+fi
+assert_file_has_content err.txt "doesn't match the checksum in the summary"
+for idx in ${repopath}/objects/pack/*.idx; do
+    mv ${idx}.orig ${idx}
+done
+echo "ok corrupt pack index"
@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# Copyright (C) 2019 Collabora Ltd.
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+echo "1..4"
+
+setup_fake_remote_repo1 "archive"
+srv=${test_tmpdir}/ostree-srv/gnomerepo
+
+cd ${test_tmpdir}
+for i in $(seq 10); do
+    mkdir -p other-files/$i
+    echo "file $i" > other-files/$i/file
+    ${CMD_PREFIX} ostree --repo=${srv} commit -b other/$i -s "Commit $i" other-files/$i
+done
+${CMD_PREFIX} ostree --repo=${srv} static-delta generate --empty --to=other/1
+
+${CMD_PREFIX} ostree --repo=${srv} config set core.summary-index true
+${CMD_PREFIX} ostree --repo=${srv} summary -u
+assert_has_file ${srv}/summary
+assert_has_file ${srv}/summary.idx
+ls ${srv}/summaries > shards.txt
+test -s shards.txt
+echo "ok summary index"
+
+ostree_repo_init repo --mode=archive
+truncate -s0 httpd/httpd.log
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false --set=summary-index=true origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull origin main other/3
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo rev-parse origin:main)" "$(${CMD_PREFIX} ostree --repo=${srv} rev-parse main)"
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo rev-parse origin:other/3)" "$(${CMD_PREFIX} ostree --repo=${srv} rev-parse other/3)"
+assert_has_dir repo/tmp/cache/summary-shards/origin
+assert_file_has_content httpd/httpd.log "serving /ostree/gnomerepo/summary.idx"
+assert_file_has_content httpd/httpd.log "serving /ostree/gnomerepo/summaries/"
+# The whole summary isn't fetched
+assert_not_file_has_content httpd/httpd.log "serving /ostree/gnomerepo/summary$"
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok pull with summary index"
+
+echo "file 3 changed" > other-files/3/file
+${CMD_PREFIX} ostree --repo=${srv} commit -b other/3 -s "Commit 3 again" other-files/3
+${CMD_PREFIX} ostree --repo=${srv} summary -u
+truncate -s0 httpd/httpd.log
+${CMD_PREFIX} ostree --repo=repo pull origin other/3
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo rev-parse origin:other/3)" "$(${CMD_PREFIX} ostree --repo=${srv} rev-parse other/3)"
+# Only shards listed in the current index are kept
+for shard in $(ls repo/tmp/cache/summary-shards/origin); do
+    assert_has_file ${srv}/summaries/${shard}
+done
+if ${CMD_PREFIX} ostree --repo=repo pull origin nosuchref 2>err.txt; then
+    assert_not_reached "pulling a missing ref succeeded"
+fi
+assert_file_has_content err.txt "No such branch"
+echo "ok pull updated ref with summary index"
+
+${CMD_PREFIX} ostree --repo=${srv} config set core.summary-index false
+${CMD_PREFIX} ostree --repo=${srv} summary -u
+assert_not_has_file ${srv}/summary.idx
+# Without an index, the whole summary is used again
+truncate -s0 httpd/httpd.log
+${CMD_PREFIX} ostree --repo=repo pull origin other/5
+assert_file_has_content httpd/httpd.log "serving /ostree/gnomerepo/summary$"
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo rev-parse origin:other/5)" "$(${CMD_PREFIX} ostree --repo=${srv} rev-parse other/5)"
+echo "ok pull without summary index"
@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+# Copyright (C) 2019 Collabora Ltd.
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+echo '1..5'
+
+setup_test_repository "archive"
+
+cd ${test_tmpdir}
+${CMD_PREFIX} ostree --repo=repo checkout -U test2 checkout-orig
+${CMD_PREFIX} ostree --repo=repo ls -R -C test2 > ls-orig.txt
+n_loose_orig=$(find repo/objects -name '*.dirtree' -o -name '*.dirmeta' -o -name '*.filez' | wc -l)
+
+${CMD_PREFIX} ostree --repo=repo repack > repack.txt
+assert_file_has_content repack.txt "Packed ${n_loose_orig} objects"
+assert_streq "$(find repo/objects -name '*.dirtree' -o -name '*.dirmeta' -o -name '*.filez' | wc -l)" "0"
+assert_streq "$(ls repo/objects/pack/pack-*.idx | wc -l)" "1"
+assert_streq "$(ls repo/objects/pack/pack-*.pack | wc -l)" "1"
+# Commits stay loose
+assert_streq "$(find repo/objects -name '*.commit' | wc -l)" "2"
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok repack"
+
+${CMD_PREFIX} ostree --repo=repo ls -R -C test2 > ls-packed.txt
+diff -u ls-orig.txt ls-packed.txt
+${CMD_PREFIX} ostree --repo=repo checkout -U test2 checkout-packed
+diff -r checkout-orig checkout-packed
+${CMD_PREFIX} ostree --repo=repo cat test2 /baz/cow > cow.txt
+assert_file_has_content cow.txt moo
+echo "ok read packed objects"
+
+ostree_repo_init repo2 --mode=bare-user
+${CMD_PREFIX} ostree --repo=repo2 pull-local repo test2
+${CMD_PREFIX} ostree --repo=repo2 fsck
+${CMD_PREFIX} ostree --repo=repo2 checkout -U test2 checkout-pulled
+diff -r checkout-orig checkout-pulled
+echo "ok pull-local from packed repo"
+
+# New objects go loose, and a second repack only packs those
+cd ${test_tmpdir}/files
+echo "new content" > baz/newfile
+${CMD_PREFIX} ostree --repo=${test_tmpdir}/repo commit -b test2 -s "Test Commit 3"
+cd ${test_tmpdir}
+${CMD_PREFIX} ostree --repo=repo repack > repack.txt
+assert_not_file_has_content repack.txt "Packed ${n_loose_orig} objects"
+assert_streq "$(ls repo/objects/pack/pack-*.idx | wc -l)" "2"
+${CMD_PREFIX} ostree --repo=repo fsck
+${CMD_PREFIX} ostree --repo=repo cat test2 /baz/newfile > newfile.txt
+assert_file_has_content newfile.txt "new content"
+${CMD_PREFIX} ostree --repo=repo repack > repack.txt
+assert_file_has_content repack.txt "No loose objects to pack"
+# Prune leaves packed objects alone
+${CMD_PREFIX} ostree --repo=repo prune --refs-only --depth=0
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok repack again"
+
+if ${CMD_PREFIX} ostree --repo=repo2 repack 2>err.txt; then
+    assert_not_reached "repack of a bare-user repo succeeded"
+fi
+assert_file_has_content err.txt "only supported in archive"
+echo "ok repack requires archive"
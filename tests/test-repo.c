@@ -197,6 +197,192 @@ test_repo_get_min_free_space (Fixture *fixture,
     }
 }
 
+/* Write @key=@value to the [core] section of @repo's config and reload it */
+static gboolean
+set_core_config (OstreeRepo  *repo,
+                 const char  *key,
+                 const char  *value,
+                 GError     **error)
+{
+  g_autoptr(GKeyFile) config = ostree_repo_copy_config (repo);
+  g_key_file_set_string (config, "core", key, value);
+  if (!ostree_repo_write_config (repo, config, error))
+    return FALSE;
+  return ostree_repo_reload_config (repo, NULL, error);
+}
+
+static GVariant *
+create_dirmeta (void)
+{
+  return g_variant_ref_sink (g_variant_new ("(uuu@a(ayay))",
+                                            GUINT32_TO_BE (0), GUINT32_TO_BE (0),
+                                            GUINT32_TO_BE (S_IFDIR | 0755),
+                                            g_variant_new_array (G_VARIANT_TYPE ("(ayay)"), NULL, 0)));
+}
+
+/* Test that with core.mmap-metadata, an object loaded during a transaction
+ * which is then aborted doesn't remain visible through the mapping cache. */
+static void
+test_repo_mmap_metadata_abort (Fixture       *fixture,
+                               gconstpointer  test_data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(OstreeRepo) repo = ostree_repo_create_at (fixture->tmpdir.fd, ".",
+                                                      OSTREE_REPO_MODE_ARCHIVE,
+                                                      NULL,
+                                                      NULL, &error);
+  g_assert_no_error (error);
+
+  set_core_config (repo, "mmap-metadata-cache-size", "lots", &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_clear_error (&error);
+  set_core_config (repo, "mmap-metadata-cache-size", "1048576", &error);
+  g_assert_no_error (error);
+  set_core_config (repo, "mmap-metadata", "true", &error);
+  g_assert_no_error (error);
+
+  g_autoptr(GVariant) dirmeta = create_dirmeta ();
+  g_autofree guchar *csum = NULL;
+
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, dirmeta,
+                              &csum, NULL, &error);
+  g_assert_no_error (error);
+  char checksum[OSTREE_SHA256_STRING_LEN + 1];
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+
+  /* Visible within the transaction... */
+  g_autoptr(GVariant) loaded = NULL;
+  ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, checksum, &loaded, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_variant_equal (loaded, dirmeta));
+  g_clear_pointer (&loaded, g_variant_unref);
+
+  ostree_repo_abort_transaction (repo, NULL, &error);
+  g_assert_no_error (error);
+
+  /* ...but not once it's aborted */
+  ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_DIR_META, checksum,
+                                      &loaded, &error);
+  g_assert_no_error (error);
+  g_assert_null (loaded);
+  gboolean have_object = TRUE;
+  ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_DIR_META, checksum, &have_object,
+                          NULL, &error);
+  g_assert_no_error (error);
+  g_assert_false (have_object);
+
+  /* Once committed, it is mapped and loads the same */
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, dirmeta,
+                              NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_commit_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  for (guint i = 0; i < 2; i++)
+    {
+      ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, checksum, &loaded, &error);
+      g_assert_no_error (error);
+      g_assert_true (g_variant_equal (loaded, dirmeta));
+      g_clear_pointer (&loaded, g_variant_unref);
+    }
+}
+
+/* Load @checksum twice, checking it is served from the metadata cache the
+ * second time if @cached */
+static void
+assert_load_twice (OstreeRepo       *repo,
+                   OstreeObjectType  objtype,
+                   const char       *checksum,
+                   gboolean          cached)
+{
+  g_autoptr(GError) error = NULL;
+  guint64 hits_before, misses_before, hits, misses;
+
+  ostree_repo_get_metadata_cache_stats (repo, &hits_before, &misses_before, NULL);
+  for (guint i = 0; i < 2; i++)
+    {
+      g_autoptr(GVariant) variant = NULL;
+      ostree_repo_load_variant (repo, objtype, checksum, &variant, &error);
+      g_assert_no_error (error);
+      g_assert_nonnull (variant);
+    }
+  ostree_repo_get_metadata_cache_stats (repo, &hits, &misses, NULL);
+
+  if (cached)
+    {
+      g_assert_cmpuint (hits - hits_before, ==, 1);
+      g_assert_cmpuint (misses - misses_before, ==, 1);
+    }
+  else
+    g_assert_cmpuint (hits - hits_before, ==, 0);
+}
+
+/* Test core.metadata-cache-size: repeated loads of a commit and dirtree are
+ * served from the cache, a size of 0 disables it, and objects only staged in
+ * a transaction are never cached. */
+static void
+test_repo_metadata_cache (Fixture       *fixture,
+                          gconstpointer  test_data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(OstreeRepo) repo = ostree_repo_create_at (fixture->tmpdir.fd, ".",
+                                                      OSTREE_REPO_MODE_ARCHIVE,
+                                                      NULL,
+                                                      NULL, &error);
+  g_assert_no_error (error);
+
+  set_core_config (repo, "metadata-cache-size", "1MB", &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_clear_error (&error);
+  set_core_config (repo, "metadata-cache-size", "1048576", &error);
+  g_assert_no_error (error);
+
+  g_autoptr(GVariant) dirmeta = create_dirmeta ();
+  g_autofree guchar *dirmeta_csum = NULL;
+  g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  g_autoptr(GFile) root = NULL;
+  g_autofree char *commit_checksum = NULL;
+
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, dirmeta,
+                              &dirmeta_csum, NULL, &error);
+  g_assert_no_error (error);
+  char dirmeta_checksum[OSTREE_SHA256_STRING_LEN + 1];
+  ostree_checksum_inplace_from_bytes (dirmeta_csum, dirmeta_checksum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_checksum);
+  ostree_repo_write_mtree (repo, mtree, &root, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_commit (repo, NULL, "Test", NULL, NULL, OSTREE_REPO_FILE (root),
+                            &commit_checksum, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Staged objects may yet be aborted, so they aren't cached */
+  assert_load_twice (repo, OSTREE_OBJECT_TYPE_COMMIT, commit_checksum, FALSE);
+
+  ostree_repo_commit_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  const char *dirtree_checksum = ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (root));
+  assert_load_twice (repo, OSTREE_OBJECT_TYPE_COMMIT, commit_checksum, TRUE);
+  assert_load_twice (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum, TRUE);
+  guint64 size = 0;
+  ostree_repo_get_metadata_cache_stats (repo, NULL, NULL, &size);
+  g_assert_cmpuint (size, >, 0);
+
+  set_core_config (repo, "metadata-cache-size", "0", &error);
+  g_assert_no_error (error);
+  assert_load_twice (repo, OSTREE_OBJECT_TYPE_COMMIT, commit_checksum, FALSE);
+  guint64 hits = 1, misses = 1;
+  ostree_repo_get_metadata_cache_stats (repo, &hits, &misses, &size);
+  g_assert_cmpuint (hits, ==, 0);
+  g_assert_cmpuint (misses, ==, 0);
+  g_assert_cmpuint (size, ==, 0);
+}
+
 int
 main (int    argc,
       char **argv)
@@ -212,6 +398,10 @@ main (int    argc,
               test_repo_equal, teardown);
   g_test_add ("/repo/get_min_free_space", Fixture, NULL, setup,
               test_repo_get_min_free_space, teardown);
+  g_test_add ("/repo/mmap-metadata/abort", Fixture, NULL, setup,
+              test_repo_mmap_metadata_abort, teardown);
+  g_test_add ("/repo/metadata-cache", Fixture, NULL, setup,
+              test_repo_metadata_cache, teardown);
 
 
   return g_test_run ();
@@ -72,6 +72,67 @@ test_sysroot_reload (gconstpointer data)
     g_error ("%s", error->message);
 }
 
+static void
+count_relabeled (OstreeSePolicy *sepolicy,
+                 const char     *path,
+                 const char     *new_label,
+                 gpointer        user_data)
+{
+  guint *n_relabeled = user_data;
+  (*n_relabeled)++;
+}
+
+/* The sysroot has no SELinux policy, so nothing gets labeled; but that's
+ * only an error if labels are required */
+static void
+test_sysroot_restorecon_no_policy (gconstpointer data)
+{
+  OstreeSysroot *sysroot = (void*)data;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(OstreeSePolicy) sepolicy = NULL;
+  const OstreeSePolicyRestoreconFlags flags[] = {
+    OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL,
+    OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL | OSTREE_SEPOLICY_RESTORECON_FLAGS_KEEP_EXISTING,
+  };
+
+  if (!ostree_sysroot_load (sysroot, NULL, &error))
+    goto out;
+
+  sepolicy = ostree_sepolicy_new_at (ostree_sysroot_get_fd (sysroot), NULL, &error);
+  if (!sepolicy)
+    goto out;
+  g_assert_null (ostree_sepolicy_get_name (sepolicy));
+
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, "restorecon/a/b", 0755, NULL, &error))
+    goto out;
+  if (!glnx_file_replace_contents_at (AT_FDCWD, "restorecon/a/b/file", (guint8*)"hello", 5,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, &error))
+    goto out;
+  if (symlinkat ("b/file", AT_FDCWD, "restorecon/a/link") < 0)
+    {
+      glnx_throw_errno_prefix (&error, "symlinkat");
+      goto out;
+    }
+
+  for (guint i = 0; i < G_N_ELEMENTS (flags); i++)
+    {
+      for (guint n_threads = 0; n_threads <= 2; n_threads++)
+        {
+          guint n_relabeled = 0;
+          if (!ostree_sepolicy_restorecon_recursive_at (sepolicy, AT_FDCWD, "restorecon", "/var",
+                                                        flags[i], n_threads,
+                                                        count_relabeled, &n_relabeled,
+                                                        NULL, &error))
+            goto out;
+          g_assert_cmpuint (n_relabeled, ==, 0);
+        }
+    }
+
+ out:
+  if (error)
+    g_error ("%s", error->message);
+}
+
 int main (int argc, char **argv)
 {
   g_autoptr(GError) error = NULL;
@@ -84,6 +145,7 @@ int main (int argc, char **argv)
     goto out;
   
   g_test_add_data_func ("/sysroot-reload", sysroot, test_sysroot_reload);
+  g_test_add_data_func ("/sysroot-restorecon-no-policy", sysroot, test_sysroot_restorecon_no_policy);
 
   return g_test_run();
  out:
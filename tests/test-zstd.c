@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2019 Collabora Ltd.
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+#include "libglnx.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <gio/gio.h>
+#include <string.h>
+#include "ostree-zstd-common.h"
+#include "ostree-zstd-compressor.h"
+#include "ostree-zstd-decompressor.h"
+#include <gio/gmemoryoutputstream.h>
+
+static GBytes *
+convert (GConverter   *converter,
+         const guint8 *data,
+         gsize         data_size)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GOutputStream) out = g_memory_output_stream_new_resizable ();
+  g_autoptr(GInputStream) in = g_memory_input_stream_new_from_data (data, data_size, NULL);
+  g_autoptr(GInputStream) convin = g_converter_input_stream_new (in, converter);
+  gssize n_bytes_written = g_output_stream_splice (out, convin,
+                                                   G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET | G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                                   NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (n_bytes_written, >=, 0);
+  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (out));
+}
+
+static gsize
+helper_test_compress_decompress (const guint8 *data,
+                                 gssize        data_size,
+                                 GBytes       *dictionary)
+{
+  g_autoptr(GConverter) compressor = (GConverter*)_ostree_zstd_compressor_new (3, dictionary);
+  g_autoptr(GBytes) compressed = convert (compressor, data, data_size);
+  g_assert_cmpint (g_bytes_get_size (compressed), >, 0);
+
+  g_autoptr(GConverter) decompressor = (GConverter*)_ostree_zstd_decompressor_new (dictionary);
+  g_autoptr(GBytes) decompressed = convert (decompressor, g_bytes_get_data (compressed, NULL),
+                                            g_bytes_get_size (compressed));
+
+  g_assert_cmpint (g_bytes_get_size (decompressed), ==, data_size);
+  g_assert_cmpint (memcmp (g_bytes_get_data (decompressed, NULL), data, data_size), ==, 0);
+
+  return g_bytes_get_size (compressed);
+}
+
+static void
+test_zstd_random (void)
+{
+  gssize i;
+  guint8 buffer[4096];
+  g_autoptr(GRand) r = g_rand_new ();
+  for (i = 0; i < sizeof(buffer); i++)
+    buffer[i] = g_rand_int (r);
+
+  for (i = 2; i < (sizeof(buffer) - 1); i *= 2)
+    {
+      helper_test_compress_decompress (buffer, i - 1, NULL);
+      helper_test_compress_decompress (buffer, i, NULL);
+      helper_test_compress_decompress (buffer, i + 1, NULL);
+    }
+}
+
+static void
+test_zstd_big_buffer (void)
+{
+  const guint32 buffer_size = 1 << 21;
+  g_autofree guint8 *buffer = g_new (guint8, buffer_size);
+
+  memset (buffer, (int) 'a', buffer_size);
+
+  helper_test_compress_decompress (buffer, buffer_size, NULL);
+}
+
+/* Generate a small "config file" like sample that shares most of its
+ * content with the others.
+ */
+static char *
+make_sample (GRand *r)
+{
+  return g_strdup_printf ("[Unit]\nDescription=Sample service %u\n"
+                          "After=network-online.target\nWants=network-online.target\n\n"
+                          "[Service]\nType=notify\nExecStart=/usr/libexec/sample-%u --verbose\n"
+                          "Restart=on-failure\nRestartSec=%us\n\n"
+                          "[Install]\nWantedBy=multi-user.target\n",
+                          g_rand_int (r), g_rand_int (r), g_rand_int_range (r, 1, 60));
+}
+
+static void
+test_zstd_dictionary (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GRand) r = g_rand_new_with_seed (42);
+  g_autoptr(GByteArray) samples = g_byte_array_new ();
+  g_autoptr(GArray) sample_sizes = g_array_new (FALSE, FALSE, sizeof (size_t));
+
+  for (guint i = 0; i < 1000; i++)
+    {
+      g_autofree char *sample = make_sample (r);
+      size_t len = strlen (sample);
+      g_byte_array_append (samples, (guint8*)sample, len);
+      g_array_append_val (sample_sizes, len);
+    }
+
+  g_autoptr(GBytes) dictionary =
+    _ostree_zstd_train_dictionary (samples, sample_sizes, 4096, &error);
+  g_assert_no_error (error);
+  g_assert (dictionary != NULL);
+  g_assert_cmpint (g_bytes_get_size (dictionary), <=, 4096);
+
+  g_autofree char *data = make_sample (r);
+  const gsize plain_size = helper_test_compress_decompress ((guint8*)data, strlen (data), NULL);
+  const gsize dict_size = helper_test_compress_decompress ((guint8*)data, strlen (data), dictionary);
+  g_assert_cmpint (dict_size, <, plain_size);
+
+  /* Decompressing without the dictionary must fail */
+  g_autoptr(GConverter) compressor = (GConverter*)_ostree_zstd_compressor_new (3, dictionary);
+  g_autoptr(GBytes) compressed = convert (compressor, (guint8*)data, strlen (data));
+  g_autoptr(GConverter) decompressor = (GConverter*)_ostree_zstd_decompressor_new (NULL);
+  g_autoptr(GInputStream) in = g_memory_input_stream_new_from_bytes (compressed);
+  g_autoptr(GInputStream) convin = g_converter_input_stream_new (in, decompressor);
+  g_autoptr(GOutputStream) out = g_memory_output_stream_new_resizable ();
+  gssize n = g_output_stream_splice (out, convin, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                     NULL, &error);
+  g_assert_cmpint (n, ==, -1);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/zstd/random-buffer", test_zstd_random);
+  g_test_add_func ("/zstd/big-buffer", test_zstd_big_buffer);
+  g_test_add_func ("/zstd/dictionary", test_zstd_dictionary);
+
+  return g_test_run();
+}